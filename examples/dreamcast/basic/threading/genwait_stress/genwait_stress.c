@@ -0,0 +1,121 @@
+/* KallistiOS ##version##
+
+   genwait_stress.c
+
+   This is a stress test for the timed wait queue in genwait. It starts a few
+   thousand threads that each repeatedly go to sleep for a pseudo-random
+   amount of time, either through thd_sleep() or through sem_wait_timed() on
+   a semaphore that the main thread signals every so often. That exercises
+   both the timeout path and cancelling a pending timeout by waking the
+   thread early.
+
+   Every thread checks that it never wakes up from a timeout before its
+   deadline, and the main thread reports how long the whole run took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include <kos/thread.h>
+#include <kos/sem.h>
+#include <arch/arch.h>
+#include <arch/timer.h>
+
+#define THD_COUNT   (2000 * (DBL_MEM ? 2 : 1))
+#define ITERATIONS  20
+#define MAX_SLEEP   200
+
+static kthread_t *threads[THD_COUNT];
+static semaphore_t sem = SEM_INITIALIZER(0);
+
+static atomic_uint early_wakeups;
+static atomic_uint timeouts;
+static atomic_uint signaled;
+static atomic_uint finished;
+
+/* Simple per-thread LCG, so that we don't contend on rand()'s state. */
+static uint32_t next_rand(uint32_t *state) {
+    *state = *state * 1103515245 + 12345;
+    return (*state >> 16) & 0x7fff;
+}
+
+static void *sleeper(void *param) {
+    uint32_t state = (uint32_t)param;
+    uint64_t deadline;
+    int i, ms;
+
+    for(i = 0; i < ITERATIONS; i++) {
+        ms = 1 + next_rand(&state) % MAX_SLEEP;
+        deadline = timer_ms_gettime64() + ms;
+
+        if(next_rand(&state) & 1) {
+            thd_sleep(ms);
+
+            if(timer_ms_gettime64() < deadline)
+                ++early_wakeups;
+        }
+        else if(sem_wait_timed(&sem, ms) < 0) {
+            if(timer_ms_gettime64() < deadline)
+                ++early_wakeups;
+
+            ++timeouts;
+        }
+        else {
+            ++signaled;
+        }
+    }
+
+    ++finished;
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    kthread_attr_t attr = { .stack_size = 2048, .label = "sleeper" };
+    uint64_t start, end;
+    int i, count = 0;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Starting %d sleeper threads\n", THD_COUNT);
+    start = timer_ms_gettime64();
+
+    for(i = 0; i < THD_COUNT; i++) {
+        if(!(threads[i] = thd_create_ex(&attr, sleeper, (void *)(i + 1))))
+            break;
+
+        ++count;
+    }
+
+    if(count != THD_COUNT)
+        printf("Only managed to create %d threads\n", count);
+
+    /* Wake up a random sleeper every few milliseconds until everyone is done,
+       cancelling its timeout early. */
+    while(finished < (unsigned int)count) {
+        sem_signal(&sem);
+        thd_sleep(5);
+    }
+
+    for(i = 0; i < count; i++)
+        thd_join(threads[i], NULL);
+
+    end = timer_ms_gettime64();
+
+    printf("%d threads x %d waits in %" PRIu64 " ms\n", count, ITERATIONS,
+           end - start);
+    printf("Timeouts: %u, signaled: %u, early wakeups: %u\n",
+           (unsigned int)timeouts, (unsigned int)signaled,
+           (unsigned int)early_wakeups);
+
+    if(early_wakeups || !count) {
+        printf("\n\n***** GENWAIT STRESS TEST FAILED! *****\n\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("\n\n***** GENWAIT STRESS TEST SUCCESS! *****\n\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/* KallistiOS ##version##
+
+   prio_inherit.c
+
+   This program demonstrates priority inversion, and how priority inheritance
+   on mutexes bounds it. A low priority thread takes a mutex and does a fixed
+   amount of work while holding it. Meanwhile, a few medium priority threads
+   start hogging the CPU and a high priority thread tries to take the mutex.
+
+   Without priority inheritance, the medium priority threads keep the low
+   priority thread from ever finishing its critical section, so the high
+   priority thread is stuck until they are done. With priority inheritance,
+   the low priority thread runs at the high priority thread's priority until
+   it unlocks the mutex, so the high priority thread only has to wait for the
+   rest of the critical section.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <arch/timer.h>
+
+#define PRIO_HIGH       5
+#define PRIO_MED        8
+#define PRIO_LOW        12
+
+#define HOG_COUNT       3
+#define HOG_MS          500
+#define CRITICAL_MS     20
+
+static mutex_t lock;
+static volatile bool low_locked;
+static uint64_t high_wait_ms;
+
+/* Burn the given amount of this thread's own CPU time. */
+static void burn_cpu(unsigned int ms) {
+    kthread_t *self = thd_get_current();
+    uint64_t end = thd_get_cpu_time(self) + ms * 1000000ULL;
+
+    while(thd_get_cpu_time(self) < end)
+        ;
+}
+
+/* Spin for the given amount of wall clock time. */
+static void burn_wall(unsigned int ms) {
+    uint64_t end = timer_ms_gettime64() + ms;
+
+    while(timer_ms_gettime64() < end)
+        ;
+}
+
+static void *low_thd(void *param) {
+    (void)param;
+
+    mutex_lock(&lock);
+    low_locked = true;
+    burn_cpu(CRITICAL_MS);
+    mutex_unlock(&lock);
+
+    return NULL;
+}
+
+static void *med_thd(void *param) {
+    (void)param;
+
+    burn_wall(HOG_MS);
+
+    return NULL;
+}
+
+static void *high_thd(void *param) {
+    uint64_t start;
+
+    (void)param;
+
+    start = timer_ms_gettime64();
+    mutex_lock(&lock);
+    high_wait_ms = timer_ms_gettime64() - start;
+    mutex_unlock(&lock);
+
+    return NULL;
+}
+
+static kthread_t *spawn(prio_t prio, void *(*func)(void *)) {
+    kthread_attr_t attr = { .prio = prio, .label = "prio_inherit" };
+
+    return thd_create_ex(&attr, func, NULL);
+}
+
+/* Run the scenario once, returning how long the high priority thread had to
+   wait for the mutex. */
+static uint64_t run(int protocol) {
+    kthread_t *low, *high, *hogs[HOG_COUNT];
+    int i;
+
+    mutex_init(&lock, MUTEX_TYPE_NORMAL);
+    mutex_set_protocol(&lock, protocol);
+    low_locked = false;
+
+    /* Let the low priority thread grab the mutex first. */
+    low = spawn(PRIO_LOW, low_thd);
+
+    while(!low_locked)
+        thd_sleep(1);
+
+    for(i = 0; i < HOG_COUNT; i++)
+        hogs[i] = spawn(PRIO_MED, med_thd);
+
+    high = spawn(PRIO_HIGH, high_thd);
+
+    thd_join(high, NULL);
+    thd_join(low, NULL);
+
+    for(i = 0; i < HOG_COUNT; i++)
+        thd_join(hogs[i], NULL);
+
+    mutex_destroy(&lock);
+
+    return high_wait_ms;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t none, inherit;
+
+    (void)argc;
+    (void)argv;
+
+    /* Stay above everything else so we can set up each run. */
+    thd_set_prio(thd_get_current(), PRIO_HIGH - 1);
+
+    none = run(MUTEX_PRIO_NONE);
+    printf("Without priority inheritance: waited %" PRIu64 " ms\n", none);
+
+    inherit = run(MUTEX_PRIO_INHERIT);
+    printf("With priority inheritance:    waited %" PRIu64 " ms\n", inherit);
+
+    /* The high priority thread should only ever have to wait out the low
+       priority thread's critical section, plus some scheduling slop. */
+    if(inherit > CRITICAL_MS + 2 * 1000 / thd_get_hz() || inherit >= none) {
+        printf("\n\n***** PRIORITY INHERITANCE TEST FAILED! *****\n\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("\n\n***** PRIORITY INHERITANCE TEST SUCCESS! *****\n\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+/* KallistiOS ##version##
+
+   sched_bench.c
+
+   This is a small microbenchmark for the thread scheduler. For an increasing
+   number of threads, all sharing the same priority, it has every thread yield
+   its timeslice a fixed number of times with thd_pass() and reports the
+   average cost of each resulting context switch.
+
+   Each thd_pass() re-enqueues the calling thread at the end of its priority
+   group and picks the next runnable thread, so the numbers printed here are
+   a direct measure of the run queue's enqueue/pick-next cost. With the
+   per-priority run queues, the time per switch should stay flat no matter
+   how many threads are runnable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <kos/thread.h>
+#include <arch/timer.h>
+
+#define PASSES      1000
+#define MAX_THREADS 256
+
+static kthread_t *threads[MAX_THREADS];
+
+static void *pass_thd(void *param) {
+    int i;
+
+    (void)param;
+
+    for(i = 0; i < PASSES; i++)
+        thd_pass();
+
+    return NULL;
+}
+
+/* Run one round of the benchmark with the given number of threads, returning
+   the average number of nanoseconds spent per context switch. */
+static uint64_t bench_round(int count) {
+    kthread_attr_t attr = { .prio = PRIO_DEFAULT, .label = "bench" };
+    kthread_t *self = thd_get_current();
+    uint64_t start, end;
+    int i;
+
+    for(i = 0; i < count; i++) {
+        threads[i] = thd_create_ex(&attr, pass_thd, NULL);
+
+        if(!threads[i]) {
+            fprintf(stderr, "Couldn't create thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Drop below the workers so that they only compete with each other, then
+       block in thd_join() until they have all finished. */
+    start = timer_ns_gettime64();
+    thd_set_prio(self, PRIO_DEFAULT + 1);
+
+    for(i = 0; i < count; i++)
+        thd_join(threads[i], NULL);
+
+    end = timer_ns_gettime64();
+    thd_set_prio(self, PRIO_DEFAULT);
+
+    return (end - start) / ((uint64_t)count * PASSES);
+}
+
+int main(int argc, char *argv[]) {
+    int count;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Scheduler benchmark: %d thd_pass() calls per thread\n", PASSES);
+    printf("threads\tns/switch\n");
+
+    for(count = 1; count <= MAX_THREADS; count *= 2)
+        printf("%d\t%" PRIu64 "\n", count, bench_round(count));
+
+    printf("Done.\n");
+
+    return 0;
+}
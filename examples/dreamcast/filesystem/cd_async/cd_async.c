@@ -0,0 +1,134 @@
+/* KallistiOS ##version##
+
+   cd_async.c
+
+   This example reads a file from the CD twice: once with plain blocking
+   reads, and once with the file opened with O_ASYNC. In the async pass the
+   file is streamed through two buffers, so that one chunk is being read
+   while the other one is being "processed", and the main thread keeps
+   counting work done while it waits. The two passes must read the same data.
+
+   Burn this along with any reasonably large file, and pass its name on the
+   command line when using dc-tool, or change DEFAULT_FILE below.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <poll.h>
+
+#include <kos/fs.h>
+#include <arch/timer.h>
+
+#define DEFAULT_FILE    "/cd/1ST_READ.BIN"
+#define CHUNK           (64 * 1024)
+
+/* Simple FNV-1a hash, so the passes can be compared */
+static uint32_t hash_buf(uint32_t hash, const uint8_t *buf, size_t len) {
+    while(len--)
+        hash = (hash ^ *buf++) * 16777619u;
+
+    return hash;
+}
+
+static int read_sync(const char *fn, uint8_t *buf, uint32_t *hash) {
+    uint64_t start = timer_ms_gettime64();
+    ssize_t r, total = 0;
+    file_t fd;
+
+    if((fd = fs_open(fn, O_RDONLY)) < 0) {
+        printf("Can't open %s\n", fn);
+        return -1;
+    }
+
+    *hash = 2166136261u;
+
+    while((r = fs_read(fd, buf, CHUNK)) > 0) {
+        *hash = hash_buf(*hash, buf, r);
+        total += r;
+    }
+
+    fs_close(fd);
+
+    printf("sync:  %d bytes in %lu ms, hash %08lx\n", (int)total,
+           (unsigned long)(timer_ms_gettime64() - start),
+           (unsigned long)*hash);
+
+    return r < 0 ? -1 : 0;
+}
+
+static int read_async(const char *fn, uint8_t *bufs[2], uint32_t *hash) {
+    uint64_t start = timer_ms_gettime64();
+    ssize_t r, len[2], total = 0;
+    struct pollfd pfd;
+    uint32_t spins = 0;
+    file_t fd;
+    int cur = 0;
+
+    if((fd = fs_open(fn, O_RDONLY | O_ASYNC)) < 0) {
+        printf("Can't open %s\n", fn);
+        return -1;
+    }
+
+    *hash = 2166136261u;
+
+    /* Get the first chunk going */
+    len[cur] = fs_read(fd, bufs[cur], CHUNK);
+
+    while(len[cur] > 0) {
+        /* Pretend to render frames until the chunk is in */
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+
+        while(poll(&pfd, 1, 0) == 0)
+            spins++;
+
+        if(fs_complete(fd, &r) < 0 || r != len[cur]) {
+            printf("Async read failed\n");
+            fs_close(fd);
+            return -1;
+        }
+
+        /* Queue up the next chunk, then process this one while it loads */
+        len[cur ^ 1] = fs_read(fd, bufs[cur ^ 1], CHUNK);
+
+        *hash = hash_buf(*hash, bufs[cur], len[cur]);
+        total += len[cur];
+        cur ^= 1;
+    }
+
+    fs_close(fd);
+
+    printf("async: %d bytes in %lu ms, hash %08lx, %lu polls while waiting\n",
+           (int)total, (unsigned long)(timer_ms_gettime64() - start),
+           (unsigned long)*hash, (unsigned long)spins);
+
+    return len[cur] < 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    const char *fn = argc > 1 ? argv[1] : DEFAULT_FILE;
+    uint8_t *bufs[2];
+    uint32_t h1, h2;
+
+    /* Aligned buffers let the drive DMA straight into them */
+    bufs[0] = memalign(32, CHUNK);
+    bufs[1] = memalign(32, CHUNK);
+
+    if(!bufs[0] || !bufs[1]) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    if(read_sync(fn, bufs[0], &h1) < 0 || read_async(fn, bufs, &h2) < 0)
+        return 1;
+
+    printf("%s\n", h1 == h2 ? "SUCCESS" : "FAILED: data mismatch");
+
+    free(bufs[0]);
+    free(bufs[1]);
+
+    return h1 == h2 ? 0 : 1;
+}
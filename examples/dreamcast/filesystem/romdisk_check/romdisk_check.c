@@ -0,0 +1,239 @@
+/* KallistiOS ##version##
+
+   romdisk_check.c
+
+   This example checks the romdisk's path index and compressed files. The
+   Makefile builds the romdisk with an index (which Makefile.rules always
+   asks genromfs for) and with -z, so that files which shrink are stored
+   LZ4-compressed. It holds 128 small files, which don't shrink and are left
+   as they are, and one large file of numbered lines, which does.
+
+   A copy of the image with its index footer wiped out is mounted on /noidx,
+   where lookups have to walk the directories instead. Every small file is
+   looked up on both mounts, in lower and mixed case, and has to read back
+   what the Makefile put in it. Paths that don't exist, or name a directory
+   where a file is wanted, have to fail on both. The large file is read
+   through in uneven pieces, read at random offsets, and mapped with
+   fs_mmap(), and each time has to match the lines it was made from.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <kos/fs.h>
+#include <kos/fs_romdisk.h>
+#include <kos/init.h>
+
+#define LINES           4000
+#define LINE_LEN        42
+#define BIG_SIZE        (LINES * LINE_LEN)
+#define BIG_FILE        "/rd/dir3/lines.txt"
+#define MAX_REPORTS     16
+
+static char big[BIG_SIZE + 1];
+static char buf[BIG_SIZE];
+static int failures;
+
+static void report(const char *what, const char *path) {
+    if(++failures <= MAX_REPORTS)
+        printf("%s: %s\n", what, path);
+}
+
+static uint32_t be32(const uint8_t *p) {
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Make sure the image really has what this is meant to be testing, and
+   mount a copy of it without the index. */
+static int check_image(void) {
+    const uint8_t *img = (const uint8_t *)__kos_romdisk;
+    uint32_t size = be32(img + 8);
+    uint8_t *copy;
+
+    if(memcmp(img + size - 16, "-romidx-", 8)) {
+        printf("The romdisk doesn't have a path index\n");
+        return -1;
+    }
+
+    /* The whole image being smaller than one file in it means that file
+       has been compressed. */
+    if(size >= BIG_SIZE) {
+        printf("The romdisk is %lu bytes, so nothing was compressed\n",
+               (unsigned long)size);
+        return -1;
+    }
+
+    if(!(copy = malloc(size))) {
+        printf("Can't allocate a copy of the romdisk\n");
+        return -1;
+    }
+
+    memcpy(copy, img, size);
+    memset(copy + size - 16, 0, 16);
+
+    if(fs_romdisk_mount("/noidx", copy, 1) < 0) {
+        printf("Can't mount the copy of the romdisk\n");
+        free(copy);
+        return -1;
+    }
+
+    printf("Romdisk image is %lu bytes, with a %lu byte file in it\n",
+           (unsigned long)size, (unsigned long)BIG_SIZE);
+    return 0;
+}
+
+/* Open a file and make sure it holds exactly what's expected. */
+static void check_file(const char *path, const char *expect) {
+    size_t len = strlen(expect);
+    file_t f;
+    ssize_t r;
+
+    if((f = fs_open(path, O_RDONLY)) < 0) {
+        report("Can't open", path);
+        return;
+    }
+
+    r = fs_read(f, buf, sizeof(buf));
+
+    if(r != (ssize_t)len || memcmp(buf, expect, len))
+        report("Wrong contents", path);
+
+    fs_close(f);
+}
+
+static void check_missing(const char *path, int mode) {
+    file_t f;
+
+    if((f = fs_open(path, mode)) >= 0) {
+        report("Opened something that isn't there", path);
+        fs_close(f);
+    }
+}
+
+static void check_lookups(const char *mnt) {
+    char path[64], expect[32];
+    dirent_t *de;
+    file_t d;
+    int dn, s, n, cnt;
+
+    for(dn = 0; dn < 4; dn++) {
+        for(s = 0; s < 4; s++) {
+            for(n = 0; n < 8; n++) {
+                sprintf(expect, "dir%d/sub%d/file%d\n", dn, s, n);
+
+                sprintf(path, "%s/dir%d/sub%d/file%d.txt", mnt, dn, s, n);
+                check_file(path, expect);
+
+                /* Lookups don't care about case */
+                sprintf(path, "%s/DIR%d/Sub%d/FILE%d.TXT", mnt, dn, s, n);
+                check_file(path, expect);
+            }
+
+            sprintf(path, "%s/dir%d/sub%d", mnt, dn, s);
+
+            if((d = fs_open(path, O_RDONLY | O_DIR)) < 0) {
+                report("Can't open directory", path);
+                continue;
+            }
+
+            for(cnt = 0; (de = fs_readdir(d)); )
+                if(de->size >= 0)
+                    ++cnt;
+
+            if(cnt != 8)
+                report("Wrong number of files in", path);
+
+            fs_close(d);
+        }
+    }
+
+    sprintf(path, "%s/dir1/sub2/file8.txt", mnt);
+    check_missing(path, O_RDONLY);
+    sprintf(path, "%s/dir4/sub0/file0.txt", mnt);
+    check_missing(path, O_RDONLY);
+    sprintf(path, "%s/dir1/sub2/file1", mnt);
+    check_missing(path, O_RDONLY);
+    sprintf(path, "%s/dir1/sub2", mnt);
+    check_missing(path, O_RDONLY);
+    sprintf(path, "%s/dir1/sub2/file1.txt", mnt);
+    check_missing(path, O_RDONLY | O_DIR);
+}
+
+static void check_big(void) {
+    uint32_t seed = 0x12345678;
+    const char *map;
+    size_t pos, len;
+    ssize_t r;
+    file_t f;
+    int i;
+
+    for(i = 0; i < LINES; i++)
+        sprintf(big + i * LINE_LEN, "line %5d of a file that compresses well\n",
+                i + 1);
+
+    check_file(BIG_FILE, big);
+
+    if((f = fs_open(BIG_FILE, O_RDONLY)) < 0) {
+        report("Can't open", BIG_FILE);
+        return;
+    }
+
+    if(fs_total(f) != BIG_SIZE)
+        report("Wrong size", BIG_FILE);
+
+    /* Uneven pieces, which start and end in the middle of blocks */
+    for(pos = 0, len = 1; pos < BIG_SIZE; pos += r, len = len * 3 + 7) {
+        if(len > 20000)
+            len = 1;
+
+        r = fs_read(f, buf, len);
+
+        if(r <= 0 || memcmp(buf, big + pos, r)) {
+            report("Wrong contents reading in pieces", BIG_FILE);
+            break;
+        }
+    }
+
+    /* Random places */
+    for(i = 0; i < 500; i++) {
+        seed = seed * 1103515245 + 12345;
+        pos = (seed >> 8) % BIG_SIZE;
+        len = BIG_SIZE - pos < 300 ? BIG_SIZE - pos : 300;
+
+        if(fs_seek(f, pos, SEEK_SET) != (off_t)pos ||
+           fs_read(f, buf, len) != (ssize_t)len ||
+           memcmp(buf, big + pos, len)) {
+            report("Wrong contents after a seek", BIG_FILE);
+            break;
+        }
+    }
+
+    if(!(map = fs_mmap(f)) || memcmp(map, big, BIG_SIZE))
+        report("Wrong contents through fs_mmap()", BIG_FILE);
+
+    fs_close(f);
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    if(check_image() < 0)
+        return 1;
+
+    check_lookups("/rd");
+    check_lookups("/noidx");
+    check_big();
+
+    fs_romdisk_unmount("/noidx");
+
+    if(failures)
+        printf("%d failure(s)\n", failures);
+    else
+        printf("Everything matches\n");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,349 @@
+/* KallistiOS ##version##
+
+   demux.c
+
+   This example measures how long it takes the network stack to find the
+   socket an incoming packet belongs to, with different numbers of sockets
+   open. It sets up a fake network device, opens a bunch of UDP sockets and
+   TCP connections over it, and then hands the stack made-up packets for them
+   as fast as it can, timing how long each one takes to be dealt with.
+
+   Three kinds of packets are sent: UDP datagrams for one of the open sockets,
+   UDP datagrams for a port nothing is bound to, and duplicate ACKs for one of
+   the TCP connections (which the stack has to find the connection for, but
+   then doesn't have anything to do with). With the sockets kept in hash
+   tables, the time per packet should stay about the same no matter how many
+   sockets are open.
+
+   No network adapter is needed to run this.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <arch/arch.h>
+#include <arch/timer.h>
+#include <kos/net.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define MAX_SOCKS       256
+#define ROUNDS          64
+#define UDP_BASE_PORT   20000
+#define TCP_PORT        7000
+#define PKT_MAX         1600
+
+/* The stack expects an ethernet header in front of what it receives */
+#define ETH_HDR_LEN     14
+
+/* Packets sent over the fake device, waiting to be delivered */
+#define QUEUE_LEN       16
+
+static uint8_t queue[QUEUE_LEN][ETH_HDR_LEN + PKT_MAX];
+static int queue_len[QUEUE_LEN];
+static int queued, lost;
+
+static int udp_socks[MAX_SOCKS];
+static int tcp_cli[MAX_SOCKS], tcp_srv[MAX_SOCKS];
+static int tcp_listen = -1;
+
+/* The last ACK each client sent on its connection, ready to be replayed */
+static uint8_t tcp_acks[MAX_SOCKS][ETH_HDR_LEN + 60];
+static int tcp_ack_len[MAX_SOCKS];
+
+static int fake_tx(netif_t *self, const uint8 *data, int len, int blocking) {
+    (void)self;
+    (void)blocking;
+
+    if(queued == QUEUE_LEN || len > PKT_MAX) {
+        ++lost;
+        return NETIF_TX_OK;
+    }
+
+    memset(queue[queued], 0, ETH_HDR_LEN);
+    queue[queued][12] = 0x08;
+    memcpy(queue[queued] + ETH_HDR_LEN, data, len);
+    queue_len[queued++] = ETH_HDR_LEN + len;
+
+    return NETIF_TX_OK;
+}
+
+static netif_t fake_if = {
+    .name = "fake",
+    .descr = "Fake network device",
+    .flags = NETIF_NOETH | NETIF_INITIALIZED | NETIF_RUNNING,
+    .ip_addr = { 10, 0, 0, 1 },
+    .netmask = { 255, 255, 255, 0 },
+    .broadcast = { 10, 0, 0, 255 },
+    .mtu = 1500,
+    .mtu6 = 1500,
+    .hop_limit = 64,
+    .if_tx = fake_tx
+};
+
+/* Deliver everything that has been sent, along with anything sent in reply,
+   remembering the last packet delivered. */
+static void pump(uint8_t *last, int *last_len) {
+    static uint8_t pkt[ETH_HDR_LEN + PKT_MAX];
+    int len;
+
+    while(queued) {
+        len = queue_len[0];
+        memcpy(pkt, queue[0], len);
+        memmove(queue[0], queue[1], (QUEUE_LEN - 1) * sizeof(queue[0]));
+        memmove(queue_len, queue_len + 1, (QUEUE_LEN - 1) * sizeof(int));
+        --queued;
+
+        if(last && len <= ETH_HDR_LEN + 60) {
+            memcpy(last, pkt, len);
+            *last_len = len;
+        }
+
+        net_input(&fake_if, pkt, len);
+    }
+}
+
+static void set_nonblock(int s) {
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+}
+
+static void make_addr(struct sockaddr_in *addr, uint32_t ip, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr.s_addr = ip;
+}
+
+/* Open sockets up to the count given, returning how many are open. */
+static int open_udp(int from, int to) {
+    struct sockaddr_in addr;
+    int i;
+
+    for(i = from; i < to; ++i) {
+        if((udp_socks[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+            return i;
+
+        make_addr(&addr, INADDR_ANY, UDP_BASE_PORT + i);
+
+        if(bind(udp_socks[i], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(udp_socks[i]);
+            return i;
+        }
+
+        set_nonblock(udp_socks[i]);
+    }
+
+    return to;
+}
+
+static int open_tcp(int from, int to) {
+    struct sockaddr_in addr;
+    int i, sz = 2048;
+
+    if(tcp_listen < 0) {
+        tcp_listen = socket(AF_INET, SOCK_STREAM, 0);
+        make_addr(&addr, INADDR_ANY, TCP_PORT);
+        setsockopt(tcp_listen, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+        setsockopt(tcp_listen, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+
+        if(bind(tcp_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+           listen(tcp_listen, 4) < 0) {
+            printf("Couldn't set up the listening socket\n");
+            return 0;
+        }
+
+        set_nonblock(tcp_listen);
+    }
+
+    make_addr(&addr, htonl(net_ipv4_address(fake_if.ip_addr)), TCP_PORT);
+
+    for(i = from; i < to; ++i) {
+        if((tcp_cli[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return i;
+
+        setsockopt(tcp_cli[i], SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+        setsockopt(tcp_cli[i], SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+        set_nonblock(tcp_cli[i]);
+
+        if(connect(tcp_cli[i], (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+           errno != EINPROGRESS) {
+            close(tcp_cli[i]);
+            return i;
+        }
+
+        /* Get the SYN to the listening socket, accept it, and then let the
+           rest of the handshake happen. The last thing sent is the client's
+           ACK of the server's SYN. */
+        pump(NULL, NULL);
+
+        if((tcp_srv[i] = accept(tcp_listen, NULL, NULL)) < 0) {
+            close(tcp_cli[i]);
+            return i;
+        }
+
+        pump(tcp_acks[i], &tcp_ack_len[i]);
+
+        /* Make sure that really was a bare ACK (with room for options) */
+        if(tcp_ack_len[i] < ETH_HDR_LEN + 40 ||
+           tcp_acks[i][ETH_HDR_LEN + 33] != 0x10) {
+            printf("Unexpected packet at the end of the handshake\n");
+            close(tcp_srv[i]);
+            close(tcp_cli[i]);
+            return i;
+        }
+    }
+
+    return to;
+}
+
+static uint16_t ip_checksum(const uint8_t *hdr, int len) {
+    uint32_t sum = 0;
+    int i;
+
+    for(i = 0; i < len; i += 2)
+        sum += (hdr[i] << 8) | hdr[i + 1];
+
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return ~sum;
+}
+
+/* Build a UDP datagram to the port given, with the checksum left out. */
+static int make_udp(uint8_t *pkt, int port) {
+    uint8_t *ip = pkt + ETH_HDR_LEN, *udp = ip + 20;
+    uint16_t cs;
+
+    memset(pkt, 0, ETH_HDR_LEN + 36);
+    pkt[12] = 0x08;
+
+    ip[0] = 0x45;
+    ip[3] = 36;
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, fake_if.ip_addr, 4);
+    memcpy(ip + 16, fake_if.ip_addr, 4);
+    cs = ip_checksum(ip, 20);
+    ip[10] = cs >> 8;
+    ip[11] = cs & 0xFF;
+
+    udp[0] = 0x30;
+    udp[1] = 0x39;
+    udp[2] = port >> 8;
+    udp[3] = port & 0xFF;
+    udp[5] = 16;
+    memcpy(udp + 8, "demux benchmark", 8);
+
+    return ETH_HDR_LEN + 36;
+}
+
+static void drain_udp(int cnt) {
+    uint8_t buf[64];
+    int i;
+
+    for(i = 0; i < cnt; ++i) {
+        while(recv(udp_socks[i], buf, sizeof(buf), 0) > 0);
+    }
+}
+
+/* Average time in nanoseconds to handle one of the packets. */
+static uint32_t bench_udp(int cnt, int hit) {
+    static uint8_t pkts[MAX_SOCKS][ETH_HDR_LEN + 36];
+    uint64_t start, total = 0;
+    int i, r, len = 0;
+
+    for(i = 0; i < cnt; ++i)
+        len = make_udp(pkts[i], UDP_BASE_PORT + (hit ? i : MAX_SOCKS + i));
+
+    for(r = 0; r < ROUNDS; ++r) {
+        start = timer_ns_gettime64();
+
+        for(i = 0; i < cnt; ++i)
+            net_input(&fake_if, pkts[i], len);
+
+        total += timer_ns_gettime64() - start;
+
+        /* Get rid of the datagrams and any ICMP errors sent back */
+        drain_udp(cnt);
+        queued = 0;
+    }
+
+    return (uint32_t)(total / (ROUNDS * cnt));
+}
+
+static uint32_t bench_tcp(int cnt) {
+    uint64_t start, total = 0;
+    int i, r;
+
+    for(r = 0; r < ROUNDS; ++r) {
+        start = timer_ns_gettime64();
+
+        for(i = 0; i < cnt; ++i)
+            net_input(&fake_if, tcp_acks[i], tcp_ack_len[i]);
+
+        total += timer_ns_gettime64() - start;
+        queued = 0;
+    }
+
+    return (uint32_t)(total / (ROUNDS * cnt));
+}
+
+int main(int argc, char *argv[]) {
+    static const int counts[] = { 1, 4, 16, 64, 128, 256 };
+    netif_t *old;
+    unsigned int i;
+    int udp_open = 0, tcp_open = 0, n;
+
+    (void)argc;
+    (void)argv;
+
+    /* New sockets take the default device, so switch it for the duration */
+    old = net_set_default(&fake_if);
+
+    printf("Time to handle one incoming packet, in nanoseconds\n");
+    printf("sockets  udp hit  udp miss  tcp ack\n");
+
+    for(i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+        n = counts[i];
+
+        if((udp_open = open_udp(udp_open, n)) < n ||
+           (tcp_open = open_tcp(tcp_open, n)) < n) {
+            printf("Couldn't open %d sockets: %s\n", n, strerror(errno));
+            break;
+        }
+
+        /* Each TCP connection is two sockets, and there's the listener */
+        printf("%7d  %7lu  %8lu  %7lu\n", n * 3 + 1,
+               (unsigned long)bench_udp(n, 1), (unsigned long)bench_udp(n, 0),
+               (unsigned long)bench_tcp(n));
+    }
+
+    if(lost)
+        printf("%d packets were dropped by the fake device\n", lost);
+
+    while(udp_open)
+        close(udp_socks[--udp_open]);
+
+    while(tcp_open) {
+        --tcp_open;
+        close(tcp_cli[tcp_open]);
+        pump(NULL, NULL);
+        close(tcp_srv[tcp_open]);
+        pump(NULL, NULL);
+    }
+
+    if(tcp_listen >= 0)
+        close(tcp_listen);
+
+    net_set_default(old);
+
+    return 0;
+}
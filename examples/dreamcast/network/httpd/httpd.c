@@ -12,6 +12,7 @@
 
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 
 #include <kos/thread.h>
@@ -242,7 +243,7 @@ void *client_thread(void *p) {
     char * buf, * ext;
     const char * ct;
     file_t f = -1;
-    int r, o, cnt;
+    int r, cnt;
 
     printf("httpd: client thread started, sock %d\n", hs->socket);
 
@@ -293,18 +294,17 @@ void *client_thread(void *p) {
 
         send_ok(hs, ct);
 
-        while((cnt = fs_read(f, buf, BUFSIZE)) != 0) {
-            o = 0;
+        /* Let the socket pull the file in itself. Things on the romdisk go
+           straight from the image into the send queue this way. */
+        cnt = fs_total(f);
 
-            while(cnt > 0) {
-                r = write(hs->socket, buf + o, cnt);
+        while(cnt > 0) {
+            r = sendfile(hs->socket, f, NULL, cnt);
 
-                if(r <= 0)
-                    goto out;
+            if(r <= 0)
+                goto out;
 
-                cnt -= r;
-                o += r;
-            }
+            cnt -= r;
         }
     }
 
@@ -3,6 +3,9 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include <arch/timer.h>
+#include <kos/net.h>
+
 #include "speedtest.h"
 
 /*
@@ -233,6 +236,13 @@ done_parsing:
     }
     else { /* POST */
         if(exact_match(hr->path, "/upload-test")) {
+            net_tcp_stats_t before, after;
+            uint64_t start, ms;
+            uint32_t bytes, copied;
+
+            before = net_tcp_get_stats();
+            start = timer_ms_gettime64();
+
             while(hr->rem_content_length) {
                 total_bytes = recv(hr->socket, response_buf, HEADER_BUF_SIZE - 1, MSG_NONE);
 
@@ -240,6 +250,19 @@ done_parsing:
             }
             send_code(hr->socket, 204, "");
 
+            /* Show how much of the data the stack had to copy on its way in
+               (as opposed to keeping the buffer the network card put it in),
+               on top of the copy out to us in recv(). */
+            ms = timer_ms_gettime64() - start;
+            after = net_tcp_get_stats();
+            bytes = after.bytes_recv - before.bytes_recv;
+            copied = after.bytes_recv_copied - before.bytes_recv_copied;
+            printf("Upload: %lu bytes in %lu ms (%lu KB/s), %lu%% copied "
+                   "into the socket buffer\n", (unsigned long)bytes,
+                   (unsigned long)ms,
+                   (unsigned long)(ms ? (uint64_t)bytes * 1000 / 1024 / ms : 0),
+                   (unsigned long)(bytes ? (uint64_t)copied * 100 / bytes : 0));
+
             goto process_request_out;
         }
     }
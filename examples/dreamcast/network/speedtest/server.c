@@ -13,6 +13,10 @@
 #define BACKLOG         1
 #define HTTP_PORT       80
 
+/* Socket buffer size for each client. Anything past 65535 only helps if the
+   other side agrees to window scaling, which most stacks do. */
+#define SOCK_BUF_SZ     (128 * 1024)
+
 void *server_thread(void *p) {
     (void) p;
     int server_socket;
@@ -55,7 +59,7 @@ void *server_thread(void *p) {
             goto server_cleanup;
         }
 
-        uint32_t new_buf_sz = 65535;
+        uint32_t new_buf_sz = SOCK_BUF_SZ;
         setsockopt(hr->socket, SOL_SOCKET, SO_SNDBUF, &new_buf_sz, sizeof(new_buf_sz));
         setsockopt(hr->socket, SOL_SOCKET, SO_RCVBUF, &new_buf_sz, sizeof(new_buf_sz));
 
@@ -0,0 +1,382 @@
+/* KallistiOS ##version##
+
+   tcploss.c
+
+   This example measures how well TCP copes with a lossy link. It sets up a
+   fake network device that, rather than putting packets on a wire, holds
+   each one for a while and then hands it back to the network stack, dropping
+   a given fraction of them along the way. A server thread and a client then
+   talk to each other over it, first doing a bunch of small request/response
+   exchanges and then a bulk transfer, for a few different loss rates and
+   both of the congestion control algorithms TCP supports.
+
+   The loopback addresses can't be used for this, as packets sent to them
+   are delivered right away in the sending thread, with no chance to be
+   delayed or lost. No network adapter is needed to run this.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <arch/arch.h>
+#include <arch/timer.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define PORT            5000
+#define ONE_WAY_MS      5           /* Half of the round trip time */
+#define ECHO_COUNT      200
+#define ECHO_SIZE       64
+#define BULK_SIZE       (1024 * 1024)
+#define SOCK_BUF_SZ     (64 * 1024)
+
+/* The stack expects an ethernet header in front of what it receives */
+#define ETH_HDR_LEN     14
+
+/* A packet waiting to be delivered */
+typedef struct lossy_pkt {
+    STAILQ_ENTRY(lossy_pkt) list;
+    uint64_t due;
+    int len;
+    uint8_t data[];
+} lossy_pkt_t;
+
+static STAILQ_HEAD(lossy_queue, lossy_pkt) queue = STAILQ_HEAD_INITIALIZER(queue);
+static mutex_t queue_mutex = MUTEX_INITIALIZER;
+static condvar_t queue_cv = COND_INITIALIZER;
+static int loss_permille;
+static volatile int done;
+
+static uint32_t sent, dropped;
+
+/* Called by the IP layer with a full IP packet, as we set NETIF_NOETH. */
+static int lossy_tx(netif_t *self, const uint8 *data, int len, int blocking) {
+    lossy_pkt_t *pkt;
+
+    (void)self;
+    (void)blocking;
+
+    mutex_lock(&queue_mutex);
+    ++sent;
+
+    if(rand() % 1000 < loss_permille) {
+        ++dropped;
+        mutex_unlock(&queue_mutex);
+        return NETIF_TX_OK;
+    }
+
+    /* Leave room for the ethernet header the receive side expects */
+    if(!(pkt = malloc(sizeof(lossy_pkt_t) + ETH_HDR_LEN + len))) {
+        mutex_unlock(&queue_mutex);
+        return NETIF_TX_ERROR;
+    }
+
+    memset(pkt->data, 0, ETH_HDR_LEN);
+    pkt->data[12] = 0x08;
+    pkt->data[13] = 0x00;
+    memcpy(pkt->data + ETH_HDR_LEN, data, len);
+    pkt->len = ETH_HDR_LEN + len;
+    pkt->due = timer_ms_gettime64() + ONE_WAY_MS;
+
+    STAILQ_INSERT_TAIL(&queue, pkt, list);
+    cond_signal(&queue_cv);
+    mutex_unlock(&queue_mutex);
+
+    return NETIF_TX_OK;
+}
+
+static netif_t lossy_if = {
+    .name = "lossy",
+    .descr = "Lossy virtual link",
+    .flags = NETIF_NOETH | NETIF_INITIALIZED | NETIF_RUNNING,
+    .ip_addr = { 10, 0, 0, 1 },
+    .netmask = { 255, 255, 255, 0 },
+    .broadcast = { 10, 0, 0, 255 },
+    .mtu = 1500,
+    .mtu6 = 1500,
+    .hop_limit = 64,
+    .if_tx = lossy_tx
+};
+
+/* Hands packets back to the stack once their time is up. */
+static void *deliver_thd(void *p) {
+    lossy_pkt_t *pkt;
+    uint64_t now;
+
+    (void)p;
+
+    mutex_lock(&queue_mutex);
+
+    while(!done) {
+        if(!(pkt = STAILQ_FIRST(&queue))) {
+            cond_wait_timed(&queue_cv, &queue_mutex, 100);
+            continue;
+        }
+
+        now = timer_ms_gettime64();
+
+        if(pkt->due > now) {
+            mutex_unlock(&queue_mutex);
+            thd_sleep(pkt->due - now);
+            mutex_lock(&queue_mutex);
+            continue;
+        }
+
+        STAILQ_REMOVE_HEAD(&queue, list);
+        mutex_unlock(&queue_mutex);
+
+        net_input(&lossy_if, pkt->data, pkt->len);
+        free(pkt);
+
+        mutex_lock(&queue_mutex);
+    }
+
+    while((pkt = STAILQ_FIRST(&queue))) {
+        STAILQ_REMOVE_HEAD(&queue, list);
+        free(pkt);
+    }
+
+    mutex_unlock(&queue_mutex);
+    return NULL;
+}
+
+static int read_full(int s, void *buf, size_t len) {
+    uint8_t *b = (uint8_t *)buf;
+    ssize_t r;
+
+    while(len) {
+        if((r = read(s, b, len)) <= 0)
+            return -1;
+
+        b += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+static int write_full(int s, const void *buf, size_t len) {
+    const uint8_t *b = (const uint8_t *)buf;
+    ssize_t r;
+
+    while(len) {
+        if((r = write(s, b, len)) <= 0)
+            return -1;
+
+        b += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+static void set_bufs(int s) {
+    int sz = SOCK_BUF_SZ, one = 1;
+
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Echoes everything back on the first connection, and swallows BULK_SIZE
+   bytes before answering with a single one on the second. */
+static void *server_thd(void *p) {
+    int ls = (int)(intptr_t)p, s;
+    static uint8_t buf[4096];
+    ssize_t r;
+    size_t total = 0;
+
+    if((s = accept(ls, NULL, NULL)) < 0)
+        return NULL;
+
+    set_bufs(s);
+
+    while((r = read(s, buf, ECHO_SIZE)) > 0) {
+        if(write_full(s, buf, r))
+            break;
+    }
+
+    close(s);
+
+    if((s = accept(ls, NULL, NULL)) < 0)
+        return NULL;
+
+    while(total < BULK_SIZE && (r = read(s, buf, sizeof(buf))) > 0)
+        total += r;
+
+    write_full(s, buf, 1);
+    close(s);
+
+    return NULL;
+}
+
+static int client_connect(int port, const char *cc) {
+    struct sockaddr_in addr;
+    int s;
+
+    if((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    set_bufs(s);
+    setsockopt(s, IPPROTO_TCP, TCP_CONGESTION, cc, strlen(cc));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(net_ipv4_address(lossy_if.ip_addr));
+
+    if(connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void run(int permille, const char *cc) {
+    static int port = PORT;
+    static uint32_t lat[ECHO_COUNT];
+    static uint8_t buf[4096];
+    struct sockaddr_in addr;
+    net_tcp_stats_t before, after;
+    kthread_t *thd;
+    uint64_t start, end;
+    int ls, s, i;
+    size_t left;
+
+    /* Use a new port each time, so nothing left over from the last run
+       can get in the way */
+    ++port;
+    loss_permille = permille;
+    before = net_tcp_get_stats();
+
+    ls = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if(ls < 0 || bind(ls, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(ls, 1) < 0) {
+        printf("Couldn't set up the listening socket\n");
+        return;
+    }
+
+    thd = thd_create(false, server_thd, (void *)(intptr_t)ls);
+
+    /* Request/response latency */
+    if((s = client_connect(port, cc)) < 0) {
+        printf("connect: %s\n", strerror(errno));
+        goto out;
+    }
+
+    memset(buf, 0x5a, ECHO_SIZE);
+
+    for(i = 0; i < ECHO_COUNT; ++i) {
+        start = timer_us_gettime64();
+
+        if(write_full(s, buf, ECHO_SIZE) || read_full(s, buf, ECHO_SIZE))
+            break;
+
+        lat[i] = (uint32_t)(timer_us_gettime64() - start);
+    }
+
+    close(s);
+
+    if(i < ECHO_COUNT) {
+        printf("echo failed after %d requests\n", i);
+        goto out;
+    }
+
+    qsort(lat, ECHO_COUNT, sizeof(uint32_t), cmp_u32);
+
+    /* Bulk transfer */
+    if((s = client_connect(port, cc)) < 0) {
+        printf("connect: %s\n", strerror(errno));
+        goto out;
+    }
+
+    start = timer_us_gettime64();
+
+    for(left = BULK_SIZE; left; left -= i) {
+        i = left < sizeof(buf) ? left : sizeof(buf);
+
+        if(write_full(s, buf, i))
+            break;
+    }
+
+    if(left || read_full(s, buf, 1)) {
+        printf("bulk transfer failed\n");
+        close(s);
+        goto out;
+    }
+
+    end = timer_us_gettime64();
+    close(s);
+
+    after = net_tcp_get_stats();
+
+    printf("%4d.%d%% %-6s  rtt med %5lu max %6lu us  bulk %5lu KB/s  "
+           "fast rexmit %3lu  timeouts %3lu\n", permille / 10, permille % 10,
+           cc, (unsigned long)lat[ECHO_COUNT / 2],
+           (unsigned long)lat[ECHO_COUNT - 1],
+           (unsigned long)((uint64_t)BULK_SIZE * 1000000 / 1024 /
+                           (end - start)),
+           (unsigned long)(after.fast_retrans - before.fast_retrans),
+           (unsigned long)(after.timeouts - before.timeouts));
+
+out:
+    close(ls);
+    thd_join(thd, NULL);
+}
+
+int main(int argc, char *argv[]) {
+    static const int loss[] = { 0, 5, 10, 30, 50 };
+    netif_t *old;
+    kthread_t *thd;
+    unsigned int i;
+
+    (void)argc;
+    (void)argv;
+
+    srand(1234);
+
+    /* New sockets take the default device, so switch it for the duration */
+    old = net_set_default(&lossy_if);
+    thd = thd_create(false, deliver_thd, NULL);
+
+    printf("TCP over a lossy link, %d ms round trip\n", ONE_WAY_MS * 2);
+
+    for(i = 0; i < sizeof(loss) / sizeof(loss[0]); ++i) {
+        run(loss[i], "reno");
+        run(loss[i], "cubic");
+    }
+
+    printf("%lu packets sent, %lu dropped\n", (unsigned long)sent,
+           (unsigned long)dropped);
+
+    done = 1;
+    thd_join(thd, NULL);
+    net_set_default(old);
+
+    return 0;
+}
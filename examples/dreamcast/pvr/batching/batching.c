@@ -0,0 +1,366 @@
+/* KallistiOS ##version##
+
+   batching.c
+
+   This example checks that header batching (pvr_list_set_batching()) gives
+   the TA what it was asked to draw. Every frame it sends a few hundred strips
+   to the opaque list with a mix of headers:
+
+   - flat coloured triangle strips, with 32-byte vertices, under a few
+     different headers;
+   - sprites, whose vertices are 64 bytes;
+   - textured polygons with floating point colours, whose vertices are also
+     64 bytes.
+
+   The 64-byte vertices are sometimes sent in two 32-byte halves, with second
+   halves that start with values like 0.0f and -1.0f, which look nothing like
+   vertex data. Now and then pvr_vertbuf_tail() is called partway through a
+   strip, which makes everything held back be written out right there.
+
+   Once a frame's strips are in, the part of the vertex buffer they went into
+   is read back and walked the way the TA would. Every strip has to be there
+   once, in one piece, and under the header it was sent with.
+
+   Press START to stop early.
+
+*/
+
+#include <kos.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#define FRAMES          300
+#define STRIPS          256
+#define MAX_VERTS       8
+#define VERTBUF_SIZE    (512 * 1024)
+
+#define CMD_TYPE(w)     ((w) & 0xe0000000)
+
+/* A textured vertex with floating point base and offset colours. There's no
+   type for this one in pvr.h. */
+typedef struct {
+    uint32_t flags;
+    float   x, y, z, u, v;
+    uint32_t d1, d2;
+    float   a, r, g, b;
+    float   oargb[4];
+} vert_4f_t;
+
+enum { KIND_COL, KIND_SPRITE, KIND_4F, KIND_COUNT };
+
+/* What got sent for each strip, to look for in the buffer afterwards. */
+typedef struct {
+    const uint32_t *hdr;
+    uint8_t data[MAX_VERTS * 64];
+    size_t  len;
+    int     found;
+} strip_t;
+
+static strip_t strips[STRIPS];
+
+static pvr_init_params_t pvr_params = {
+    { PVR_BINSIZE_16, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0 },
+    512 * 1024, 1, 0, 0, 0
+};
+
+static pvr_poly_hdr_t col_hdrs[3];
+static pvr_poly_hdr_t txr_hdr;
+static pvr_sprite_hdr_t spr_hdr;
+
+static void *vertbuf;
+static uint32_t seed = 0xdeadbeef;
+
+static int rnd(int n) {
+    seed = seed * 1103515245 + 12345;
+    return (int)((seed >> 16) % n);
+}
+
+static void setup(void) {
+    pvr_poly_cxt_t cxt;
+    pvr_sprite_cxt_t scxt;
+    pvr_ptr_t txr;
+    uint16_t white[8 * 8];
+    int i;
+
+    pvr_init(&pvr_params);
+    pvr_set_bg_color(0, 0, 0);
+    vertbuf = memalign(32, VERTBUF_SIZE);
+    pvr_set_vertbuf(PVR_LIST_OP_POLY, vertbuf, VERTBUF_SIZE);
+
+    if(pvr_list_set_batching(PVR_LIST_OP_POLY, 1) < 0) {
+        printf("Couldn't turn on batching\n");
+        exit(1);
+    }
+
+    for(i = 0; i < 3; i++) {
+        pvr_poly_cxt_col(&cxt, PVR_LIST_OP_POLY);
+        cxt.gen.culling = i;
+        pvr_poly_compile(&col_hdrs[i], &cxt);
+    }
+
+    txr = pvr_mem_malloc(8 * 8 * 2);
+    memset(white, 0xff, sizeof(white));
+    pvr_txr_load(white, txr, sizeof(white));
+    pvr_poly_cxt_txr(&cxt, PVR_LIST_OP_POLY, PVR_TXRFMT_RGB565, 8, 8, txr,
+                     PVR_FILTER_NONE);
+    cxt.fmt.color = PVR_CLRFMT_4FLOATS;
+    pvr_poly_compile(&txr_hdr, &cxt);
+
+    pvr_sprite_cxt_col(&scxt, PVR_LIST_OP_POLY);
+    pvr_sprite_compile(&spr_hdr, &scxt);
+}
+
+/* Send a vertex, sometimes in two halves if it's a big one. */
+static void send_vert(strip_t *s, void *v, size_t size) {
+    memcpy(s->data + s->len, v, size);
+    s->len += size;
+
+    if(size == 64 && rnd(2)) {
+        pvr_prim(v, 32);
+
+        if(!rnd(8))
+            pvr_vertbuf_tail(PVR_LIST_OP_POLY);
+
+        pvr_prim((uint8_t *)v + 32, 32);
+    }
+    else {
+        pvr_prim(v, size);
+    }
+
+    if(!rnd(40))
+        pvr_vertbuf_tail(PVR_LIST_OP_POLY);
+}
+
+static void send_strip(int n) {
+    strip_t *s = &strips[n];
+    pvr_vertex_t v;
+    pvr_sprite_col_t sv;
+    vert_4f_t tv;
+    int kind = rnd(KIND_COUNT), cnt, i;
+    float x = rnd(600), y = rnd(440), z = 1.0f + n;
+
+    s->len = 0;
+    s->found = 0;
+
+    if(kind == KIND_SPRITE) {
+        s->hdr = (const uint32_t *)&spr_hdr;
+        pvr_prim(&spr_hdr, sizeof(spr_hdr));
+
+        memset(&sv, 0, sizeof(sv));
+        sv.flags = PVR_CMD_VERTEX_EOL;
+        sv.ax = x;
+        sv.ay = y;
+        sv.bx = x + 16.0f;
+        sv.by = y;
+        sv.cx = x + 16.0f;
+        sv.dx = x;
+        sv.dy = y + 16.0f;
+        sv.az = sv.bz = sv.cz = z;
+
+        /* The second half starts with cy. Make it look like other things now
+           and then, and let the sprite go off the top of the screen. */
+        switch(rnd(3)) {
+            case 0: sv.cy = 0.0f; break;
+            case 1: sv.cy = -1.0f; break;
+            default: sv.cy = y + 16.0f; break;
+        }
+
+        send_vert(s, &sv, sizeof(sv));
+        return;
+    }
+
+    cnt = 3 + rnd(MAX_VERTS - 2);
+
+    if(kind == KIND_4F) {
+        s->hdr = (const uint32_t *)&txr_hdr;
+        pvr_prim(&txr_hdr, sizeof(txr_hdr));
+
+        memset(&tv, 0, sizeof(tv));
+        tv.z = z;
+        tv.r = tv.g = tv.b = 1.0f;
+
+        /* The second half starts with the alpha, which doesn't matter in
+           the opaque list. Zero reads as no command at all. */
+        tv.a = rnd(2) ? 0.0f : -1.0f;
+
+        for(i = 0; i < cnt; i++) {
+            tv.flags = i == cnt - 1 ? PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX;
+            tv.x = x + (i >> 1) * 8.0f;
+            tv.y = y + (i & 1) * 8.0f;
+            tv.u = (i >> 1) * 0.25f;
+            tv.v = (i & 1) * 1.0f;
+            send_vert(s, &tv, sizeof(tv));
+        }
+
+        return;
+    }
+
+    /* Only send the header sometimes, so some strips carry on under the
+       header the last one used. */
+    s->hdr = (const uint32_t *)&col_hdrs[rnd(3)];
+
+    if(!n || strips[n - 1].hdr != s->hdr || rnd(2))
+        pvr_prim((void *)s->hdr, sizeof(pvr_poly_hdr_t));
+
+    v.z = z;
+    v.u = v.v = 0.0f;
+    v.argb = 0xff000000 | rnd(0x1000000);
+    v.oargb = 0;
+
+    for(i = 0; i < cnt; i++) {
+        v.flags = i == cnt - 1 ? PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX;
+        v.x = x + (i >> 1) * 8.0f;
+        v.y = y + (i & 1) * 8.0f;
+        send_vert(s, &v, sizeof(v));
+    }
+}
+
+static size_t vert_size(const uint32_t *hdr) {
+    if(CMD_TYPE(hdr[0]) == PVR_CMD_SPRITE)
+        return 64;
+
+    if((hdr[0] & 8) && ((hdr[0] & PVR_TA_CMD_CLRFMT_MASK) >>
+                        PVR_TA_CMD_CLRFMT_SHIFT) == PVR_CLRFMT_4FLOATS)
+        return 64;
+
+    return 32;
+}
+
+/* Find the strip that was sent with this header and data. */
+static int match_strip(const uint32_t *hdr, const uint8_t *data, size_t len) {
+    int i;
+
+    for(i = 0; i < STRIPS; i++) {
+        if(strips[i].len == len && !memcmp(strips[i].hdr, hdr, 32) &&
+           !memcmp(strips[i].data, data, len)) {
+            if(strips[i].found++) {
+                printf("Strip %d is in there twice\n", i);
+                return -1;
+            }
+
+            return 0;
+        }
+    }
+
+    printf("A strip came out that was never sent\n");
+    return -1;
+}
+
+/* Walk what ended up in the buffer the way the TA would. */
+static int check(const uint8_t *start, const uint8_t *end) {
+    const uint32_t *hdr = NULL, *w;
+    const uint8_t *p, *strip = NULL;
+    size_t vsize = 32, step;
+    int i, errs = 0;
+
+    for(p = start; p < end; p += step) {
+        w = (const uint32_t *)p;
+        step = vsize;
+
+        switch(CMD_TYPE(w[0])) {
+            case PVR_CMD_POLYHDR & 0xe0000000:
+            case PVR_CMD_SPRITE:
+                if(strip) {
+                    printf("A header landed in the middle of a strip\n");
+                    return -1;
+                }
+
+                hdr = w;
+                vsize = vert_size(hdr);
+                step = 32;
+                break;
+
+            case PVR_CMD_VERTEX:
+                if(!hdr) {
+                    printf("Vertex data with no header in front of it\n");
+                    return -1;
+                }
+
+                if(!strip)
+                    strip = p;
+
+                if(w[0] & 0x10000000) {
+                    if(match_strip(hdr, strip, p + vsize - strip) < 0)
+                        ++errs;
+
+                    strip = NULL;
+                }
+
+                break;
+
+            default:
+                printf("Something that isn't a header or a vertex: %08lx\n",
+                       (unsigned long)w[0]);
+                return -1;
+        }
+    }
+
+    if(strip || p != end) {
+        printf("The last strip wasn't finished\n");
+        return -1;
+    }
+
+    for(i = 0; i < STRIPS; i++) {
+        if(!strips[i].found) {
+            printf("Strip %d went missing\n", i);
+            ++errs;
+        }
+    }
+
+    return errs ? -1 : 0;
+}
+
+static int check_start(void) {
+    maple_device_t *cont;
+    cont_state_t *state;
+
+    if(!(cont = maple_enum_type(0, MAPLE_FUNC_CONTROLLER)))
+        return 0;
+
+    if(!(state = (cont_state_t *)maple_dev_status(cont)))
+        return 0;
+
+    return state->buttons & CONT_START;
+}
+
+int main(int argc, char *argv[]) {
+    const uint8_t *start, *end;
+    pvr_stats_t stats;
+    int frame, i, bad = 0;
+
+    (void)argc;
+    (void)argv;
+
+    setup();
+
+    for(frame = 0; frame < FRAMES && !check_start(); frame++) {
+        pvr_wait_ready();
+        pvr_scene_begin();
+        pvr_list_begin(PVR_LIST_OP_POLY);
+
+        start = (const uint8_t *)pvr_vertbuf_tail(PVR_LIST_OP_POLY);
+
+        for(i = 0; i < STRIPS; i++)
+            send_strip(i);
+
+        end = (const uint8_t *)pvr_vertbuf_tail(PVR_LIST_OP_POLY);
+
+        if(check(start, end) < 0) {
+            printf("Frame %d came out wrong\n", frame);
+            ++bad;
+        }
+
+        pvr_list_finish();
+        pvr_scene_finish();
+    }
+
+    pvr_get_stats(&stats);
+    printf("%d frames, %d wrong; %lu header bytes saved in the last one\n",
+           frame, bad, (unsigned long)stats.hdr_bytes_saved);
+
+    pvr_shutdown();
+    free(vertbuf);
+
+    return bad ? 1 : 0;
+}
@@ -4,8 +4,22 @@
    (c)2002 Megan Potter
 */
 
+/* This finds out roughly how many flat shaded triangles can be drawn per
+   frame while keeping up 60fps. It does that three times, once for each way
+   of getting vertices to the TA:
+
+   - SQ: vertex DMA is off, and pvr_prim() sends each vertex straight to the
+     TA with the store queues.
+   - DMA copy: pvr_prim() copies each vertex into the list's vertex buffer,
+     which is DMAed to the TA once the frame is done.
+   - DMA in place: vertices are written straight into the list's vertex buffer
+     with pvr_list_reserve() and pvr_list_commit(), and then DMAed.
+
+   Press START to skip to the next mode. */
+
 #include <kos.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <time.h>
 
 pvr_init_params_t pvr_params = {
@@ -15,6 +29,18 @@ pvr_init_params_t pvr_params = {
 
 enum { PHASE_HALVE, PHASE_INCR, PHASE_DECR, PHASE_FINAL };
 
+enum { MODE_SQ, MODE_DMA_COPY, MODE_DMA_INPLACE, MODE_COUNT };
+
+const char *mode_names[MODE_COUNT] = { "SQ", "DMA copy", "DMA in place" };
+int mode_pps[MODE_COUNT];
+
+/* The vertex buffer has to hold two frames of this many triangles. */
+#define MAX_POLYS   8192
+#define VERTBUF_SIZE    (2 * ((MAX_POLYS * 3 * sizeof(pvr_vertex_t) + 63 + 64) & ~63))
+
+int mode;
+void *vertbuf;
+
 int polycnt;
 int phase = PHASE_HALVE;
 float avgfps = -1;
@@ -61,17 +87,30 @@ pvr_poly_hdr_t hdr;
 void setup(void) {
     pvr_poly_cxt_t cxt;
 
+    pvr_params.dma_enabled = (mode != MODE_SQ);
     pvr_init(&pvr_params);
     pvr_set_bg_color(0, 0, 0);
 
+    if(pvr_params.dma_enabled) {
+        vertbuf = memalign(32, VERTBUF_SIZE);
+        pvr_set_vertbuf(PVR_LIST_OP_POLY, vertbuf, VERTBUF_SIZE);
+    }
+
     pvr_poly_cxt_col(&cxt, PVR_LIST_OP_POLY);
     cxt.gen.shading = PVR_SHADE_FLAT;
     pvr_poly_compile(&hdr, &cxt);
 }
 
+void cleanup(void) {
+    pvr_shutdown();
+
+    free(vertbuf);
+    vertbuf = NULL;
+}
+
 int oldseed = 0xdeadbeef;
 void do_frame(void) {
-    pvr_vertex_t vert;
+    pvr_vertex_t vert, *v;
     int x, y, z;
     int size;
     int i, col;
@@ -108,6 +147,38 @@ void do_frame(void) {
         col = getnum(256);
         nextnum();
 
+        if(mode == MODE_DMA_INPLACE) {
+            v = pvr_list_reserve(PVR_LIST_OP_POLY, 3 * sizeof(pvr_vertex_t));
+
+            /* Out of room in the vertex buffer: send what's there to the TA
+               to make some, or give up on the rest of the frame if that
+               doesn't help. */
+            if(!v) {
+                if(pvr_list_flush(PVR_LIST_OP_POLY) < 0 ||
+                   !(v = pvr_list_reserve(PVR_LIST_OP_POLY,
+                                          3 * sizeof(pvr_vertex_t))))
+                    break;
+            }
+
+            v[0].flags = PVR_CMD_VERTEX;
+            v[0].x = x - size;
+            v[0].y = y + size;
+            v[0].z = z;
+            v[0].u = v[0].v = 0.0f;
+            v[0].argb = col | (col << 8) | (col << 16) | 0xff000000;
+            v[0].oargb = 0;
+
+            v[1] = v[0];
+            v[1].y = y - size;
+
+            v[2] = v[0];
+            v[2].flags = PVR_CMD_VERTEX_EOL;
+            v[2].x = x + size;
+
+            pvr_list_commit(PVR_LIST_OP_POLY, 3 * sizeof(pvr_vertex_t));
+            continue;
+        }
+
         vert.flags = PVR_CMD_VERTEX;
         vert.x = x - size;
         vert.y = y + size;
@@ -132,6 +203,9 @@ void do_frame(void) {
 
 time_t begin;
 void switch_tests(int ppf) {
+    if(ppf > MAX_POLYS)
+        ppf = MAX_POLYS;
+
     printf("Beginning new test: %d polys per frame (%d per second at 60fps)\n",
            ppf, ppf * 60);
     avgfps = -1;
@@ -145,8 +219,9 @@ void check_switch(void) {
 
     if(now >= (begin + 5)) {
         printf("  Average Frame Rate: ~%f fps (%d pps)\n", (double)avgfps, (int)(polycnt * avgfps));
+        mode_pps[mode] = (int)(polycnt * avgfps);
         begin = time(NULL);
-        
+
         switch(phase) {
             case PHASE_HALVE:
 
@@ -161,7 +236,7 @@ void check_switch(void) {
                 break;
             case PHASE_INCR:
 
-                if(avgfps >= 55) {
+                if(avgfps >= 55 && polycnt < MAX_POLYS) {
                     switch_tests(polycnt + 500);
                 }
                 else {
@@ -188,23 +263,37 @@ void check_switch(void) {
 }
 
 int main(int argc, char **argv) {
-    setup();
+    for(mode = 0; mode < MODE_COUNT; mode++) {
+        printf("Mode: %s\n", mode_names[mode]);
+        setup();
 
-    /* Start off with something obscene */
-    switch_tests(200000 / 60);
-    begin = time(NULL);
+        /* Start off with something obscene */
+        phase = PHASE_HALVE;
+        switch_tests(200000 / 60);
+        begin = time(NULL);
 
-    for(;;) {
-        if(check_start())
-            break;
+        while(phase != PHASE_FINAL) {
+            if(check_start())
+                break;
+
+            printf(" \r");
+            do_frame();
+            running_stats();
+            check_switch();
+        }
 
-        printf(" \r");
-        do_frame();
-        running_stats();
-        check_switch();
+        /* Let go of START before moving on. */
+        while(check_start())
+            thd_sleep(10);
+
+        stats();
+        cleanup();
     }
 
-    stats();
+    printf("Results:\n");
+
+    for(mode = 0; mode < MODE_COUNT; mode++)
+        printf("  %-12s %d pps\n", mode_names[mode], mode_pps[mode]);
 
     return 0;
 }
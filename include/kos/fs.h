@@ -680,6 +680,20 @@ vfs_handler_t *fs_get_handler(file_t fd);
 */
 void *fs_get_handle(file_t fd);
 
+/** \brief   Wake up poll() and epoll waiters on a file.
+
+    This function is for filesystem handlers whose files can become ready in
+    the background (for instance, when an asynchronous read finishes). It
+    tells poll() and epoll about the events on every file descriptor that
+    refers to the given file, including any made with dup(). There is
+    generally no reason to call this function in user code.
+
+    \param  vfs             The VFS handler the file belongs to.
+    \param  hnd             The handler's internal handle for the file.
+    \param  events          The poll events that have happened.
+*/
+void fs_poll_notify(vfs_handler_t *vfs, void *hnd, short events);
+
 /** \brief   Get the current working directory of the running thread.
 
     \return                 The current working directory.
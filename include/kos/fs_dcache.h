@@ -0,0 +1,115 @@
+/* KallistiOS ##version##
+
+   kos/fs_dcache.h
+
+*/
+
+/** \file    kos/fs_dcache.h
+    \brief   Shared path lookup cache for read-only filesystems.
+    \ingroup vfs_dcache
+
+    Looking up a path on filesystems like ISO9660 and romfs means scanning
+    every directory along the way, entry by entry. This cache remembers the
+    result of those lookups, so that opening or stat-ing the same file, or
+    files in the same directories, doesn't need to do it again.
+
+    The cache is shared between all of the filesystems that use it and has a
+    fixed number of entries (FS_DCACHE_ENTRIES), recycled in least recently
+    used order. Each entry is tagged with an owner, which is whatever the
+    filesystem uses to tell its mounts apart, and all of an owner's entries
+    are dropped at once when that mount goes away or its media changes.
+
+    Paths are compared without regard to case, since that's how both of the
+    filesystems using this cache compare names. Paths longer than
+    FS_DCACHE_PATH_MAX are never cached.
+*/
+
+#ifndef __KOS_FS_DCACHE_H
+#define __KOS_FS_DCACHE_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** \defgroup vfs_dcache    Path Cache
+    \brief                  Path lookup cache for VFS drivers
+    \ingroup                vfs
+
+    @{
+*/
+
+/** \brief  Path lookup cache statistics.
+
+    \headerfile kos/fs_dcache.h
+*/
+typedef struct fs_dcache_stats {
+    uint32_t hits;          /**< \brief Lookups that found an entry */
+    uint32_t misses;        /**< \brief Lookups that didn't */
+    uint32_t inserts;       /**< \brief Entries added */
+    uint32_t evictions;     /**< \brief Entries recycled to make room */
+    uint32_t entries;       /**< \brief Entries currently in use */
+} fs_dcache_stats_t;
+
+/** \brief  Look up a path in the cache.
+
+    \param  owner           The mount the path belongs to.
+    \param  path            The path to look up; it need not be terminated.
+    \param  len             The length of the path.
+    \param  dir             Non-zero to look up a directory, zero for a file.
+    \param  value           Where to store the two words cached for the path.
+    \return                 true if the path was found, false otherwise.
+*/
+bool fs_dcache_lookup(const void *owner, const char *path, size_t len, int dir,
+                      uint32_t value[2]);
+
+/** \brief  Add a path to the cache.
+
+    What the two words of value mean is up to the filesystem. If the path is
+    already cached, its entry is updated.
+
+    \param  owner           The mount the path belongs to.
+    \param  path            The path to add; it need not be terminated.
+    \param  len             The length of the path.
+    \param  dir             Non-zero for a directory, zero for a file.
+    \param  value           The two words to cache for the path.
+*/
+void fs_dcache_insert(const void *owner, const char *path, size_t len, int dir,
+                      const uint32_t value[2]);
+
+/** \brief  Drop every cached path belonging to a mount.
+
+    This must be called whenever the mount goes away or its contents change,
+    before anything else can be mounted with the same owner.
+
+    \param  owner           The mount to drop, or NULL for everything.
+*/
+void fs_dcache_invalidate(const void *owner);
+
+/** \brief  Turn the cache on or off.
+
+    While the cache is off, lookups always miss and nothing is added. Turning
+    it off also empties it. The cache is on by default.
+
+    \param  enable          Whether the cache should be used.
+    \return                 Whether the cache was on before.
+*/
+bool fs_dcache_set_enabled(bool enable);
+
+/** \brief  Get the path lookup cache statistics.
+
+    \param  stats           Where to store the statistics.
+*/
+void fs_dcache_get_stats(fs_dcache_stats_t *stats);
+
+/** \cond */
+void fs_dcache_shutdown(void);
+/** \endcond */
+
+/** @} */
+
+__END_DECLS
+
+#endif  /* __KOS_FS_DCACHE_H */
@@ -39,7 +39,19 @@
     filesystem image. A rule to create the image is provided in the rules provided in Makefile.rules,
     the created object file must be linked with your binary file by adding romdisk.o to your 
     list of objects.
-    
+
+    Images built with genromfs -i (which the Makefile.rules rule does) carry
+    an index of every path in them, so files can be found without scanning
+    each directory along the way. Images without one still work as before.
+
+    To save RAM, files can also be stored compressed, by building the image
+    with genromfs -z (add "KOS_ROMDISK_FLAGS = -z" to your Makefile). Each file
+    is split into blocks that are compressed on their own, and reads only
+    unpack the blocks they need, keeping the last FS_ROMDISK_ZCACHE_BLOCKS of
+    them around. Mapping a compressed file with fs_mmap() unpacks all of it into
+    a buffer that lives until the file is closed, so that's best avoided for big
+    files.
+
     \see INIT_FS_ROMDISK
     \see KOS_INIT_FLAGS()
 
@@ -378,6 +378,39 @@ typedef struct fs_socket_proto {
                             currently true in the socket. 0 if none are true.
     */
     short (*poll)(net_socket_t *s, short events);
+
+    /** \brief  Receive a batch of messages on a socket.
+
+        This function is used to implement ::recvmmsg(). It is optional; if it
+        is NULL, fs_socket will call recvfrom once for each piece of each
+        message instead.
+
+        \param  s           The socket to receive on.
+        \param  msgs        The messages to fill in.
+        \param  vlen        The number of entries in msgs.
+        \param  flags       Flags for the receive.
+        \param  timeout     The longest to wait, or NULL for no limit.
+        \retval -1          On error (set errno appropriately).
+        \return             The number of messages received.
+    */
+    int (*recvmmsg)(net_socket_t *s, struct mmsghdr *msgs, unsigned int vlen,
+                    int flags, struct timespec *timeout);
+
+    /** \brief  Send a batch of messages on a socket.
+
+        This function is used to implement ::sendmmsg(). It is optional; if it
+        is NULL, fs_socket will call sendto once for each piece of each message
+        instead.
+
+        \param  s           The socket to send on.
+        \param  msgs        The messages to send.
+        \param  vlen        The number of entries in msgs.
+        \param  flags       Flags for the send.
+        \retval -1          On error (set errno appropriately).
+        \return             The number of messages sent.
+    */
+    int (*sendmmsg)(net_socket_t *s, struct mmsghdr *msgs, unsigned int vlen,
+                    int flags);
 } fs_socket_proto_t;
 
 /** \brief   Initializer for the entry field in the fs_socket_proto_t struct. 
@@ -0,0 +1,56 @@
+/* KallistiOS ##version##
+
+   kos/fs_threads.h
+
+*/
+
+/** \file    kos/fs_threads.h
+    \brief   /dev/threads, a live view of scheduler statistics.
+    \ingroup vfs_dev
+
+    Reading /dev/threads gives a plain text table with one line for every
+    thread in the system, built from thd_get_stats(). Each open takes a fresh
+    snapshot, so just re-open the file to sample again.
+*/
+
+#ifndef __KOS_FS_THREADS_H
+#define __KOS_FS_THREADS_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <kos/fs.h>
+
+/** \defgroup vfs_threads   /dev/threads
+    \brief                  VFS driver for /dev/threads
+    \ingroup                vfs
+
+    The snapshot starts with a header line, followed by one line per thread
+    with these columns:
+
+    - tid, prio, state and label, as in thd_pslist()
+    - cpu: CPU time used, in nanoseconds
+    - vol/invol: voluntary and involuntary context switches
+    - runq/runq_max: total and worst run queue latency, in nanoseconds
+    - wait: total time blocked in genwait, in nanoseconds
+    - stack: deepest stack usage seen, over the stack size, in bytes
+
+    Every thread line is followed by one indented line for each genwait
+    object the thread has spent time blocked on, giving the object address,
+    wait message, number of waits and total time.
+
+    @{
+*/
+
+/* \cond */
+/* Initialization */
+int fs_threads_init(void);
+int fs_threads_shutdown(void);
+/* \endcond */
+
+/** @} */
+
+__END_DECLS
+
+#endif  /* __KOS_FS_THREADS_H */
+
@@ -125,6 +125,19 @@ void genwait_wake_one_err(void *obj, int err);
 */
 int genwait_wake_thd(void *obj, kthread_t *thd, int err);
 
+/** \brief  Find the highest priority thread sleeping on an object.
+
+    This function looks through the threads sleeping on the given object and
+    returns the one with the best (numerically lowest) dynamic priority. If
+    several share that priority, the one that went to sleep first is returned.
+    This is used by the priority inheritance code in the sync primitives.
+
+    \param  obj             The object to look for sleeping threads on
+    \return                 The highest priority sleeper, or NULL if no thread
+                            is sleeping on the object
+*/
+kthread_t *genwait_top_waiter(void *obj);
+
 /** \brief  Look for timed out genwait_wait() calls.
 
     There should be no reason you need to call this function, it is called
@@ -140,6 +140,7 @@ extern const void * __kos_romdisk;
 #define INIT_EXPORT      0x00000020  /**< \brief Export kernel symbols */
 #define INIT_FS_ROMDISK  0x00000040  /**< \brief Enable support for romdisks */
 #define INIT_NO_SHUTDOWN 0x00000080  /**< \brief Disable hardware shutdown */
+#define INIT_THD_TICKLESS 0x00000100 /**< \brief Tickless thread scheduling */
 /** @} */
 
 __END_DECLS
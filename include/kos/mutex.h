@@ -45,6 +45,15 @@
     There is a fourth type of mutex defined (MUTEX_TYPE_DEFAULT), which maps to
     the MUTEX_TYPE_NORMAL type. This is simply for alignment with POSIX.
 
+    By default, all types of mutexes use priority inheritance: while a thread is
+    blocked waiting for a mutex, the thread holding it runs at (at least) the
+    blocked thread's priority. The boost follows chains of holders that are
+    themselves blocked on other mutexes, and it is dropped again when the mutex
+    is unlocked. When a mutex is unlocked, the highest priority waiter gets the
+    first shot at it. This bounds how long a high priority thread can be held
+    up by a low priority one that happens to hold a lock it needs. It can be
+    turned off per-mutex with mutex_set_protocol().
+
     \author Lawrence Sebald
     \see    kos/sem.h
 */
@@ -70,6 +79,8 @@ typedef struct kos_mutex {
     int dynamic;
     kthread_t *holder;
     int count;
+    int protocol;
+    kthread_pi_lock_t pi;
 } mutex_t;
 
 /** \name  Mutex types
@@ -89,6 +100,18 @@ typedef struct kos_mutex {
 #define MUTEX_TYPE_DEFAULT      MUTEX_TYPE_NORMAL
 /** @} */
 
+/** \name  Mutex priority protocols
+    \brief Priority protocols supported by KOS mutexes
+
+    These values control what happens to the priority of the thread holding a
+    mutex while other threads are waiting for it.
+
+    @{
+*/
+#define MUTEX_PRIO_INHERIT      0   /**< \brief Priority inheritance (default) */
+#define MUTEX_PRIO_NONE         1   /**< \brief Holder priority is unaffected */
+/** @} */
+
 /** \brief  Initializer for a transient mutex. */
 #define MUTEX_INITIALIZER               { MUTEX_TYPE_NORMAL, 0, NULL, 0 }
 
@@ -130,6 +153,23 @@ mutex_t *mutex_create(void) __depr("Use mutex_init or an initializer.");
 */
 int mutex_init(mutex_t *m, int mtype);
 
+/** \brief  Set the priority protocol of a mutex.
+
+    This function selects whether the mutex uses priority inheritance. It must
+    only be called while the mutex is unlocked.
+
+    \param  m               The mutex to modify
+    \param  protocol        MUTEX_PRIO_INHERIT or MUTEX_PRIO_NONE
+
+    \retval 0               On success
+    \retval -1              On error, errno will be set as appropriate
+
+    \par    Error Conditions:
+    \em     EINVAL - an invalid protocol was specified \n
+    \em     EBUSY - the mutex is currently locked
+*/
+int mutex_set_protocol(mutex_t *m, int protocol);
+
 /** \brief  Destroy a mutex.
 
     This function destroys a mutex, releasing any memory that may have been
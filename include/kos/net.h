@@ -25,6 +25,7 @@ __BEGIN_DECLS
 
 #include <arch/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 /* All functions in this header return < 0 on failure, and 0 on success. */
@@ -181,6 +182,33 @@ typedef struct knetif {
         \param  count       The number of addresses in list.
     */
     int (*if_set_mc)(struct knetif *self, const uint8 *list, int count);
+
+    /** \brief  Queue a packet for transmission, given in pieces (optional).
+
+        Devices that have this get packets handed to them as a list of
+        pieces (generally the headers, and then the data straight out of
+        wherever it was sitting), rather than having the stack put each one
+        together in a single buffer first. Packets queued through here don't
+        have to actually go out until if_tx_commit() is called, so that the
+        device can be told about several of them at once. If this is NULL,
+        packets go through if_tx() instead. The pieces only have to stay
+        around until this returns, so the device has to copy them somewhere
+        before then.
+
+        \param  self        The network device in question.
+        \param  iov         The pieces of the packet, in order.
+        \param  iovcnt      The number of pieces.
+        \param  blocking    1 if we should block if needed, 0 otherwise.
+        \retval NETIF_TX_OK     On success.
+        \retval NETIF_TX_ERROR  On general failure.
+        \retval NETIF_TX_AGAIN  If non-blocking and we must block to send.
+    */
+    int (*if_tx_sg)(struct knetif *self, const struct iovec *iov, int iovcnt,
+                    int blocking);
+
+    /** \brief  How deep in net_tx_batch_begin() calls the device is. Don't
+                touch this, it's for the stack to keep track of. */
+    int                 tx_batch;
 } netif_t;
 
 /** \defgroup net_drivers_flags netif_t Flags
@@ -417,6 +445,102 @@ int net_input(netif_t *device, const uint8 *data, int len);
 */
 net_input_func net_input_set_target(net_input_func t);
 
+/***** net_pbuf.c **********************************************************/
+
+/** \brief   Size of each packet buffer, in bytes.
+    \ingroup networking_drivers
+*/
+#define NET_PBUF_SIZE   2048
+
+/** \brief   Number of packet buffers in the pool.
+    \ingroup networking_drivers
+*/
+#define NET_PBUF_COUNT  32
+
+/** \brief   Packet buffer.
+    \ingroup networking_drivers
+
+    Packet buffers come out of a fixed pool, and are meant for drivers to
+    receive frames into. A socket that gets data that's sitting in one of
+    these can keep the buffer (with net_pbuf_keep()) instead of copying the
+    data out of it, so the data only gets copied again when it's read.
+
+    The next, data, len, and tag fields are for whoever is holding onto the
+    buffer to use as it likes. The rest should be left alone.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_pbuf {
+    struct net_pbuf *next;      /**< \brief Next buffer in a queue */
+    uint8 *data;                /**< \brief Start of the data of interest */
+    uint32 len;                 /**< \brief Length of the data of interest */
+    uint32 tag;                 /**< \brief Free for the holder to use */
+    uint8 *buf;                 /**< \brief The buffer itself (read-only) */
+    int refcnt;                 /**< \brief Reference count (read-only) */
+} net_pbuf_t;
+
+/** \brief   Allocate a packet buffer.
+    \ingroup networking_drivers
+
+    This is safe to call inside interrupt handlers.
+
+    \return                 A buffer with one reference, or NULL if the pool
+                            is empty.
+*/
+net_pbuf_t *net_pbuf_alloc(void);
+
+/** \brief   Take another reference to a packet buffer.
+    \ingroup networking_drivers
+
+    \param  pb              The buffer.
+*/
+void net_pbuf_ref(net_pbuf_t *pb);
+
+/** \brief   Drop a reference to a packet buffer.
+    \ingroup networking_drivers
+
+    The buffer goes back to the pool once the last reference is dropped. This
+    is safe to call inside interrupt handlers.
+
+    \param  pb              The buffer.
+*/
+void net_pbuf_free(net_pbuf_t *pb);
+
+/** \brief   Take a reference to the packet buffer some data is in.
+    \ingroup networking_drivers
+
+    This is how the protocols get hold of the buffer a packet came in, given
+    only a pointer to its data. It fails if the data isn't in a packet buffer
+    at all, if someone other than the driver is already keeping the buffer, or
+    if the pool is running low, in which case the data should be copied
+    instead.
+
+    \param  ptr             Pointer to somewhere in the data.
+
+    \return                 The buffer, with a new reference taken, or NULL.
+*/
+net_pbuf_t *net_pbuf_keep(const void *ptr);
+
+/** \brief   Find out if net_pbuf_keep() would work on some data.
+    \ingroup networking_drivers
+
+    This lets a protocol decide up front whether it's going to have to copy the
+    data (and so whether it might as well do something else with it while it
+    does). Nothing is kept.
+
+    \param  ptr             Pointer to somewhere in the data.
+
+    \return                 Nonzero if the buffer could be kept right now.
+*/
+int net_pbuf_can_keep(const void *ptr);
+
+/** \brief   Find out how many packet buffers are free.
+    \ingroup networking_drivers
+
+    \return                 The number of free buffers.
+*/
+int net_pbuf_avail(void);
+
 /***** net_icmp.c *********************************************************/
 
 /** \defgroup networking_icmp   ICMP
@@ -801,6 +925,11 @@ typedef struct net_udp_stats {
     uint32  pkt_recv_bad_size;      /**< \brief Packets of a bad size */
     uint32  pkt_recv_bad_chksum;    /**< \brief Packets with a bad checksum */
     uint32  pkt_recv_no_sock;       /**< \brief Packets with to a closed port */
+    uint32  bytes_recv;             /**< \brief Data bytes received */
+    uint32  bytes_recv_copied;      /**< \brief Of those, bytes that were copied
+                                         rather than kept where they came in */
+    uint32  pkt_recv_no_space;      /**< \brief Packets dropped because the
+                                         socket's receive ring was full */
 } net_udp_stats_t;
 
 /** \brief  Retrieve statistics from the UDP layer.
@@ -828,6 +957,30 @@ void net_udp_shutdown(void);
     @{
 */
 
+/** \brief  TCP statistics structure.
+
+    This structure holds some basic statistics about the TCP layer of the stack,
+    and can be retrieved with the appropriate function.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_tcp_stats {
+    uint32  pkt_sent;               /**< \brief Segments sent out */
+    uint32  pkt_recv;               /**< \brief Segments received */
+    uint32  pkt_retrans;            /**< \brief Segments sent again */
+    uint32  fast_retrans;           /**< \brief Losses caught by duplicate ACKs */
+    uint32  timeouts;               /**< \brief Retransmission timeouts */
+    uint32  bytes_recv;             /**< \brief Data bytes received */
+    uint32  bytes_recv_copied;      /**< \brief Of those, bytes that were copied
+                                         rather than kept where they came in */
+} net_tcp_stats_t;
+
+/** \brief  Retrieve statistics from the TCP layer.
+
+    \return                 The global TCP stats struct.
+*/
+net_tcp_stats_t net_tcp_get_stats(void);
+
 /** \brief  Init TCP.
     \retval 0               On success (no error conditions defined).
 */
@@ -959,6 +1112,64 @@ extern netif_t *net_default_dev;
 */
 netif_t *net_set_default(netif_t *n);
 
+/** \brief   Send a packet out on a network device.
+    \ingroup networking_drivers
+
+    This takes care of handing the packet to the device the best way it can:
+    in pieces, if the device can take it that way, or put together in one
+    buffer otherwise. Packets sent in pieces are committed right away, unless
+    a batch has been started with net_tx_batch_begin().
+
+    \param  net             The device to send on.
+    \param  iov             The pieces of the packet, in order.
+    \param  iovcnt          The number of pieces.
+    \param  blocking        1 if it's ok to block, 0 otherwise.
+
+    \return                 A NETIF_TX_* value, as returned by the device.
+*/
+int net_tx(netif_t *net, const struct iovec *iov, int iovcnt, int blocking);
+
+/** \brief   Start a batch of packets on a network device.
+    \ingroup networking_drivers
+
+    Packets sent on the device after this (by anyone) don't have to actually
+    go out until the matching net_tx_batch_end(), so the device can be told
+    about all of them at once. Batches may be nested.
+
+    \param  net             The device, or NULL for the default one.
+*/
+void net_tx_batch_begin(netif_t *net);
+
+/** \brief   Finish a batch of packets on a network device.
+    \ingroup networking_drivers
+
+    Once the outermost batch is finished, the device's if_tx_commit() is called
+    to send off everything that was queued up.
+
+    \param  net             The device, or NULL for the default one.
+*/
+void net_tx_batch_end(netif_t *net);
+
+/** \brief   Add up the length of a list of pieces of a packet.
+    \ingroup networking_drivers
+
+    \param  iov             The pieces.
+    \param  iovcnt          The number of pieces.
+
+    \return                 Their total length, in bytes.
+*/
+size_t net_iov_len(const struct iovec *iov, int iovcnt);
+
+/** \brief   Copy a list of pieces of a packet into one buffer.
+    \ingroup networking_drivers
+
+    \param  dst             Where to put the data. This must have room for all
+                            of it.
+    \param  iov             The pieces.
+    \param  iovcnt          The number of pieces.
+*/
+void net_iov_copy(uint8 *dst, const struct iovec *iov, int iovcnt);
+
 /** \brief   Register a network device.
     \ingroup networking_drivers
 
@@ -119,16 +119,49 @@ __BEGIN_DECLS
 #define FS_CD_MAX_FILES 8
 #endif
 
+/** \brief  The default number of 2048-byte blocks in the cd data cache.
+
+    This can be changed at runtime with iso_cache_config(). */
+#ifndef FS_CD_CACHE_BLOCKS
+#define FS_CD_CACHE_BLOCKS 16
+#endif
+
+/** \brief  The default number of sectors read at once for sequential cd
+            reads.
+
+    This can be changed at runtime with iso_cache_config(). */
+#ifndef FS_CD_READAHEAD
+#define FS_CD_READAHEAD 8
+#endif
+
 /** \brief  The maximum number of romdisk files that can be open at a time. */
 #ifndef FS_ROMDISK_MAX_FILES
 #define FS_ROMDISK_MAX_FILES 16
 #endif
 
+/** \brief  The number of decompressed blocks kept around for reading
+            compressed romdisk files. */
+#ifndef FS_ROMDISK_ZCACHE_BLOCKS
+#define FS_ROMDISK_ZCACHE_BLOCKS 4
+#endif
+
 /** \brief  The maximum number of ramdisk files that can be open at a time. */
 #ifndef FS_RAMDISK_MAX_FILES
 #define FS_RAMDISK_MAX_FILES 8
 #endif
 
+/** \brief  The number of paths remembered by the shared path lookup cache
+            used by the cd and romdisk filesystems. */
+#ifndef FS_DCACHE_ENTRIES
+#define FS_DCACHE_ENTRIES 128
+#endif
+
+/** \brief  The longest path, in bytes, that the path lookup cache will
+            remember. */
+#ifndef FS_DCACHE_PATH_MAX
+#define FS_DCACHE_PATH_MAX 64
+#endif
+
 /** \brief  The number of distinct file descriptors, including files and
             network sockets, that can be in use at a time. Decreasing this
             value can reduce memory usage.  */
@@ -20,6 +20,10 @@
     a reader either (since the reader might attempt to read while the writer is
     changing data).
 
+    The thread holding the write lock inherits the priority of any readers or
+    writers blocked waiting for it to release the lock, in the same way that
+    mutexes do. Readers are not tracked individually, so they are not boosted.
+
     \author Lawrence Sebald
 */
 
@@ -52,6 +56,9 @@ typedef struct rw_semaphore {
 
     /** \brief  Space for one reader who's trying to upgrade to a writer. */
     kthread_t *reader_waiting;
+
+    /** \brief  Priority inheritance record for the write lock. */
+    kthread_pi_lock_t pi;
 } rw_semaphore_t;
 
 /** \brief  Initializer for a transient reader/writer semaphore */
@@ -25,7 +25,6 @@
     \see    kos/tls.h
 
     \todo
-        - Remove deprecated thread mode API
         - Remove global extern pointer to current thread
 
     \author Megan Potter
@@ -119,6 +118,89 @@ TAILQ_HEAD(ktqueue, kthread);
 LIST_HEAD(ktlist, kthread);
 /* \endcond */
 
+/** \brief   Priority inheritance lock record.
+
+    Sync primitives that support priority inheritance (mutex_t and the write
+    side of rw_semaphore_t) embed one of these. While the lock is held, the
+    record sits on its owner's list of held locks, which lets the scheduler
+    work out how far the owner should be boosted by the threads sleeping on
+    the lock's genwait objects.
+
+    All members of this structure should be considered to be private.
+
+    \headerfile kos/thread.h
+*/
+typedef struct kthread_pi_lock {
+    /** \brief  List handle for the owner's held lock list. */
+    LIST_ENTRY(kthread_pi_lock) list;
+
+    /** \brief  The thread currently holding the lock, if any. */
+    struct kthread *owner;
+
+    /** \brief  The genwait objects that waiters sleep on. */
+    void *wait_obj[2];
+} kthread_pi_lock_t;
+
+/* \cond */
+LIST_HEAD(kthread_pi_list, kthread_pi_lock);
+/* \endcond */
+
+/** \brief   Number of wait objects tracked per thread.
+
+    Each thread keeps blocked time for at most this many distinct genwait
+    objects. When a thread blocks on a new object and the table is full, the
+    entry with the least accumulated time is recycled.
+*/
+#define KTHREAD_WAIT_STATS  4
+
+/** \brief   Blocked time accounting for one genwait object.
+
+    \headerfile kos/thread.h
+*/
+typedef struct kthread_wait_stat {
+    void *obj;          /**< \brief The object waited on (NULL if unused) */
+    const char *msg;    /**< \brief Wait message from the last wait */
+    uint32_t count;     /**< \brief Number of times the thread blocked */
+    uint64_t time;      /**< \brief Total nanoseconds spent blocked */
+} kthread_wait_stat_t;
+
+/** \brief   Per-thread scheduler statistics.
+
+    These are maintained by the scheduler and genwait for every thread. Use
+    thd_get_stats() to get a consistent copy, or read /dev/threads for a
+    snapshot of every thread in the system. All times are in nanoseconds.
+
+    \headerfile kos/thread.h
+*/
+typedef struct kthread_stats {
+    /** \brief  Switches away from the thread because it blocked or yielded. */
+    uint32_t vol_switches;
+
+    /** \brief  Switches away from the thread while it was still runnable. */
+    uint32_t invol_switches;
+
+    /** \brief  Total time spent runnable, waiting for the CPU. */
+    uint64_t runq_time;
+
+    /** \brief  Longest single wait in the run queue. */
+    uint64_t runq_max;
+
+    /** \brief  Total time spent blocked in genwait. */
+    uint64_t wait_time;
+
+    /** \brief  Deepest stack usage seen at a context switch, in bytes. */
+    size_t stack_max;
+
+    /** \brief  Blocked time broken down by wait object. */
+    kthread_wait_stat_t waits[KTHREAD_WAIT_STATS];
+
+    /** \brief  When the thread last entered the run queue (internal). */
+    uint64_t ready_since;
+
+    /** \brief  When the thread last blocked in genwait (internal). */
+    uint64_t wait_since;
+} kthread_stats_t;
+
 /** \name     Thread flag values
     \brief    Flags for kthread_flags_t
 
@@ -176,8 +258,17 @@ typedef __attribute__((aligned(32))) struct kthread {
     /** \brief  Run/Wait queue handle. Once again, not a function. */
     TAILQ_ENTRY(kthread) thdq;
 
-    /** \brief  Timer queue handle (if applicable). Also not a function. */
-    TAILQ_ENTRY(kthread) timerq;
+    /** \brief  Timer queue handle (if applicable). Also not a function.
+
+        The timer queue is a pairing heap, so each sleeping thread links to
+        its first child and next sibling within the heap. The prev pointer is
+        either the previous sibling, or the parent for a first child.
+    */
+    struct {
+        struct kthread *child;      /**< \brief First child in the heap */
+        struct kthread *sibling;    /**< \brief Next sibling in the heap */
+        struct kthread *prev;       /**< \brief Previous sibling or parent */
+    } timerq;
 
     /** \brief  Kernel thread id. */
     tid_t tid;
@@ -223,12 +314,21 @@ typedef __attribute__((aligned(32))) struct kthread {
     */
     uint64_t wait_timeout;
 
+    /** \brief  Priority inheritance locks held by this thread. */
+    struct kthread_pi_list pi_locks;
+
+    /** \brief  Priority inheritance lock this thread is blocked on, if any. */
+    kthread_pi_lock_t *pi_blocked;
+
     /** \brief Per-Thread CPU Time. */
     struct {
         uint64_t scheduled; /**< \brief time when the thread became active */
         uint64_t total;     /**< \brief total running CPU time for thread */
     } cpu_time;
 
+    /** \brief  Scheduler statistics. */
+    kthread_stats_t stats;
+
     /** \brief  Thread label.
 
         This value is used when printing out a user-readable process listing.
@@ -301,16 +401,20 @@ typedef struct kthread_attr {
 
 /** \brief  kthread mode values
 
-    \deprecated
-    Only preemptive scheduling is still supported!
-
     The threading system will always be in one of the following modes. This
-    represents either pre-emptive scheduling or an un-initialized state.
+    represents either pre-emptive scheduling with a periodic timer tick,
+    tickless pre-emptive scheduling, or an un-initialized state.
+
+    In tickless mode, the scheduler only programs the timer for the next
+    genwait timeout, or for the end of the current timeslice when another
+    thread of the same (or better) priority is ready to run. An idle system, or
+    one with a single runnable thread, takes no periodic scheduler interrupts.
 */
 typedef enum kthread_mode {
-    THD_MODE_NONE    = -1,  /**< \brief Threads not running */
-    THD_MODE_COOP    =  0,  /**< \brief Cooperative mode \deprecated */
-    THD_MODE_PREEMPT =  1   /**< \brief Preemptive threading mode */
+    THD_MODE_NONE     = -1, /**< \brief Threads not running */
+    THD_MODE_COOP     =  0, /**< \brief Cooperative mode \deprecated */
+    THD_MODE_PREEMPT  =  1, /**< \brief Preemptive threading mode */
+    THD_MODE_TICKLESS =  2  /**< \brief Tickless preemptive mode */
 } kthread_mode_t;
 
 /** \cond The currently executing thread -- Do not manipulate directly! */
@@ -520,6 +624,22 @@ void thd_sleep(unsigned ms);
 */
 int thd_set_prio(kthread_t *thd, prio_t prio);
 
+/** \brief       Set a thread's dynamic priority value.
+    \relatesalso kthread_t
+
+    This function changes only the dynamic priority of a thread, leaving its
+    static priority (real_prio) alone. This is what synchronization primitives
+    use to temporarily boost a thread. If the thread is in the run queue, it is
+    moved to the queue for its new priority. Interrupts must be disabled when
+    calling this function.
+
+    \param  thd             The thread to change the priority of.
+    \param  prio            The new dynamic priority value.
+
+    \sa thd_set_prio
+*/
+void thd_set_prio_dyn(kthread_t *thd, prio_t prio);
+
 /** \brief       Retrieve the current thread's kthread struct.
     \relatesalso kthread_t
 
@@ -628,34 +748,79 @@ struct _reent *thd_get_reent(kthread_t *thd);
 */
 uint64_t thd_get_cpu_time(kthread_t *thd);
 
-/** \brief   Change threading modes.
+/** \brief       Retrieves the thread's scheduler statistics
+    \relatesalso kthread_t
 
-    This function changes the current threading mode of the system.
-    With preemptive threading being the only mode.
+    Copies out the switch counts, run queue latency, blocked time and stack
+    depth statistics that the scheduler keeps for the given thread. The copy
+    is taken with interrupts disabled, so it is internally consistent.
 
-    \deprecated
-    This is now deprecated
+    \note
+    Stack depth is sampled whenever the thread is switched out, so it is a
+    lower bound on the real maximum.
 
-    \param  mode            One of the THD_MODE values.
+    \param thd          The thread to retrieve statistics for
+    \param stats        Where to store the statistics
 
-    \return                 The old mode of the threading system.
+    \retval 0           On success
+    \retval -1          If thd or stats is NULL
+*/
+int thd_get_stats(kthread_t *thd, kthread_stats_t *stats);
+
+/** \brief       Resets the thread's scheduler statistics
+    \relatesalso kthread_t
 
-    \sa thd_get_mode
+    \param thd          The thread to reset, or NULL for every thread
 */
-int thd_set_mode(kthread_mode_t mode) __deprecated;
+void thd_reset_stats(kthread_t *thd);
 
-/** \brief   Fetch the current threading mode.
+/** \brief   Change threading modes.
 
-    With preemptive threading being the only mode.
+    This function changes the current threading mode of the system. Threading
+    is always preemptive; this selects between a periodic scheduler tick
+    (THD_MODE_PREEMPT) and tickless scheduling (THD_MODE_TICKLESS). Tickless
+    mode can also be selected at startup with the INIT_THD_TICKLESS flag.
 
-    \deprecated
-    This is now deprecated.
+    \param  mode            One of THD_MODE_PREEMPT or THD_MODE_TICKLESS.
+
+    \return                 The old mode of the threading system, or -1 if the
+                            requested mode is unsupported or threading has not
+                            been initialized.
+
+    \sa thd_get_mode, thd_get_timer_irqs_saved
+*/
+int thd_set_mode(kthread_mode_t mode);
+
+/** \brief   Fetch the current threading mode.
 
     \return                 The current mode of the threading system.
 
     \sa thd_set_mode
 */
-kthread_mode_t thd_get_mode(void) __deprecated;
+kthread_mode_t thd_get_mode(void);
+
+/** \brief   Fetch the number of scheduler timer interrupts taken.
+
+    This counts every time the primary timer has called into the scheduler,
+    in either threading mode.
+
+    \return                 The number of scheduler timer interrupts.
+
+    \sa thd_get_timer_irqs_saved
+*/
+uint64_t thd_get_timer_irqs(void);
+
+/** \brief   Fetch the number of scheduler interrupts avoided by tickless mode.
+
+    This estimates how many timer interrupts a periodic scheduler tick at the
+    current frequency would have taken over all the time spent in tickless
+    mode, minus the ones that tickless mode actually took.
+
+    \return                 The number of scheduler interrupts saved.
+
+    \sa thd_set_mode, thd_get_timer_irqs
+*/
+uint64_t thd_get_timer_irqs_saved(void);
 
 /** \brief   Set the scheduler's frequency.
 
@@ -749,6 +914,45 @@ int thd_pslist_queue(int (*pf)(const char *fmt, ...));
 
 /** \cond INTERNAL */
 
+/** \brief  Record that the current thread now owns a priority inheritance lock.
+
+    The current thread is boosted to the priority of the best thread still
+    sleeping on either of the given objects. Interrupts must be disabled.
+
+    \param  pi              The lock's priority inheritance record.
+    \param  obj0            The first genwait object waiters sleep on.
+    \param  obj1            The second genwait object waiters sleep on, or NULL.
+*/
+void thd_pi_acquired(kthread_pi_lock_t *pi, void *obj0, void *obj1);
+
+/** \brief  Record that a priority inheritance lock has been released.
+
+    The former owner drops back to its static priority, or to whatever the
+    other locks it still holds require. Interrupts must be disabled.
+
+    \param  pi              The lock's priority inheritance record.
+*/
+void thd_pi_released(kthread_pi_lock_t *pi);
+
+/** \brief  Boost the owner of a lock the current thread is about to block on.
+
+    The boost is propagated along the chain of owners that are themselves
+    blocked on priority inheritance locks. Interrupts must be disabled.
+
+    \param  pi              The lock's priority inheritance record.
+*/
+void thd_pi_wait_begin(kthread_pi_lock_t *pi);
+
+/** \brief  Finish blocking on a priority inheritance lock.
+
+    If the wait timed out, the owner's boost is recomputed without the current
+    thread. Interrupts must be disabled.
+
+    \param  pi              The lock's priority inheritance record.
+    \param  timed_out       true if the wait ended without the lock.
+*/
+void thd_pi_wait_end(kthread_pi_lock_t *pi, bool timed_out);
+
 /** \brief  Initialize the threading system.
     
     This is normally done for you by default when KOS starts. This will also
@@ -47,6 +47,14 @@ __BEGIN_DECLS
 
 #define TCP_NODELAY             1 /**< \brief Don't delay to coalesce. */
 
+/** \brief Congestion control algorithm.
+
+    The value is the name of the algorithm, as a string. Either "reno" (which
+    is really NewReno, the default) or "cubic" is accepted. The number matches
+    the one Linux uses for this option.
+*/
+#define TCP_CONGESTION          13
+
 /** @} */
 
 __END_DECLS
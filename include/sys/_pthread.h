@@ -14,4 +14,7 @@
 /** \brief  POSIX timeouts supported (sorta) */
 #define _POSIX_TIMEOUTS
 
+/** \brief  POSIX mutex priority inheritance supported */
+#define _POSIX_THREAD_PRIO_INHERIT
+
 #endif  /* __SYS__PTHREAD_H */
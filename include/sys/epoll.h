@@ -0,0 +1,153 @@
+/* KallistiOS ##version##
+
+   sys/epoll.h
+
+*/
+
+/** \file    sys/epoll.h
+    \brief   Scalable I/O event notification.
+    \ingroup threading_polling
+
+    This file contains an epoll interface in the style of the one on Linux.
+    Unlike poll(), which has to be handed every file descriptor on each call,
+    an epoll instance remembers the set of file descriptors it is watching, and
+    keeps a list of the ones that have had something happen to them. Waiting on
+    it only has to look at that list, so it doesn't get any slower as more file
+    descriptors are added to the set.
+
+    As with poll(), this is really only useful for sockets at the moment.
+*/
+
+#ifndef __SYS_EPOLL_H
+#define __SYS_EPOLL_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <poll.h>
+
+__BEGIN_DECLS
+
+/** \addtogroup threading_polling
+    @{
+*/
+
+/** \defgroup epoll_events              Events for epoll
+    \brief                              Masks representing event types for epoll
+
+    These are the events that can be set in the events field of the struct
+    epoll_event. They are the same as the ones for poll(), plus a couple of
+    flags that change how the events are delivered.
+
+    @{
+*/
+#define EPOLLIN         POLLIN      /**< \brief Data may be read */
+#define EPOLLPRI        POLLPRI     /**< \brief High-priority data may be read */
+#define EPOLLOUT        POLLOUT     /**< \brief Data may be written */
+#define EPOLLRDNORM     POLLRDNORM  /**< \brief Normal data may be read */
+#define EPOLLRDBAND     POLLRDBAND  /**< \brief Priority data may be read */
+#define EPOLLWRNORM     POLLWRNORM  /**< \brief Normal data may be written */
+#define EPOLLWRBAND     POLLWRBAND  /**< \brief Priority data may be written */
+#define EPOLLERR        POLLERR     /**< \brief Error has occurred */
+#define EPOLLHUP        POLLHUP     /**< \brief Peer disconnected */
+
+/** \brief  Only report the fd once after it has been modified again. */
+#define EPOLLONESHOT    (1U << 30)
+
+/** \brief  Only report an event when something happens on the fd, rather than
+            whenever it is ready. */
+#define EPOLLET         (1U << 31)
+/** @} */
+
+/** \brief  Add a file descriptor to the set. */
+#define EPOLL_CTL_ADD   1
+/** \brief  Remove a file descriptor from the set. */
+#define EPOLL_CTL_DEL   2
+/** \brief  Change the events for a file descriptor in the set. */
+#define EPOLL_CTL_MOD   3
+
+/** \brief  Flag for epoll_create1(). Accepted for compatibility, but ignored,
+            since there's nothing to exec. */
+#define EPOLL_CLOEXEC   0x80000
+
+/** \brief   User data attached to a file descriptor in an epoll set. */
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+/** \brief   An event on a file descriptor in an epoll set.
+    \headerfile sys/epoll.h
+*/
+struct epoll_event {
+    uint32_t events;        /**< \brief Events to watch for/that occurred. */
+    epoll_data_t data;      /**< \brief Data given back with the events. */
+};
+
+/** \brief   Create an epoll instance.
+
+    \param  size        Ignored, but must be greater than zero.
+    \return             A file descriptor for the new instance, or -1 on error
+                        (sets errno as appropriate). Use close() to free it.
+
+    \sa     epoll_create1()
+*/
+int epoll_create(int size);
+
+/** \brief   Create an epoll instance.
+
+    \param  flags       0 or EPOLL_CLOEXEC.
+    \return             A file descriptor for the new instance, or -1 on error
+                        (sets errno as appropriate). Use close() to free it.
+*/
+int epoll_create1(int flags);
+
+/** \brief   Add, change, or remove a file descriptor in an epoll set.
+
+    File descriptors are taken out of every set they are in automatically when
+    they're closed. An epoll instance cannot be added to another one.
+
+    \param  epfd        The epoll instance.
+    \param  op          One of EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL.
+    \param  fd          The file descriptor to work on.
+    \param  event       The events to watch for and the data to hand back with
+                        them. Not used for EPOLL_CTL_DEL.
+
+    \return             0 on success, or -1 on error (sets errno as
+                        appropriate).
+
+    \par    Error Conditions:
+    \em     EBADF - epfd or fd is not a valid file descriptor \n
+    \em     EINVAL - epfd is not an epoll instance, fd is one, or op is bad \n
+    \em     EEXIST - fd is already in the set (EPOLL_CTL_ADD) \n
+    \em     ENOENT - fd is not in the set (EPOLL_CTL_MOD, EPOLL_CTL_DEL) \n
+    \em     ENOMEM - out of memory
+*/
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/** \brief   Wait for events on an epoll set.
+
+    This function blocks until at least one of the file descriptors in the set
+    is ready, or the timeout expires. Unless EPOLLET is set for it, a file
+    descriptor will be reported by every call for as long as it stays ready.
+
+    \param  epfd        The epoll instance.
+    \param  events      Where to put the events that occurred.
+    \param  maxevents   The maximum number of events to return.
+    \param  timeout     Maximum amount of time to block, in milliseconds. Pass
+                        0 to ensure the function does not block and -1 to block
+                        until an event occurs.
+
+    \return             The number of events returned, 0 on timeout, or -1 on
+                        error (sets errno as appropriate).
+*/
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__SYS_EPOLL_H */
@@ -0,0 +1,64 @@
+/* KallistiOS ##version##
+
+   sys/sendfile.h
+
+*/
+
+/** \file    sys/sendfile.h
+    \brief   Sending files over sockets.
+    \ingroup networking_sockets
+
+    This file contains the sendfile() function, which copies data from a file
+    straight into a socket, without having to bring it through a buffer in the
+    program first. It works like the Linux function of the same name.
+*/
+
+#ifndef __SYS_SENDFILE_H
+#define __SYS_SENDFILE_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+/** \addtogroup networking_sockets
+    @{
+*/
+
+/** \brief  Send data from a file over a socket.
+
+    This function sends up to count bytes from the file in_fd over the socket
+    out_fd. If the filesystem that in_fd is on supports fs_mmap() (such as the
+    romdisk and the ramdisk), the data is queued on the socket straight from the
+    mapping. Otherwise, it is read in a bit at a time with fs_read() and passed
+    along to the socket.
+
+    If the socket is blocking, this will not return until all of the data has
+    been queued up, the end of the file is reached, or an error occurs. A
+    non-blocking socket will take as much as it has room for, as with send().
+
+    \param  out_fd          The socket to send the data on.
+    \param  in_fd           The file to read the data from.
+    \param  offset          If not NULL, where in the file to start reading.
+                            This will be updated to point just past the last
+                            byte sent, and the file's own position will not be
+                            changed. If NULL, the data is read from the file's
+                            current position, which is moved along past it.
+    \param  count           The maximum number of bytes to send.
+
+    \return                 The number of bytes sent, 0 at the end of the file,
+                            or -1 on error, with errno set as appropriate.
+
+    \par    Error Conditions:
+    \em     EBADF - out_fd or in_fd is not a valid file descriptor \n
+    \em     ENOTSOCK - out_fd is not a socket \n
+    \em     ENOMEM - out of memory to read the file with \n
+    Plus anything that send() or fs_read() might set.
+*/
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __SYS_SENDFILE_H */
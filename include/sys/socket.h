@@ -87,6 +87,28 @@ struct sockaddr_storage {
     char _ss_pad2[_SS_PAD2SIZE];
 };
 
+/** \brief  Message header structure, for sending and receiving messages made
+            up of several pieces.
+    \headerfile sys/socket.h
+*/
+struct msghdr {
+    void         *msg_name;         /**< \brief Address of the peer */
+    socklen_t     msg_namelen;      /**< \brief Size of msg_name */
+    struct iovec *msg_iov;          /**< \brief Pieces of the message */
+    int           msg_iovlen;       /**< \brief Number of pieces in msg_iov */
+    void         *msg_control;      /**< \brief Ancillary data (unsupported) */
+    socklen_t     msg_controllen;   /**< \brief Size of msg_control */
+    int           msg_flags;        /**< \brief Flags on received message */
+};
+
+/** \brief  One message in a batch for recvmmsg() or sendmmsg().
+    \headerfile sys/socket.h
+*/
+struct mmsghdr {
+    struct msghdr msg_hdr;          /**< \brief The message */
+    unsigned int  msg_len;          /**< \brief Bytes sent or received */
+};
+
 /** \brief  Datagram socket type.
 
     This socket type specifies that the socket in question transmits datagrams
@@ -171,6 +193,7 @@ struct sockaddr_storage {
 #define MSG_TRUNC       0x20    /**< \brief Normal data truncated (U) */
 #define MSG_WAITALL     0x40    /**< \brief Attempt to fill read buffer */
 #define MSG_DONTWAIT    0x80    /**< \brief Make this call non-blocking (non-standard) */
+#define MSG_WAITFORONE  0x100   /**< \brief Only block for the first message (recvmmsg, non-standard) */
 /** @} */
 
 /** \addtogroup networking_sockets
@@ -339,6 +362,53 @@ ssize_t send(int socket, const void *message, size_t length, int flags);
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
                const struct sockaddr *dest_addr, socklen_t dest_len);
 
+struct timespec;
+
+/** \brief  Receive a batch of messages on a socket.
+
+    This function receives up to vlen messages from a (usually connectionless)
+    socket in one call, scattering each one into the iovecs of its msghdr. For
+    datagram sockets, each message is one datagram, and the address it came
+    from is put in msg_name, if that isn't NULL. The number of bytes received
+    for each one goes in its msg_len, and MSG_TRUNC is set in msg_flags if the
+    datagram didn't fit.
+
+    A blocking socket waits until vlen messages have been received or the
+    timeout is up, unless MSG_WAITFORONE is given, in which case it only waits
+    for the first one. Protocols that don't support this directly only ever
+    wait for the first one, and ignore the timeout.
+
+    \param  socket      The socket to receive on.
+    \param  msgvec      The messages to fill in.
+    \param  vlen        The number of entries in msgvec.
+    \param  flags       MSG_DONTWAIT, MSG_WAITFORONE and/or MSG_PEEK.
+    \param  timeout     The longest to wait, or NULL to wait as long as it
+                        takes.
+
+    \return             On success, the number of messages received. On error,
+                        -1, and sets errno as appropriate.
+*/
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
+
+/** \brief  Send a batch of messages on a socket.
+
+    This function sends up to vlen messages on a socket in one call. Each one is
+    gathered from the iovecs in its msghdr, and sent to msg_name if that isn't
+    NULL (and the socket isn't connected). The number of bytes sent for each one
+    goes in its msg_len.
+
+    \param  socket      The socket to send on.
+    \param  msgvec      The messages to send.
+    \param  vlen        The number of entries in msgvec.
+    \param  flags       The type of message transmission. Set to 0 for now.
+
+    \return             On success, the number of messages sent, which may be
+                        less than vlen if an error occurred after the first
+                        one. On error, -1, and sets errno as appropriate.
+*/
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
 /** \brief  Shutdown socket send and receive operations.
 
     This function closes a specific socket for the set of specified operations.
@@ -34,7 +34,9 @@ ISO9660 systems, as these were used as references as well.
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/cond.h>
 #include <kos/fs.h>
+#include <kos/fs_dcache.h>
 #include <kos/opts.h>
 
 #include <stdlib.h>
@@ -44,6 +46,8 @@ ISO9660 systems, as these were used as references as well.
 #include <strings.h>
 #include <malloc.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/queue.h>
 
 static int init_percd(void);
 static int percd_done;
@@ -187,129 +191,351 @@ static uint32 iso_733(const uint8 *from) {
 
 
 /********************************************************************************/
-/* Low-level block caching routines. This implements a simple queue-based
-   LRU/MRU caching system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
-
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
-    uint8   *data;          /* Sector data */
-    uint32  sector;         /* CD sector */
+/* Low-level block caching routines. Each cache is a fixed pool of blocks,
+   indexed by a hash of the sector number and kept on an LRU list. Whenever
+   a block is requested, it will be moved to the MRU end of the list. As more
+   blocks are loaded than can fit in the cache, blocks are recycled from the
+   LRU end. The inode cache has a fixed size; the data cache is sized when a
+   disc is mounted, according to iso_cache_config(). */
+
+/* Holds the data for one cache block. */
+typedef struct cache_block {
+    uint8   *data;                      /* Sector data */
+    uint32  sector;                     /* CD sector */
+    struct cache_block *hnext;          /* Next block in the hash chain */
+    TAILQ_ENTRY(cache_block) lru;       /* LRU list handle */
 } cache_block_t;
 
-/* List of cache blocks (ordered least recently used to most recently) */
+typedef struct iso_cache {
+    cache_block_t   *blocks;            /* Block headers */
+    uint8           *data;              /* Sector data for every block */
+    cache_block_t   **hash;             /* Hash buckets */
+    size_t          count;              /* Number of blocks */
+    uint32          hmask;              /* Number of buckets - 1 */
+    TAILQ_HEAD(, cache_block) lru;      /* Ordered LRU to MRU */
+    uint32          hits, misses;
+} iso_cache_t;
+
 #define NUM_CACHE_BLOCKS 16
-static cache_block_t *icache[NUM_CACHE_BLOCKS];     /* inode cache */
-static cache_block_t *dcache[NUM_CACHE_BLOCKS];     /* data cache */
+static iso_cache_t icache;      /* inode cache */
+static iso_cache_t dcache;      /* data cache */
+
+/* Settings to use for the data cache at the next mount */
+static size_t dcache_blocks = FS_CD_CACHE_BLOCKS;
+static size_t readahead = FS_CD_READAHEAD;
+
+/* Read-ahead staging buffer, one read-ahead window in size */
+static uint8 *ra_buf;
+static size_t ra_size;
 
-static unsigned char *cache_data;
-static cache_block_t *caches;
+/* Other statistics, see iso_cache_stats_t */
+static uint32 stat_ra_sectors, stat_direct_sectors, stat_drive_reads;
 
 /* Cache modification mutex */
 static mutex_t cache_mutex;
 
+static inline cache_block_t **bhash(iso_cache_t *cache, uint32 sector) {
+    return &cache->hash[sector & cache->hmask];
+}
+
+static void bunhash(iso_cache_t *cache, cache_block_t *blk) {
+    cache_block_t **p;
+
+    if(blk->sector == (uint32)-1)
+        return;
+
+    for(p = bhash(cache, blk->sector); *p; p = &(*p)->hnext) {
+        if(*p == blk) {
+            *p = blk->hnext;
+            break;
+        }
+    }
+
+    blk->sector = (uint32)-1;
+}
+
 /* Clears all cache blocks */
-static void bclear_cache(cache_block_t **cache) {
-    int i;
+static void bclear_cache(iso_cache_t *cache) {
+    size_t i;
 
     mutex_lock(&cache_mutex);
 
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = (uint32)-1;
+    for(i = 0; i <= cache->hmask; i++)
+        cache->hash[i] = NULL;
+
+    for(i = 0; i < cache->count; i++)
+        cache->blocks[i].sector = (uint32)-1;
 
     mutex_unlock(&cache_mutex);
 }
 
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad_cache(cache_block_t **cache, int block) {
-    int     i;
-    cache_block_t   *tmp;
+static void bfree_cache(iso_cache_t *cache) {
+    free(cache->data);
+    free(cache->blocks);
+    free(cache->hash);
+    memset(cache, 0, sizeof(iso_cache_t));
+}
 
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
+/* Allocate a cache of the given number of blocks */
+static int balloc_cache(iso_cache_t *cache, size_t count) {
+    size_t i, buckets = 1;
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+    /* Keep the hash chains short */
+    while(buckets < count)
+        buckets <<= 1;
 
-    for(i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
+    /* Allocate cache block space, properly aligned for DMA access */
+    cache->data = memalign(32, count * 2048);
+    cache->blocks = malloc(count * sizeof(cache_block_t));
+    cache->hash = calloc(buckets, sizeof(cache_block_t *));
+
+    if(!cache->data || !cache->blocks || !cache->hash) {
+        bfree_cache(cache);
+        return -1;
+    }
 
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
+    cache->count = count;
+    cache->hmask = buckets - 1;
+    TAILQ_INIT(&cache->lru);
+
+    for(i = 0; i < count; i++) {
+        cache->blocks[i].data = cache->data + i * 2048;
+        cache->blocks[i].sector = (uint32)-1;
+        cache->blocks[i].hnext = NULL;
+        TAILQ_INSERT_TAIL(&cache->lru, &cache->blocks[i], lru);
+    }
+
+    return 0;
 }
 
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
-static void iso_break_all(void);
-static int bread_cache(cache_block_t **cache, uint32 sector) {
-    int i, j, rv;
+/* Apply the requested data cache settings; this happens on every mount. */
+static int bresize(void) {
+    size_t ra;
+    int rv = 0;
 
-    rv = -1;
     mutex_lock(&cache_mutex);
 
-    /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad_cache(cache, i);
-            rv = NUM_CACHE_BLOCKS - 1;
-            goto bread_exit;
+    if(dcache.count != dcache_blocks) {
+        bfree_cache(&dcache);
+
+        if(balloc_cache(&dcache, dcache_blocks) < 0) {
+            dbglog(DBG_ERROR, "fs_iso9660: can't allocate %u cache blocks\n",
+                   (unsigned int)dcache_blocks);
+
+            /* Fall back on something that'll probably work */
+            dcache_blocks = NUM_CACHE_BLOCKS;
+            rv = balloc_cache(&dcache, dcache_blocks);
         }
     }
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == (uint32)-1) break;
+    /* Don't let one read-ahead flush the whole cache */
+    ra = readahead;
+
+    if(ra > dcache.count / 2)
+        ra = dcache.count / 2;
+
+    if(ra != ra_size) {
+        free(ra_buf);
+        ra_buf = ra > 1 ? memalign(32, ra * 2048) : NULL;
+        ra_size = ra_buf ? ra : 0;
     }
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
+    mutex_unlock(&cache_mutex);
+    return rv;
+}
+
+/* Look up a sector; on a hit, the block graduates to the MRU end. */
+static cache_block_t *bfind(iso_cache_t *cache, uint32 sector) {
+    cache_block_t *blk;
+
+    for(blk = *bhash(cache, sector); blk; blk = blk->hnext) {
+        if(blk->sector == sector) {
+            TAILQ_REMOVE(&cache->lru, blk, lru);
+            TAILQ_INSERT_TAIL(&cache->lru, blk, lru);
+            return blk;
+        }
+    }
+
+    return NULL;
+}
+
+/* Kick the LRU block out of the cache, and give it to the given sector. The
+   caller has to fill in the data. */
+static cache_block_t *bnew(iso_cache_t *cache, uint32 sector) {
+    cache_block_t *blk = TAILQ_FIRST(&cache->lru);
+    cache_block_t **bucket = bhash(cache, sector);
+
+    bunhash(cache, blk);
+
+    blk->sector = sector;
+    blk->hnext = *bucket;
+    *bucket = blk;
+
+    TAILQ_REMOVE(&cache->lru, blk, lru);
+    TAILQ_INSERT_TAIL(&cache->lru, blk, lru);
+
+    return blk;
+}
+
+static int bread_sectors(void *buf, uint32 sector, size_t cnt) {
+    ++stat_drive_reads;
+    return cdrom_read_sectors_ex(buf, sector + 150, cnt, CDROM_READ_DMA);
+}
+
+/* Deal with a failed read. This must be called without cache_mutex held, as
+   a disc change re-initializes everything. */
+static void bread_error(int err) {
+    //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors: %d\n", err);
+    if(err == ERR_DISC_CHG || err == ERR_NO_DISC)
+        init_percd();
+}
+
+/* Pulls the requested sector into a cache block and returns the block. Note
+   that the sector in question may already be in the cache, in which case it
+   just returns the containing block. If ra is more than one, that many
+   sectors are read in one go, to get ahead of a sequential reader. Assumes
+   cache_mutex is held; *err is set if the read fails. */
+static cache_block_t *bread_locked(iso_cache_t *cache, uint32 sector, size_t ra,
+                                   int *err) {
+    cache_block_t *blk;
+    size_t i;
+
+    /* Look for a pre-existing cache block */
+    if((blk = bfind(cache, sector))) {
+        ++cache->hits;
+        return blk;
     }
 
-    /* Load the requested block */
-    j = cdrom_read_sectors_ex(cache[i]->data, sector + 150, 1, CDROM_READ_DMA);
+    ++cache->misses;
+
+    if(ra > ra_size)
+        ra = ra_size;
+
+    /* Single sector, straight into the cache */
+    if(ra <= 1) {
+        blk = bnew(cache, sector);
 
-    if(j < 0) {
-        //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
-        //  sector+150, j);
-        if(j == ERR_DISC_CHG || j == ERR_NO_DISC) {
-            init_percd();
+        if((*err = bread_sectors(blk->data, sector, 1)) != ERR_OK) {
+            bunhash(cache, blk);
+            return NULL;
         }
 
-        rv = -1;
-        goto bread_exit;
+        return blk;
     }
 
-    cache[i]->sector = sector;
+    /* Read the whole window with one DMA, then spread it around. */
+    if((*err = bread_sectors(ra_buf, sector, ra)) != ERR_OK)
+        return NULL;
 
-    /* Move it to the most-recently-used position */
-    bgrad_cache(cache, i);
-    rv = NUM_CACHE_BLOCKS - 1;
+    stat_ra_sectors += ra - 1;
 
-    /* Return the new cache block index */
-bread_exit:
-    mutex_unlock(&cache_mutex);
-    return rv;
+    /* Go backwards, so the one we want ends up most recently used. */
+    for(i = ra; i-- > 0;) {
+        if(!(blk = bfind(cache, sector + i)))
+            blk = bnew(cache, sector + i);
+
+        memcpy(blk->data, ra_buf + i * 2048, 2048);
+    }
+
+    return blk;
 }
 
-/* read data block */
-static int bdread(uint32 sector) {
-    return bread_cache(dcache, sector);
+static cache_block_t *bread_cache(iso_cache_t *cache, uint32 sector) {
+    cache_block_t *blk;
+    int err = 0;
+
+    mutex_lock(&cache_mutex);
+    blk = bread_locked(cache, sector, 1, &err);
+    mutex_unlock(&cache_mutex);
+
+    if(!blk)
+        bread_error(err);
+
+    return blk;
 }
 
 /* read inode block */
-static int biread(uint32 sector) {
-    return bread_cache(icache, sector);
+static cache_block_t *biread(uint32 sector) {
+    return bread_cache(&icache, sector);
+}
+
+/* Copy part of a data block out of the cache, reading ahead by up to ra
+   sectors if it has to go to the disc. */
+static int bdread(uint32 sector, size_t ra, uint32 off, void *buf, size_t len) {
+    cache_block_t *blk;
+    int err = 0;
+
+    mutex_lock(&cache_mutex);
+
+    if((blk = bread_locked(&dcache, sector, ra, &err)))
+        memcpy(buf, blk->data + off, len);
+
+    mutex_unlock(&cache_mutex);
+
+    if(!blk) {
+        bread_error(err);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Read whole sectors straight into the caller's buffer, which must be 32-byte
+   aligned for DMA. */
+static int bdirect(void *buf, uint32 sector, size_t cnt) {
+    int err;
+
+    mutex_lock(&cache_mutex);
+    stat_direct_sectors += cnt;
+    err = bread_sectors(buf, sector, cnt);
+    mutex_unlock(&cache_mutex);
+
+    if(err != ERR_OK) {
+        bread_error(err);
+        return -1;
+    }
+
+    return 0;
 }
 
 /* Clear both caches */
 static void bclear(void) {
-    bclear_cache(dcache);
-    bclear_cache(icache);
+    bclear_cache(&dcache);
+    bclear_cache(&icache);
+}
+
+int iso_cache_config(size_t blocks, size_t ra) {
+    if(blocks < 2)
+        return -1;
+
+    mutex_lock(&cache_mutex);
+    dcache_blocks = blocks;
+    readahead = ra;
+    mutex_unlock(&cache_mutex);
+
+    return 0;
+}
+
+void iso_get_cache_stats(iso_cache_stats_t *stats) {
+    mutex_lock(&cache_mutex);
+    stats->ihits = icache.hits;
+    stats->imisses = icache.misses;
+    stats->dhits = dcache.hits;
+    stats->dmisses = dcache.misses;
+    stats->readahead = stat_ra_sectors;
+    stats->direct = stat_direct_sectors;
+    stats->drive_reads = stat_drive_reads;
+    stats->blocks = dcache.count;
+    stats->readahead_max = ra_size;
+    mutex_unlock(&cache_mutex);
+}
+
+void iso_reset_cache_stats(void) {
+    mutex_lock(&cache_mutex);
+    icache.hits = icache.misses = 0;
+    dcache.hits = dcache.misses = 0;
+    stat_ra_sectors = stat_direct_sectors = stat_drive_reads = 0;
+    mutex_unlock(&cache_mutex);
 }
 
 /********************************************************************************/
@@ -328,7 +554,8 @@ static iso_dirent_t root_dirent;
 /* Per-disc initialization; this is done every time it's discovered that
    a new CD has been inserted. */
 static int init_percd(void) {
-    int     i, blk;
+    int     i;
+    cache_block_t *blk = NULL;
     CDROM_TOC   toc;
 
     dbglog(DBG_NOTICE, "fs_iso9660: disc change detected\n");
@@ -336,6 +563,10 @@ static int init_percd(void) {
     /* Start off with no cached blocks and no open files*/
     iso_reset();
 
+    /* Size the data cache for this disc */
+    if(bresize() < 0)
+        return -1;
+
     /* Locate the root session */
     if((i = cdrom_reinit()) != 0) {
         dbglog(DBG_ERROR, "fs_iso9660:init_percd: cdrom_reinit returned %d\n", i);
@@ -354,10 +585,10 @@ static int init_percd(void) {
     for(i = 1; i <= 3; i++) {
         blk = biread(session_base + i + 16 - 150);
 
-        if(blk < 0) return blk;
+        if(!blk) return -1;
 
-        if(memcmp((char *)icache[blk]->data, "\02CD001", 6) == 0) {
-            joliet = isjoliet((char *)icache[blk]->data + 88);
+        if(memcmp((char *)blk->data, "\02CD001", 6) == 0) {
+            joliet = isjoliet((char *)blk->data + 88);
             dbglog(DBG_NOTICE, "  (joliet level %d extensions detected)\n", joliet);
 
             if(joliet) break;
@@ -369,16 +600,16 @@ static int init_percd(void) {
         /* Grab and check the volume descriptor */
         blk = biread(session_base + 16 - 150);
 
-        if(blk < 0) return i;
+        if(!blk) return -1;
 
-        if(memcmp((char*)icache[blk]->data, "\01CD001", 6)) {
+        if(memcmp((char*)blk->data, "\01CD001", 6)) {
             dbglog(DBG_ERROR, "fs_iso9660: disc is not iso9660\r\n");
             return -1;
         }
     }
 
     /* Locate the root directory */
-    memcpy(&root_dirent, icache[blk]->data + 156, sizeof(iso_dirent_t));
+    memcpy(&root_dirent, blk->data + 156, sizeof(iso_dirent_t));
     root_extent = iso_733(root_dirent.extent);
     root_size = iso_733(root_dirent.size);
 
@@ -427,7 +658,8 @@ static int fncompare(const char *isofn, int isosize, const char *normalfn) {
  */
 static iso_dirent_t *find_object(const char *fn, int dir,
                                  uint32 dir_extent, uint32 dir_size) {
-    int     i, c;
+    int     i;
+    cache_block_t   *c;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -450,11 +682,11 @@ static iso_dirent_t *find_object(const char *fn, int dir,
     while(size_left > 0) {
         c = biread(dir_extent);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
         for(i = 0; i < 2048 && i < size_left;) {
             /* Locate the current dirent */
-            de = (iso_dirent_t *)(icache[c]->data + i);
+            de = (iso_dirent_t *)(c->data + i);
 
             if(!de->length) break;
 
@@ -528,42 +760,71 @@ static iso_dirent_t *find_object(const char *fn, int dir,
    and expecting a fully qualified path name. This is analogous to find_object
    but it searches with the path in mind.
 
-   fn:      object filename (relative to the passed directory)
-   dir:     0 if looking for a file, 1 if looking for a dir
-   dir_extent:  directory extent to start with
-   dir_size:    directory size (in bytes)
+   Lookups go through the path cache. On a miss, the walk starts from the
+   deepest directory along the path that is already cached, and every
+   directory it passes through is cached on the way. Cache entries hold the
+   extent and size of the object.
 
-   It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
- */
-static iso_dirent_t *find_object_path(const char *fn, int dir, iso_dirent_t *start) {
-    char        *cur;
+   Returns 0 and fills in extent and size on success, -1 if there is no such
+   object. */
+static int iso_lookup(const char *path, int dir, uint32 *extent, uint32 *size) {
+    size_t len = strlen(path);
+    const char *fn = path, *cur;
+    iso_dirent_t *de;
+    uint32_t v[2];
+
+    /* The cache can't be trusted while a disc change is pending */
+    if(percd_done) {
+        if(fs_dcache_lookup(&root_dirent, path, len, dir, v))
+            goto found;
+
+        /* Find the deepest directory we already know about */
+        for(cur = path + len; cur > path; cur--) {
+            if(*cur == '/' &&
+               fs_dcache_lookup(&root_dirent, path, cur - path, 1, v)) {
+                fn = cur + 1;
+                break;
+            }
+        }
+    }
+
+    if(fn == path) {
+        v[0] = iso_733(root_dirent.extent);
+        v[1] = iso_733(root_dirent.size);
+    }
 
-    /* If the object is in a sub-tree, traverse the trees looking
-       for the right directory */
+    /* Walk the rest of the path, remembering each directory found */
     while((cur = strchr(fn, '/'))) {
         if(cur != fn) {
-            /* Note: trailing path parts don't matter since find_object
-               only compares based on the FN length on the disc. */
-            start = find_object(fn, 1, iso_733(start->extent), iso_733(start->size));
+            if(!(de = find_object(fn, 1, v[0], v[1])))
+                return -1;
 
-            if(start == NULL) return NULL;
+            v[0] = iso_733(de->extent);
+            v[1] = iso_733(de->size);
+            fs_dcache_insert(&root_dirent, path, cur - path, 1, v);
         }
 
         fn = cur + 1;
     }
 
-    /* Locate the file in the resulting directory */
+    /* Locate the object itself in the resulting directory */
     if(*fn) {
-        start = find_object(fn, dir, iso_733(start->extent), iso_733(start->size));
-        return start;
+        if(!(de = find_object(fn, dir, v[0], v[1])))
+            return -1;
+
+        v[0] = iso_733(de->extent);
+        v[1] = iso_733(de->size);
     }
-    else {
-        if(!dir)
-            return NULL;
-        else
-            return start;
+    else if(!dir) {
+        return -1;
     }
+
+    fs_dcache_insert(&root_dirent, path, len, dir, v);
+
+found:
+    *extent = v[0];
+    *size = v[1];
+    return 0;
 }
 
 /********************************************************************************/
@@ -578,11 +839,31 @@ static struct {
     uint32      size;       /* Length of file in bytes */
     dirent_t    dirent;     /* A static dirent to pass back to clients */
     int     broken;     /* >0 if the CD has been swapped out since open */
+    uint32      next_sector;    /* Sector a sequential reader wants next */
+    int     async;      /* >0 if opened with O_ASYNC */
+    int     aio_pending;    /* Number of async reads still in flight */
+    int     aio_error;  /* >0 if an async read failed */
+    ssize_t     aio_bytes;  /* Bytes read by completed async reads */
+    int     aio_notify; /* >0 while poll() is being told about a read */
 } fh[FS_CD_MAX_FILES];
 
 /* Mutex for file handles */
 static mutex_t fh_mutex;
 
+/* Async read completion state (the aio_* handle members) */
+static mutex_t aio_mutex;
+static condvar_t aio_cv;
+
+/* One outstanding async read. Reads that don't start and end on a sector
+   boundary, or aren't into a DMA-able buffer, go through a bounce buffer. */
+typedef struct iso_aio {
+    file_t  fd;         /* File the read belongs to */
+    uint8   *dst;       /* Caller's buffer */
+    uint8   *bounce;    /* Sector buffer, if the caller's can't be used */
+    uint32  off;        /* Offset of the data in the bounce buffer */
+    size_t  len;        /* Bytes to read */
+} iso_aio_t;
+
 /* Break all of our open file descriptor. This is necessary when the disc
    is changed so that we don't accidentally try to keep on doing stuff
    with the old info. As files are closed and re-opened, the broken flag
@@ -601,7 +882,7 @@ static void iso_break_all(void) {
 /* Open a file or directory */
 static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     file_t      fd;
-    iso_dirent_t    *de;
+    uint32      extent, size;
 
     (void)vfs;
 
@@ -611,6 +892,12 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
         return 0;
     }
 
+    /* Directories can't be read asynchronously */
+    if((mode & O_ASYNC) && (mode & O_DIR)) {
+        errno = EINVAL;
+        return 0;
+    }
+
     /* Do this only when we need to (this is still imperfect) */
     if(!percd_done && init_percd() < 0) {
         errno = ENODEV;
@@ -620,9 +907,7 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     percd_done = 1;
 
     /* Find the file we want */
-    de = find_object_path(fn, (mode & O_DIR) ? 1 : 0, &root_dirent);
-
-    if(!de) {
+    if(iso_lookup(fn, (mode & O_DIR) ? 1 : 0, &extent, &size) < 0) {
         errno = ENOENT;
         return 0;
     }
@@ -644,11 +929,17 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     }
 
     /* Fill in the file handle and return the fd */
-    fh[fd].first_extent = iso_733(de->extent);
+    fh[fd].first_extent = extent;
     fh[fd].dir = (mode & O_DIR) ? 1 : 0;
     fh[fd].ptr = 0;
-    fh[fd].size = iso_733(de->size);
+    fh[fd].size = size;
     fh[fd].broken = 0;
+    fh[fd].next_sector = fh[fd].first_extent;
+    fh[fd].async = (mode & O_ASYNC) ? 1 : 0;
+    fh[fd].aio_pending = 0;
+    fh[fd].aio_error = 0;
+    fh[fd].aio_bytes = 0;
+    fh[fd].aio_notify = 0;
 
     return (void *)fd;
 }
@@ -659,15 +950,177 @@ static int iso_close(void * h) {
 
     /* Check that the fd is valid */
     if(fd < FS_CD_MAX_FILES) {
+        /* Any async reads still in flight are writing to the caller's
+           buffers, so let them land first. The VFS still has to know about
+           the file while poll() is being told about the last one, too. */
+        mutex_lock(&aio_mutex);
+
+        while(fh[fd].aio_pending || fh[fd].aio_notify)
+            cond_wait(&aio_cv, &aio_mutex);
+
+        mutex_unlock(&aio_mutex);
+
         /* No need to lock the mutex: this is an atomic op */
         fh[fd].first_extent = 0;
     }
     return 0;
 }
 
+static vfs_handler_t vh;
+
+/* Called from the cdrom worker thread when an async read is done */
+static void iso_aio_done(int result, void *data) {
+    iso_aio_t *req = (iso_aio_t *)data;
+    short event = 0;
+
+    if(result == ERR_OK && req->bounce)
+        memcpy(req->dst, req->bounce + req->off, req->len);
+
+    /* Let the next open pick up the new disc */
+    if(result == ERR_DISC_CHG || result == ERR_NO_DISC)
+        percd_done = 0;
+
+    mutex_lock(&aio_mutex);
+
+    if(result != ERR_OK)
+        fh[req->fd].aio_error = 1;
+    else
+        fh[req->fd].aio_bytes += req->len;
+
+    /* The file is readable again once the last read in flight is done. */
+    if(!--fh[req->fd].aio_pending) {
+        event = fh[req->fd].aio_error ? POLLERR : (POLLIN | POLLRDNORM);
+        ++fh[req->fd].aio_notify;
+    }
+
+    cond_broadcast(&aio_cv);
+    mutex_unlock(&aio_mutex);
+
+    if(event) {
+        fs_poll_notify(&vh, (void *)req->fd, event);
+
+        mutex_lock(&aio_mutex);
+        --fh[req->fd].aio_notify;
+        cond_broadcast(&aio_cv);
+        mutex_unlock(&aio_mutex);
+    }
+
+    free(req->bounce);
+    free(req);
+}
+
+/* Queue an async read from the current position. The read counts as done as
+   far as the file position goes; iso_complete() waits for the data. */
+static ssize_t iso_read_async(file_t fd, uint8 *outbuf, size_t bytes) {
+    iso_aio_t *req;
+    uint32 sector, cnt;
+    size_t toread;
+
+    toread = (bytes > (fh[fd].size - fh[fd].ptr)) ?
+             fh[fd].size - fh[fd].ptr : bytes;
+
+    if(toread == 0)
+        return 0;
+
+    if(!(req = malloc(sizeof(iso_aio_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    req->fd = fd;
+    req->dst = outbuf;
+    req->off = fh[fd].ptr % 2048;
+    req->len = toread;
+    req->bounce = NULL;
+
+    sector = fh[fd].first_extent + fh[fd].ptr / 2048;
+    cnt = (req->off + toread + 2047) / 2048;
+
+    if(req->off || (toread % 2048) || ((uintptr_t)outbuf & 31)) {
+        if(!(req->bounce = memalign(32, cnt * 2048))) {
+            free(req);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    mutex_lock(&aio_mutex);
+    ++fh[fd].aio_pending;
+    mutex_unlock(&aio_mutex);
+
+    if(cdrom_read_sectors_async(req->bounce ? req->bounce : outbuf,
+                                sector + 150, cnt, iso_aio_done, req) < 0) {
+        mutex_lock(&aio_mutex);
+        --fh[fd].aio_pending;
+        mutex_unlock(&aio_mutex);
+
+        free(req->bounce);
+        free(req);
+        errno = EIO;
+        return -1;
+    }
+
+    fh[fd].ptr += toread;
+    fh[fd].next_sector = sector + cnt;
+
+    return toread;
+}
+
+/* Wait for all of a file's async reads to finish */
+static int iso_complete(void *h, ssize_t *rv) {
+    file_t fd = (file_t)h;
+    int err;
+
+    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || !fh[fd].async) {
+        errno = EBADF;
+        return -1;
+    }
+
+    mutex_lock(&aio_mutex);
+
+    while(fh[fd].aio_pending)
+        cond_wait(&aio_cv, &aio_mutex);
+
+    err = fh[fd].aio_error;
+
+    if(rv)
+        *rv = err ? -1 : fh[fd].aio_bytes;
+
+    fh[fd].aio_error = 0;
+    fh[fd].aio_bytes = 0;
+
+    mutex_unlock(&aio_mutex);
+
+    if(err) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* An async file is readable once it has no reads in flight */
+static short iso_poll(void *h, short events) {
+    file_t fd = (file_t)h;
+    short rv = 0;
+
+    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken)
+        return POLLNVAL;
+
+    if(!fh[fd].aio_pending) {
+        rv = events & (POLLIN | POLLRDNORM);
+
+        if(fh[fd].aio_error)
+            rv |= POLLERR;
+    }
+
+    return rv;
+}
+
 /* Read from a file */
 static ssize_t iso_read(void * h, void *buf, size_t bytes) {
-    int rv, toread, thissect, c;
+    int rv, toread, thissect;
+    uint32 sector, ra;
     uint8 * outbuf;
     file_t fd = (file_t)h;
 
@@ -680,6 +1133,9 @@ static ssize_t iso_read(void * h, void *buf, size_t bytes) {
     rv = 0;
     outbuf = (uint8 *)buf;
 
+    if(fh[fd].async)
+        return iso_read_async(fd, outbuf, bytes);
+
     /* Read zero or more sectors into the buffer from the current pos */
     while(bytes > 0) {
         /* Figure out how much we still need to read */
@@ -690,44 +1146,51 @@ static ssize_t iso_read(void * h, void *buf, size_t bytes) {
 
         /* How much more can we read in the current sector? */
         thissect = 2048 - (fh[fd].ptr % 2048);
-
-        /* If we're on a sector boundary and we have more than one
-           full sector to read, then short-circuit the cache here
-           and use the multi-sector reads from the CD unit (this
-           should theoretically be a lot faster) */
-        /* XXX This code isn't actually faster, but I'm leaving it
-           here commented out in case we could find a better use
-           for it later than speed (i.e., preventing thread context
-           switches). */
-        /* if(thissect == 2048 && toread >= 2048) {
-            // Round it off to an even sector count
+        sector = fh[fd].first_extent + fh[fd].ptr / 2048;
+
+        /* If we're on a sector boundary and we have at least a read-ahead
+           window's worth of full sectors to read, then skip the cache and
+           have the drive DMA the sectors straight into the caller's buffer.
+           This saves a copy and gets the whole request done with one
+           command. Smaller reads do better going through the cache. */
+        if(thissect == 2048 && !((uintptr_t)outbuf & 31) &&
+           (size_t)toread >= 2048 * (ra_size > 1 ? ra_size : 2)) {
             thissect = toread / 2048;
             toread = thissect * 2048;
 
-            printf("cdrom: short-circuit read for %d sectors\n",
-                thissect);
-
-            // Do the read
-            if(cdrom_read_sectors(outbuf,
-                fh[fd].first_extent + fh[fd].ptr/2048 + 150,
-                thissect) < 0)
-            {
-                // Something went wrong...
+            if(bdirect(outbuf, sector, thissect) < 0) {
+                errno = EIO;
                 return -1;
             }
-        } else { */
-        toread = (toread > thissect) ? thissect : toread;
 
-        /* Do the read */
-        c = bdread(fh[fd].first_extent + fh[fd].ptr / 2048);
-
-        if(c < 0) {
-            errno = EIO;
-            return -1;
+            fh[fd].next_sector = sector + thissect;
         }
+        else {
+            toread = (toread > thissect) ? thissect : toread;
+
+            /* If the file is being read sequentially, fetch the rest of the
+               read-ahead window along with this sector. */
+            ra = 1;
 
-        memcpy(outbuf, dcache[c]->data + (fh[fd].ptr % 2048), toread);
-        /* } */
+            if(sector == fh[fd].next_sector) {
+                ra = (fh[fd].size + 2047) / 2048 -
+                     (sector - fh[fd].first_extent);
+
+                if(ra > readahead)
+                    ra = readahead;
+            }
+
+            /* Do the read */
+            if(bdread(sector, ra, fh[fd].ptr % 2048, outbuf, toread) < 0) {
+                errno = EIO;
+                return -1;
+            }
+
+            /* Sequential readers can come back for the rest of a sector, so
+               only move on once this one is done. */
+            if(sector == fh[fd].next_sector || sector + 1 == fh[fd].next_sector)
+                fh[fd].next_sector = sector + (toread == thissect);
+        }
 
         /* Adjust pointers */
         outbuf += toread;
@@ -833,7 +1296,7 @@ static void fn_postprocess(char *fnin) {
 
 /* Read a directory entry */
 static dirent_t *iso_readdir(void * h) {
-    int     c;
+    cache_block_t   *c;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -850,16 +1313,16 @@ static dirent_t *iso_readdir(void * h) {
 
     /* Scan forwards until we find the next valid entry, an
        end-of-entry mark, or run out of dir size. */
-    c = -1;
+    c = NULL;
     de = NULL;
 
     while(fh[fd].ptr < fh[fd].size) {
         /* Get the current dirent block */
         c = biread(fh[fd].first_extent + fh[fd].ptr / 2048);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
 
         if(de->length) break;
 
@@ -872,9 +1335,9 @@ static dirent_t *iso_readdir(void * h) {
     /* If we're at the first, skip the two blank entries */
     if(!de->name[0] && de->name_len == 1) {
         fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
         fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
 
         if(!de->length) return NULL;
     }
@@ -939,6 +1402,7 @@ static int iso_rewinddir(void * h) {
 int iso_reset(void) {
     iso_break_all();
     bclear();
+    fs_dcache_invalidate(&root_dirent);
     percd_done = 0;
     return 0;
 }
@@ -949,6 +1413,9 @@ int iso_reset(void) {
    time someone calls in it'll get reset. */
 static int iso_last_status;
 static int iso_vblank_hnd;
+
+/* Whether fs_iso9660_init() got everything set up */
+static int initted;
 static void iso_vblank(uint32 evt, void *data) {
     int status, disc_type;
 
@@ -971,7 +1438,7 @@ static void iso_vblank(uint32 evt, void *data) {
 static int iso_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
                     int flag) {
     mode_t md;
-    iso_dirent_t *de;
+    uint32 extent, size;
     size_t len = strlen(path);
     
     (void)vfs;
@@ -989,26 +1456,24 @@ static int iso_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
         return 0;
     }
 
-    /* First try opening as a file */
-    de = find_object_path(path, 0, &root_dirent);
+    /* First try opening as a file, and if we couldn't get it as a file, try
+       as a directory */
     md = S_IFREG;
 
-    /* If we couldn't get it as a file, try as a directory */
-    if(!de) {
-        de = find_object_path(path, 1, &root_dirent);
+    if(iso_lookup(path, 0, &extent, &size) < 0) {
         md = S_IFDIR;
-    }
 
-    /* If we still don't have it, then we're not going to get it. */
-    if(!de) {
-        errno = ENOENT;
-        return -1;
+        /* If we still don't have it, then we're not going to get it. */
+        if(iso_lookup(path, 1, &extent, &size) < 0) {
+            errno = ENOENT;
+            return -1;
+        }
     }
-       
+
     memset(st, 0, sizeof(struct stat));
     st->st_dev = (dev_t)('c' | ('d' << 8));
     st->st_mode = md | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH;
-    st->st_size = (md == S_IFDIR) ? -1 : (int)iso_733(de->size);
+    st->st_size = (md == S_IFDIR) ? -1 : (int)size;
     st->st_nlink = (md == S_IFDIR) ? 2 : 1;
     st->st_blksize = 512;
 
@@ -1033,6 +1498,9 @@ static int iso_fcntl(void *h, int cmd, va_list ap) {
             if(fh[fd].dir)
                 rv |= O_DIR;
 
+            if(fh[fd].async)
+                rv |= O_ASYNC;
+
             break;
 
         case F_SETFL:
@@ -1093,12 +1561,12 @@ static vfs_handler_t vh = {
     NULL,
     NULL,
     NULL,
-    NULL,
+    iso_complete,
     iso_stat,
     NULL,
     NULL,
     iso_fcntl,
-    NULL,               /* poll */
+    iso_poll,           /* poll */
     NULL,               /* link */
     NULL,               /* symlink */
     NULL,               /* seek64 */
@@ -1111,8 +1579,6 @@ static vfs_handler_t vh = {
 
 /* Initialize the file system */
 void fs_iso9660_init(void) {
-    int i;
-
     /* Reset fd's */
     memset(fh, 0, sizeof(fh));
 
@@ -1122,18 +1588,24 @@ void fs_iso9660_init(void) {
     /* Init thread mutexes */
     mutex_init(&cache_mutex, MUTEX_TYPE_NORMAL);
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
-
-    /* Allocate cache block space, properly aligned for DMA access */
-    cache_data = memalign(32, 2 * NUM_CACHE_BLOCKS * 2048);
-    caches = malloc(2 * NUM_CACHE_BLOCKS * sizeof(cache_block_t));
-
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        icache[i] = &caches[i * 2];
-        icache[i]->data = &cache_data[i * 2 * 2048];
-        icache[i]->sector = -1;
-        dcache[i] = &caches[i * 2 + 1];
-        dcache[i]->data = &cache_data[i * 2 * 2048 + 2048];
-        dcache[i]->sector = -1;
+    mutex_init(&aio_mutex, MUTEX_TYPE_NORMAL);
+    cond_init(&aio_cv);
+
+    /* Allocate the inode cache; the data cache is sized at mount time, but
+       start it off with the defaults so there's always one around. */
+    if(balloc_cache(&icache, NUM_CACHE_BLOCKS) < 0 || bresize() < 0) {
+        dbglog(DBG_ERROR, "fs_iso9660: can't allocate the block caches\n");
+
+        bfree_cache(&icache);
+        bfree_cache(&dcache);
+        free(ra_buf);
+        ra_buf = NULL;
+        ra_size = 0;
+        mutex_destroy(&cache_mutex);
+        mutex_destroy(&fh_mutex);
+        mutex_destroy(&aio_mutex);
+        cond_destroy(&aio_cv);
+        return;
     }
 
     percd_done = 0;
@@ -1144,20 +1616,33 @@ void fs_iso9660_init(void) {
 
     /* Register with VFS */
     nmmgr_handler_add(&vh.nmmgr);
+
+    initted = 1;
 }
 
 /* De-init the file system */
 void fs_iso9660_shutdown(void) {
+    if(!initted)
+        return;
+
+    initted = 0;
+
     /* De-register with vblank */
     vblank_handler_remove(iso_vblank_hnd);
 
-    /* Dealloc cache block space */
-    free(cache_data);
-    free(caches);
+    /* Forget any cached paths and dealloc cache block space */
+    fs_dcache_invalidate(&root_dirent);
+    bfree_cache(&icache);
+    bfree_cache(&dcache);
+    free(ra_buf);
+    ra_buf = NULL;
+    ra_size = 0;
 
     /* Free muteces */
     mutex_destroy(&cache_mutex);
     mutex_destroy(&fh_mutex);
+    mutex_destroy(&aio_mutex);
+    cond_destroy(&aio_cv);
 
     nmmgr_handler_remove(&vh.nmmgr);
 }
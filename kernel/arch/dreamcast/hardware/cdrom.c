@@ -13,6 +13,7 @@
 
 #include <arch/timer.h>
 #include <arch/memory.h>
+#include <arch/cache.h>
 
 #include <dc/cdrom.h>
 #include <dc/g1ata.h>
@@ -20,8 +21,13 @@
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/cond.h>
 #include <kos/dbglog.h>
 
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
 /*
 
 This module contains low-level primitives for accessing the CD-Rom (I
@@ -55,6 +61,9 @@ typedef int gdc_cmd_hnd_t;
 /* The G1 ATA access mutex */
 mutex_t _g1_ata_mutex = MUTEX_INITIALIZER;
 
+/* Size of the sectors the drive has been told to give us */
+static int cur_sector_size = 2048;
+
 /* Shortcut to cdrom_reinit_ex. Typically this is the only thing changed. */
 int cdrom_set_sector_size(int size) {
     return cdrom_reinit_ex(-1, -1, size);
@@ -210,6 +219,8 @@ int cdrom_change_datatype(int sector_part, int cdxa, int sector_size) {
             sector_size = 2048;
     }
 
+    cur_sector_size = sector_size;
+
     params[0] = 0;              /* 0 = set, 1 = get */
     params[1] = sector_part;    /* Get Data or Full Sector */
     params[2] = cdxa;           /* CD-XA mode 1/2 */
@@ -276,8 +287,12 @@ int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode) {
     /* XXX: DMA Mode may conflict with using a second G1ATA device. More 
        testing is needed from someone with such a device.
     */
-    if(mode == CDROM_READ_DMA)
+    if(mode == CDROM_READ_DMA) {
+        /* The drive writes straight to memory, so don't leave anything in
+           the cache that could be read (or written back) over it later. */
+        dcache_purge_range((uintptr_t)buffer, cnt * cur_sector_size);
         rv = cdrom_exec_cmd(CMD_DMAREAD, &params);
+    }
     else if(mode == CDROM_READ_PIO)
         rv = cdrom_exec_cmd(CMD_PIOREAD, &params);
 
@@ -290,6 +305,125 @@ int cdrom_read_sectors(void *buffer, int sector, int cnt) {
 }
 
 
+/* Asynchronous reads. These are queued up in sector order and serviced by a
+   worker thread, which sweeps up through the queue and then wraps around to
+   the lowest sector again (C-SCAN), so that interleaved streams don't have
+   the drive seeking back and forth all the time. */
+typedef struct cdrom_async_req {
+    TAILQ_ENTRY(cdrom_async_req) list;
+    void *buffer;
+    int sector, cnt;
+    cdrom_async_cb_t cb;
+    void *data;
+} cdrom_async_req_t;
+
+static TAILQ_HEAD(cdrom_async_queue, cdrom_async_req) async_queue =
+    TAILQ_HEAD_INITIALIZER(async_queue);
+static mutex_t async_mutex = MUTEX_INITIALIZER;
+static condvar_t async_cv = COND_INITIALIZER;
+static kthread_t *async_thd;
+static int async_count;
+static int async_head;
+static bool async_quit;
+
+/* Pick the next request in elevator order; async_mutex must be held. */
+static cdrom_async_req_t *cdrom_async_next(void) {
+    cdrom_async_req_t *req;
+
+    TAILQ_FOREACH(req, &async_queue, list) {
+        if(req->sector >= async_head)
+            return req;
+    }
+
+    return TAILQ_FIRST(&async_queue);
+}
+
+static void *cdrom_async_thd(void *param) {
+    cdrom_async_req_t *req;
+    int rv;
+
+    (void)param;
+
+    mutex_lock(&async_mutex);
+
+    for(;;) {
+        while(TAILQ_EMPTY(&async_queue) && !async_quit)
+            cond_wait(&async_cv, &async_mutex);
+
+        if(async_quit)
+            break;
+
+        req = cdrom_async_next();
+        TAILQ_REMOVE(&async_queue, req, list);
+        async_head = req->sector + req->cnt;
+        mutex_unlock(&async_mutex);
+
+        rv = cdrom_read_sectors_ex(req->buffer, req->sector, req->cnt,
+                                   ((uintptr_t)req->buffer & 31) ?
+                                   CDROM_READ_PIO : CDROM_READ_DMA);
+
+        if(req->cb)
+            req->cb(rv, req->data);
+
+        free(req);
+
+        mutex_lock(&async_mutex);
+        --async_count;
+        cond_broadcast(&async_cv);
+    }
+
+    mutex_unlock(&async_mutex);
+    return NULL;
+}
+
+int cdrom_read_sectors_async(void *buffer, int sector, int cnt,
+                             cdrom_async_cb_t cb, void *data) {
+    cdrom_async_req_t *req, *cur;
+    kthread_attr_t attr = { 0 };
+
+    if(!(req = malloc(sizeof(cdrom_async_req_t))))
+        return -1;
+
+    req->buffer = buffer;
+    req->sector = sector;
+    req->cnt = cnt;
+    req->cb = cb;
+    req->data = data;
+
+    mutex_lock_scoped(&async_mutex);
+
+    /* The worker only gets started for programs that actually use it. */
+    if(!async_thd) {
+        attr.label = "cdrom_async";
+        async_quit = false;
+
+        if(!(async_thd = thd_create_ex(&attr, cdrom_async_thd, NULL))) {
+            free(req);
+            return -1;
+        }
+    }
+
+    /* Keep the queue sorted by sector */
+    TAILQ_FOREACH(cur, &async_queue, list) {
+        if(cur->sector > sector)
+            break;
+    }
+
+    if(cur)
+        TAILQ_INSERT_BEFORE(cur, req, list);
+    else
+        TAILQ_INSERT_TAIL(&async_queue, req, list);
+
+    ++async_count;
+    cond_broadcast(&async_cv);
+
+    return 0;
+}
+
+int cdrom_async_pending(void) {
+    return async_count;
+}
+
 /* Read a piece of or all of the Q byte of the subcode of the last sector read.
    If you need the subcode from every sector, you cannot read more than one at 
    a time. */
@@ -415,6 +549,31 @@ void cdrom_init(void) {
 }
 
 void cdrom_shutdown(void) {
+    cdrom_async_req_t *req, *tmp;
+
+    /* Let the read in progress finish, fail everything else */
+    mutex_lock(&async_mutex);
+
+    if(!async_thd) {
+        mutex_unlock(&async_mutex);
+        return;
+    }
+
+    async_quit = true;
+    cond_broadcast(&async_cv);
+    mutex_unlock(&async_mutex);
+
+    thd_join(async_thd, NULL);
+    async_thd = NULL;
+
+    TAILQ_FOREACH_SAFE(req, &async_queue, list, tmp) {
+        TAILQ_REMOVE(&async_queue, req, list);
+
+        if(req->cb)
+            req->cb(ERR_ABORTED, req->data);
+
+        free(req);
+    }
 
-    /* What would you want done here? */
+    async_count = 0;
 }
@@ -205,6 +205,8 @@ static int gaps_init(void) {
 struct {
     uint16  cur_rx;     /* Current Rx read ptr */
     uint16  cur_tx;     /* Current available Tx slot */
+    uint16  tx_pending; /* Tx slots filled in, but not handed to the chip */
+    uint16  tx_len[TX_NB_BUFFERS];  /* Length of each pending Tx slot */
     uint8   mac[6];     /* Mac address */
 } rtl;
 
@@ -390,6 +392,7 @@ static int bba_hw_init(void) {
 
     /* Initialize status vars */
     rtl.cur_tx = 0;
+    rtl.tx_pending = 0;
     rtl.cur_rx = 0;
 
     /* Enable receiving broadcast and physical match packets */
@@ -462,15 +465,16 @@ static void g2_read_block_8_fast(uint8 *dst, uint8 *src, int len) {
 }
 
 
-#define RXBSZ    (64*1024) /* must be a power of two */
-#define MAX_PKTS (RXBSZ / 32)
+/* Received packets are copied out of the ring buffer into packet buffers from
+   the network stack's pool, which get handed up the stack as they are, so
+   that sockets can hang onto them rather than copying the data again. */
+#define MAX_PKTS 64
 static struct pkt {
     int pkt_size;
     uint8 * rxbuff;
+    net_pbuf_t * pbuf;
 } rx_pkt[MAX_PKTS];
 
-static uint8 rxbuff[RXBSZ + 2 * 1600] __attribute__((aligned(32)));
-static uint32 rxbuff_pos;
 static int rxin;
 static int rxout;
 static int dma_used;
@@ -502,6 +506,11 @@ static void rx_finish_enq(int room) {
         sem_signal(&bba_rx_sema);
         thd_schedule(1, 0);
     }
+    else if(rx_pkt[rxin].pbuf) {
+        /* Didn't get queued, so give the buffer back */
+        net_pbuf_free(rx_pkt[rxin].pbuf);
+        rx_pkt[rxin].pbuf = NULL;
+    }
 }
 
 static void bba_dma_cb(void *p) {
@@ -593,24 +602,24 @@ static int  bba_copy_packet(uint8 * dst, uint32 src, int len) {
 }
 
 static int rx_enq(int ring_offset, size_t pkt_size) {
+    net_pbuf_t *pb;
+
     /* If there's no one to receive it, don't bother. */
     if(eth_rx_callback) {
-        if(rxin != rxout &&
-                (((rx_pkt[rxout].rxbuff - (rxbuff + 32)) - rxbuff_pos) & (RXBSZ - 1)) < pkt_size + 2048) {
+        if(((rxin + 1) % MAX_PKTS) == rxout || !(pb = net_pbuf_alloc()))
             return -1;
-        }
 
-        /* Receive buffer: temporary space to copy out received data */
+        /* Receive buffer: a packet buffer to copy out received data into,
+           with the same alignment as it has in the ring, and room in front
+           for the DMA to start on a 32 byte boundary */
+        rx_pkt[rxin].pbuf = pb;
 
 #ifdef USE_P2_AREA
-        rx_pkt[rxin].rxbuff = rxbuff + 32 + (rxbuff_pos | MEM_AREA_P2_BASE) + (ring_offset & 31);
+        rx_pkt[rxin].rxbuff = (uint8 *)(((uint32)pb->buf | MEM_AREA_P2_BASE) + 32 + (ring_offset & 31));
 #else
-        rx_pkt[rxin].rxbuff = rxbuff + 32 + rxbuff_pos + (ring_offset & 31);
+        rx_pkt[rxin].rxbuff = pb->buf + 32 + (ring_offset & 31);
 #endif
 
-
-        rxbuff_pos = (rxbuff_pos + pkt_size + 63) & (RXBSZ - 32);
-
         rx_pkt[rxin].pkt_size = pkt_size;
         return bba_copy_packet(rx_pkt[rxin].rxbuff, ring_offset, pkt_size);
     }
@@ -618,22 +627,63 @@ static int rx_enq(int ring_offset, size_t pkt_size) {
         return 1;
 }
 
-/* Transmit a single packet */
-#ifdef TX_SEMA
-static int bba_rtx(const uint8 * pkt, int len, int wait)
-#else
-static int bba_tx(const uint8 * pkt, int len, int wait)
-#endif
-{
+/* Copy a piece of a packet out to RTL memory. Check alignment of both ends,
+   if they're 32-bit aligned, use g2_write_block_32, if they're 16-bit aligned,
+   use g2_write_block_16, otherwise, use g2_write_block_8. */
+static void bba_tx_copy(const uint8 *src, uint32 dst, int len) {
+    /* XXX could use store queues or memcpy8 here */
+    if(!(((uint32)src | dst) & 0x03)) {
+        g2_write_block_32((uint32 *) src, dst, (len + 3) >> 2);
+    }
+    else if(!(((uint32)src | dst) & 0x01)) {
+        g2_write_block_16((uint16 *) src, dst, (len + 1) >> 1);
+    }
+    else {
+        g2_write_block_8(src, dst, len);
+    }
+}
+
+/* Hand any Tx slots we've filled in over to the chip, in order. */
+static void bba_tx_flush(void) {
+    int i;
+
+    while(rtl.tx_pending) {
+        i = (rtl.cur_tx + TX_NB_BUFFERS - rtl.tx_pending) % TX_NB_BUFFERS;
+        g2_write_32(NIC(RT_TXSTATUS0 + 4 * i), rtl.tx_len[i]);
+        --rtl.tx_pending;
+    }
+}
+
+/* Fill in the next Tx slot with a packet, given in pieces. The chip isn't told
+   about it until bba_tx_flush() is called, so that a batch of packets can be
+   copied out and then started all at once. */
+static int bba_tx_queue(const struct iovec *iov, int iovcnt, int wait) {
+    uint32 dst = txdesc[rtl.cur_tx];
+    int i, len = 0;
+
+    for(i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
+
+    if(len > TX_BUFFER_LEN)
+        return BBA_TX_ERROR;
+
     if(!link_stable) {
         if(wait == BBA_TX_WAIT) {
             while(!link_stable)
                 ;
         }
-        else
+        else {
+            bba_tx_flush();
             return BBA_TX_AGAIN;
+        }
     }
 
+    /* If every slot is waiting to go, or the next one is still busy, get the
+       waiting ones going before we go any further. */
+    if(rtl.tx_pending == TX_NB_BUFFERS ||
+       !(g2_read_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx)) & RT_TX_HOST_OWNS))
+        bba_tx_flush();
+
     /* Wait till it's clear to transmit */
     if(wait == BBA_TX_WAIT) {
         while(!(g2_read_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx)) & RT_TX_HOST_OWNS)) {
@@ -649,21 +699,11 @@ static int bba_tx(const uint8 * pkt, int len, int wait)
     }
 
     /* Copy the packet out to RTL memory */
-    /* XXX could use store queues or memcpy8 here */
-
-    //g2_write_block_8(pkt, txdesc[rtl.cur_tx], len);
-
-    /* Check alignment of the packet, if its 32-bit aligned, use
-       g2_write_block_32, if its 16-bit aligned, use g2_write_block_16,
-       otherwise, use g2_write_block_8. */
-    if(!((uint32)pkt & 0x03)) {
-        g2_write_block_32((uint32 *) pkt, txdesc[rtl.cur_tx], (len + 3) >> 2);
-    }
-    else if(!((uint32)pkt & 0x01)) {
-        g2_write_block_16((uint16 *) pkt, txdesc[rtl.cur_tx], (len + 1) >> 1);
-    }
-    else {
-        g2_write_block_8(pkt, txdesc[rtl.cur_tx], len);
+    for(i = 0; i < iovcnt; ++i) {
+        if(iov[i].iov_len) {
+            bba_tx_copy((const uint8 *)iov[i].iov_base, dst, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
     }
 
     /* All packets must be at least 60 bytes, pad them with null bytes if
@@ -673,15 +713,32 @@ static int bba_tx(const uint8 * pkt, int len, int wait)
         len = 60;
     }
 
-    /* Transmit from the current TX buffer */
-    g2_write_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx), len);
-
     /* Go to the next TX buffer */
+    rtl.tx_len[rtl.cur_tx] = len;
     rtl.cur_tx = (rtl.cur_tx + 1) % TX_NB_BUFFERS;
+    ++rtl.tx_pending;
 
     return BBA_TX_OK;
 }
 
+/* Transmit a single packet */
+#ifdef TX_SEMA
+static int bba_rtx(const uint8 * pkt, int len, int wait)
+#else
+static int bba_tx(const uint8 * pkt, int len, int wait)
+#endif
+{
+    struct iovec iov = { (void *)pkt, len };
+    int rv;
+
+    /* Transmit from the current TX buffer, along with anything queued up
+       before it. */
+    rv = bba_tx_queue(&iov, 1, wait);
+    bba_tx_flush();
+
+    return rv;
+}
+
 #ifdef TX_SEMA
 int bba_tx(const uint8 * pkt, int len, int wait) {
     int res;
@@ -700,6 +757,21 @@ int bba_tx(const uint8 * pkt, int len, int wait) {
 
     return res;
 }
+
+/* Take the Tx lock, the same way bba_tx() does. Returns nonzero if we can't
+   get it (inside an interrupt while a thread has it). */
+static int bba_tx_lock(void) {
+    if(irq_inside_int())
+        return sem_trywait(&tx_sema);
+
+    sem_wait(&tx_sema);
+    return 0;
+}
+
+#define bba_tx_unlock() sem_signal(&tx_sema)
+#else
+#define bba_tx_lock()   0
+#define bba_tx_unlock() ((void)0)
 #endif
 
 void bba_lock(void) {
@@ -729,6 +801,10 @@ static void *bba_rx_threadfunc(void *dummy) {
             /* Call the callback to process it */
             eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
 
+            /* Anyone who wants to keep the data has taken a reference */
+            net_pbuf_free(rx_pkt[rxout].pbuf);
+            rx_pkt[rxout].pbuf = NULL;
+
             rxout = (rxout + 1) % MAX_PKTS;
         }
 
@@ -933,7 +1009,7 @@ static int bba_if_start(netif_t *self) {
     sem_init(&bba_rx_sema, 0);
     sem_init(&bba_rx_sema2, 1);
     bba_rx_thread = thd_create(0, bba_rx_threadfunc, 0);
-    bba_rx_thread->prio = 1;
+    thd_set_prio(bba_rx_thread, 1);
     thd_set_label(bba_rx_thread, "BBA-rx-thd");
 
     /* We need something like this to get DHCP to work (since it doesn't
@@ -957,6 +1033,8 @@ static int bba_if_start(netif_t *self) {
 }
 
 static int bba_if_stop(netif_t *self) {
+    int old;
+
     (void)self;
 
     if(!(bba_if.flags & NETIF_RUNNING))
@@ -973,6 +1051,17 @@ static int bba_if_stop(netif_t *self) {
 
     bba_rx_thread = NULL;
 
+    /* Give back the buffers of anything that never got handled */
+    old = irq_disable();
+
+    while(rxout != rxin) {
+        net_pbuf_free(rx_pkt[rxout].pbuf);
+        rx_pkt[rxout].pbuf = NULL;
+        rxout = (rxout + 1) % MAX_PKTS;
+    }
+
+    irq_restore(old);
+
     bba_if.flags &= ~NETIF_RUNNING;
     return 0;
 }
@@ -989,9 +1078,38 @@ static int bba_if_tx(netif_t *self, const uint8 *data, int len, int blocking) {
     return 0;
 }
 
-/* We'll auto-commit for now */
+static int bba_if_tx_sg(netif_t *self, const struct iovec *iov, int iovcnt,
+                        int blocking) {
+    int rv;
+
+    (void)self;
+
+    if(!(bba_if.flags & NETIF_RUNNING))
+        return NETIF_TX_ERROR;
+
+    if(bba_tx_lock())
+        return NETIF_TX_OK;
+
+    rv = bba_tx_queue(iov, iovcnt, blocking);
+    bba_tx_unlock();
+
+    if(rv == BBA_TX_AGAIN)
+        return NETIF_TX_AGAIN;
+    else if(rv != BBA_TX_OK)
+        return NETIF_TX_ERROR;
+
+    return NETIF_TX_OK;
+}
+
+/* Start up anything bba_if_tx_sg() has queued */
 static int bba_if_tx_commit(netif_t *self) {
     (void)self;
+
+    if(bba_tx_lock())
+        return 0;
+
+    bba_tx_flush();
+    bba_tx_unlock();
     return 0;
 }
 
@@ -1013,6 +1131,9 @@ static int bba_if_rx_poll(netif_t *self) {
         /* Call the callback to process it */
         eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
 
+        net_pbuf_free(rx_pkt[rxout].pbuf);
+        rx_pkt[rxout].pbuf = NULL;
+
         rxout = (rxout + 1) % MAX_PKTS;
     }
 
@@ -1155,6 +1276,8 @@ int bba_init(void) {
     bba_if.if_rx_poll = bba_if_rx_poll;
     bba_if.if_set_flags = bba_if_set_flags;
     bba_if.if_set_mc = bba_if_set_mc;
+    bba_if.if_tx_sg = bba_if_tx_sg;
+    bba_if.tx_batch = 0;
 
     /* Attempt to set up our IP address et al from the flashrom */
     bba_set_ispcfg();
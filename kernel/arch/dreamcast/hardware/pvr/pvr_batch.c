@@ -0,0 +1,497 @@
+/* KallistiOS ##version##
+
+   pvr_batch.c
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dc/pvr.h>
+#include "pvr_internal.h"
+
+/*
+
+   Header batching
+
+   When batching is turned on for a list, pvr_list_prim() (and so pvr_prim()
+   in DMA mode) doesn't put things straight into the list's vertex buffer.
+   Instead, each distinct polygon header gets a bucket, and the vertex data
+   that follows a header is copied into a staging buffer and added to that
+   header's bucket. When the list is finished, the buckets are written out
+   sorted by texture and blending state, with each header sent once for all
+   of the strips that use it, rather than once for every strip.
+
+   Translucent polygons have to stay in the order they were given in when
+   the PVR is in presort mode, so that list is sent straight through, and
+   only headers that are the same as the one before them are dropped.
+
+   Anything else in the data, such as a user clip command, and anything
+   written into the buffer some other way (like pvr_list_reserve()), can't be
+   moved around. Everything held back for the list is written out before it.
+
+   Strips mustn't be split up, or have anything else land in the middle of
+   them. Whenever things are written out, the bucket for the header that's in
+   use goes last, so that it's still the one in effect afterwards. If a strip
+   was partway through, the rest of it then goes straight into the buffer
+   behind that, rather than being held back.
+
+*/
+
+#define BATCH_HDRS      256     /* Distinct headers held back at once */
+#define BATCH_RUNS      1024    /* Runs of vertex data held back at once */
+#define BATCH_HASH      512     /* Header hash table size (power of two) */
+
+/* What something sent to the TA is, from the top three bits of its first
+   word */
+#define CMD_TYPE(w)     ((w) & 0xe0000000)
+#define CMD_POLYHDR     0x80000000
+#define CMD_SPRITEHDR   0xa0000000
+#define CMD_VERTEX      0xe0000000
+#define CMD_EOL         0x10000000
+
+typedef struct {
+    uint32  words[8];           /* The header itself */
+    int     head, tail;         /* Runs of vertices that go with it */
+    size_t  bytes;              /* How much vertex data that is */
+} batch_hdr_t;
+
+typedef struct {
+    uint32  off, len;           /* Where it is in the staging buffer */
+    int     next;               /* Next run with the same header, or -1 */
+} batch_run_t;
+
+typedef struct {
+    uint8       *stage;             /* Vertex data held back */
+    size_t      stage_size, stage_used;
+
+    batch_hdr_t hdrs[BATCH_HDRS];   /* Distinct headers, in order of arrival */
+    int         hdr_count;
+    int16       hash[BATCH_HASH];   /* Index in hdrs + 1, or 0 if empty */
+
+    batch_run_t runs[BATCH_RUNS];
+    int         run_count;
+
+    int         cur;                /* Header the next vertices go with */
+    size_t      vsize;              /* Size of the vertices that go with it */
+    size_t      voff;               /* How far into a vertex we are */
+    int         open;               /* A strip has been started, not ended */
+    int         direct;             /* The rest of the strip goes straight in */
+
+    uint32      last[8];            /* Last header written to the buffer */
+    int         last_valid;
+} batch_t;
+
+static batch_t *batches[PVR_OPB_COUNT];
+
+/* Header bytes dropped so far this frame */
+static int32 bytes_saved;
+
+/* Translucent polygons have to keep their order in presort mode. */
+static inline int batch_ordered(pvr_list_t list) {
+    return list == PVR_LIST_TR_POLY && pvr_state.presort;
+}
+
+static inline unsigned int batch_hash(const uint32 *hdr) {
+    uint32 h = hdr[0] ^ (hdr[1] * 3) ^ (hdr[2] * 5) ^ (hdr[3] * 7);
+
+    h ^= hdr[4] ^ hdr[5] ^ hdr[6] ^ hdr[7];
+    h ^= h >> 16;
+    h ^= h >> 7;
+
+    return h & (BATCH_HASH - 1);
+}
+
+/* How big the vertices that follow a header are. Sprites, and textured
+   polygons with floating point colours or two volumes, take 64 bytes. */
+static size_t batch_vsize(const uint32 *hdr) {
+    const uint32 vol = PVR_TA_CMD_MODIFIER_MASK | PVR_TA_CMD_MODIFIERMODE_MASK;
+    uint32 cmd = hdr[0];
+
+    if(CMD_TYPE(cmd) == CMD_SPRITEHDR)
+        return 64;
+
+    if(cmd & 8) {
+        if(((cmd & PVR_TA_CMD_CLRFMT_MASK) >> PVR_TA_CMD_CLRFMT_SHIFT) ==
+           PVR_CLRFMT_4FLOATS || (cmd & vol) == vol)
+            return 64;
+    }
+
+    return 32;
+}
+
+/* Keep track of whether we're partway through a strip (or a vertex). */
+static void batch_track(batch_t *b, const uint32 *d, size_t size) {
+    for(; size; size -= 32, d += 8) {
+        if(!b->voff)
+            b->open = !(d[0] & CMD_EOL);
+
+        b->voff = (b->voff + 32) % b->vsize;
+    }
+}
+
+static inline int batch_in_strip(const batch_t *b) {
+    return b->open || b->voff;
+}
+
+/* Find the bucket for a header, or make a new one. Returns -1 if there's no
+   room for another. */
+static int batch_find(batch_t *b, const uint32 *hdr) {
+    unsigned int i = batch_hash(hdr);
+    int h;
+
+    while((h = b->hash[i]) != 0) {
+        if(!memcmp(b->hdrs[h - 1].words, hdr, 32))
+            return h - 1;
+
+        i = (i + 1) & (BATCH_HASH - 1);
+    }
+
+    if(b->hdr_count == BATCH_HDRS)
+        return -1;
+
+    h = b->hdr_count++;
+    memcpy(b->hdrs[h].words, hdr, 32);
+    b->hdrs[h].head = b->hdrs[h].tail = -1;
+    b->hdrs[h].bytes = 0;
+    b->hash[i] = h + 1;
+
+    return h;
+}
+
+static void batch_reset(batch_t *b) {
+    memset(b->hash, 0, sizeof(b->hash));
+    b->hdr_count = 0;
+    b->run_count = 0;
+    b->stage_used = 0;
+    b->cur = -1;
+}
+
+/* Write a header to the list's buffer, unless it's the one that's already in
+   effect there. */
+static int batch_write_hdr(pvr_list_t list, batch_t *b, const uint32 *hdr) {
+    if(b->last_valid && !memcmp(b->last, hdr, 32))
+        return 0;
+
+    if(pvr_list_write(list, hdr, 32) < 0)
+        return -1;
+
+    memcpy(b->last, hdr, 32);
+    b->last_valid = 1;
+    bytes_saved -= 32;
+
+    return 0;
+}
+
+static int batch_write_runs(pvr_list_t list, batch_t *b, int r) {
+    for(; r != -1; r = b->runs[r].next) {
+        if(pvr_list_write(list, b->stage + b->runs[r].off,
+                          b->runs[r].len) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* qsort() doesn't let us pass this along. */
+static batch_t *sorting;
+
+/* Put headers for the same texture together, then the same blending. */
+static int batch_cmp(const void *a, const void *b) {
+    static const int order[8] = { 3, 2, 0, 1, 4, 5, 6, 7 };
+    const uint32 *ha = sorting->hdrs[*(const int16 *)a].words;
+    const uint32 *hb = sorting->hdrs[*(const int16 *)b].words;
+    int i;
+
+    for(i = 0; i < 8; i++) {
+        if(ha[order[i]] != hb[order[i]])
+            return ha[order[i]] < hb[order[i]] ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static int batch_write_bucket(pvr_list_t list, batch_t *b, int h) {
+    /* A header with nothing drawn with it doesn't need to go at all. */
+    if(!b->hdrs[h].bytes)
+        return 0;
+
+    if(batch_write_hdr(list, b, b->hdrs[h].words) < 0)
+        return -1;
+
+    return batch_write_runs(list, b, b->hdrs[h].head);
+}
+
+/* Write out everything that's been held back for the list. The header that's
+   in use at the moment goes last, so that it's the one left in effect, and it
+   carries on into the next batch. */
+static int batch_emit(pvr_list_t list, batch_t *b) {
+    int16 order[BATCH_HDRS];
+    uint32 cur[8];
+    int i, n = 0, rv = 0, had_cur = b->cur != -1;
+
+    if(had_cur)
+        memcpy(cur, b->hdrs[b->cur].words, 32);
+
+    for(i = 0; i < b->hdr_count; i++) {
+        if(i != b->cur)
+            order[n++] = i;
+    }
+
+    sorting = b;
+    qsort(order, n, sizeof(int16), batch_cmp);
+
+    for(i = 0; i < n && rv >= 0; i++) {
+        if(batch_write_bucket(list, b, order[i]) < 0)
+            rv = -1;
+    }
+
+    if(had_cur && rv >= 0 && batch_write_bucket(list, b, b->cur) < 0)
+        rv = -1;
+
+    batch_reset(b);
+
+    if(had_cur)
+        b->cur = batch_find(b, cur);
+
+    /* If that stopped partway through a strip, the rest of it has to follow
+       on straight after. */
+    b->direct = batch_in_strip(b);
+
+    return rv;
+}
+
+/* Hold on to some vertex data, to go with the current header. */
+static void batch_stage(batch_t *b, const void *data, size_t size) {
+    batch_hdr_t *hdr = &b->hdrs[b->cur];
+    batch_run_t *run;
+    int *head = &hdr->head, *tail = &hdr->tail;
+
+    memcpy(b->stage + b->stage_used, data, size);
+    hdr->bytes += size;
+
+    /* Carry on with the last run if this comes straight after it. */
+    run = *tail != -1 ? &b->runs[*tail] : NULL;
+
+    if(run && *tail == b->run_count - 1 &&
+       run->off + run->len == b->stage_used) {
+        run->len += size;
+    }
+    else {
+        run = &b->runs[b->run_count];
+        run->off = b->stage_used;
+        run->len = size;
+        run->next = -1;
+
+        if(*tail != -1)
+            b->runs[*tail].next = b->run_count;
+        else
+            *head = b->run_count;
+
+        *tail = b->run_count++;
+    }
+
+    b->stage_used += size;
+}
+
+/* Take some vertex data for the current header. */
+static int batch_vertices(pvr_list_t list, batch_t *b, const uint32 *d,
+                          size_t size) {
+    int rv = 0, direct;
+
+    /* If there's no more room, everything has to go out now. */
+    if(!b->direct && b->cur != -1 &&
+       (b->stage_used + size > b->stage_size || b->run_count == BATCH_RUNS))
+        rv = batch_emit(list, b);
+
+    /* With no header to go with, there's nothing to batch it up with. Past
+       that, the rest of a strip that has already been started in the buffer
+       has to follow it straight in, and so does anything that could never fit
+       in the vertex buffer anyway. */
+    direct = b->direct || b->cur == -1 || size > b->stage_size;
+
+    if(rv >= 0) {
+        if(!direct)
+            batch_stage(b, d, size);
+        else if(b->direct || b->cur == -1)
+            rv = pvr_list_write(list, d, size);
+        else if((rv = batch_write_hdr(list, b, b->hdrs[b->cur].words)) >= 0)
+            rv = pvr_list_write(list, d, size);
+    }
+
+    batch_track(b, d, size);
+    b->direct = direct && batch_in_strip(b);
+
+    return rv < 0 ? -1 : 0;
+}
+
+int pvr_batch_prim(pvr_list_t list, const void *data, size_t size) {
+    batch_t *b = batches[list];
+    const uint32 *d = (const uint32 *)data;
+    uint32 cmd;
+
+    assert(b);
+    assert(!(size & 31));
+
+    /* The second half of a 64-byte vertex can start with anything at all, so
+       don't go by what it looks like. */
+    cmd = b->voff ? CMD_VERTEX : CMD_TYPE(d[0]);
+
+    /* Polygon and sprite headers. Anything after the header in the same call
+       is taken to be vertex data. */
+    if(cmd == CMD_POLYHDR || cmd == CMD_SPRITEHDR) {
+        bytes_saved += 32;
+
+        /* A header always starts things over. */
+        b->vsize = batch_vsize(d);
+        b->voff = 0;
+        b->open = 0;
+        b->direct = 0;
+
+        if(batch_ordered(list)) {
+            if(batch_write_hdr(list, b, d) < 0)
+                return -1;
+        }
+        else if((b->cur = batch_find(b, d)) < 0) {
+            if(batch_emit(list, b) < 0)
+                return -1;
+
+            b->cur = batch_find(b, d);
+        }
+
+        d += 8;
+        size -= 32;
+
+        if(!size)
+            return 0;
+    }
+    else if(cmd != CMD_VERTEX) {
+        /* Some other command. That has to stay where it is, and might change
+           what the TA makes of the next header. */
+        if(batch_emit(list, b) < 0)
+            return -1;
+
+        b->last_valid = 0;
+
+        return pvr_list_write(list, data, size);
+    }
+
+    if(batch_ordered(list)) {
+        batch_track(b, d, size);
+        return pvr_list_write(list, d, size);
+    }
+
+    return batch_vertices(list, b, d, size);
+}
+
+int pvr_batch_flush(pvr_list_t list) {
+    batch_t *b = batches[list];
+    int rv;
+
+    assert(b);
+
+    rv = batch_emit(list, b);
+
+    /* Whatever comes next might not go through here, so the header has to be
+       sent again before anything else is drawn with it. The header itself is
+       kept, though, since more vertices for it can still come after this. */
+    b->last_valid = 0;
+
+    return rv;
+}
+
+static void batch_restart(batch_t *b) {
+    batch_reset(b);
+    b->vsize = 32;
+    b->voff = 0;
+    b->open = 0;
+    b->direct = 0;
+    b->last_valid = 0;
+}
+
+void pvr_batch_frame(void) {
+    int i;
+
+    pvr_state.hdr_bytes_saved = bytes_saved > 0 ? bytes_saved : 0;
+    bytes_saved = 0;
+
+    /* Everything has been written out by now; the next frame starts from
+       nothing. */
+    for(i = 0; i < PVR_OPB_COUNT; i++) {
+        if(batches[i])
+            batch_restart(batches[i]);
+    }
+}
+
+int pvr_list_set_batching(pvr_list_t list, int enable) {
+    batch_t *b;
+    size_t size;
+
+    if(list != PVR_LIST_OP_POLY && list != PVR_LIST_TR_POLY &&
+       list != PVR_LIST_PT_POLY) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!enable) {
+        if((b = batches[list])) {
+            if(pvr_state.lists_batched & (1 << list))
+                pvr_batch_flush(list);
+
+            pvr_state.lists_batched &= ~(1 << list);
+            batches[list] = NULL;
+            free(b->stage);
+            free(b);
+        }
+
+        return 0;
+    }
+
+    if(batches[list]) {
+        pvr_state.lists_batched |= 1 << list;
+        return 0;
+    }
+
+    /* Only lists that are put together in RAM can be batched. */
+    size = pvr_state.dma_buffers[0].size[list];
+
+    if(!pvr_state.dma_mode || !size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(b = (batch_t *)malloc(sizeof(batch_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(!(b->stage = (uint8 *)malloc(size))) {
+        free(b);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    b->stage_size = size;
+    batch_restart(b);
+
+    batches[list] = b;
+    pvr_state.lists_batched |= 1 << list;
+
+    return 0;
+}
+
+void pvr_batch_shutdown(void) {
+    int i;
+
+    for(i = 0; i < PVR_OPB_COUNT; i++) {
+        if(batches[i]) {
+            free(batches[i]->stage);
+            free(batches[i]);
+            batches[i] = NULL;
+        }
+    }
+
+    pvr_state.lists_batched = 0;
+    bytes_saved = 0;
+}
@@ -133,6 +133,7 @@ void pvr_init_tile_matrices(int presort) {
 }
 
 void pvr_set_presort_mode(int presort) {
+    pvr_state.presort = !!presort;
     pvr_init_tile_matrix(pvr_state.ta_target, presort);
 }
 
@@ -93,7 +93,8 @@ int pvr_init(pvr_init_params_t *params) {
     pvr_allocate_buffers(params);
 
     // Initialize tile matrices
-    pvr_init_tile_matrices(!!params->autosort_disabled);
+    pvr_state.presort = !!params->autosort_disabled;
+    pvr_init_tile_matrices(pvr_state.presort);
 
     // Setup all pipeline targets. Yes, this is redundant. :) I just
     // like to have it explicit.
@@ -102,6 +103,7 @@ int pvr_init(pvr_init_params_t *params) {
     pvr_state.view_target = 0;
 
     pvr_state.list_reg_open = -1;
+    pvr_state.list_flushing = -1;
 
     // Sync all the hardware registers with our pipeline state.
     pvr_sync_view();
@@ -217,6 +219,12 @@ int pvr_shutdown(void) {
     if(!pvr_state.valid)
         return -1;
 
+    /* Drop everything from the texture cache, once it's done uploading */
+    pvr_txr_cache_shutdown();
+
+    /* Free the header batching buffers */
+    pvr_batch_shutdown();
+
     /* Set us invalid */
     pvr_state.valid = 0;
 
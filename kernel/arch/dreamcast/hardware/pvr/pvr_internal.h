@@ -109,6 +109,16 @@
    or ISP/TSP phases to take longer than one frame, they are allowed to expand
    into the next slot gracefully.
 
+   The program can also cut the SH4-to-RAM and DMA-to-TA stages short for a
+   list with pvr_list_flush(). Once the TA is done with the previous frame
+   (that is, once it has started rendering), whatever has been written so far
+   is DMAed to the TA straight away, and the program carries on writing into
+   another part of the same RAM buffer while it goes. Only one list can be in
+   the TA at once, so flushing another list ends the first one for the frame.
+   The DMA at the end of the frame starts with the rest of the list that was
+   being flushed, skips the lists that have been ended, and the render isn't
+   started until it is done.
+
  */
 
 /* Note that these must match the list types in pvr.h; these are here
@@ -134,6 +144,8 @@ typedef struct {
     uint8   * base[PVR_OPB_COUNT];  // DMA buffers, if assigned
     uint32  ptr[PVR_OPB_COUNT];     // DMA buffer write pointer, if used
     uint32  size[PVR_OPB_COUNT];    // DMA buffer sizes, or zero if none
+    uint32  start[PVR_OPB_COUNT];   // Start of the data not sent to the TA yet
+    uint32  end[PVR_OPB_COUNT];     // End of the space free to write into
     int ready;                      // >0 if these buffers are ready to be DMAed
 } pvr_dma_buffers_t;
 
@@ -154,6 +166,8 @@ typedef struct {
     uint32  list_reg_mask;              // Active lists register mask
     int     dma_mode;                   // 1 if we are using DMA to transfer vertices
     int     opb_size[PVR_OPB_COUNT];    // opb size flags
+    int     presort;                    // 1 if translucent polygons are presorted
+    uint32  lists_batched;              // (1 << idx) for each list with header batching on
 
     // Pipeline state
     int     ram_target;                 // RAM buffer we're writing into
@@ -167,6 +181,10 @@ typedef struct {
     uint32  lists_closed;               // (1 << idx) for each list which the SH4 has lost interest in
     uint32  lists_transferred;          // (1 << idx) for each list which has completely transferred to the TA
     uint32  lists_dmaed;                // (1 << idx) for each list which has been DMA'd (DMA mode only)
+    uint32  lists_flushed;              // (1 << idx) for each list which was sent in full by pvr_list_flush()
+    int     list_flushing;              // Which list pvr_list_flush() is partway through sending, if any?
+    int     ta_flushing;                // >0 if pvr_list_flush() has started sending this frame to the TA
+    int     flush_busy;                 // >0 if a pvr_list_flush() DMA is in progress
 
     mutex_t dma_lock;                   // Locked if a DMA is in progress (vertex or texture)
     int     ta_busy;                    // >0 if a DMA is in progress and the TA hasn't signaled completion
@@ -203,6 +221,7 @@ typedef struct {
     size_t   frame_count;                // Total number of viewed frames
     size_t   vtx_buf_used;               // Vertex buffer used size for the last frame
     size_t   vtx_buf_used_max;           // Maximum used vertex buffer size
+    size_t   hdr_bytes_saved;            // Header bytes dropped by batching in the last frame
 
     /* Wait-ready semaphore: this will be signaled whenever the pvr_wait_ready()
        call should be ready to return. */
@@ -290,6 +309,40 @@ void pvr_blank_polyhdr(int type);
 void pvr_blank_polyhdr_buf(int type, pvr_poly_hdr_t * buf);
 
 
+/**** pvr_scene.c *****************************************************/
+
+/* Copy data into a list's vertex buffer, leaving batching out of it */
+int pvr_list_write(pvr_list_t list, const void *data, size_t size);
+
+
+/**** pvr_batch.c *****************************************************/
+
+/* Take data for a list that has batching turned on */
+int pvr_batch_prim(pvr_list_t list, const void *data, size_t size);
+
+/* Write out everything that has been held back for a list */
+int pvr_batch_flush(pvr_list_t list);
+
+/* Finish off the statistics for a frame */
+void pvr_batch_frame(void);
+
+/* Turn off batching and free everything it uses */
+void pvr_batch_shutdown(void);
+
+
+/**** pvr_txr_cache.c *************************************************/
+
+/* Set once any textures have been given to the texture cache */
+extern int pvr_txr_cache_active;
+
+/* Mark the cached texture at the given address (if there is one) as used in
+   the current frame */
+void pvr_txr_cache_touch(pvr_ptr_t addr);
+
+/* Start a new frame of texture cache use and statistics */
+void pvr_txr_cache_frame(void);
+
+
 /**** pvr_irq.c *******************************************************/
 
 /* Interrupt handler for PVR events */
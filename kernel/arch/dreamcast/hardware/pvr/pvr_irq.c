@@ -9,6 +9,7 @@
 #include <dc/pvr.h>
 #include <dc/asic.h>
 #include <arch/cache.h>
+#include <kos/genwait.h>
 #include "pvr_internal.h"
 
 #ifdef PVR_RENDER_DBG
@@ -27,16 +28,23 @@
 // Find the next list to DMA out. If we have none left to do, then do
 // nothing. Otherwise, start the DMA and chain back to us upon completion.
 static void dma_next_list(void *data) {
-    int i, did = 0;
+    int i, n, did = 0;
     volatile pvr_dma_buffers_t * b;
 
     (void)data;
 
     // DBG(("dma_next_list\n"));
 
-    for(i = 0; i < PVR_OPB_COUNT; i++) {
+    for(n = 0; n < PVR_OPB_COUNT; n++) {
+        // If pvr_list_flush() left a list partway into the TA, then that
+        // one has to be finished off before anything else can go in.
+        i = pvr_state.list_flushing;
+
+        if(i < 0 || (pvr_state.lists_dmaed & (1 << i)))
+            i = n;
+
         if((pvr_state.lists_enabled & (1 << i))
-                && !(pvr_state.lists_dmaed & (1 << i))) {
+                && !((pvr_state.lists_dmaed | pvr_state.lists_flushed) & (1 << i))) {
             // Get the buffers for this frame.
             b = pvr_state.dma_buffers + (pvr_state.ram_target ^ 1);
 
@@ -52,7 +60,8 @@ static void dma_next_list(void *data) {
 
             // Flush the last 32 bytes out of dcache, just in case.
             // dcache_flush_range((ptr_t)(b->base[i] + b->ptr[i] - 32), 32);
-            dcache_flush_range((ptr_t)(b->base[i]), b->ptr[i] + 32);
+            dcache_flush_range((ptr_t)(b->base[i] + b->start[i]),
+                               b->ptr[i] - b->start[i] + 32);
             //amt = b->ptr[i] > 16384 ? 16384 : b->ptr[i];
             //dcache_flush_range((ptr_t)(b->base[i] + b->ptr[i] - amt), amt);
 
@@ -60,7 +69,8 @@ static void dma_next_list(void *data) {
             //DBG(("dma_begin(buf %d, list %d, base %p, len %d)\n",
             //  pvr_state.ram_target ^ 1, i,
             //  b->base[i], b->ptr[i]));
-            pvr_dma_load_ta(b->base[i], b->ptr[i], 0, dma_next_list, 0);
+            pvr_dma_load_ta(b->base[i] + b->start[i], b->ptr[i] - b->start[i],
+                            0, dma_next_list, 0);
 
             // Mark this list as done, and break out for now.
             pvr_state.lists_dmaed |= 1 << i;
@@ -78,6 +88,11 @@ static void dma_next_list(void *data) {
         mutex_unlock((mutex_t *)&pvr_state.dma_lock);
         pvr_state.lists_dmaed = 0;
 
+        // Anything sent early by pvr_list_flush() is done with too.
+        pvr_state.lists_flushed = 0;
+        pvr_state.list_flushing = -1;
+        pvr_state.ta_flushing = 0;
+
         // Buffers are now empty again
         pvr_state.dma_buffers[pvr_state.ram_target ^ 1].ready = 0;
 
@@ -199,8 +214,10 @@ void pvr_int_handler(uint32 code, void *data) {
     }
 
     // If all lists are fully transferred and a render is not in progress,
-    // we are ready to start rendering.
+    // we are ready to start rendering. If pvr_list_flush() has been sending
+    // the next frame early, hold off until the rest of it has gone too.
     if(!pvr_state.render_busy
+            && !pvr_state.ta_flushing
             && pvr_state.lists_transferred == pvr_state.lists_enabled) {
         /* XXX Note:
            For some reason, the render must be started _before_ we sync
@@ -232,6 +249,7 @@ void pvr_int_handler(uint32 code, void *data) {
 
         // The TA is no longer busy.
         pvr_state.ta_busy = 0;
+        genwait_wake_all((void *)&pvr_state.ta_busy);
     }
 
     // If we're in DMA mode, the DMA source buffers are ready, and a DMA
@@ -6,202 +6,758 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
 #include <dc/pvr.h>
+#include <arch/cache.h>
+#include <kos/mutex.h>
 #include "pvr_internal.h"
-#include <stdio.h>
-
-#include <malloc.h> /* For the struct mallinfo defs */
 
 #include <kos/opts.h>
 
-/*
+#ifdef PVR_KM_DBG
+#include <kos/thread.h>
+#include <arch/arch.h>
+#endif
 
-This module basically serves as a KOS-friendly front end and support routines
-for the pvr_mem_core module, which is a dlmalloc-derived malloc for use with
-the PVR memory pool.
+/*
 
-I was originally going to make a totally separate thing that could be used
-to generically manage any memory pool, but then I realized what a gruelling
-and thankless task that would be when starting with dlmalloc, so we have this
-instead. ^_^;
+This module manages the texture RAM pool, which is whatever VRAM is left over
+once the TA/ISP buffers have been set up.
+
+It's a TLSF ("two-level segregated fit") allocator. Free blocks are kept in
+lists by size: the first level splits sizes up by powers of two, and each of
+those is split into 16 more evenly sized lists. A bitmap for each level says
+which lists have anything in them, so finding a block that's big enough, and
+putting one back, both take a fixed amount of time, and the leftovers of a
+block are always split off and merged back with their neighbours straight
+away.
+
+Unlike a general purpose malloc, the bookkeeping lives in main RAM rather
+than in headers in front of each block. Touching VRAM from the SH4 is slow,
+and it means blocks come out packed one after another with nothing in
+between. It also means a block can be moved without anything in VRAM having
+to be fixed up, which is what the handle interface is for: blocks allocated
+with pvr_mem_halloc() can be slid down over the free space below them by
+pvr_mem_compact(), and are found again through their handle.
+
+Offsets in here are all from the start of VRAM, as seen through the 64-bit
+area, which is where textures live. Blocks for use through the 32-bit area
+come from the same pool; see pvr_mem_malloc32().
 
 */
 
-/* Bring in some prototypes from pvr_mem_core.c */
-/* We can't directly include its header because of name clashes with
-   the real malloc header */
-extern void * pvr_int_malloc(size_t bytes);
-extern void pvr_int_free(void *ptr);
-extern struct mallinfo pvr_int_mallinfo();
-extern void pvr_int_mem_reset();
-extern void pvr_int_malloc_stats();
+/* Everything is handed out in multiples of this (and aligned to it). */
+#define ALIGN_SHIFT     5
+#define ALIGN_SIZE      (1 << ALIGN_SHIFT)
+
+/* Number of second level lists for each first level one (as a power of 2) */
+#define SL_SHIFT        4
+#define SL_COUNT        (1 << SL_SHIFT)
+
+/* Sizes below this all go in the first first-level list, which is split up
+   by ALIGN_SIZE steps. Everything above goes by powers of two, up to 8MB. */
+#define FL_SHIFT        (ALIGN_SHIFT + SL_SHIFT)
+#define FL_COUNT        (23 - FL_SHIFT + 2)
+
+/* Block flags */
+#define BLOCK_FREE      0x01    /* Block is in the free lists */
+#define BLOCK_HANDLE    0x02    /* Block was allocated with pvr_mem_halloc() */
+#define BLOCK_32BIT     0x04    /* Block was allocated with pvr_mem_malloc32() */
+
+/* A block of VRAM, either free or in use. These are kept in address order
+   in one list, and free ones are also in the list for their size. Used ones
+   that were allocated by address are in a hash table instead, so that
+   pvr_mem_free() can find them. */
+struct pvr_mem_block {
+    uint32                  offset;     /* Start of the block in VRAM */
+    uint32                  size;       /* Size of the block, in bytes */
+    uint32                  flags;
+    struct pvr_mem_block    *prev_phys;
+    struct pvr_mem_block    *next_phys;
+    struct pvr_mem_block    *next;      /* Next free block, or hash chain */
+    struct pvr_mem_block    *prev;      /* Previous free block */
+#ifdef PVR_KM_DBG
+    tid_t                   thread;     /* Who allocated it, and from where */
+    uint32                  addr;
+#endif
+};
 
+/* Block descriptors are allocated this many at a time. */
+#define BLOCK_CHUNK     64
 
-#ifdef PVR_KM_DBG
+struct block_chunk {
+    struct block_chunk      *next;
+    struct pvr_mem_block    blocks[BLOCK_CHUNK];
+};
 
-#include <kos/thread.h>
-#include <arch/arch.h>
+/* Hash table of used blocks, by offset */
+#define HASH_BITS       8
+#define HASH_SIZE       (1 << HASH_BITS)
+#define HASH(off)       ((((off) >> ALIGN_SHIFT) * 2654435761u) >> (32 - HASH_BITS))
+
+/* How much pvr_mem_compact() moves at a time */
+#define MOVE_CHUNK      16384
 
-/* List of allocated memory blocks for leak checking */
-typedef struct memctl {
-    uint32          size;
-    tid_t           thread;
-    uint32          addr;
-    pvr_ptr_t       block;
-    LIST_ENTRY(memctl)  list;
-} memctl_t;
+static struct pvr_mem_block *free_lists[FL_COUNT][SL_COUNT];
+static uint32 fl_bitmap;
+static uint32 sl_bitmap[FL_COUNT];
 
-static LIST_HEAD(memctl_list, memctl) block_list;
+static struct pvr_mem_block *used_hash[HASH_SIZE];
 
-#endif  /* PVR_KM_DBG */
+static struct pvr_mem_block *first_block;
+static struct pvr_mem_block *spare_blocks;
+static struct block_chunk *chunks;
 
+static mutex_t pvr_mem_mutex = MUTEX_INITIALIZER;
+
+/* Size of the pool; zero is considered invalid */
+static uint32 pool_size;
+static uint32 pool_used;
+static pvr_mem_stats_t stats;
 
-/* PVR RAM base; NULL is considered invalid */
-static pvr_ptr_t pvr_mem_base = NULL;
 #define CHECK_MEM_BASE \
-    assert_msg(pvr_mem_base != NULL, \
+    assert_msg(pool_size != 0, \
                "pvr_mem_* used, but PVR hasn't been initialized yet")
 
-/* Used in pvr_mem_core.c */
-void * pvr_int_sbrk(size_t amt) {
-    uint32 old, n;
+static inline int fls32(uint32 x) {
+    return 31 - __builtin_clz(x);
+}
+
+static inline int ffs32(uint32 x) {
+    return __builtin_ctz(x);
+}
+
+/* Which size class (for the stats) does a block go in? */
+static inline int size_class(uint32 size) {
+    return fls32(size - 1) - (ALIGN_SHIFT - 1);
+}
+
+/* Work out which free list a block of the given size goes in. */
+static void mapping_insert(uint32 size, int *fl, int *sl) {
+    int t;
+
+    if(size < (1 << FL_SHIFT)) {
+        *fl = 0;
+        *sl = size >> ALIGN_SHIFT;
+    }
+    else {
+        t = fls32(size);
+        *sl = (size >> (t - SL_SHIFT)) ^ SL_COUNT;
+        *fl = t - FL_SHIFT + 1;
+    }
+}
+
+/* Work out the first free list where every block is at least the given
+   size, so whatever is at the head of it will do. */
+static void mapping_search(uint32 size, int *fl, int *sl) {
+    if(size >= (1 << FL_SHIFT))
+        size += (1 << (fls32(size) - SL_SHIFT)) - 1;
+
+    mapping_insert(size, fl, sl);
+}
+
+static struct pvr_mem_block *block_new(void) {
+    struct pvr_mem_block *b;
+    struct block_chunk *c;
+    int i;
+
+    if(!spare_blocks) {
+        if(!(c = (struct block_chunk *)malloc(sizeof(struct block_chunk))))
+            return NULL;
+
+        c->next = chunks;
+        chunks = c;
+
+        for(i = 0; i < BLOCK_CHUNK; i++) {
+            c->blocks[i].next = spare_blocks;
+            spare_blocks = c->blocks + i;
+        }
+    }
+
+    b = spare_blocks;
+    spare_blocks = b->next;
+    memset(b, 0, sizeof(struct pvr_mem_block));
+
+    return b;
+}
+
+static void block_release(struct pvr_mem_block *b) {
+    b->next = spare_blocks;
+    spare_blocks = b;
+}
+
+static void free_insert(struct pvr_mem_block *b) {
+    int fl, sl;
+
+    mapping_insert(b->size, &fl, &sl);
+
+    b->flags = BLOCK_FREE;
+    b->prev = NULL;
+    b->next = free_lists[fl][sl];
+
+    if(b->next)
+        b->next->prev = b;
+
+    free_lists[fl][sl] = b;
+    fl_bitmap |= 1 << fl;
+    sl_bitmap[fl] |= 1 << sl;
+    stats.free_blocks++;
+}
+
+static void free_remove(struct pvr_mem_block *b) {
+    int fl, sl;
+
+    mapping_insert(b->size, &fl, &sl);
+
+    if(b->next)
+        b->next->prev = b->prev;
+
+    if(b->prev)
+        b->prev->next = b->next;
+    else {
+        free_lists[fl][sl] = b->next;
+
+        if(!b->next) {
+            sl_bitmap[fl] &= ~(1 << sl);
+
+            if(!sl_bitmap[fl])
+                fl_bitmap &= ~(1 << fl);
+        }
+    }
+
+    b->flags = 0;
+    stats.free_blocks--;
+}
+
+/* Find a free block that's at least the given size and take it out of the
+   free lists. */
+static struct pvr_mem_block *free_find(uint32 size) {
+    struct pvr_mem_block *b;
+    uint32 map;
+    int fl, sl;
+
+    mapping_search(size, &fl, &sl);
+
+    if(fl >= FL_COUNT)
+        return NULL;
+
+    map = sl_bitmap[fl] & (~0U << sl);
+
+    if(!map) {
+        map = fl_bitmap & (~0U << (fl + 1));
+
+        if(!map)
+            return NULL;
+
+        fl = ffs32(map);
+        map = sl_bitmap[fl];
+    }
+
+    sl = ffs32(map);
+    b = free_lists[fl][sl];
+    free_remove(b);
+
+    return b;
+}
+
+/* Take a block out of the address list and merge it into the one before. */
+static void phys_merge(struct pvr_mem_block *prev, struct pvr_mem_block *b) {
+    prev->size += b->size;
+    prev->next_phys = b->next_phys;
+
+    if(b->next_phys)
+        b->next_phys->prev_phys = prev;
+
+    block_release(b);
+}
+
+/* Split whatever is past the given size off of a block, and free it. */
+static void block_trim(struct pvr_mem_block *b, uint32 size) {
+    struct pvr_mem_block *r;
+
+    if(b->size - size < ALIGN_SIZE)
+        return;
+
+    /* If we can't get a descriptor for the rest, just leave it on. */
+    if(!(r = block_new()))
+        return;
+
+    r->offset = b->offset + size;
+    r->size = b->size - size;
+    r->prev_phys = b;
+    r->next_phys = b->next_phys;
+
+    if(r->next_phys)
+        r->next_phys->prev_phys = r;
+
+    b->next_phys = r;
+    b->size = size;
+
+    free_insert(r);
+}
+
+static void hash_insert(struct pvr_mem_block *b) {
+    uint32 h = HASH(b->offset);
+
+    b->next = used_hash[h];
+    used_hash[h] = b;
+}
+
+static struct pvr_mem_block *hash_remove(uint32 offset) {
+    struct pvr_mem_block *b, **p;
+
+    for(p = used_hash + HASH(offset); (b = *p) != NULL; p = &b->next) {
+        if(b->offset == offset) {
+            *p = b->next;
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+static struct pvr_mem_block *block_alloc(size_t size, uint32 flags) {
+    struct pvr_mem_block *b;
+    int c;
 
-    /* Are we valid? */
     CHECK_MEM_BASE;
 
-    /* Try to increment it */
-    old = (uint32)pvr_mem_base;
-    n = old + amt;
+    if(size > pool_size) {
+        stats.alloc_fails++;
+        return NULL;
+    }
+
+    /* Round everything up to the alignment; a 0 byte request still gets a
+       block, as with malloc(). */
+    size = (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+
+    if(!size)
+        size = ALIGN_SIZE;
+
+    if(!(b = free_find(size))) {
+        stats.alloc_fails++;
+        return NULL;
+    }
+
+    block_trim(b, size);
+    b->flags = flags;
+
+    if(!(flags & BLOCK_HANDLE))
+        hash_insert(b);
+
+    pool_used += b->size;
+
+    if(pool_used > stats.used_max)
+        stats.used_max = pool_used;
+
+    c = size_class(b->size);
+    stats.class_count[c]++;
+    stats.class_bytes[c] += b->size;
+    stats.class_allocs[c]++;
 
-    /* Did we run over? */
-    if(n > PVR_RAM_INT_TOP)
-        return (void *) - 1;
+    return b;
+}
+
+static void block_free(struct pvr_mem_block *b) {
+    struct pvr_mem_block *n;
+    int c;
+
+    pool_used -= b->size;
+
+    c = size_class(b->size);
+    stats.class_count[c]--;
+    stats.class_bytes[c] -= b->size;
 
-    /* Nope, everything's cool */
-    pvr_mem_base = (pvr_ptr_t)n;
-    return (pvr_ptr_t)old;
+    /* Merge it with its neighbours, if they're free too. */
+    if(b->prev_phys && (b->prev_phys->flags & BLOCK_FREE)) {
+        n = b->prev_phys;
+        free_remove(n);
+        phys_merge(n, b);
+        b = n;
+    }
+
+    if(b->next_phys && (b->next_phys->flags & BLOCK_FREE)) {
+        n = b->next_phys;
+        free_remove(n);
+        phys_merge(b, n);
+    }
+
+    free_insert(b);
 }
 
 /* Allocate a chunk of memory from texture space; the returned value
-   will be relative to the base of texture memory (zero-based) */
+   will be a pointer into the 64-bit VRAM area */
 pvr_ptr_t pvr_mem_malloc(size_t size) {
-    uint32 rv32;
+    struct pvr_mem_block *b;
 #ifdef PVR_KM_DBG
-    uint32      ra = arch_get_ret_addr();
-    memctl_t    * ctl;
-#endif  /* PVR_KM_DBG */
-
-    CHECK_MEM_BASE;
+    uint32 ra = arch_get_ret_addr();
+#endif
 
-    rv32 = (uint32)pvr_int_malloc(size);
-    assert_msg((rv32 & 0x1f) == 0,
-               "dlmalloc's alignment is broken; "
-               "please make a bug report");
+    mutex_lock(&pvr_mem_mutex);
+    b = block_alloc(size, 0);
 
 #ifdef PVR_KM_DBG
-    ctl = malloc(sizeof(memctl_t));
-    ctl->size = size;
-    ctl->thread = thd_current->tid;
-    ctl->addr = ra;
-    ctl->block = (pvr_ptr_t)rv32;
-    LIST_INSERT_HEAD(&block_list, ctl, list);
-#endif  /* PVR_KM_DBG */
+    if(b) {
+        b->thread = thd_current->tid;
+        b->addr = ra;
+    }
+#endif
+
+    mutex_unlock(&pvr_mem_mutex);
+
+    if(!b)
+        return NULL;
 
 #ifdef PVR_KM_DBG_VERBOSE
     printf("Thread %d/%08lx allocated %lu bytes at %08lx\n",
-           ctl->thread, ctl->addr, ctl->size, rv32);
+           b->thread, b->addr, b->size, PVR_RAM_INT_BASE + b->offset);
 #endif
 
-    return (pvr_ptr_t)rv32;
+    return (pvr_ptr_t)(PVR_RAM_INT_BASE + b->offset);
+}
+
+/* Allocate a buffer for use through the 32-bit VRAM area. Consecutive 32-bit
+   words there alternate between the two VRAM banks when looked at through
+   the 64-bit area, so a buffer of n bytes covers the lower halves of 2n bytes
+   of the 64-bit area. We take all 2n of them, so that nothing else ends up in
+   the upper halves, and hand back the address in bank 0. */
+pvr_ptr_t pvr_mem_malloc32(size_t size) {
+    struct pvr_mem_block *b;
+#ifdef PVR_KM_DBG
+    uint32 ra = arch_get_ret_addr();
+#endif
+
+    mutex_lock(&pvr_mem_mutex);
+    b = block_alloc(size * 2, BLOCK_32BIT);
+
+#ifdef PVR_KM_DBG
+    if(b) {
+        b->thread = thd_current->tid;
+        b->addr = ra;
+    }
+#endif
+
+    mutex_unlock(&pvr_mem_mutex);
+
+    if(!b)
+        return NULL;
+
+    return (pvr_ptr_t)(PVR_RAM_BASE + b->offset / 2);
 }
 
 /* Free a previously allocated chunk of memory */
 void pvr_mem_free(pvr_ptr_t chunk) {
-#ifdef PVR_KM_DBG
-    uint32      ra = arch_get_ret_addr();
-    memctl_t    *ctl, *tmp;
-    int     found;
-#endif  /* PVR_KM_DBG */
+    struct pvr_mem_block *b;
+    uint32 addr = (uint32)chunk, offset;
+    int is32 = 0;
+
+    if(!chunk)
+        return;
 
     CHECK_MEM_BASE;
 
 #ifdef PVR_KM_DBG_VERBOSE
     printf("Thread %d/%08lx freeing block @ %08lx\n",
-           thd_current->tid, ra, (uint32)chunk);
+           thd_current->tid, arch_get_ret_addr(), addr);
 #endif
 
+    if(addr >= PVR_RAM_BASE && addr < PVR_RAM_TOP) {
+        offset = (addr - PVR_RAM_BASE) * 2;
+        is32 = 1;
+    }
+    else {
+        offset = addr - PVR_RAM_INT_BASE;
+    }
+
+    mutex_lock(&pvr_mem_mutex);
+
+    if(!(b = hash_remove(offset))) {
+        mutex_unlock(&pvr_mem_mutex);
+        dbglog(DBG_ERROR, "pvr_mem_free: trying to free non-alloc'd block "
+               "%08lx\n", addr);
+        return;
+    }
+
+    assert_msg(!!(b->flags & BLOCK_32BIT) == is32,
+               "pvr_mem_free: block freed through the wrong VRAM area");
+
+    block_free(b);
+    mutex_unlock(&pvr_mem_mutex);
+}
+
+pvr_mem_handle_t pvr_mem_halloc(size_t size) {
+    struct pvr_mem_block *b;
 #ifdef PVR_KM_DBG
-    found = 0;
+    uint32 ra = arch_get_ret_addr();
+#endif
 
-    LIST_FOREACH_SAFE(ctl, &block_list, list, tmp) {
-        if(ctl->block == chunk) {
-            LIST_REMOVE(ctl, list);
-            free(ctl);
-            found = 1;
-            break;
-        }
+    mutex_lock(&pvr_mem_mutex);
+    b = block_alloc(size, BLOCK_HANDLE);
+
+#ifdef PVR_KM_DBG
+    if(b) {
+        b->thread = thd_current->tid;
+        b->addr = ra;
     }
+#endif
+
+    mutex_unlock(&pvr_mem_mutex);
+
+    return b;
+}
+
+pvr_ptr_t pvr_mem_hptr(pvr_mem_handle_t handle) {
+    assert(handle->flags & BLOCK_HANDLE);
+
+    return (pvr_ptr_t)(PVR_RAM_INT_BASE + handle->offset);
+}
 
-    if(!found) {
-        dbglog(DBG_ERROR, 
-               "pvr_mem_free: trying to free non-alloc'd block "
-               "%08lx (called from %d/%08lx\n",
-               (uint32)chunk, thd_current->tid, ra);
+void pvr_mem_hfree(pvr_mem_handle_t handle) {
+    if(!handle)
+        return;
+
+    assert(handle->flags & BLOCK_HANDLE);
+
+    mutex_lock(&pvr_mem_mutex);
+    block_free(handle);
+    mutex_unlock(&pvr_mem_mutex);
+}
+
+/* Move a block of VRAM down. It has to come back through main RAM, as the PVR
+   DMA can only copy into VRAM, but going forwards a piece at a time is safe
+   even if the two overlap, since the destination is lower. */
+static int pvr_mem_move(uint32 dst, uint32 src, uint32 size, void *buf) {
+    uint32 done, n;
+    int rv;
+
+    for(done = 0; done < size; done += n) {
+        n = size - done;
+
+        if(n > MOVE_CHUNK)
+            n = MOVE_CHUNK;
+
+        memcpy(buf, (void *)(PVR_RAM_INT_BASE + src + done), n);
+        dcache_flush_range((uintptr_t)buf, n);
+
+        mutex_lock((mutex_t *)&pvr_state.dma_lock);
+        rv = pvr_txr_load_dma(buf, (pvr_ptr_t)(PVR_RAM_INT_BASE + dst + done),
+                              n, 1, NULL, NULL);
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+
+        if(rv < 0)
+            return -1;
     }
 
-#endif  /* PVR_KM_DBG */
+    return 0;
+}
+
+int pvr_mem_compact(void) {
+    struct pvr_mem_block *b, *u, *n;
+    void *buf;
+    int moved = 0;
+
+    CHECK_MEM_BASE;
 
-    pvr_int_free((void *)chunk);
+    if(!(buf = memalign(32, MOVE_CHUNK)))
+        return -1;
+
+    mutex_lock(&pvr_mem_mutex);
+
+    for(b = first_block; b; b = b->next_phys) {
+        /* Slide any handle blocks down over a free block before them. The
+           free block ends up after them, and might join up with the next
+           one along. */
+        while((b->flags & BLOCK_FREE) && (u = b->next_phys) &&
+              (u->flags & BLOCK_HANDLE)) {
+            if(pvr_mem_move(b->offset, u->offset, u->size, buf) < 0) {
+                dbglog(DBG_ERROR, "pvr_mem_compact: DMA failed, block at "
+                       "%08lx lost\n", PVR_RAM_INT_BASE + u->offset);
+                moved = -1;
+                break;
+            }
+
+            free_remove(b);
+
+            u->offset = b->offset;
+            b->offset += u->size;
+
+            u->prev_phys = b->prev_phys;
+            b->next_phys = u->next_phys;
+            u->next_phys = b;
+            b->prev_phys = u;
+
+            if(u->prev_phys)
+                u->prev_phys->next_phys = u;
+            else
+                first_block = u;
+
+            if(b->next_phys)
+                b->next_phys->prev_phys = b;
+
+            if((n = b->next_phys) && (n->flags & BLOCK_FREE)) {
+                free_remove(n);
+                phys_merge(b, n);
+            }
+
+            free_insert(b);
+            stats.moved_bytes += u->size;
+            moved++;
+        }
+
+        if(moved < 0)
+            break;
+    }
+
+    mutex_unlock(&pvr_mem_mutex);
+    free(buf);
+
+    return moved;
 }
 
 /* Check the memory block list to see what's allocated */
 void pvr_mem_print_list(void) {
-#ifdef PVR_KM_DBG
-    memctl_t    * ctl;
+    struct pvr_mem_block *b;
+
+    CHECK_MEM_BASE;
 
+    mutex_lock(&pvr_mem_mutex);
     printf("pvr_mem_print_list block list:\n");
-    LIST_FOREACH(ctl, &block_list, list) {
-        printf("  unfreed block at %08lx size %lu, "
+
+    for(b = first_block; b; b = b->next_phys) {
+        if(b->flags & BLOCK_FREE)
+            continue;
+
+#ifdef PVR_KM_DBG
+        printf("  unfreed block at %08lx size %lu%s, "
                "allocated by thread %d/%08lx\n",
-               (unsigned long)ctl->block, ctl->size, 
-               ctl->thread, (unsigned long)ctl->addr);
+               PVR_RAM_INT_BASE + b->offset, b->size,
+               (b->flags & BLOCK_HANDLE) ? " (handle)" : "",
+               b->thread, b->addr);
+#else
+        printf("  unfreed block at %08lx size %lu%s\n",
+               PVR_RAM_INT_BASE + b->offset, b->size,
+               (b->flags & BLOCK_HANDLE) ? " (handle)" : "");
+#endif
     }
+
     printf("pvr_mem_print_list end block list\n");
-#endif  /* PVR_KM_DBG */
+    mutex_unlock(&pvr_mem_mutex);
 }
 
 /* Return the number of bytes available still in the memory pool */
-static uint32 pvr_mem_available_int(void) {
-    struct mallinfo mi = pvr_int_mallinfo();
+uint32 pvr_mem_available(void) {
+    CHECK_MEM_BASE;
 
-    /* This magic formula is modeled after mstats() */
-    return mi.arena - mi.uordblks;
+    return pool_size - pool_used;
 }
 
-uint32 pvr_mem_available(void) {
+/* Find the biggest free block. The highest non-empty list has it, but the
+   blocks in that list aren't all the same size, so it has to be looked
+   through. */
+static uint32 free_largest(void) {
+    struct pvr_mem_block *b;
+    uint32 rv = 0;
+    int fl;
+
+    if(!fl_bitmap)
+        return 0;
+
+    fl = fls32(fl_bitmap);
+
+    for(b = free_lists[fl][fls32(sl_bitmap[fl])]; b; b = b->next) {
+        if(b->size > rv)
+            rv = b->size;
+    }
+
+    return rv;
+}
+
+void pvr_mem_get_stats(pvr_mem_stats_t *out) {
     CHECK_MEM_BASE;
 
-    return pvr_mem_available_int() + 
-        (PVR_RAM_INT_TOP - (uint32)pvr_mem_base);
+    mutex_lock(&pvr_mem_mutex);
+    *out = stats;
+    out->total = pool_size;
+    out->used = pool_used;
+    out->free_largest = free_largest();
+    mutex_unlock(&pvr_mem_mutex);
 }
 
 /* Reset the memory pool, equivalent to freeing all textures currently
    residing in RAM. This _must_ be done on a mode change, configuration
    change, etc. */
 void pvr_mem_reset(void) {
-    if(!pvr_state.valid)
-        pvr_mem_base = NULL;
-    else {
-        pvr_mem_base = (pvr_ptr_t)(PVR_RAM_INT_BASE + pvr_state.texture_base);
-        pvr_int_mem_reset();
+    struct pvr_mem_block *b, *n;
+    struct block_chunk *c;
+
+    mutex_lock(&pvr_mem_mutex);
+
+    /* Throw away all the old blocks. */
+    for(b = first_block; b; b = n) {
+        n = b->next_phys;
+        block_release(b);
+    }
+
+    first_block = NULL;
+    memset(free_lists, 0, sizeof(free_lists));
+    memset(sl_bitmap, 0, sizeof(sl_bitmap));
+    memset(used_hash, 0, sizeof(used_hash));
+    memset(&stats, 0, sizeof(stats));
+    fl_bitmap = 0;
+    pool_used = 0;
+    pool_size = 0;
+
+    if(!pvr_state.valid) {
+        /* We're shutting down, so let go of the descriptors too. */
+        while((c = chunks) != NULL) {
+            chunks = c->next;
+            free(c);
+        }
+
+        spare_blocks = NULL;
     }
+    else if((b = block_new()) != NULL) {
+        /* Start off with one big free block. */
+        b->offset = pvr_state.texture_base;
+        b->size = PVR_RAM_SIZE - pvr_state.texture_base;
+        first_block = b;
+        pool_size = b->size;
+        free_insert(b);
+    }
+
+    mutex_unlock(&pvr_mem_mutex);
 }
 
 /* Print some statistics (like mallocstats) */
 void pvr_mem_stats(void) {
+    pvr_mem_stats_t st;
+    int i;
+
+    pvr_mem_get_stats(&st);
+
     printf("pvr_mem_stats():\n");
-    pvr_int_malloc_stats();
-    printf("max sbrk base: %08lx\n", (uint32)pvr_mem_base);
+    printf("total:         %10lu bytes\n", (unsigned long)st.total);
+    printf("in use:        %10lu bytes\n", (unsigned long)st.used);
+    printf("max in use:    %10lu bytes\n", (unsigned long)st.used_max);
+    printf("free:          %10lu bytes in %lu blocks\n",
+           (unsigned long)(st.total - st.used), (unsigned long)st.free_blocks);
+    printf("largest free:  %10lu bytes\n", (unsigned long)st.free_largest);
+    printf("failed allocs: %10lu\n", (unsigned long)st.alloc_fails);
+    printf("moved:         %10lu bytes\n", (unsigned long)st.moved_bytes);
+
+    for(i = 0; i < PVR_MEM_SIZE_CLASSES; i++) {
+        if(!st.class_allocs[i])
+            continue;
+
+        printf("  <= %7lu: %5lu blocks, %8lu bytes (%lu allocated)\n",
+               (unsigned long)ALIGN_SIZE << i, (unsigned long)st.class_count[i],
+               (unsigned long)st.class_bytes[i],
+               (unsigned long)st.class_allocs[i]);
+    }
+
 #ifdef PVR_KM_DBG
     pvr_mem_print_list();
 #endif
@@ -72,6 +72,7 @@ int pvr_get_stats(pvr_stats_t *stat) {
 
     stat->vtx_buffer_used = pvr_state.vtx_buf_used;
     stat->vtx_buffer_used_max = pvr_state.vtx_buf_used_max;
+    stat->hdr_bytes_saved = pvr_state.hdr_bytes_saved;
     stat->buf_last_time = pvr_state.buf_last_len;
     stat->frame_count = pvr_state.frame_count;
 
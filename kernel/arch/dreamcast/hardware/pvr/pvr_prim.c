@@ -155,6 +155,9 @@ void pvr_poly_compile(pvr_poly_hdr_t *dst, const pvr_poly_cxt_t *src) {
         txr_base = (txr_base & 0x00fffff8) >> 3;
         mode[2] |= txr_base;
 
+        if(pvr_txr_cache_active)
+            pvr_txr_cache_touch(src->txr.base);
+
         dst->mode3 = mode[2];
     }
 
@@ -463,6 +466,9 @@ void pvr_sprite_compile(pvr_sprite_hdr_t *dst, const pvr_sprite_cxt_t *src) {
         txr_base = (txr_base & 0x00fffff8) >> 3;
         mode[2] |= txr_base;
 
+        if(pvr_txr_cache_active)
+            pvr_txr_cache_touch(src->txr.base);
+
         dst->mode3 = mode[2];
     }
 
@@ -614,6 +620,9 @@ void pvr_poly_mod_compile(pvr_poly_mod_hdr_t *dst, const pvr_poly_cxt_t *src) {
         txr_base = (txr_base & 0x00fffff8) >> 3;
         mode3[0] |= txr_base;
 
+        if(pvr_txr_cache_active)
+            pvr_txr_cache_touch(src->txr.base);
+
         dst->mode3_0 = mode3[0];
     }
 
@@ -714,6 +723,9 @@ void pvr_poly_mod_compile(pvr_poly_mod_hdr_t *dst, const pvr_poly_cxt_t *src) {
         txr_base = (txr_base & 0x00fffff8) >> 3;
         mode3[1] |= txr_base;
 
+        if(pvr_txr_cache_active)
+            pvr_txr_cache_touch(src->txr2.base);
+
         dst->mode3_1 = mode3[1];
     }
 
@@ -11,6 +11,8 @@
 #include <string.h>
 #include <kos/string.h>
 #include <kos/thread.h>
+#include <kos/genwait.h>
+#include <arch/cache.h>
 #include <dc/pvr.h>
 #include <dc/sq.h>
 #include "pvr_internal.h"
@@ -48,10 +50,14 @@ void * pvr_set_vertbuf(pvr_list_t list, void * buffer, int len) {
     pvr_state.dma_buffers[0].base[list] = (uint8 *)buffer;
     pvr_state.dma_buffers[0].ptr[list] = 0;
     pvr_state.dma_buffers[0].size[list] = len / 2;
+    pvr_state.dma_buffers[0].start[list] = 0;
+    pvr_state.dma_buffers[0].end[list] = len / 2;
     pvr_state.dma_buffers[0].ready = 0;
     pvr_state.dma_buffers[1].base[list] = ((uint8 *)buffer) + len / 2;
     pvr_state.dma_buffers[1].ptr[list] = 0;
     pvr_state.dma_buffers[1].size[list] = len / 2;
+    pvr_state.dma_buffers[1].start[list] = 0;
+    pvr_state.dma_buffers[1].end[list] = len / 2;
     pvr_state.dma_buffers[1].ready = 0;
 
     return oldbuf;
@@ -64,6 +70,11 @@ void * pvr_vertbuf_tail(pvr_list_t list) {
     assert(list < PVR_OPB_COUNT);
     assert(pvr_state.dma_mode);
 
+    // Whatever gets written here has to go after anything held back for
+    // batching.
+    if(pvr_state.lists_batched & (1 << list))
+        pvr_batch_flush(list);
+
     // Get the buffer base.
     bufbase = pvr_state.dma_buffers[pvr_state.ram_target].base[list];
     assert(bufbase);
@@ -82,7 +93,7 @@ void pvr_vertbuf_written(pvr_list_t list, uint32 amt) {
     // Change the current end of the buffer.
     val = pvr_state.dma_buffers[pvr_state.ram_target].ptr[list];
     val += amt;
-    assert(val < pvr_state.dma_buffers[pvr_state.ram_target].size[list]);
+    assert(val < pvr_state.dma_buffers[pvr_state.ram_target].end[list]);
     pvr_state.dma_buffers[pvr_state.ram_target].ptr[list] = val;
 }
 
@@ -90,14 +101,22 @@ void pvr_vertbuf_written(pvr_list_t list, uint32 amt) {
    frame buffer */
 void pvr_scene_begin(void) {
     int i;
+    volatile pvr_dma_buffers_t * b;
 
     // Get general stuff ready.
     pvr_state.list_reg_open = -1;
 
+    if(pvr_txr_cache_active)
+        pvr_txr_cache_frame();
+
     // Clear these out in case we're using DMA.
     if(pvr_state.dma_mode) {
+        b = pvr_state.dma_buffers + pvr_state.ram_target;
+
         for(i = 0; i < PVR_OPB_COUNT; i++) {
-            pvr_state.dma_buffers[pvr_state.ram_target].ptr[i] = 0;
+            b->ptr[i] = 0;
+            b->start[i] = 0;
+            b->end[i] = b->size[i];
         }
 
         pvr_sync_stats(PVR_SYNC_BUFSTART);
@@ -164,8 +183,13 @@ int pvr_list_begin(pvr_list_t list) {
 
     pvr_list_dma = pvr_list_uses_dma(list);
 
-    if(!pvr_list_dma)
+    if(!pvr_list_dma) {
+        /* Texture uploads can't share the TA FIFO with the store queues */
+        if(pvr_txr_cache_active)
+            pvr_txr_cache_wait();
+
         sq_lock((void *)PVR_TA_INPUT);
+    }
 
     /* Ok, set the flag */
     pvr_state.list_reg_open = list;
@@ -208,10 +232,22 @@ int pvr_list_finish(void) {
 
         /* Set the flags */
         pvr_state.lists_closed |= (1 << pvr_state.list_reg_open);
+        pvr_state.list_reg_open = -1;
+
+        /* Textures asked for while the list was being sent had to wait, but
+           they need to be there before the TA is done and rendering starts */
+        if(pvr_txr_cache_active)
+            pvr_txr_cache_wait();
 
         /* Send an EOL marker */
         pvr_sq_set32((void *)0, 0, 32, PVR_DMA_TA);
     }
+    else if(pvr_state.list_reg_open != -1 &&
+            (pvr_state.lists_batched & (1 << pvr_state.list_reg_open))) {
+        /* Write out whatever has been held back for batching */
+        if(pvr_batch_flush(pvr_state.list_reg_open) < 0)
+            return -1;
+    }
 
     pvr_state.list_reg_open = -1;
 
@@ -245,7 +281,8 @@ int pvr_prim(void * data, int size) {
     return 0;
 }
 
-int pvr_list_prim(pvr_list_t list, void * data, int size) {
+/* Find room in a list's vertex buffer, without regard to batching. */
+static void * pvr_list_space(pvr_list_t list, size_t size) {
     volatile pvr_dma_buffers_t * b;
 
     b = pvr_state.dma_buffers + pvr_state.ram_target;
@@ -255,14 +292,61 @@ int pvr_list_prim(pvr_list_t list, void * data, int size) {
 
     /* Ensure data size is multiple of 32-bytes. */
     assert(!(size & 31));
+    /* Ensure pvr_list_flush() didn't already end this list. */
+    assert(!(pvr_state.lists_flushed & (1 << list)));
+
+    /* Leave room for the zero-marker pvr_scene_finish() puts on the end. */
+    if(b->ptr[list] + size >= b->end[list])
+        return NULL;
+
+    return b->base[list] + b->ptr[list];
+}
+
+void * pvr_list_reserve(pvr_list_t list, size_t size) {
+    /* Whatever gets written here has to go after anything held back for
+       batching. */
+    if((pvr_state.lists_batched & (1 << list)) && pvr_batch_flush(list) < 0)
+        return NULL;
+
+    return pvr_list_space(list, size);
+}
+
+void pvr_list_commit(pvr_list_t list, size_t size) {
+    volatile pvr_dma_buffers_t * b;
+
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+    assert(!(size & 31));
+
+    b->ptr[list] += size;
+
+    /* Ensure we didn't overflow the vertex buffer. */
+    assert(b->ptr[list] < b->end[list]);
+}
+
+int pvr_list_prim(pvr_list_t list, void * data, int size) {
     /* Ensure at least 4-byte alignment. */
     assert(!((uintptr_t)data & 0x3));
 
-    memcpy(b->base[list] + b->ptr[list], data, size);
-    b->ptr[list] += size;
+    if(pvr_state.lists_batched & (1 << list))
+        return pvr_batch_prim(list, data, size);
+
+    return pvr_list_write(list, data, size);
+}
+
+int pvr_list_write(pvr_list_t list, const void * data, size_t size) {
+    void * dst;
+
+    dst = pvr_list_space(list, size);
 
     /* Ensure we didn't overflow the vertex buffer. */
-    assert(b->ptr[list] <= b->size[list]);
+    assert(dst);
+
+    if(!dst)
+        return -1;
+
+    memcpy(dst, data, size);
+    pvr_list_commit(list, size);
 
     return 0;
 }
@@ -276,11 +360,141 @@ void pvr_dr_finish(void) {
     pvr_state.dr_used = 0;
 }
 
+/* Called when a chunk sent by pvr_list_flush() has made it to the TA. */
+static void pvr_flush_done(void *data) {
+    (void)data;
+
+    pvr_state.flush_busy = 0;
+    genwait_wake_all((void *)&pvr_state.flush_busy);
+}
+
+/* Wait for the last chunk sent by pvr_list_flush() to make it to the TA. */
+static int pvr_flush_wait(void) {
+    int o, rv = 0;
+
+    o = irq_disable();
+
+    while(pvr_state.flush_busy && rv >= 0)
+        rv = genwait_wait((void *)&pvr_state.flush_busy, "pvr_list_flush",
+                          100, NULL);
+
+    irq_restore(o);
+
+    return rv;
+}
+
+/* Start sending whatever is in the list's buffer that hasn't been sent yet,
+   and move the part of the buffer that gets written to next out of its way.
+   Returns the number of bytes being sent, or -1 on error. */
+static int pvr_flush_send(pvr_list_t list) {
+    volatile pvr_dma_buffers_t * b;
+    uint32 start, len;
+    int rv;
+
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+    start = b->start[list];
+    len = b->ptr[list] - start;
+
+    if(!len)
+        return 0;
+
+    dcache_flush_range((ptr_t)(b->base[list] + start), len);
+
+    mutex_lock((mutex_t *)&pvr_state.dma_lock);
+    pvr_state.flush_busy = 1;
+    rv = pvr_dma_load_ta(b->base[list] + start, len, 0, pvr_flush_done, 0);
+    mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+
+    if(rv < 0) {
+        pvr_state.flush_busy = 0;
+        return -1;
+    }
+
+    /* Carry on in whichever of the free parts of the buffer is bigger: after
+       what's being sent, or before it (which has all gone already). */
+    if(b->size[list] - b->ptr[list] >= start) {
+        b->start[list] = b->ptr[list];
+        b->end[list] = b->size[list];
+    }
+    else {
+        b->start[list] = 0;
+        b->ptr[list] = 0;
+        b->end[list] = start;
+    }
+
+    return (int)len;
+}
+
 int pvr_list_flush(pvr_list_t list) {
-    (void)list;
+    volatile pvr_dma_buffers_t * b;
+    int i, o, rv = 0;
+
+    assert(list < PVR_OPB_COUNT);
+
+    /* If the list isn't being buffered, it has already gone to the TA. */
+    if(!pvr_list_uses_dma(list))
+        return 0;
+
+    /* Ensure we didn't already end this list. */
+    assert(!(pvr_state.lists_flushed & (1 << list)));
+
+    /* Anything held back for batching has to go now too. */
+    if((pvr_state.lists_batched & (1 << list)) && pvr_batch_flush(list) < 0)
+        return -1;
+
+    /* Nothing can go to the TA for this frame until it has got all of the
+       last one, and the render of that has been started. */
+    if(!pvr_state.ta_flushing) {
+        o = irq_disable();
+
+        while(rv >= 0 && (pvr_state.ta_busy ||
+                pvr_state.dma_buffers[pvr_state.ram_target ^ 1].ready))
+            rv = genwait_wait((void *)&pvr_state.ta_busy, "pvr_list_flush",
+                              100, NULL);
+
+        if(rv >= 0)
+            pvr_state.ta_flushing = 1;
+
+        irq_restore(o);
+
+        if(rv < 0) {
+            dbglog(DBG_WARNING, "pvr_list_flush: timed out waiting for TA\n");
+            return -1;
+        }
+    }
+
+    /* The part of the buffer that's going out now can't be written into
+       again until the last part has finished. */
+    if(pvr_flush_wait() < 0)
+        return -1;
+
+    /* The TA can only take one list at a time, so if we were partway through
+       another one, then that has to be finished off first. */
+    if(pvr_state.list_flushing != -1 && pvr_state.list_flushing != (int)list) {
+        i = pvr_state.list_flushing;
+        b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+        if((pvr_state.lists_batched & (1 << i)) && pvr_batch_flush(i) < 0)
+            return -1;
+
+        memset4(b->base[i] + b->ptr[i], 0, 32);
+        b->ptr[i] += 32;
+        assert(b->ptr[i] <= b->end[i]);
+
+        if(pvr_flush_send(i) < 0 || pvr_flush_wait() < 0)
+            return -1;
+
+        pvr_state.lists_flushed |= 1 << i;
+        pvr_state.list_flushing = -1;
+    }
 
-    assert_msg(0, "not implemented yet");
-    return -1;
+    if((rv = pvr_flush_send(list)) < 0)
+        return -1;
+
+    if(rv > 0)
+        pvr_state.list_flushing = list;
+
+    return 0;
 }
 
 /* Call this after you have finished submitting all data for a frame; once
@@ -309,11 +523,16 @@ int pvr_scene_finish(void) {
                B. We never associated an in-RAM DMA vertex buffer with
                   the given list type, because we're using hybrid
                   rendering and submitted that list type directly. */
-            if(!(pvr_state.lists_enabled & (1 << i)) || !b->base[i])
+            if(!(pvr_state.lists_enabled & (1 << i)) || !b->base[i]
+                    || (pvr_state.lists_flushed & (1 << i)))
                 continue;
 
+            // Write out anything held back for batching.
+            if((pvr_state.lists_batched & (1 << i)) && pvr_batch_flush(i) < 0)
+                return -1;
+
             // Make sure there's at least one primitive in each.
-            if(b->ptr[i] == 0) {
+            if(b->ptr[i] == 0 && pvr_state.list_flushing != i) {
                 pvr_blank_polyhdr_buf(i, (pvr_poly_hdr_t*)(b->base[i]));
                 b->ptr[i] += 32;
             }
@@ -323,9 +542,21 @@ int pvr_scene_finish(void) {
             b->ptr[i] += 32;
 
             // Verify that there is no overrun.
-            assert(b->ptr[i] <= b->size[i]);
+            assert(b->ptr[i] <= b->end[i]);
         }
 
+        // Whatever pvr_list_flush() last sent has to get there before the
+        // rest of the frame can be DMAed after it.
+        if(pvr_state.ta_flushing && pvr_flush_wait() < 0)
+            return -1;
+
+        // Same goes for any textures this frame is going to need.
+        if(pvr_txr_cache_active && pvr_txr_cache_wait() < 0)
+            return -1;
+
+        if(pvr_state.lists_batched)
+            pvr_batch_frame();
+
         // Flip buffers and mark them complete.
         o = irq_disable();
         pvr_state.dma_buffers[pvr_state.ram_target].ready = 1;
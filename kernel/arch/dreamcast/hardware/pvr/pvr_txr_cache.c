@@ -0,0 +1,452 @@
+/* KallistiOS ##version##
+
+   pvr_txr_cache.c
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/genwait.h>
+#include <arch/cache.h>
+#include <arch/irq.h>
+#include <dc/pvr.h>
+#include "pvr_internal.h"
+
+/*
+
+   Texture residency cache
+
+   Textures are registered with an ID and a copy of their data in main RAM,
+   and only take up VRAM while they're being drawn with. pvr_txr_cache_get()
+   hands back the VRAM address of a texture, and if it isn't there right now,
+   makes room for it and queues it to be DMAed over. The queue is worked
+   through from the DMA interrupt, so the upload happens while the program
+   carries on building the scene.
+
+   Every texture that's in VRAM sits on an LRU list. pvr_txr_cache_get() and
+   compiling a polygon header that points at a texture both move it to the
+   back of the list and mark it as used in the current frame. When there
+   isn't enough room for a new texture, the ones at the front of the list get
+   thrown out, as long as they weren't used recently enough that the PVR
+   might still be rendering from them.
+
+   Uploads share the PVR DMA channel with vertex DMA, so the first one to
+   start takes pvr_state.dma_lock and the last one lets it go again (from the
+   interrupt, on behalf of the thread that took it). They can't happen while
+   the store queues are feeding a list to the TA either, as both go through
+   the TA FIFO, so in that case they're held back until the list is finished,
+   which waits for them before letting the TA know it's done.
+
+*/
+
+/* How many frames after its last use a texture might still be drawn from. A
+   frame is built while the one before it is DMAed to the TA and the one
+   before that is rendered. */
+#define CACHE_IN_FLIGHT     2
+
+/* Size of the hash tables for finding textures by ID and by address */
+#define CACHE_HASH_SIZE     256
+
+/* What a texture is up to */
+#define TXR_ABSENT          0   /* Not in VRAM */
+#define TXR_QUEUED          1   /* Waiting to be uploaded */
+#define TXR_UPLOADING       2   /* Being DMAed right now */
+#define TXR_RESIDENT        3   /* In VRAM and ready to go */
+
+typedef struct txr_entry {
+    uint32_t        id;         /* What the program calls it */
+    const void      *data;      /* Where it lives in main RAM */
+    size_t          size;       /* Size, rounded up to a multiple of 32 */
+    pvr_ptr_t       vram;       /* Where it is in VRAM, or NULL */
+    volatile int    state;      /* One of the TXR_* values above */
+    uint32_t        last_used;  /* Frame it was last used in */
+
+    struct txr_entry *id_next;      /* Next in the ID hash chain */
+    struct txr_entry *addr_next;    /* Next in the address hash chain */
+
+    TAILQ_ENTRY(txr_entry) lru;     /* Resident textures, oldest first */
+    TAILQ_ENTRY(txr_entry) queue;   /* Textures waiting for upload */
+} txr_entry_t;
+
+TAILQ_HEAD(txr_list, txr_entry);
+
+/* Set once anything has been registered, so that the hooks in the rest of the
+   PVR code know whether they have to bother. */
+int pvr_txr_cache_active;
+
+static txr_entry_t *id_hash[CACHE_HASH_SIZE];
+static txr_entry_t *addr_hash[CACHE_HASH_SIZE];
+static struct txr_list lru_list = TAILQ_HEAD_INITIALIZER(lru_list);
+static struct txr_list upload_queue = TAILQ_HEAD_INITIALIZER(upload_queue);
+
+/* The upload in progress, and whether the queue is being worked through (in
+   which case upload_owner holds the DMA lock). */
+static txr_entry_t *uploading;
+static volatile int upload_busy;
+static kthread_t *upload_owner;
+
+static size_t budget;
+static uint32_t frame;
+
+/* Counters for this frame so far, and the totals */
+static size_t cur_hits, cur_misses;
+static size_t cur_bytes;
+static pvr_txr_cache_stats_t stats;
+
+static inline unsigned int id_bucket(uint32_t id) {
+    return (id ^ (id >> 8) ^ (id >> 16) ^ (id >> 24)) & (CACHE_HASH_SIZE - 1);
+}
+
+static inline unsigned int addr_bucket(pvr_ptr_t addr) {
+    uint32_t a = ((uintptr_t)addr & 0x00ffffff) >> 5;
+
+    return (a ^ (a >> 8)) & (CACHE_HASH_SIZE - 1);
+}
+
+static txr_entry_t *find_id(uint32_t id) {
+    txr_entry_t *e;
+
+    for(e = id_hash[id_bucket(id)]; e; e = e->id_next)
+        if(e->id == id)
+            break;
+
+    return e;
+}
+
+static void addr_remove(txr_entry_t *e) {
+    txr_entry_t **p = &addr_hash[addr_bucket(e->vram)];
+
+    while(*p != e)
+        p = &(*p)->addr_next;
+
+    *p = e->addr_next;
+}
+
+/* Is the CPU sending a list to the TA through the store queues? */
+static int sq_list_open(void) {
+    int list = pvr_state.list_reg_open;
+
+    return list != -1 && !(pvr_state.dma_mode &&
+                           pvr_state.dma_buffers[pvr_state.ram_target].base[list]);
+}
+
+/* Start the next upload in the queue, or give up the DMA channel if there
+   aren't any left. This is the DMA completion callback, and is also called
+   with interrupts disabled to get things going. */
+static void upload_next(void *data) {
+    txr_entry_t *e;
+
+    (void)data;
+
+    if(uploading) {
+        uploading->state = TXR_RESIDENT;
+        uploading = NULL;
+    }
+
+    if((e = TAILQ_FIRST(&upload_queue))) {
+        TAILQ_REMOVE(&upload_queue, e, queue);
+        e->state = TXR_UPLOADING;
+        uploading = e;
+
+        if(pvr_dma_transfer(e->data, (uintptr_t)e->vram, e->size,
+                            PVR_DMA_VRAM64, 0, upload_next, NULL) >= 0)
+            return;
+
+        /* Someone else is using the channel without the lock. Put it back,
+           and try again next time around. */
+        e->state = TXR_QUEUED;
+        uploading = NULL;
+        TAILQ_INSERT_HEAD(&upload_queue, e, queue);
+    }
+
+    upload_busy = 0;
+
+    if(irq_inside_int())
+        mutex_unlock_as_thread((mutex_t *)&pvr_state.dma_lock, upload_owner);
+    else
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+
+    genwait_wake_all((void *)&upload_busy);
+}
+
+/* Start working through the upload queue, if it isn't already. If block is
+   set, wait for the DMA channel to be free rather than leaving it for next
+   time. Returns -1 if there's something queued that couldn't be started. */
+static int upload_kick(int block) {
+    int o;
+
+    if(upload_busy || TAILQ_EMPTY(&upload_queue))
+        return 0;
+
+    if(sq_list_open())
+        return -1;
+
+    if(block) {
+        if(mutex_lock((mutex_t *)&pvr_state.dma_lock) < 0)
+            return -1;
+    }
+    else if(mutex_trylock((mutex_t *)&pvr_state.dma_lock) < 0) {
+        return -1;
+    }
+
+    o = irq_disable();
+    upload_busy = 1;
+    upload_owner = thd_get_current();
+    upload_next(NULL);
+    irq_restore(o);
+
+    return 0;
+}
+
+int pvr_txr_cache_wait(void) {
+    int o, rv = 0;
+
+    /* If the DMA channel was used behind our back, something might have been
+       put back on the queue, so keep going until it's empty. */
+    do {
+        if(upload_kick(1) < 0)
+            return -1;
+
+        o = irq_disable();
+
+        while(upload_busy && rv >= 0)
+            rv = genwait_wait((void *)&upload_busy, "pvr_txr_cache_wait",
+                              100, NULL);
+
+        irq_restore(o);
+    } while(rv >= 0 && !TAILQ_EMPTY(&upload_queue));
+
+    return rv;
+}
+
+/* Take a texture out of VRAM. It must not be queued or uploading. */
+static void evict(txr_entry_t *e) {
+    assert(e->state == TXR_RESIDENT);
+
+    TAILQ_REMOVE(&lru_list, e, lru);
+    addr_remove(e);
+    pvr_mem_free(e->vram);
+
+    e->vram = NULL;
+    e->state = TXR_ABSENT;
+
+    stats.resident_count--;
+    stats.resident_bytes -= e->size;
+}
+
+/* Find room in VRAM for a texture, throwing out the least recently used ones
+   until there's enough. */
+static pvr_ptr_t txr_alloc(size_t size) {
+    txr_entry_t *e;
+    pvr_ptr_t rv;
+
+    for(;;) {
+        if(!budget || stats.resident_bytes + size <= budget) {
+            if((rv = pvr_mem_malloc(size)))
+                return rv;
+        }
+
+        e = TAILQ_FIRST(&lru_list);
+
+        if(!e || e->last_used + CACHE_IN_FLIGHT >= frame) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        evict(e);
+        stats.evictions++;
+    }
+}
+
+int pvr_txr_cache_init(size_t max_bytes) {
+    budget = max_bytes;
+    return 0;
+}
+
+void pvr_txr_cache_shutdown(void) {
+    txr_entry_t *e, *n;
+    int i;
+
+    pvr_txr_cache_wait();
+
+    for(i = 0; i < CACHE_HASH_SIZE; i++) {
+        for(e = id_hash[i]; e; e = n) {
+            n = e->id_next;
+
+            if(e->vram)
+                pvr_mem_free(e->vram);
+
+            free(e);
+        }
+
+        id_hash[i] = NULL;
+        addr_hash[i] = NULL;
+    }
+
+    TAILQ_INIT(&lru_list);
+    TAILQ_INIT(&upload_queue);
+
+    pvr_txr_cache_active = 0;
+    budget = 0;
+    cur_hits = cur_misses = 0;
+    cur_bytes = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+int pvr_txr_cache_add(uint32_t id, const void *data, size_t size) {
+    txr_entry_t *e;
+    unsigned int b;
+
+    if(!size || ((uintptr_t)data & 31)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(find_id(id)) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if(!(e = (txr_entry_t *)malloc(sizeof(txr_entry_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(e, 0, sizeof(txr_entry_t));
+    e->id = id;
+    e->data = data;
+    e->size = (size + 31) & ~31;
+    e->state = TXR_ABSENT;
+
+    b = id_bucket(id);
+    e->id_next = id_hash[b];
+    id_hash[b] = e;
+
+    stats.texture_count++;
+    pvr_txr_cache_active = 1;
+
+    return 0;
+}
+
+int pvr_txr_cache_remove(uint32_t id) {
+    txr_entry_t **p, *e;
+
+    for(p = &id_hash[id_bucket(id)]; (e = *p); p = &e->id_next)
+        if(e->id == id)
+            break;
+
+    if(!e) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Let it finish going over before pulling it out from under the DMA. */
+    if(e->state == TXR_QUEUED || e->state == TXR_UPLOADING) {
+        if(pvr_txr_cache_wait() < 0)
+            return -1;
+    }
+
+    if(e->vram)
+        evict(e);
+
+    *p = e->id_next;
+    free(e);
+
+    stats.texture_count--;
+
+    return 0;
+}
+
+pvr_ptr_t pvr_txr_cache_get(uint32_t id) {
+    txr_entry_t *e;
+    unsigned int b;
+    int o;
+
+    if(!(e = find_id(id))) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if(e->vram) {
+        ++cur_hits;
+
+        e->last_used = frame;
+        TAILQ_REMOVE(&lru_list, e, lru);
+        TAILQ_INSERT_TAIL(&lru_list, e, lru);
+
+        return e->vram;
+    }
+
+    ++cur_misses;
+
+    if(!(e->vram = txr_alloc(e->size)))
+        return NULL;
+
+    e->last_used = frame;
+    TAILQ_INSERT_TAIL(&lru_list, e, lru);
+
+    b = addr_bucket(e->vram);
+    e->addr_next = addr_hash[b];
+    addr_hash[b] = e;
+
+    stats.resident_count++;
+    stats.resident_bytes += e->size;
+    cur_bytes += e->size;
+
+    dcache_flush_range((uintptr_t)e->data, e->size);
+
+    o = irq_disable();
+    e->state = TXR_QUEUED;
+    TAILQ_INSERT_TAIL(&upload_queue, e, queue);
+    irq_restore(o);
+
+    upload_kick(0);
+
+    return e->vram;
+}
+
+int pvr_txr_cache_resident(uint32_t id) {
+    txr_entry_t *e = find_id(id);
+
+    return e && e->state == TXR_RESIDENT;
+}
+
+void pvr_txr_cache_touch(pvr_ptr_t addr) {
+    txr_entry_t *e;
+
+    for(e = addr_hash[addr_bucket(addr)]; e; e = e->addr_next) {
+        if(e->vram == addr) {
+            if(e->last_used != frame) {
+                e->last_used = frame;
+                TAILQ_REMOVE(&lru_list, e, lru);
+                TAILQ_INSERT_TAIL(&lru_list, e, lru);
+            }
+
+            return;
+        }
+    }
+}
+
+void pvr_txr_cache_frame(void) {
+    stats.frame_hits = cur_hits;
+    stats.frame_misses = cur_misses;
+    stats.frame_bytes_uploaded = cur_bytes;
+
+    stats.hits += cur_hits;
+    stats.misses += cur_misses;
+    stats.bytes_uploaded += cur_bytes;
+
+    cur_hits = cur_misses = 0;
+    cur_bytes = 0;
+
+    ++frame;
+}
+
+void pvr_txr_cache_get_stats(pvr_txr_cache_stats_t *out) {
+    *out = stats;
+}
@@ -423,6 +423,15 @@ timer_primary_callback_t timer_primary_set_callback(timer_primary_callback_t cal
 */
 void timer_primary_wakeup(uint32_t millis);
 
+/** \brief   Cancel a pending primary timer wakeup.
+    \ingroup tmu_primary
+
+    This function stops the primary timer without calling the callback, so
+    that no further interrupts are taken until the next call to
+    timer_primary_wakeup().
+*/
+void timer_primary_cancel(void);
+
 /** \cond */
 /* Init function */
 int timer_init(void);
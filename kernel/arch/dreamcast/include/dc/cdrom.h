@@ -425,6 +425,52 @@ int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode);
 */
 int cdrom_read_sectors(void *buffer, int sector, int cnt);
 
+/** \brief    Completion callback for asynchronous sector reads.
+    \ingroup  gdrom
+
+    \param  result          ERR_OK if the read worked, or another value from
+                            \ref cd_cmd_response if it didn't.
+    \param  data            The user data passed in with the request.
+    \see    cdrom_read_sectors_async
+*/
+typedef void (*cdrom_async_cb_t)(int result, void *data);
+
+/** \brief    Queue an asynchronous read of one or more sectors.
+    \ingroup  gdrom
+
+    This queues up a read and returns straight away. Any number of reads can
+    be outstanding at once. They are carried out one at a time by a worker
+    thread, in elevator order: the drive sweeps upwards through the queued
+    sector numbers, then starts again at the lowest one. This keeps seeks to
+    a minimum when several streams (music, FMV, level data) share the drive.
+
+    Reads into a 32-byte aligned buffer are done with DMA; anything else
+    falls back on PIO.
+
+    \note   The callback is called from the worker thread, not from the
+            thread that queued the read. It should be short, and it must not
+            wait on another asynchronous read.
+
+    \param  buffer          Space to store the read sectors.
+    \param  sector          The sector to start reading from.
+    \param  cnt             The number of sectors to read.
+    \param  cb              Function to call when the read is done, or NULL.
+    \param  data            User data passed to the callback.
+    \retval 0               On success.
+    \retval -1              If the worker thread couldn't be started or memory
+                            couldn't be allocated for the request.
+    \see    cdrom_read_sectors_ex
+*/
+int cdrom_read_sectors_async(void *buffer, int sector, int cnt,
+                             cdrom_async_cb_t cb, void *data);
+
+/** \brief    Get the number of queued asynchronous reads.
+    \ingroup  gdrom
+
+    \return                 The number of reads queued or in progress.
+*/
+int cdrom_async_pending(void);
+
 /** \brief    Read subcode data from the most recently read sectors.
     \ingroup  gdrom
 
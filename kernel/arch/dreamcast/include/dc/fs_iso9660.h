@@ -18,6 +18,13 @@
     The implementation was originally based on a simple ISO9660 implementation
     by Marcus Comstedt.
 
+    Files opened with O_ASYNC are read asynchronously: each fs_read() queues
+    a read with cdrom_read_sectors_async() and returns at once, with the
+    file position already moved past the data. The buffer must stay valid
+    until fs_complete() on the file returns, which waits for every queued
+    read and gives the number of bytes read since the last completion.
+    Polling the file for POLLIN tells whether the reads are done yet.
+
     \author Megan Potter
     \author Andrew Kieschnick
     \author Bero
@@ -47,6 +54,50 @@ __BEGIN_DECLS
 */
 int iso_reset(void);
 
+/** \brief  ISO9660 block cache statistics.
+
+    \headerfile dc/fs_iso9660.h
+*/
+typedef struct iso_cache_stats {
+    uint32 ihits;           /**< \brief Directory block cache hits */
+    uint32 imisses;         /**< \brief Directory block cache misses */
+    uint32 dhits;           /**< \brief Data block cache hits */
+    uint32 dmisses;         /**< \brief Data block cache misses */
+    uint32 readahead;       /**< \brief Sectors fetched by read-ahead */
+    uint32 direct;          /**< \brief Sectors read straight to the caller */
+    uint32 drive_reads;     /**< \brief Read commands sent to the drive */
+    uint32 blocks;          /**< \brief Current data cache size, in blocks */
+    uint32 readahead_max;   /**< \brief Current read-ahead window, in sectors */
+} iso_cache_stats_t;
+
+/** \brief  Configure the ISO9660 data cache.
+
+    This sets the size of the data block cache and the read-ahead window used
+    when a file is read sequentially. Large reads into a 32-byte aligned
+    buffer skip the cache entirely and are done with a single DMA, no matter
+    what is set here.
+
+    The new settings take effect the next time a disc is mounted, which
+    happens when the disc is changed or after iso_reset(). The read-ahead
+    window is limited to half of the cache, and a window of 0 or 1 turns
+    read-ahead off.
+
+    \param  blocks          The number of 2048-byte blocks in the data cache.
+    \param  readahead       The number of sectors to read at once.
+    \retval 0               On success.
+    \retval -1              If blocks is less than 2.
+*/
+int iso_cache_config(size_t blocks, size_t readahead);
+
+/** \brief  Get the ISO9660 block cache statistics.
+
+    \param  stats           Where to store the statistics.
+*/
+void iso_get_cache_stats(iso_cache_stats_t *stats);
+
+/** \brief  Reset the ISO9660 block cache statistics to zero. */
+void iso_reset_cache_stats(void);
+
 /* \cond */
 void fs_iso9660_init(void);
 void fs_iso9660_shutdown(void);
@@ -1504,6 +1504,7 @@ typedef struct pvr_stats {
     size_t   vbl_count;           /**< \brief VBlank count */
     size_t   vtx_buffer_used;     /**< \brief Number of bytes used in the vertex buffer for the last frame */
     size_t   vtx_buffer_used_max; /**< \brief Number of bytes used in the vertex buffer for the largest frame */
+    size_t   hdr_bytes_saved;     /**< \brief Number of header bytes dropped by batching in the last frame */
     float    frame_rate;          /**< \brief Current frame rate (per second) */
     uint32_t enabled_list_mask;   /**< \brief Which lists are enabled? */
     /* ... more later as it's implemented ... */
@@ -1689,9 +1690,52 @@ void pvr_fog_table_custom(float tbl1[]);
     \brief                   Memory management API for VRAM
     \ingroup                 pvr_vram
 
-    PVR memory management in KOS uses a modified dlmalloc; see the
-    source file pvr_mem_core.c for more info. 
+    PVR memory management in KOS uses a TLSF allocator, which takes the same
+    amount of time to allocate or free a block no matter how many there are,
+    and keeps all of its bookkeeping in main RAM. See pvr_mem.c for more info.
+
+    Blocks can be allocated in two ways. pvr_mem_malloc() hands out a pointer,
+    and the block stays put until it is freed. pvr_mem_halloc() hands out a
+    handle instead, which lets pvr_mem_compact() move the block around to
+    squeeze out the gaps left by freeing things.
+*/
+
+/** \brief   Number of size classes in pvr_mem_stats_t.
+    \ingroup pvr_mem_mgmt
+
+    Class 0 is blocks of 32 bytes, and each class after that is blocks of up
+    to twice the size of the one before, up to 8MB.
 */
+#define PVR_MEM_SIZE_CLASSES    19
+
+/** \brief   PVR memory statistics.
+    \ingroup pvr_mem_mgmt
+
+    \headerfile dc/pvr.h
+*/
+typedef struct {
+    size_t  total;          /**< \brief Size of the texture RAM pool */
+    size_t  used;           /**< \brief Bytes allocated right now */
+    size_t  used_max;       /**< \brief Most bytes ever allocated at once */
+    size_t  free_largest;   /**< \brief Size of the biggest free block */
+    size_t  free_blocks;    /**< \brief Number of free blocks */
+    size_t  alloc_fails;    /**< \brief Number of allocations that failed */
+    size_t  moved_bytes;    /**< \brief Bytes moved by pvr_mem_compact() */
+
+    /** \brief Number of blocks allocated right now, by size class */
+    size_t  class_count[PVR_MEM_SIZE_CLASSES];
+    /** \brief Bytes allocated right now, by size class */
+    size_t  class_bytes[PVR_MEM_SIZE_CLASSES];
+    /** \brief Number of allocations ever made, by size class */
+    size_t  class_allocs[PVR_MEM_SIZE_CLASSES];
+} pvr_mem_stats_t;
+
+/** \brief   Handle to a block of PVR memory that can be moved.
+    \ingroup pvr_mem_mgmt
+
+    \see pvr_mem_halloc()
+*/
+typedef struct pvr_mem_block *pvr_mem_handle_t;
 
 /** \brief   Allocate a chunk of memory from texture space.
     \ingroup pvr_mem_mgmt
@@ -1716,6 +1760,75 @@ pvr_ptr_t pvr_mem_malloc(size_t size);
 */
 void pvr_mem_free(pvr_ptr_t chunk);
 
+/** \brief   Allocate a buffer to be accessed through the 32-bit VRAM area.
+    \ingroup pvr_mem_mgmt
+
+    Textures are accessed through the 64-bit area, where VRAM's two banks take
+    turns every 32 bits. Through the 32-bit area, one bank comes after the
+    other instead, so a buffer there covers every other 32-bit word in the
+    64-bit area. This allocates twice the space from the pool to keep anything
+    else from ending up in the words in between, and returns a pointer in the
+    32-bit area (PVR_RAM_BASE). Free it with pvr_mem_free().
+
+    \param  size            The amount of memory to allocate
+
+    \return                 A pointer to the memory on success, NULL on error
+*/
+pvr_ptr_t pvr_mem_malloc32(size_t size);
+
+/** \brief   Allocate a block of PVR memory that can be moved.
+    \ingroup pvr_mem_mgmt
+
+    This works like pvr_mem_malloc(), but pvr_mem_compact() can move the block
+    to somewhere else in VRAM. Use pvr_mem_hptr() to find out where it is,
+    and do so again after every pvr_mem_compact().
+
+    \param  size            The amount of memory to allocate
+
+    \return                 A handle for the memory on success, NULL on error
+*/
+pvr_mem_handle_t pvr_mem_halloc(size_t size);
+
+/** \brief   Get the current location of a block from pvr_mem_halloc().
+    \ingroup pvr_mem_mgmt
+
+    \param  handle          The block to look up
+
+    \return                 Where the block is in VRAM right now
+*/
+pvr_ptr_t pvr_mem_hptr(pvr_mem_handle_t handle);
+
+/** \brief   Free a block allocated with pvr_mem_halloc().
+    \ingroup pvr_mem_mgmt
+
+    \param  handle          The block to free
+*/
+void pvr_mem_hfree(pvr_mem_handle_t handle);
+
+/** \brief   Compact the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    This slides blocks allocated with pvr_mem_halloc() down over the free
+    space below them, so that the free space gathers into bigger blocks.
+    Blocks from pvr_mem_malloc() stay where they are. The data is copied
+    through main RAM and DMAed back into VRAM, so this blocks until it's
+    done.
+
+    \warning
+    Nothing may be rendered from the moved blocks while this runs, and any
+    polygon headers pointing at them have to be recompiled afterwards.
+
+    \return                 The number of blocks moved, or -1 on error.
+*/
+int pvr_mem_compact(void);
+
+/** \brief   Get statistics about the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    \param  stats           Where to put the statistics
+*/
+void pvr_mem_get_stats(pvr_mem_stats_t *stats);
+
 /** \brief   Return the number of bytes available still in the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
@@ -1734,15 +1847,17 @@ void pvr_mem_reset(void);
 /** \brief   Print the list of allocated blocks in the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
-    This function only works if you've enabled KM_DBG in pvr_mem.c.
+    If PVR_KM_DBG is enabled in kos/opts.h, this also shows which thread
+    allocated each block, and from where.
 */
 void pvr_mem_print_list(void);
 
 /** \brief   Print statistics about the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
-    This prints out statistics like what malloc_stats() provides. Also, if
-    KM_DBG is enabled in pvr_mem.c, it prints the list of allocated blocks.
+    This prints out the statistics from pvr_mem_get_stats(). Also, if
+    PVR_KM_DBG is enabled in kos/opts.h, it prints the list of allocated
+    blocks.
 */
 void pvr_mem_stats(void);
 
@@ -1854,6 +1969,80 @@ void *pvr_vertbuf_tail(pvr_list_t list);
 */
 void pvr_vertbuf_written(pvr_list_t list, uint32_t amt);
 
+/** \brief   Reserve space for primitives in the vertex buffer for the given
+             list.
+    \ingroup pvr_vertex_dma
+
+    This lets primitives be written straight into the list's vertex buffer,
+    rather than being built somewhere else and then copied in with
+    pvr_list_prim(). Write up to \p size bytes of primitives at the returned
+    address, then call pvr_list_commit() with how much was actually written.
+    Nothing else may be submitted to the list in between.
+
+    The returned address is always 32-byte aligned. The data is flushed from
+    the cache before it is DMAed, so it can be written with ordinary stores.
+
+    \param  list            The primitive list to write into.
+    \param  size            The number of bytes to reserve. Must be a multiple
+                            of 32.
+
+    \return                 Where to write the primitives, or NULL if there
+                            isn't room for them in the buffer. In that case,
+                            pvr_list_flush() can be used to free up some space.
+
+    \sa pvr_list_commit()
+*/
+void *pvr_list_reserve(pvr_list_t list, size_t size);
+
+/** \brief   Submit primitives written into space from pvr_list_reserve().
+    \ingroup pvr_vertex_dma
+
+    \param  list            The primitive list that was written into.
+    \param  size            The number of bytes written. Must be a multiple of
+                            32, and no more than was reserved.
+
+    \sa pvr_list_reserve()
+*/
+void pvr_list_commit(pvr_list_t list, size_t size);
+
+/** \brief   Turn header batching on or off for a list.
+    \ingroup pvr_vertex_dma
+
+    With batching on, primitives sent with pvr_list_prim() (or pvr_prim()) are
+    held back and grouped by polygon header until the list is finished. Each
+    distinct header is then sent to the TA once, followed by all of the strips
+    that were drawn with it, and the headers are put in order of texture and
+    blending mode. This cuts down on the headers the TA has to take in when a
+    program switches back and forth between a few of them.
+
+    Translucent polygons are not reordered while presort mode is in effect
+    (see pvr_set_presort_mode()). Only headers that are the same as the one
+    just before them are dropped then. In the other lists, polygons drawn with
+    different headers can end up in a different order, which matters only for
+    polygons at exactly the same depth.
+
+    Each call to pvr_list_prim() must start either with a header (which may be
+    followed by vertices) or with vertices. Anything else, such as a user clip
+    command, and anything written with pvr_list_reserve() or
+    pvr_vertbuf_tail(), goes in after everything held back so far.
+
+    Batching only works on lists with a vertex buffer of their own in DMA mode,
+    and takes up a buffer of the same size again to hold things back in. The
+    number of bytes saved is given by pvr_get_stats().
+
+    \param  list            The list to change. Must be PVR_LIST_OP_POLY,
+                            PVR_LIST_TR_POLY or PVR_LIST_PT_POLY.
+    \param  enable          Non-zero to turn batching on, 0 to turn it off.
+
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - the list can't be batched, or isn't being DMAed \n
+    \em     ENOMEM - out of memory
+*/
+int pvr_list_set_batching(pvr_list_t list, int enable);
+
 /** \brief   Set the translucent polygon sort mode for the next frame.
     \ingroup pvr_scene_mgmt
 
@@ -2027,13 +2216,30 @@ int pvr_list_prim(pvr_list_t list, void *data, int size);
 /** \brief   Flush the buffered data of the given list type to the TA.
     \ingroup pvr_list_mgmt
 
-    This function is currently not implemented, and calling it will result in an
-    assertion failure. It is intended to be used later in a "hybrid" mode where
-    both direct and DMA TA submission is possible.
+    In vertex DMA mode, a list's data normally sits in its vertex buffer until
+    pvr_scene_finish() is called, so the buffer has to be big enough for all
+    of it. This function starts DMAing what has been written to the list so
+    far to the TA right away, and returns while that happens. New primitives
+    for the list go into another part of the buffer in the meantime, so
+    calling this whenever the list has filled about half of its buffer lets a
+    much smaller buffer hold a frame, and lets the TA take in the frame while
+    it is still being built.
+
+    Nothing can be sent to the TA for a frame until it is done with the one
+    before, so the first call in a frame may block until the last frame has
+    started rendering. Also, the TA only takes one list at a time. Once part of
+    a list has been flushed, flushing a different one will end the first list
+    for the frame, and nothing more may be submitted to it. The same goes for
+    lists submitted directly in hybrid mode: don't open one while a flushed
+    list is unfinished.
+
+    If the list has no vertex buffer (or DMA mode is not enabled), its data
+    has already gone to the TA, and this does nothing.
 
     \param  list            The list to flush.
-    
-    \retval -1              On error (it is not possible to succeed).
+
+    \retval 0               On success.
+    \retval -1              On error (the TA or the DMA timed out).
 */
 int pvr_list_flush(pvr_list_t list);
 
@@ -2352,6 +2558,160 @@ void pvr_txr_load_ex(const void *src, pvr_ptr_t dst,
 */
 void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags);
 
+/** \defgroup pvr_txr_cache    Texture Cache
+    \brief                     Keeping textures in VRAM only while they're used
+    \ingroup                   pvr_txr_mgmt
+
+    The texture cache lets a program have more textures than fit in VRAM at
+    once. Each texture is registered with pvr_txr_cache_add(), giving it an ID
+    and a copy of its data in main RAM, which has to stay there for as long as
+    the texture is registered. pvr_txr_cache_get() then hands back where the
+    texture is in VRAM, to put in the polygon context. If it isn't in VRAM
+    already, room is made for it and it is DMAed over in the background, and
+    the scene functions make sure it has arrived before anything gets drawn
+    with it.
+
+    Textures are marked as used by pvr_txr_cache_get(), and by compiling a
+    polygon or sprite header that points at them. When VRAM runs out (or the
+    limit given to pvr_txr_cache_init() is reached), the ones that have gone
+    unused the longest are thrown out, as long as they haven't been used in
+    the last couple of frames, since the PVR might still be drawing with them.
+    So a header that is compiled once and then kept around does not count as
+    using its texture; either compile it every frame, or call
+    pvr_txr_cache_get() for the texture every frame.
+
+    The texture cache uses the PVR DMA channel, so it can't be used at the same
+    time as pvr_dma_transfer() is called without holding the DMA lock. None of
+    these functions may be called from an interrupt.
+*/
+
+/** \brief   Texture cache statistics.
+    \ingroup pvr_txr_cache
+
+    The per-frame values are for the last frame that was finished, and are
+    updated along with the totals each time a scene is begun.
+
+    \headerfile dc/pvr.h
+*/
+typedef struct {
+    size_t   hits;                  /**< \brief Lookups that found the texture in VRAM */
+    size_t   misses;                /**< \brief Lookups that had to upload it */
+    uint64_t bytes_uploaded;        /**< \brief Bytes DMAed to VRAM */
+    size_t   evictions;             /**< \brief Textures thrown out of VRAM */
+
+    size_t   frame_hits;            /**< \brief Hits in the last frame */
+    size_t   frame_misses;          /**< \brief Misses in the last frame */
+    size_t   frame_bytes_uploaded;  /**< \brief Bytes DMAed in the last frame */
+
+    size_t   texture_count;         /**< \brief Textures registered */
+    size_t   resident_count;        /**< \brief Textures in VRAM right now */
+    size_t   resident_bytes;        /**< \brief VRAM taken up by them */
+} pvr_txr_cache_stats_t;
+
+/** \brief   Set up the texture cache.
+    \ingroup pvr_txr_cache
+
+    Calling this is optional, and only needed to limit how much VRAM the cache
+    may take up.
+
+    \param  max_bytes       The most VRAM the cached textures may take up at
+                            once, or 0 to let them have as much as is free.
+
+    \retval 0               On success (no error conditions defined).
+*/
+int pvr_txr_cache_init(size_t max_bytes);
+
+/** \brief   Throw out everything in the texture cache.
+    \ingroup pvr_txr_cache
+
+    This waits for any uploads to finish, frees the VRAM used by the cache,
+    and forgets about every registered texture. pvr_shutdown() calls this.
+*/
+void pvr_txr_cache_shutdown(void);
+
+/** \brief   Register a texture with the texture cache.
+    \ingroup pvr_txr_cache
+
+    \param  id              The ID to know the texture by.
+    \param  data            The texture data, laid out just as it should be in
+                            VRAM. This must be 32-byte aligned, and stay where
+                            it is until the texture is removed.
+    \param  size            The size of the texture data, in bytes. This is
+                            rounded up to a multiple of 32.
+
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - size is 0, or data is not 32-byte aligned \n
+    \em     EEXIST - there's already a texture with that ID \n
+    \em     ENOMEM - out of memory
+*/
+int pvr_txr_cache_add(uint32_t id, const void *data, size_t size);
+
+/** \brief   Take a texture out of the texture cache.
+    \ingroup pvr_txr_cache
+
+    This frees the texture's VRAM straight away, so it must not be used by any
+    frame that hasn't finished rendering.
+
+    \param  id              The texture to remove.
+
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     ENOENT - there's no texture with that ID
+*/
+int pvr_txr_cache_remove(uint32_t id);
+
+/** \brief   Get the VRAM address of a cached texture.
+    \ingroup pvr_txr_cache
+
+    If the texture isn't in VRAM, this makes room for it and starts uploading
+    it, without waiting for that to finish. Either way, the texture is marked
+    as used in the current frame.
+
+    \param  id              The texture to look up.
+
+    \return                 Where the texture is in VRAM, or NULL on error
+                            (with errno set as appropriate).
+
+    \par    Error Conditions:
+    \em     ENOENT - there's no texture with that ID \n
+    \em     ENOMEM - there isn't room for it, even after throwing out every
+                     texture that wasn't used recently
+*/
+pvr_ptr_t pvr_txr_cache_get(uint32_t id);
+
+/** \brief   Check whether a cached texture has finished uploading.
+    \ingroup pvr_txr_cache
+
+    \param  id              The texture to check.
+
+    \return                 Non-zero if the texture is in VRAM and ready.
+*/
+int pvr_txr_cache_resident(uint32_t id);
+
+/** \brief   Wait for the texture cache to finish uploading.
+    \ingroup pvr_txr_cache
+
+    The scene functions call this as needed, so there's usually no reason to
+    call it directly, except before writing to VRAM some other way.
+
+    \retval 0               On success.
+    \retval -1              On error, such as being called while a list is
+                            being sent directly to the TA.
+*/
+int pvr_txr_cache_wait(void);
+
+/** \brief   Get statistics about the texture cache.
+    \ingroup pvr_txr_cache
+
+    \param  stats           Where to put the statistics.
+*/
+void pvr_txr_cache_get_stats(pvr_txr_cache_stats_t *stats);
+
 
 /* PVR DMA ***********************************************************/
 /** \defgroup pvr_dma   DMA
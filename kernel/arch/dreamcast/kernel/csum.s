@@ -0,0 +1,220 @@
+! KallistiOS ##version##
+!
+! arch/dreamcast/kernel/csum.s
+!
+! Optimized SH4 assembler version of net_ipv4_checksum_copy(), which copies a
+! block of data and works out its IP-style checksum in the same pass, so the
+! data only has to come through the cache once. The C version in
+! kernel/net/net_ipv4.c, net_ipv4_checksum_copy_ref(), is the reference for
+! what this has to return; examples/dreamcast/network/csum checks the two
+! against each other.
+!
+
+    .text
+    .globl _net_ipv4_checksum_copy
+
+!
+! uint16 net_ipv4_checksum_copy(uint8 *dst, const uint8 *src, size_t bytes,
+!                               uint16 start);
+!
+! r4: dst
+! r5: src
+! r6: bytes
+! r7: start
+!
+! The sum is kept in r2. If the copy starts on an odd address, the first byte
+! is taken on its own, and from then on everything we add up is a byte off
+! from where the checksum wants it. Rather than fix up every word, the sum is
+! byte swapped once before and once after (r3 says whether to). When src and
+! dst line up on 32-bit boundaries, the bulk of the data goes 32 bytes at a
+! time, summed a long at a time with the carries folded back in. Otherwise it
+! goes 16 or 8 bits at a time, which is fine for anything under 64KiB.
+!
+    .align 2
+_net_ipv4_checksum_copy:
+    extu.w  r7, r2          ! sum = start
+    mov     r4, r0
+    xor     r5, r0
+    tst     #1, r0
+    bf/s    .bytes          ! Go a byte at a time if src and dst don't line up
+    mov     #0, r3
+
+    mov     r5, r0
+    tst     #1, r0
+    bt      .even
+    tst     r6, r6
+    bt      .done
+
+    ! Take the first byte on its own, and swap the sum around so that the rest
+    ! of the data lines up with it.
+    mov.b   @r5+, r1
+    add     #-1, r6
+    mov.b   r1, @r4
+    extu.b  r1, r1
+    add     #1, r4
+    add     r1, r2
+    mov     r2, r0
+    shlr16  r0
+    extu.w  r2, r2
+    add     r0, r2          ! sum <= 0xFFFF now
+    swap.b  r2, r2
+    mov     #1, r3
+
+.even:
+    mov     r4, r0
+    xor     r5, r0
+    tst     #2, r0
+    bf      .halves         ! Go 16 bits at a time if they don't line up on 32
+
+    mov     r5, r0
+    tst     #2, r0
+    bt      .aligned
+    mov     #1, r0
+    cmp/hi  r0, r6
+    bf      .tail           ! Less than 2 bytes left
+    mov.w   @r5+, r1
+    add     #-2, r6
+    mov.w   r1, @r4
+    extu.w  r1, r1
+    add     #2, r4
+    add     r1, r2
+
+.aligned:
+    mov     r6, r7
+    shlr2   r7
+    shlr2   r7
+    shlr    r7              ! r7 = number of 32 byte blocks
+    tst     r7, r7
+    bt/s    .words
+    clrt
+
+.block:
+    mov     r5, r0
+    add     #32, r0
+    pref    @r0             ! Prefetch the next block
+    mov.l   @r5+, r0
+    mov.l   @r5+, r1
+    addc    r0, r2
+    mov.l   r0, @r4
+    addc    r1, r2
+    mov.l   r1, @(4, r4)
+    mov.l   @r5+, r0
+    mov.l   @r5+, r1
+    addc    r0, r2
+    mov.l   r0, @(8, r4)
+    addc    r1, r2
+    mov.l   r1, @(12, r4)
+    mov.l   @r5+, r0
+    mov.l   @r5+, r1
+    addc    r0, r2
+    mov.l   r0, @(16, r4)
+    addc    r1, r2
+    mov.l   r1, @(20, r4)
+    mov.l   @r5+, r0
+    mov.l   @r5+, r1
+    addc    r0, r2
+    mov.l   r0, @(24, r4)
+    addc    r1, r2
+    mov.l   r1, @(28, r4)
+    mov     #0, r0
+    addc    r0, r2          ! Fold the carry back in (this can't carry again)
+    dt      r7
+    bf/s    .block
+    add     #32, r4
+
+.words:
+    mov     r6, r0
+    and     #31, r0
+    mov     r0, r6
+
+.wloop:
+    mov     #3, r0
+    cmp/hi  r0, r6
+    bf      .fold           ! Less than 4 bytes left
+    mov.l   @r5+, r1
+    clrt
+    addc    r1, r2
+    mov     #0, r0
+    addc    r0, r2
+    mov.l   r1, @r4
+    add     #-4, r6
+    bra     .wloop
+    add     #4, r4
+
+.fold:
+    mov     r2, r0
+    shlr16  r0
+    extu.w  r2, r2
+    add     r0, r2
+    mov     r2, r0
+    shlr16  r0
+    extu.w  r2, r2
+    add     r0, r2
+
+.tail:
+    mov     #1, r0
+    cmp/hi  r0, r6
+    bf      .last
+    mov.w   @r5+, r1
+    add     #-2, r6
+    mov.w   r1, @r4
+    extu.w  r1, r1
+    add     #2, r4
+    add     r1, r2
+
+.last:
+    tst     r6, r6
+    bt      .done
+    mov.b   @r5, r1
+    mov.b   r1, @r4
+    extu.b  r1, r1
+    add     r1, r2
+
+.done:
+    ! Fold the sum down to 16 bits, swap it back if we need to, and complement
+    ! it to get the result.
+    mov     r2, r0
+    shlr16  r0
+    extu.w  r2, r2
+    add     r0, r2
+    mov     r2, r0
+    shlr16  r0
+    extu.w  r2, r2
+    add     r0, r2
+    tst     r3, r3
+    bt      1f
+    swap.b  r2, r2
+1:
+    not     r2, r0
+    rts
+    extu.w  r0, r0
+
+.halves:
+    mov     #1, r0
+    cmp/hi  r0, r6
+    bf      .last
+    mov.w   @r5+, r1
+    add     #-2, r6
+    mov.w   r1, @r4
+    extu.w  r1, r1
+    add     #2, r4
+    bra     .halves
+    add     r1, r2
+
+.bytes:
+    mov     #1, r0
+    cmp/hi  r0, r6
+    bf      .last
+    mov.b   @r5+, r0
+    mov.b   @r5+, r1
+    mov.b   r0, @r4
+    add     #1, r4
+    mov.b   r1, @r4
+    add     #1, r4
+    extu.b  r0, r0
+    extu.b  r1, r1
+    shll8   r1
+    or      r1, r0
+    add     #-2, r6
+    bra     .bytes
+    add     r0, r2
@@ -181,11 +181,15 @@ int  __weak arch_auto_init(void) {
 
     thd_init();
 
+    if(__kos_init_flags & INIT_THD_TICKLESS)
+        thd_set_mode(THD_MODE_TICKLESS);
+
     nmmgr_init();
 
     fs_init();          /* VFS */
     fs_dev_init();
     fs_null_init();
+    fs_threads_init();
     fs_pty_init();          /* Pty */
     fs_ramdisk_init();      /* Ramdisk */
     KOS_INIT_FLAG_CALL(fs_romdisk_init);    /* Romdisk */
@@ -252,6 +256,7 @@ void  __weak arch_auto_shutdown(void) {
     fs_ramdisk_shutdown();
     KOS_INIT_FLAG_CALL(fs_romdisk_shutdown);
     fs_pty_shutdown();
+    fs_threads_shutdown();
     fs_null_shutdown();
     fs_dev_shutdown();
     thd_shutdown();
@@ -5,6 +5,7 @@
 #include <kos/fs_pty.h>
 #include <kos/fs_dev.h>
 #include <kos/fs_null.h>
+#include <kos/fs_threads.h>
 #include <kos/fs_random.h>
 #include <kos/fs_romdisk.h>
 #include <kos/fs_ramdisk.h>
@@ -435,6 +435,11 @@ void timer_primary_wakeup(uint32_t millis) {
     }
 }
 
+void timer_primary_cancel(void) {
+    timer_stop(TMU0);
+    tp_ms_remaining = 0;
+}
+
 /* Init */
 int timer_init(void) {
     /* Disable all timers */
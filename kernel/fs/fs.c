@@ -35,6 +35,7 @@ something like this:
 #include <stdlib.h>
 #include <limits.h>
 #include <kos/fs.h>
+#include <kos/fs_dcache.h>
 #include <kos/thread.h>
 #include <kos/mutex.h>
 #include <kos/nmmgr.h>
@@ -52,6 +53,10 @@ typedef struct fs_hnd {
 /* The global file descriptor table */
 fs_hnd_t * fd_table[FD_SETSIZE] = { NULL };
 
+/* In poll.c */
+extern void __poll_fd_closed(int fd);
+extern void __poll_event_trigger(int fd, short event);
+
 /* Internal file commands for root dir reading */
 static fs_hnd_t * fs_root_opendir(void) {
     return calloc(1, sizeof(fs_hnd_t));
@@ -280,6 +285,20 @@ void * fs_get_handle(file_t fd) {
     return fd_table[fd]->hnd;
 }
 
+void fs_poll_notify(vfs_handler_t *vfs, void *hnd, short events) {
+    file_t fd;
+    fs_hnd_t *h;
+
+    /* The same file may be open under more than one descriptor, thanks to
+       dup(), so every one of them has to hear about it. */
+    for(fd = 0; fd < FD_SETSIZE; fd++) {
+        h = fd_table[fd];
+
+        if(h && h->handler == vfs && h->hnd == hnd)
+            __poll_event_trigger(fd, events);
+    }
+}
+
 file_t fs_dup(file_t oldfd) {
     /* Make sure it exists */
     if(oldfd < 0 || oldfd >= FD_SETSIZE) {
@@ -340,6 +359,9 @@ int fs_close(file_t fd) {
         return -1;
     }
 
+    /* Make sure nobody is still waiting on it */
+    __poll_fd_closed(fd);
+
     /* Deref it and remove it from our table */
     retval = fs_hnd_unref(hnd);
 
@@ -960,5 +982,6 @@ int fs_init(void) {
 }
 
 void fs_shutdown(void) {
+    fs_dcache_shutdown();
     fs_fdtbl_destroy();
 }
@@ -0,0 +1,218 @@
+/* KallistiOS ##version##
+
+   fs_dcache.c
+
+*/
+
+/* This is a small, fixed-size cache of path lookups that read-only
+   filesystems can share. Entries live in one table that is allocated the
+   first time something is cached. They are found through a hash of the
+   owner, type and lower-cased path, and are kept on an LRU list so the
+   least recently used one can be recycled when the table is full. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/queue.h>
+
+#include <kos/fs_dcache.h>
+#include <kos/mutex.h>
+#include <kos/opts.h>
+
+#define DCACHE_BUCKETS  (FS_DCACHE_ENTRIES / 2)
+
+typedef struct dcache_entry {
+    const void *owner;                  /* Mount this belongs to */
+    uint32_t hash;                      /* Full hash of the key */
+    uint32_t value[2];                  /* Filesystem-defined data */
+    uint8_t dir;                        /* Directory lookup? */
+    uint8_t len;                        /* Length of the path */
+    struct dcache_entry *hnext;         /* Next entry in the hash chain */
+    TAILQ_ENTRY(dcache_entry) lru;      /* LRU list handle */
+    char path[FS_DCACHE_PATH_MAX];      /* The path (not terminated) */
+} dcache_entry_t;
+
+static dcache_entry_t *entries;
+static dcache_entry_t *buckets[DCACHE_BUCKETS];
+static TAILQ_HEAD(dcache_lru, dcache_entry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static mutex_t dcache_mutex = MUTEX_INITIALIZER;
+static bool enabled = true;
+static fs_dcache_stats_t stats;
+
+_Static_assert(FS_DCACHE_PATH_MAX <= 255, "FS_DCACHE_PATH_MAX is too big");
+
+static uint32_t dcache_hash(const void *owner, const char *path, size_t len,
+                            int dir) {
+    uint32_t hash = 2166136261u ^ (uint32_t)(uintptr_t)owner ^ (dir ? 1 : 0);
+
+    /* FNV-1a over the lower-cased path */
+    while(len--)
+        hash = (hash ^ (uint8_t)tolower((unsigned char)*path++)) * 16777619u;
+
+    return hash;
+}
+
+static dcache_entry_t **dcache_bucket(uint32_t hash) {
+    return &buckets[hash % DCACHE_BUCKETS];
+}
+
+static dcache_entry_t *dcache_find(const void *owner, const char *path,
+                                   size_t len, int dir, uint32_t hash) {
+    dcache_entry_t *ent;
+
+    for(ent = *dcache_bucket(hash); ent; ent = ent->hnext) {
+        if(ent->hash == hash && ent->owner == owner && ent->len == len &&
+           ent->dir == (dir ? 1 : 0) && !strncasecmp(ent->path, path, len))
+            return ent;
+    }
+
+    return NULL;
+}
+
+/* Take an entry out of its hash chain and mark it free. */
+static void dcache_unhash(dcache_entry_t *ent) {
+    dcache_entry_t **p;
+
+    if(!ent->owner)
+        return;
+
+    for(p = dcache_bucket(ent->hash); *p; p = &(*p)->hnext) {
+        if(*p == ent) {
+            *p = ent->hnext;
+            break;
+        }
+    }
+
+    ent->owner = NULL;
+    stats.entries--;
+}
+
+bool fs_dcache_lookup(const void *owner, const char *path, size_t len, int dir,
+                      uint32_t value[2]) {
+    dcache_entry_t *ent = NULL;
+
+    if(len > FS_DCACHE_PATH_MAX)
+        return false;
+
+    mutex_lock_scoped(&dcache_mutex);
+
+    if(!enabled)
+        return false;
+
+    if(entries)
+        ent = dcache_find(owner, path, len, dir,
+                          dcache_hash(owner, path, len, dir));
+
+    if(!ent) {
+        stats.misses++;
+        return false;
+    }
+
+    TAILQ_REMOVE(&lru, ent, lru);
+    TAILQ_INSERT_TAIL(&lru, ent, lru);
+
+    value[0] = ent->value[0];
+    value[1] = ent->value[1];
+    stats.hits++;
+
+    return true;
+}
+
+void fs_dcache_insert(const void *owner, const char *path, size_t len, int dir,
+                      const uint32_t value[2]) {
+    dcache_entry_t *ent;
+    uint32_t hash;
+    int i;
+
+    if(!owner || len > FS_DCACHE_PATH_MAX)
+        return;
+
+    mutex_lock_scoped(&dcache_mutex);
+
+    if(!enabled)
+        return;
+
+    if(!entries) {
+        if(!(entries = calloc(FS_DCACHE_ENTRIES, sizeof(dcache_entry_t))))
+            return;
+
+        for(i = 0; i < FS_DCACHE_ENTRIES; i++)
+            TAILQ_INSERT_TAIL(&lru, &entries[i], lru);
+    }
+
+    hash = dcache_hash(owner, path, len, dir);
+
+    /* Reuse the existing entry if there is one, otherwise the LRU one */
+    if(!(ent = dcache_find(owner, path, len, dir, hash))) {
+        ent = TAILQ_FIRST(&lru);
+
+        if(ent->owner) {
+            dcache_unhash(ent);
+            stats.evictions++;
+        }
+
+        ent->owner = owner;
+        ent->hash = hash;
+        ent->dir = dir ? 1 : 0;
+        ent->len = len;
+        memcpy(ent->path, path, len);
+        ent->hnext = *dcache_bucket(hash);
+        *dcache_bucket(hash) = ent;
+
+        stats.inserts++;
+        stats.entries++;
+    }
+
+    ent->value[0] = value[0];
+    ent->value[1] = value[1];
+
+    TAILQ_REMOVE(&lru, ent, lru);
+    TAILQ_INSERT_TAIL(&lru, ent, lru);
+}
+
+void fs_dcache_invalidate(const void *owner) {
+    int i;
+
+    mutex_lock_scoped(&dcache_mutex);
+
+    if(!entries)
+        return;
+
+    /* Freed entries go to the LRU end so they get used first */
+    for(i = 0; i < FS_DCACHE_ENTRIES; i++) {
+        if(entries[i].owner && (!owner || entries[i].owner == owner)) {
+            dcache_unhash(&entries[i]);
+            TAILQ_REMOVE(&lru, &entries[i], lru);
+            TAILQ_INSERT_HEAD(&lru, &entries[i], lru);
+        }
+    }
+}
+
+bool fs_dcache_set_enabled(bool enable) {
+    bool old;
+
+    fs_dcache_invalidate(NULL);
+
+    mutex_lock(&dcache_mutex);
+    old = enabled;
+    enabled = enable;
+    mutex_unlock(&dcache_mutex);
+
+    return old;
+}
+
+void fs_dcache_get_stats(fs_dcache_stats_t *st) {
+    mutex_lock_scoped(&dcache_mutex);
+    *st = stats;
+}
+
+void fs_dcache_shutdown(void) {
+    mutex_lock_scoped(&dcache_mutex);
+
+    free(entries);
+    entries = NULL;
+    memset(buckets, 0, sizeof(buckets));
+    TAILQ_INIT(&lru);
+    memset(&stats, 0, sizeof(stats));
+}
@@ -20,10 +20,13 @@ on sunsite.unc.edu in /pub/Linux/system/recovery/, or as a package under Debian
 #include <kos/thread.h>
 #include <kos/mutex.h>
 #include <kos/fs_romdisk.h>
+#include <kos/fs_dcache.h>
 #include <kos/opts.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
@@ -50,6 +53,31 @@ typedef struct {
 } romdisk_file_t;
 
 
+/* Optional path index that genromfs -i appends to the image. The footer is
+   the last 16 bytes inside full_size; the header and slots are at the offset
+   it gives, followed by the path strings. Each slot holds the hash of a full
+   path (lower-cased, FNV-1a), the offset of its file header (0 if the slot
+   is free) and the offset of the path in the string table. */
+#define ROMIDX_MAGIC    "-romidx-"
+
+typedef struct {
+    char    magic[8];       /* Should be "-romidx-" */
+    uint32  slots;          /* Number of slots (a power of two) */
+    uint32  count;          /* Number of used slots */
+} romdisk_idx_t;
+
+typedef struct {
+    uint32  hash;           /* Hash of the path */
+    uint32  offset;         /* File header offset */
+    uint32  name;           /* Offset of the path in the string table */
+} romdisk_idx_slot_t;
+
+typedef struct {
+    char    magic[8];       /* Should be "-romidx-" */
+    uint32  offset;         /* Offset of the index header */
+    uint32  size;           /* Size of the header, slots and strings */
+} romdisk_idx_footer_t;
+
 /* Util function to reverse the byte order of a uint32 */
 static uint32 ntohl_32(const void *data) {
     const uint8 *d = (const uint8*)data;
@@ -72,6 +100,9 @@ typedef struct rd_image {
     const romdisk_hdr_t * hdr;      /* Pointer to the header */
     uint32          files;      /* Offset in the image to the files area */
     vfs_handler_t       * vfsh;     /* Our VFS mount struct */
+    const romdisk_idx_t * index;    /* Path index, if the image has one */
+    const char      * idxnames; /* Path strings for the index */
+    uint32          idxmask;    /* Number of index slots - 1 */
 } rd_image_t;
 
 /* Global list of mounted romdisks */
@@ -89,16 +120,231 @@ static struct {
     uint32      size;       /* Length of file in bytes */
     dirent_t    dirent;     /* A static dirent to pass back to clients */
     rd_image_t  * mnt;      /* Which mount instance are we using? */
+    uint32      zshift;     /* log2 of the block size if compressed, or 0 */
+    uint8       * map;      /* Decompressed copy for mmap, if any */
 } fh[FS_ROMDISK_MAX_FILES];
 
 /* File type */
 #define ROMFH_DIR   1
+#define ROMFH_REG   2
 
 #define ROMFH_MASK  3
 
 /* Mutex for file handles */
 static mutex_t fh_mutex;
 
+/* Regular files made with genromfs -z may be compressed. Those have a
+   spec_info of ROMFH_ZMAGIC | log2(block size), and their data starts with a
+   table of (blocks + 1) offsets, relative to the start of the data, to each
+   independently LZ4-compressed block. A block that didn't compress is stored
+   as is, which shows as its compressed size being the same as its real
+   size. */
+#define ROMFH_ZMAGIC    0x4c5a3400
+#define ROMFH_ZSHIFT    0x1f
+
+/* Cache of recently decompressed blocks, shared by all files */
+typedef struct {
+    const uint8 * src;      /* Compressed block held, or NULL if unused */
+    uint8       * data;     /* Decompressed data */
+    uint32      size;       /* Bytes of data */
+    uint32      alloc;      /* Size of the data buffer */
+    uint32      used;       /* Last use, for LRU replacement */
+} rd_zblock_t;
+
+static rd_zblock_t zcache[FS_ROMDISK_ZCACHE_BLOCKS];
+static uint32 zstamp;
+static mutex_t zcache_mutex;
+
+/* Decode one LZ4 block into dst, which must have room for exactly dlen
+   bytes. Returns 0 on success, or -1 if the data is corrupt. */
+static int romdisk_lz4_decode(const uint8 *src, uint32 slen, uint8 *dst,
+                              uint32 dlen) {
+    const uint8 *send = src + slen, *match;
+    uint8 *d = dst, *dend = dst + dlen;
+    uint32 len, off, b;
+    uint8 token;
+
+    while(src < send) {
+        token = *src++;
+
+        /* Literals */
+        if((len = token >> 4) == 15) {
+            do {
+                if(src >= send)
+                    return -1;
+
+                b = *src++;
+                len += b;
+            } while(b == 255);
+        }
+
+        if(len > (uint32)(send - src) || len > (uint32)(dend - d))
+            return -1;
+
+        memcpy(d, src, len);
+        d += len;
+        src += len;
+
+        /* The last sequence is only literals */
+        if(src == send)
+            break;
+
+        /* Match */
+        if(send - src < 2)
+            return -1;
+
+        off = src[0] | (src[1] << 8);
+        src += 2;
+
+        if(!off || off > (uint32)(d - dst))
+            return -1;
+
+        if((len = (token & 15) + 4) == 19) {
+            do {
+                if(src >= send)
+                    return -1;
+
+                b = *src++;
+                len += b;
+            } while(b == 255);
+        }
+
+        if(len > (uint32)(dend - d))
+            return -1;
+
+        /* Matches may overlap what they write, so copy bytewise */
+        for(match = d - off; len; len--)
+            *d++ = *match++;
+    }
+
+    return d == dend ? 0 : -1;
+}
+
+/* Decompress block blk of a compressed file into dst. */
+static int romdisk_zdecode(file_t fd, uint32 blk, uint8 *dst, uint32 size) {
+    const uint8 *base = fh[fd].mnt->image + fh[fd].index;
+    uint32 start = ntohl_32(base + blk * 4);
+    uint32 end = ntohl_32(base + blk * 4 + 4);
+
+    if(end - start == size) {
+        memcpy(dst, base + start, size);
+        return 0;
+    }
+
+    return romdisk_lz4_decode(base + start, end - start, dst, size);
+}
+
+/* Size of block blk of a compressed file. */
+static uint32 romdisk_zsize(file_t fd, uint32 blk) {
+    uint32 pos = blk << fh[fd].zshift;
+
+    return (fh[fd].size - pos) < (1UL << fh[fd].zshift) ?
+           fh[fd].size - pos : (1UL << fh[fd].zshift);
+}
+
+/* Find block blk of a compressed file in the cache, decompressing it into
+   the least recently used slot if it isn't there. Call with zcache_mutex
+   held. */
+static rd_zblock_t *romdisk_zblock(file_t fd, uint32 blk) {
+    const uint8 *src = fh[fd].mnt->image + fh[fd].index + blk * 4;
+    rd_zblock_t *z, *victim = zcache;
+    uint32 size = romdisk_zsize(fd, blk);
+    uint8 *data;
+    int i;
+
+    /* Blocks are known by where their table entry is in the image */
+    for(i = 0; i < FS_ROMDISK_ZCACHE_BLOCKS; i++) {
+        z = &zcache[i];
+
+        if(z->src == src) {
+            z->used = ++zstamp;
+            return z;
+        }
+
+        if(z->used < victim->used)
+            victim = z;
+    }
+
+    if(victim->alloc < size) {
+        if(!(data = realloc(victim->data, size)))
+            return NULL;
+
+        victim->data = data;
+        victim->alloc = size;
+    }
+
+    victim->src = NULL;
+    victim->used = 0;
+
+    if(romdisk_zdecode(fd, blk, victim->data, size) < 0) {
+        dbglog(DBG_ERROR, "fs_romdisk: corrupt compressed block %lu\n",
+               (unsigned long)blk);
+        return NULL;
+    }
+
+    victim->src = src;
+    victim->size = size;
+    victim->used = ++zstamp;
+
+    return victim;
+}
+
+/* Read from a compressed file. Whole blocks go straight to the caller's
+   buffer; partial ones come through the cache. */
+static ssize_t romdisk_zread(file_t fd, uint8 *buf, size_t bytes) {
+    uint32 bmask = (1UL << fh[fd].zshift) - 1, blk, off, n;
+    rd_zblock_t *z;
+    size_t done = 0;
+
+    mutex_lock_scoped(&zcache_mutex);
+
+    while(done < bytes) {
+        blk = fh[fd].ptr >> fh[fd].zshift;
+        off = fh[fd].ptr & bmask;
+        n = romdisk_zsize(fd, blk);
+
+        if(!off && bytes - done >= n) {
+            if(romdisk_zdecode(fd, blk, buf + done, n) < 0) {
+                errno = EIO;
+                return done ? (ssize_t)done : -1;
+            }
+        }
+        else {
+            if(!(z = romdisk_zblock(fd, blk))) {
+                errno = EIO;
+                return done ? (ssize_t)done : -1;
+            }
+
+            n = z->size - off;
+
+            if(n > bytes - done)
+                n = bytes - done;
+
+            memcpy(buf + done, z->data + off, n);
+        }
+
+        done += n;
+        fh[fd].ptr += n;
+    }
+
+    return done;
+}
+
+/* Forget cached blocks from an image that's going away. */
+static void romdisk_zcache_drop(rd_image_t *mnt) {
+    const uint8 *end = mnt->image + ntohl_32(&mnt->hdr->full_size);
+    int i;
+
+    mutex_lock_scoped(&zcache_mutex);
+
+    for(i = 0; i < FS_ROMDISK_ZCACHE_BLOCKS; i++) {
+        if(zcache[i].src >= mnt->image && zcache[i].src < end) {
+            zcache[i].src = NULL;
+            zcache[i].used = 0;
+        }
+    }
+}
+
 /* Given a filename and a starting romdisk directory listing (byte offset),
    search for the entry in the directory and return the byte offset to its
    entry. */
@@ -137,8 +383,9 @@ static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn, size_t fnlen
             }
         }
 
-        /* Check filename */
-        if((strlen(fhdr->filename) == fnlen) && (!strncasecmp(fhdr->filename, fn, fnlen))) {
+        /* Check filename; the names are terminated, so a match followed by
+           the end of the stored name means the lengths match too. */
+        if(!strncasecmp(fhdr->filename, fn, fnlen) && !fhdr->filename[fnlen]) {
             /* Match: return this index */
             return i;
         }
@@ -151,6 +398,64 @@ static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn, size_t fnlen
     return 0;
 }
 
+/* Look a path up in the image's index. Returns the header offset, or 0 if
+   it isn't there; since the index holds every file and directory, a miss
+   means the object doesn't exist, as long as the path is in the plain form
+   the index uses (no leading, trailing or doubled slashes, and no "." or
+   ".." parts). */
+static uint32 romdisk_index_find(rd_image_t *mnt, const char *fn, size_t len,
+                                 int dir) {
+    const romdisk_idx_slot_t *slot;
+    const romdisk_file_t *fhdr;
+    const char *name;
+    uint32 hash = 2166136261u, i, n, off;
+    size_t j;
+
+    for(j = 0; j < len; j++)
+        hash = (hash ^ (uint8)tolower((unsigned char)fn[j])) * 16777619u;
+
+    for(i = hash, n = 0; n <= mnt->idxmask; i++, n++) {
+        slot = (const romdisk_idx_slot_t *)(mnt->index + 1) + (i & mnt->idxmask);
+
+        if(!(off = ntohl_32(&slot->offset)))
+            return 0;
+
+        if(ntohl_32(&slot->hash) != hash)
+            continue;
+
+        name = mnt->idxnames + ntohl_32(&slot->name);
+
+        if(!strncasecmp(name, fn, len) && !name[len]) {
+            fhdr = (const romdisk_file_t *)(mnt->image + off);
+            return (ntohl_32(&fhdr->next_header) & ROMFH_MASK) ==
+                   (dir ? ROMFH_DIR : ROMFH_REG) ? off : 0;
+        }
+    }
+
+    return 0;
+}
+
+/* Is this path in the form the index stores? */
+static int romdisk_index_plain(const char *fn, size_t len) {
+    size_t i, start = 0;
+
+    if(!len)
+        return 0;
+
+    for(i = 0; i <= len; i++) {
+        if(i == len || fn[i] == '/') {
+            /* Empty, "." and ".." components all need a real walk */
+            if(i == start || (fn[start] == '.' && (i - start == 1 ||
+               (i - start == 2 && fn[start + 1] == '.'))))
+                return 0;
+
+            start = i + 1;
+        }
+    }
+
+    return 1;
+}
+
 /* Locate an object anywhere in the image, starting at the root, and
    expecting a fully qualified path name. This is analogous to the
    find_object_path in iso9660.
@@ -158,24 +463,51 @@ static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn, size_t fnlen
    fn:      object filename (absolute path)
    dir:     0 if looking for a file, 1 if looking for a dir
 
+   Lookups go through the path cache. Each entry holds the offset of the
+   object's header and, for directories, the offset of its listing. On a
+   miss, the walk starts from the deepest directory along the path that is
+   already cached, and every directory it passes through is cached.
+
    It will return an offset in the romdisk image for the object. */
 static uint32 romdisk_find(rd_image_t * mnt, const char *fn, int dir) {
-    const char      *cur;
-    uint32          i;
+    const char      *path = fn, *cur;
+    size_t          len = strlen(fn);
+    uint32_t        v[2];
     const romdisk_file_t    *fhdr;
 
+    /* Images with an index can answer most lookups straight away */
+    if(mnt->index) {
+        if((v[0] = romdisk_index_find(mnt, fn, len, dir)))
+            return v[0];
+
+        if(romdisk_index_plain(fn, len))
+            return 0;
+    }
+
+    if(fs_dcache_lookup(mnt, path, len, dir, v))
+        return v[0];
+
+    /* Find the deepest directory we already know about */
+    v[1] = mnt->files;
+
+    for(cur = path + len; cur > path; cur--) {
+        if(*cur == '/' && fs_dcache_lookup(mnt, path, cur - path, 1, v)) {
+            fn = cur + 1;
+            break;
+        }
+    }
+
     /* If the object is in a sub-tree, traverse the trees looking
        for the right directory. */
-    i = mnt->files;
-
     while((cur = strchr(fn, '/'))) {
         if(cur != fn) {
-            i = romdisk_find_object(mnt, fn, cur - fn, 1, i);
+            v[0] = romdisk_find_object(mnt, fn, cur - fn, 1, v[1]);
 
-            if(i == 0) return 0;
+            if(v[0] == 0) return 0;
 
-            fhdr = (const romdisk_file_t *)(mnt->image + i);
-            i = ntohl_32(&fhdr->spec_info);
+            fhdr = (const romdisk_file_t *)(mnt->image + v[0]);
+            v[1] = ntohl_32(&fhdr->spec_info);
+            fs_dcache_insert(mnt, path, cur - path, 1, v);
         }
 
         fn = cur + 1;
@@ -183,15 +515,23 @@ static uint32 romdisk_find(rd_image_t * mnt, const char *fn, int dir) {
 
     /* Locate the file in the resulting directory */
     if(*fn) {
-        i = romdisk_find_object(mnt, fn, strlen(fn), dir, i);
-        return i;
+        v[0] = romdisk_find_object(mnt, fn, len - (fn - path), dir, v[1]);
+
+        if(v[0] == 0) return 0;
+
+        fhdr = (const romdisk_file_t *)(mnt->image + v[0]);
+        v[1] = dir ? ntohl_32(&fhdr->spec_info) : 0;
     }
     else {
         if(!dir)
             return 0;
-        else
-            return i;
+
+        v[0] = v[1];
     }
+
+    fs_dcache_insert(mnt, path, len, dir, v);
+
+    return v[0];
 }
 
 /* Open a file or directory */
@@ -242,6 +582,12 @@ static void * romdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
     fh[fd].ptr = 0;
     fh[fd].size = ntohl_32(&fhdr->size);
     fh[fd].mnt = mnt;
+    fh[fd].map = NULL;
+    fh[fd].zshift = 0;
+
+    if(!fh[fd].dir &&
+       (ntohl_32(&fhdr->spec_info) & ~ROMFH_ZSHIFT) == ROMFH_ZMAGIC)
+        fh[fd].zshift = ntohl_32(&fhdr->spec_info) & ROMFH_ZSHIFT;
 
     return (void *)fd;
 }
@@ -252,6 +598,9 @@ static int romdisk_close(void * h) {
 
     /* Check that the fd is valid */
     if(fd < FS_ROMDISK_MAX_FILES) {
+        free(fh[fd].map);
+        fh[fd].map = NULL;
+
         /* No need to lock the mutex: this is an atomic op */
         fh[fd].index = 0;
     }
@@ -272,6 +621,9 @@ static ssize_t romdisk_read(void * h, void *buf, size_t bytes) {
     if((fh[fd].ptr + bytes) > fh[fd].size)
         bytes = fh[fd].size - fh[fd].ptr;
 
+    if(fh[fd].zshift)
+        return romdisk_zread(fd, (uint8 *)buf, bytes);
+
     /* Copy out the requested amount */
     memcpy(buf, fh[fd].mnt->image + fh[fd].index + fh[fd].ptr, bytes);
     fh[fd].ptr += bytes;
@@ -402,12 +754,38 @@ static dirent_t *romdisk_readdir(void * h) {
 
 static void *romdisk_mmap(void * h) {
     file_t fd = (file_t)h;
+    uint32 blk, pos;
 
     if(fd >= FS_ROMDISK_MAX_FILES || fh[fd].index == 0) {
         errno = EINVAL;
         return NULL;
     }
 
+    /* Compressed files have to be unpacked in full to be mapped */
+    if(fh[fd].zshift) {
+        if(fh[fd].map)
+            return fh[fd].map;
+
+        if(!(fh[fd].map = malloc(fh[fd].size ? fh[fd].size : 1))) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        for(blk = 0, pos = 0; pos < fh[fd].size; blk++) {
+            if(romdisk_zdecode(fd, blk, fh[fd].map + pos,
+                               romdisk_zsize(fd, blk)) < 0) {
+                free(fh[fd].map);
+                fh[fd].map = NULL;
+                errno = EIO;
+                return NULL;
+            }
+
+            pos += romdisk_zsize(fd, blk);
+        }
+
+        return fh[fd].map;
+    }
+
     /* Can't really help the loss of "const" here */
     return (void *)(fh[fd].mnt->image + fh[fd].index);
 }
@@ -600,6 +978,7 @@ void fs_romdisk_init(void) {
 
     /* Init thread mutexes */
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&zcache_mutex, MUTEX_TYPE_NORMAL);
 
     initted = 1;
 }
@@ -607,6 +986,7 @@ void fs_romdisk_init(void) {
 /* De-init the file system; also unmounts any mounted images. */
 void fs_romdisk_shutdown(void) {
     rd_image_t *n, *c;
+    int i;
 
     if(!initted)
         return;
@@ -625,6 +1005,9 @@ void fs_romdisk_shutdown(void) {
 
         assert((void *)&c->vfsh->nmmgr == (void *)c->vfsh);
 
+        fs_dcache_invalidate(c);
+        romdisk_zcache_drop(c);
+
         if(c->own_buffer)
             free((void *)c->image);
 
@@ -635,12 +1018,63 @@ void fs_romdisk_shutdown(void) {
         c = n;
     }
 
-    /* Free mutex */
+    /* Free any open mappings and the block cache */
+    for(i = 0; i < FS_ROMDISK_MAX_FILES; i++) {
+        free(fh[i].map);
+        fh[i].map = NULL;
+    }
+
+    for(i = 0; i < FS_ROMDISK_ZCACHE_BLOCKS; i++)
+        free(zcache[i].data);
+
+    memset(zcache, 0, sizeof(zcache));
+
+    /* Free mutexes */
     mutex_destroy(&fh_mutex);
+    mutex_destroy(&zcache_mutex);
 
     initted = 0;
 }
 
+/* Look for a path index at the end of the image and check that it makes
+   sense before using it. Images without one work exactly as before. */
+static void romdisk_find_index(rd_image_t *mnt) {
+    const romdisk_idx_footer_t *ftr;
+    const romdisk_idx_t *idx;
+    uint32 full, off, size, slots;
+
+    mnt->index = NULL;
+    full = ntohl_32(&mnt->hdr->full_size);
+
+    if(full < mnt->files + sizeof(romdisk_idx_t) + sizeof(*ftr) || (full & 15))
+        return;
+
+    ftr = (const romdisk_idx_footer_t *)(mnt->image + full - sizeof(*ftr));
+    off = ntohl_32(&ftr->offset);
+    size = ntohl_32(&ftr->size);
+
+    if(memcmp(ftr->magic, ROMIDX_MAGIC, 8) || (off & 15) || off < mnt->files ||
+       size < sizeof(romdisk_idx_t) || off + size != full - sizeof(*ftr))
+        return;
+
+    idx = (const romdisk_idx_t *)(mnt->image + off);
+    slots = ntohl_32(&idx->slots);
+
+    if(memcmp(idx->magic, ROMIDX_MAGIC, 8) || !slots || (slots & (slots - 1)) ||
+       slots > size / sizeof(romdisk_idx_slot_t) ||
+       ntohl_32(&idx->count) > slots)
+        return;
+
+    mnt->index = idx;
+    mnt->idxmask = slots - 1;
+    mnt->idxnames = (const char *)idx +
+                    ((sizeof(romdisk_idx_t) + slots * sizeof(romdisk_idx_slot_t) +
+                      15) & ~15);
+
+    dbglog(DBG_DEBUG, "fs_romdisk: image has a path index of %lu entries\n",
+           (unsigned long)ntohl_32(&idx->count));
+}
+
 /* Mount a romdisk image; must have called fs_romdisk_init() earlier.
    Also note that we do _not_ take ownership of the image data if
    own_buffer is 0, so if you malloc'd that buffer, you must
@@ -678,6 +1112,7 @@ int fs_romdisk_mount(const char * mountpoint, const uint8 *img, int own_buffer)
     mnt->hdr = hdr;
     mnt->files = sizeof(romdisk_hdr_t)
                  + (strlen(hdr->volume_name) / 16) * 16;
+    romdisk_find_index(mnt);
 
     /* Make a VFS struct */
     vfsh = (vfs_handler_t *)malloc(sizeof(vfs_handler_t));
@@ -732,6 +1167,10 @@ int fs_romdisk_unmount(const char * mountpoint) {
         assert((void *)&n->vfsh->nmmgr == (void *)n->vfsh);
         nmmgr_handler_remove(&n->vfsh->nmmgr);
 
+        /* Forget its paths and blocks before the memory can be reused */
+        fs_dcache_invalidate(n);
+        romdisk_zcache_drop(n);
+
         /* If we own the buffer, free it */
         if(n->own_buffer)
             free((void *)n->image);
@@ -15,6 +15,7 @@
 #include <malloc.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -504,6 +505,269 @@ ssize_t sendto(int sock, const void *message, size_t length, int flags,
                                  dest_len);
 }
 
+/* Make sure none of the messages has a bogus number of pieces, before anything
+   goes looking at the pieces themselves. */
+static int mmsg_check(const struct mmsghdr *msgvec, unsigned int vlen) {
+    unsigned int i;
+
+    for(i = 0; i < vlen; ++i) {
+        if(msgvec[i].msg_hdr.msg_iovlen < 0 ||
+           msgvec[i].msg_hdr.msg_iovlen > IOV_MAX) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout) {
+    net_socket_t *hnd;
+    struct msghdr *m;
+    unsigned int i;
+    int j;
+    ssize_t r;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(mmsg_check(msgvec, vlen))
+        return -1;
+
+    if(hnd->protocol->recvmmsg)
+        return hnd->protocol->recvmmsg(hnd, msgvec, vlen, flags, timeout);
+
+    /* Otherwise, do it a piece at a time. Only the very first piece is allowed
+       to wait for anything. */
+    for(i = 0; i < vlen; ++i) {
+        m = &msgvec[i].msg_hdr;
+        m->msg_flags = 0;
+        msgvec[i].msg_len = 0;
+
+        for(j = 0; j < m->msg_iovlen; ++j) {
+            r = hnd->protocol->recvfrom(hnd, m->msg_iov[j].iov_base,
+                                        m->msg_iov[j].iov_len, flags,
+                                        j ? NULL : m->msg_name,
+                                        j ? NULL : &m->msg_namelen);
+
+            if(r < 0) {
+                if(!i && !j)
+                    return -1;
+
+                return msgvec[i].msg_len ? i + 1 : i;
+            }
+
+            flags |= MSG_DONTWAIT;
+            msgvec[i].msg_len += r;
+
+            if((size_t)r < m->msg_iov[j].iov_len)
+                break;
+        }
+
+        if(!msgvec[i].msg_len && m->msg_iovlen)
+            return i + 1;
+    }
+
+    return i;
+}
+
+int sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    net_socket_t *hnd;
+    struct msghdr *m;
+    unsigned int i;
+    int j;
+    ssize_t r;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(mmsg_check(msgvec, vlen))
+        return -1;
+
+    if(hnd->protocol->sendmmsg)
+        return hnd->protocol->sendmmsg(hnd, msgvec, vlen, flags);
+
+    /* Otherwise, do it a piece at a time. */
+    for(i = 0; i < vlen; ++i) {
+        m = &msgvec[i].msg_hdr;
+        msgvec[i].msg_len = 0;
+
+        for(j = 0; j < m->msg_iovlen; ++j) {
+            r = hnd->protocol->sendto(hnd, m->msg_iov[j].iov_base,
+                                      m->msg_iov[j].iov_len, flags,
+                                      (struct sockaddr *)m->msg_name,
+                                      m->msg_name ? m->msg_namelen : 0);
+
+            if(r < 0) {
+                if(!i && !msgvec[i].msg_len)
+                    return -1;
+
+                return msgvec[i].msg_len ? (int)i + 1 : (int)i;
+            }
+
+            msgvec[i].msg_len += r;
+
+            /* A stream socket may only have taken part of it. Anything after
+               that can't go out without leaving a hole, so stop here. */
+            if((size_t)r < m->msg_iov[j].iov_len)
+                return i + 1;
+        }
+    }
+
+    return i;
+}
+
+/* How much of a file sendfile() reads in at a time when it can't map it. */
+#define SENDFILE_CHUNK  4096
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    net_socket_t *hnd;
+    const uint8 *map;
+    uint8 *buf = NULL;
+    off_t pos, start = -1;
+    size_t total, done = 0, o;
+    ssize_t r = 0, cnt;
+    int err = errno;
+
+    hnd = (net_socket_t *)fs_get_handle(out_fd);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(out_fd) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    /* Figure out where in the file we're starting. If the caller didn't give
+       us an offset and the file can't tell us, it's not seekable, so just read
+       it from wherever it is. */
+    if(offset) {
+        if(*offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        pos = *offset;
+    }
+    else if(!fs_get_handle(in_fd)) {
+        errno = EBADF;
+        return -1;
+    }
+    else {
+        pos = fs_tell(in_fd);
+    }
+
+    if(pos >= 0 && (map = (const uint8 *)fs_mmap(in_fd))) {
+        /* The whole file is already sitting in memory, so the protocol can take
+           it straight from there. */
+        total = fs_total(in_fd);
+
+        if((size_t)pos >= total)
+            count = 0;
+        else if(count > total - pos)
+            count = total - pos;
+
+        while(done < count) {
+            if((r = hnd->protocol->sendto(hnd, map + pos + done, count - done,
+                                          0, NULL, 0)) <= 0)
+                break;
+
+            done += r;
+        }
+    }
+    else {
+        /* Not everything can be mapped (fs_mmap() will have set errno to say
+           so), so we have to read it in a chunk at a time instead. */
+        errno = err;
+
+        if(!(buf = (uint8 *)malloc(SENDFILE_CHUNK))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if(offset) {
+            if((start = fs_tell(in_fd)) < 0 ||
+               fs_seek(in_fd, pos, SEEK_SET) < 0) {
+                free(buf);
+                return -1;
+            }
+        }
+
+        while(done < count) {
+            cnt = fs_read(in_fd, buf, count - done < SENDFILE_CHUNK ?
+                          count - done : SENDFILE_CHUNK);
+
+            if(cnt <= 0) {
+                r = cnt;
+                break;
+            }
+
+            for(o = 0; o < (size_t)cnt; o += r, done += r) {
+                if((r = hnd->protocol->sendto(hnd, buf + o, cnt - o, 0, NULL,
+                                              0)) <= 0)
+                    break;
+            }
+
+            if(o < (size_t)cnt)
+                break;
+        }
+
+        free(buf);
+    }
+
+    /* Leave the file where the caller expects it. If we read more than the
+       socket would take, this puts back whatever didn't get sent. */
+    if(offset) {
+        *offset = pos + done;
+
+        if(start >= 0)
+            fs_seek(in_fd, start, SEEK_SET);
+    }
+    else if(pos >= 0) {
+        fs_seek(in_fd, pos + done, SEEK_SET);
+    }
+
+    if(r < 0 && !done)
+        return -1;
+
+    return done;
+}
+
 int shutdown(int sock, int how) {
     net_socket_t *hnd;
 
@@ -0,0 +1,438 @@
+/* KallistiOS ##version##
+
+   fs_threads.c
+
+*/
+
+/* This is a read-only /dev node that renders the scheduler's per-thread
+   statistics as text. The whole report is generated when the file is opened
+   and then served out of a buffer, so a reader always sees one consistent
+   snapshot no matter how slowly it reads. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <errno.h>
+#include <arch/types.h>
+#include <arch/irq.h>
+#include <kos/mutex.h>
+#include <kos/thread.h>
+#include <kos/fs_threads.h>
+#include <sys/queue.h>
+
+/* Longest label we print, so the table stays readable */
+#define THREADS_LABEL_LEN   32
+
+/* Room for one thread line plus all of its wait object lines */
+#define THREADS_ROW_SIZE    (192 + KTHREAD_WAIT_STATS * 96)
+
+/* Copy of everything we want to print about one thread */
+typedef struct threads_snap {
+    tid_t tid;
+    prio_t prio;
+    kthread_state_t state;
+    size_t stack_size;
+    uint64_t cpu_time;
+    kthread_stats_t stats;
+    char label[THREADS_LABEL_LEN];
+} threads_snap_t;
+
+/* File handles */
+typedef struct threads_fh_str {
+    char *data;                             /* rendered snapshot */
+    size_t size;                            /* size of the snapshot */
+    size_t ptr;                             /* current read position */
+
+    TAILQ_ENTRY(threads_fh_str) listent;    /* list entry */
+} threads_fh_t;
+
+/* Linked list of open files (controlled by "mutex") */
+static TAILQ_HEAD(threads_fh_list, threads_fh_str) threads_fh;
+
+/* Thread mutex for threads_fh access */
+static mutex_t fh_mutex;
+
+/* State passed through thd_each() while taking a snapshot */
+typedef struct threads_walk {
+    threads_snap_t *snap;
+    int cnt;
+    int max;
+} threads_walk_t;
+
+static int threads_count_cb(kthread_t *thd, void *data) {
+    (void)thd;
+
+    ((threads_walk_t *)data)->max++;
+    return 0;
+}
+
+static int threads_snap_cb(kthread_t *thd, void *data) {
+    threads_walk_t *walk = (threads_walk_t *)data;
+    threads_snap_t *s;
+
+    /* Threads created since we counted just don't make it in */
+    if(walk->cnt >= walk->max)
+        return 1;
+
+    s = &walk->snap[walk->cnt++];
+    s->tid = thd->tid;
+    s->prio = thd->prio;
+    s->state = thd->state;
+    s->stack_size = thd->stack_size;
+    s->cpu_time = thd_get_cpu_time(thd);
+    thd_get_stats(thd, &s->stats);
+    strncpy(s->label, thd->label, THREADS_LABEL_LEN - 1);
+    s->label[THREADS_LABEL_LEN - 1] = '\0';
+
+    return 0;
+}
+
+static const char *threads_state_str(kthread_state_t state) {
+    switch(state) {
+        case STATE_ZOMBIE:
+            return "zombie";
+        case STATE_RUNNING:
+            return "running";
+        case STATE_READY:
+            return "ready";
+        case STATE_WAIT:
+            return "wait";
+        case STATE_FINISHED:
+            return "finished";
+        default:
+            return "unknown";
+    }
+}
+
+/* Render one snapshot into buf, which has room for every row */
+static size_t threads_render(char *buf, size_t len, const threads_snap_t *snap,
+                             int cnt) {
+    const kthread_wait_stat_t *ws;
+    size_t pos;
+    int i, j;
+
+    pos = snprintf(buf, len, "%5s %4s %-8s %14s %8s %8s %14s %12s %14s "
+                   "%13s  %s\n", "tid", "prio", "state", "cpu", "vol",
+                   "invol", "runq", "runq_max", "wait", "stack", "name");
+
+    for(i = 0; i < cnt && pos < len; i++) {
+        pos += snprintf(buf + pos, len - pos, "%5d %4d %-8s %14llu %8lu "
+                        "%8lu %14llu %12llu %14llu %6lu/%-6lu  %s\n",
+                        (int)snap[i].tid, (int)snap[i].prio,
+                        threads_state_str(snap[i].state),
+                        snap[i].cpu_time,
+                        (unsigned long)snap[i].stats.vol_switches,
+                        (unsigned long)snap[i].stats.invol_switches,
+                        snap[i].stats.runq_time, snap[i].stats.runq_max,
+                        snap[i].stats.wait_time,
+                        (unsigned long)snap[i].stats.stack_max,
+                        (unsigned long)snap[i].stack_size, snap[i].label);
+
+        for(j = 0; j < KTHREAD_WAIT_STATS && pos < len; j++) {
+            ws = &snap[i].stats.waits[j];
+
+            if(!ws->obj)
+                continue;
+
+            pos += snprintf(buf + pos, len - pos,
+                            "      wait %08lx %-16.16s %8lu %14llu\n",
+                            (unsigned long)ws->obj,
+                            ws->msg ? ws->msg : "?",
+                            (unsigned long)ws->count, ws->time);
+        }
+    }
+
+    return pos < len ? pos : len - 1;
+}
+
+/* openfile function */
+static threads_fh_t *threads_open_file(vfs_handler_t *vfs, const char *fn,
+                                       int mode) {
+    threads_walk_t walk = { NULL, 0, 0 };
+    threads_fh_t *fd;
+    size_t len;
+    int old;
+
+    (void)vfs;
+    (void)fn;
+
+    /* This is a read-only file */
+    if((mode & O_MODE_MASK) != O_RDONLY) {
+        errno = EROFS;
+        return NULL;
+    }
+
+    /* Count the threads, then copy out their stats. The thread list can't be
+       walked safely while threads come and go, so keep interrupts off while
+       doing it, but don't do anything slow in there. */
+    old = irq_disable();
+    thd_each(threads_count_cb, &walk);
+    irq_restore(old);
+
+    /* Leave some slack for threads created in the meantime */
+    walk.max += 4;
+    walk.snap = malloc(walk.max * sizeof(threads_snap_t));
+    len = (walk.max + 1) * THREADS_ROW_SIZE;
+
+    fd = malloc(sizeof(threads_fh_t));
+
+    if(fd)
+        fd->data = malloc(len);
+
+    if(!walk.snap || !fd || !fd->data) {
+        if(fd)
+            free(fd->data);
+
+        free(fd);
+        free(walk.snap);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    old = irq_disable();
+    thd_each(threads_snap_cb, &walk);
+    irq_restore(old);
+
+    /* Fill in the filehandle struct */
+    fd->size = threads_render(fd->data, len, walk.snap, walk.cnt);
+    fd->ptr = 0;
+
+    free(walk.snap);
+
+    return fd;
+}
+
+/* open function */
+static void *threads_open(vfs_handler_t *vfs, const char *path, int mode) {
+    threads_fh_t *fh = threads_open_file(vfs, path, mode);
+
+    if(!fh)
+        return NULL;
+
+    /* link the fh onto the top of the list */
+    mutex_lock(&fh_mutex);
+    TAILQ_INSERT_TAIL(&threads_fh, fh, listent);
+    mutex_unlock(&fh_mutex);
+
+    return (void *)fh;
+}
+
+/* Verify that a given hnd is actually in the list */
+static int threads_verify_hnd(void *hnd) {
+    threads_fh_t *cur;
+    int rv = 0;
+
+    mutex_lock(&fh_mutex);
+    TAILQ_FOREACH(cur, &threads_fh, listent) {
+        if((void *)cur == hnd) {
+            rv = 1;
+            break;
+        }
+    }
+    mutex_unlock(&fh_mutex);
+
+    return rv;
+}
+
+/* close a file */
+static int threads_close(void *hnd) {
+    threads_fh_t *fh;
+
+    /* Check the handle */
+    if(!threads_verify_hnd(hnd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    fh = (threads_fh_t *)hnd;
+
+    mutex_lock(&fh_mutex);
+    TAILQ_REMOVE(&threads_fh, fh, listent);
+    mutex_unlock(&fh_mutex);
+
+    free(fh->data);
+    free(fh);
+    return 0;
+}
+
+/* read function */
+static ssize_t threads_read(void *hnd, void *buffer, size_t cnt) {
+    threads_fh_t *fh;
+
+    /* Check the handle */
+    if(!threads_verify_hnd(hnd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    fh = (threads_fh_t *)hnd;
+
+    if(fh->ptr >= fh->size)
+        return 0;
+
+    if(cnt > fh->size - fh->ptr)
+        cnt = fh->size - fh->ptr;
+
+    memcpy(buffer, fh->data + fh->ptr, cnt);
+    fh->ptr += cnt;
+
+    return cnt;
+}
+
+/* Seek elsewhere in a file */
+static off_t threads_seek(void *hnd, off_t offset, int whence) {
+    threads_fh_t *fh;
+
+    /* Check the handle */
+    if(!threads_verify_hnd(hnd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    fh = (threads_fh_t *)hnd;
+
+    switch(whence) {
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            offset += fh->ptr;
+            break;
+        case SEEK_END:
+            offset += fh->size;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fh->ptr = (size_t)offset > fh->size ? fh->size : (size_t)offset;
+
+    return fh->ptr;
+}
+
+/* tell the current position in the file */
+static off_t threads_tell(void *hnd) {
+    /* Check the handle */
+    if(!threads_verify_hnd(hnd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return ((threads_fh_t *)hnd)->ptr;
+}
+
+/* return the filesize */
+static size_t threads_total(void *hnd) {
+    /* Check the handle */
+    if(!threads_verify_hnd(hnd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return ((threads_fh_t *)hnd)->size;
+}
+
+static int threads_stat(vfs_handler_t *vfs, const char *fn, struct stat *rv,
+                        int flag) {
+    (void)vfs;
+    (void)fn;
+    (void)flag;
+
+    memset(rv, 0, sizeof(struct stat));
+    rv->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    rv->st_nlink = 1;
+
+    return 0;
+}
+
+static int threads_fstat(void *fd, struct stat *st) {
+    /* Check the handle */
+    if(!threads_verify_hnd(fd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    st->st_nlink = 1;
+    st->st_size = ((threads_fh_t *)fd)->size;
+
+    return 0;
+}
+
+/* handler interface */
+static vfs_handler_t vh = {
+    /* Name handler */
+    {
+        "/dev/threads",         /* name */
+        0,                      /* tbfi */
+        0x00010000,             /* Version 1.0 */
+        NMMGR_FLAGS_INDEV,      /* flags */
+        NMMGR_TYPE_VFS,         /* VFS handler */
+        NMMGR_LIST_INIT
+    },
+    0, NULL,            /* In-kernel, privdata */
+
+    threads_open,
+    threads_close,
+    threads_read,
+    NULL,               /* write */
+    threads_seek,
+    threads_tell,
+    threads_total,
+    NULL,
+    NULL,               /* ioctl */
+    NULL,               /* rename/move */
+    NULL,               /* unlink */
+    NULL,
+    NULL,               /* complete */
+    threads_stat,       /* stat */
+    NULL,               /* mkdir */
+    NULL,               /* rmdir */
+    NULL,               /* fcntl */
+    NULL,               /* poll */
+    NULL,               /* link */
+    NULL,               /* symlink */
+    NULL,               /* seek64 */
+    NULL,               /* tell64 */
+    NULL,               /* total64 */
+    NULL,               /* readlink */
+    NULL,
+    threads_fstat
+};
+
+int fs_threads_init(void) {
+    TAILQ_INIT(&threads_fh);
+    mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
+
+    nmmgr_handler_add(&vh.nmmgr);
+
+    return 0;
+}
+
+int fs_threads_shutdown(void) {
+    threads_fh_t *c, *n;
+
+    /* First, clean up any open files */
+    c = TAILQ_FIRST(&threads_fh);
+
+    while(c) {
+        n = TAILQ_NEXT(c, listent);
+        free(c->data);
+        free(c);
+        c = n;
+    }
+
+    mutex_destroy(&fh_mutex);
+
+    nmmgr_handler_remove(&vh.nmmgr);
+
+    return 0;
+}
@@ -7,131 +7,592 @@
 
 #include <poll.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <sys/queue.h>
+#include <sys/epoll.h>
 
 #include <arch/irq.h>
+#include <arch/timer.h>
 #include <kos/fs.h>
 #include <kos/mutex.h>
 #include <kos/cond.h>
 
-struct poll_int {
-    LIST_ENTRY(poll_int) entry;
-    struct pollfd *fds;
-    nfds_t nfds;
-    int nmatched;
+/* Both poll() and epoll are built on the same thing here. Each set of fds that
+   someone is waiting on (a poll() call or an epoll instance) has an item for
+   each fd in it, and each fd has a list of the items watching it. When
+   something happens on an fd, __poll_event_trigger() only has to look at that
+   fd's watchers, and puts the ones that care on their set's ready list. Waiting
+   on a set then only has to ask the fds on its ready list what's going on,
+   instead of every fd in the set.
+
+   The watcher and ready lists get touched from interrupts (that's where most of
+   the events come from), so they are protected by disabling interrupts. The
+   rest of a set is protected by its mutex. */
+
+struct poll_set;
+
+struct poll_item {
+    LIST_ENTRY(poll_item) fd_entry;     /* On the fd's list of watchers */
+    LIST_ENTRY(poll_item) set_entry;    /* On the set's list of items */
+    TAILQ_ENTRY(poll_item) rdy_entry;   /* On the set's ready list */
+    struct poll_set *set;
+    int fd;
+    uint32_t events;
+    epoll_data_t data;
+    int flags;
+};
+
+#define ITEM_QUEUED     1   /* On the ready list (or about to be looked at) */
+#define ITEM_DEAD       2   /* The fd was closed */
+#define ITEM_OFF        4   /* EPOLLONESHOT fired, wait for EPOLL_CTL_MOD */
+
+LIST_HEAD(poll_item_list, poll_item);
+TAILQ_HEAD(poll_item_queue, poll_item);
+
+struct poll_set {
+    struct poll_item_list items;
+    struct poll_item_queue ready;
+    mutex_t mutex;
     condvar_t cv;
 };
 
-LIST_HEAD(polllist, poll_int) poll_list;
+static struct poll_item_list watchers[FD_SETSIZE];
+
+/* Put an item on its set's ready list, and wake up whoever's waiting on the
+   set. Interrupts must be disabled. */
+static void item_ready(struct poll_item *i) {
+    if(!(i->flags & ITEM_QUEUED)) {
+        TAILQ_INSERT_TAIL(&i->set->ready, i, rdy_entry);
+        i->flags |= ITEM_QUEUED;
+    }
 
-static mutex_t mutex = MUTEX_INITIALIZER;
+    cond_broadcast(&i->set->cv);
+}
 
 void __poll_event_trigger(int fd, short event) {
-    struct poll_int *i;
-    nfds_t j;
-    int gotone = 0;
-    short mask;
+    struct poll_item *i;
 
-    if(mutex_lock_irqsafe(&mutex))
-        /* XXXX: Uhh... this is bad... */
+    if(fd < 0 || fd >= FD_SETSIZE)
         return;
 
-    /* Look through the list of poll fds for any that match */
-    LIST_FOREACH(i, &poll_list, entry) {
-        for(j = 0; j < i->nfds; ++j) {
-            if(i->fds[j].fd == fd) {
-                mask = i->fds[j].events | POLLERR | POLLHUP | POLLNVAL;
-                if(event & mask) {
-                    i->fds[j].revents |= event & mask;
-                    ++i->nmatched;
-                    gotone = 1;
-                }
-            }
-        }
+    irq_disable_scoped();
 
-        /* If we got any events, signal the waiting thread to wake it up. */
-        if(gotone) {
-            cond_signal(&i->cv);
-            gotone = 0;
-        }
+    LIST_FOREACH(i, &watchers[fd], fd_entry) {
+        if(!(i->flags & ITEM_OFF) &&
+           (event & (i->events | POLLERR | POLLHUP | POLLNVAL)))
+            item_ready(i);
     }
+}
+
+/* Called by fs_close(). Take the fd out of every set it's in. Whoever owns each
+   set will notice and clean up the next time they look at it. */
+void __poll_fd_closed(int fd) {
+    struct poll_item *i;
+
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
 
-    mutex_unlock(&mutex);
+    irq_disable_scoped();
+
+    while((i = LIST_FIRST(&watchers[fd]))) {
+        LIST_REMOVE(i, fd_entry);
+        i->flags |= ITEM_DEAD;
+        item_ready(i);
+    }
 }
 
-int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
-    struct poll_int p = { { 0 }, fds, nfds, 0, COND_INITIALIZER };
-    int tmp;
-    nfds_t i;
+static void set_init(struct poll_set *s) {
+    LIST_INIT(&s->items);
+    TAILQ_INIT(&s->ready);
+    mutex_init(&s->mutex, MUTEX_TYPE_NORMAL);
+    cond_init(&s->cv);
+}
+
+/* Start watching an fd. The set's mutex must be held. */
+static void set_add(struct poll_set *s, struct poll_item *i, int fd,
+                    uint32_t events, epoll_data_t data) {
+    int old;
+
+    i->set = s;
+    i->fd = fd;
+    i->events = events;
+    i->data = data;
+    i->flags = 0;
+    LIST_INSERT_HEAD(&s->items, i, set_entry);
+
+    old = irq_disable();
+    LIST_INSERT_HEAD(&watchers[fd], i, fd_entry);
+    irq_restore(old);
+}
+
+/* Stop watching an fd. The set's mutex must be held. */
+static void set_del(struct poll_set *s, struct poll_item *i) {
+    int old;
+
+    old = irq_disable();
+
+    if(!(i->flags & ITEM_DEAD))
+        LIST_REMOVE(i, fd_entry);
+
+    if(i->flags & ITEM_QUEUED)
+        TAILQ_REMOVE(&s->ready, i, rdy_entry);
+
+    irq_restore(old);
+    LIST_REMOVE(i, set_entry);
+}
+
+/* Take everything off the set's ready list, to be looked at. The items stay
+   marked as queued until item_take() gets to them, so that nothing else
+   touches their ready list entries in the meantime. */
+static void set_drain(struct poll_set *s, struct poll_item_queue *q) {
+    int old;
+
+    TAILQ_INIT(q);
+    old = irq_disable();
+    TAILQ_CONCAT(q, &s->ready, rdy_entry);
+    irq_restore(old);
+}
+
+static struct poll_item *item_take(struct poll_item_queue *q) {
+    struct poll_item *i;
+    int old;
+
+    old = irq_disable();
+
+    if((i = TAILQ_FIRST(q))) {
+        TAILQ_REMOVE(q, i, rdy_entry);
+        i->flags &= ~ITEM_QUEUED;
+    }
+
+    irq_restore(old);
+    return i;
+}
+
+/* Wait for something to show up on the set's ready list. The set's mutex must
+   be held. A deadline of 0 means to wait forever. */
+static int set_wait(struct poll_set *s, uint64 deadline) {
+    uint64 now;
+    int old, rv = 0, tmout = 0;
+
+    if(deadline) {
+        if((now = timer_ms_gettime64()) >= deadline)
+            return -1;
+
+        tmout = (int)(deadline - now);
+    }
+
+    /* Interrupts have to stay off between checking the list and going to sleep,
+       or we could miss the wakeup. */
+    old = irq_disable();
+
+    if(TAILQ_EMPTY(&s->ready))
+        rv = cond_wait_timed(&s->cv, &s->mutex, tmout);
+
+    irq_restore(old);
+    return rv;
+}
+
+/* Ask an fd which of the events are pending on it right now. */
+static short fd_query(int fd, short events) {
     vfs_handler_t *hndl;
     void *hnd;
 
-    if(mutex_lock_irqsafe(&mutex))
-        return -1;
+    /* If we don't get one of these, then assume its a bad fd. */
+    if(fd < 0 || fd >= FD_SETSIZE || !(hndl = fs_get_handler(fd)) ||
+       !(hnd = fs_get_handle(fd)))
+        return POLLNVAL;
+
+    /* Assume its a regular file if there's no poll method in the handler. */
+    if(!hndl->poll)
+        return (POLLRDNORM | POLLWRNORM) & events;
+
+    return hndl->poll(hnd, events);
+}
+
+static int poll_scan(struct pollfd fds[], nfds_t nfds) {
+    nfds_t i;
+    int rv = 0;
 
-    /* Check if any of the fds already match */
     for(i = 0; i < nfds; ++i) {
-        hndl = fs_get_handler(fds[i].fd);
-        hnd = fs_get_handle(fds[i].fd);
-        fds[i].revents = 0;
-
-        /* If we didn't get one of these, then assume its a bad fd. */
-        if(!hndl || !hnd) {
-            fds[i].revents = POLLNVAL;
-            ++p.nmatched;
-            continue;
+        if((fds[i].revents = fd_query(fds[i].fd, fds[i].events)))
+            ++rv;
+    }
+
+    return rv;
+}
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
+    struct poll_set s;
+    struct poll_item *items, *i;
+    struct poll_item_queue q;
+    struct pollfd *p;
+    uint64 deadline = 0;
+    epoll_data_t data;
+    int rv, err = errno;
+    nfds_t j;
+
+    /* If the user specified a 0 timeout, all we need to do is look. We can't
+       actually wait while we're in an interrupt either, so if we'd have to, it
+       is an error. */
+    if(!timeout || irq_inside_int()) {
+        if((rv = poll_scan(fds, nfds)) || !timeout)
+            return rv;
+
+        errno = EPERM;
+        return -1;
+    }
+
+    if(!(items = (struct poll_item *)malloc(sizeof(*items) * (nfds + 1)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(timeout > 0)
+        deadline = timer_ms_gettime64() + timeout;
+
+    /* Start watching everything before checking on it, so nothing that happens
+       in between gets missed. */
+    set_init(&s);
+    mutex_lock(&s.mutex);
+
+    for(j = 0; j < nfds; ++j) {
+        if(fds[j].fd >= 0 && fds[j].fd < FD_SETSIZE) {
+            data.u32 = j;
+            set_add(&s, &items[j], fds[j].fd, fds[j].events, data);
         }
+    }
 
-        if(!hndl->poll) {
-            /* Assume its a regular file if there's no poll method in the
-               handler. */
-            if(fds[i].events & (POLLRDNORM | POLLWRNORM)) {
-                fds[i].revents |= (POLLRDNORM | POLLWRNORM) & fds[i].events;
-                ++p.nmatched;
-            }
+    rv = poll_scan(fds, nfds);
+
+    /* From here on, only the fds that something has happened to need to be
+       looked at again. */
+    while(!rv) {
+        if(set_wait(&s, deadline) < 0) {
+            errno = err;
+            break;
         }
-        else {
-            if((fds[i].revents = hndl->poll(hnd, fds[i].events))) {
-                ++p.nmatched;
-            }
+
+        set_drain(&s, &q);
+
+        while((i = item_take(&q))) {
+            p = &fds[i->data.u32];
+
+            if(i->flags & ITEM_DEAD)
+                p->revents = POLLNVAL;
+            else
+                p->revents = fd_query(p->fd, p->events);
+
+            if(p->revents)
+                ++rv;
         }
     }
 
-    /* If the user specified a 0 timeout, or we've already matched something,
-       bail out now. */
-    if(p.nmatched || !timeout) {
-        mutex_unlock(&mutex);
-        return p.nmatched;
+    while((i = LIST_FIRST(&s.items)))
+        set_del(&s, i);
+
+    mutex_unlock(&s.mutex);
+    mutex_destroy(&s.mutex);
+    cond_destroy(&s.cv);
+    free(items);
+
+    return rv;
+}
+
+/* The epoll instances themselves live behind file descriptors. */
+static int epoll_close_hnd(void *hnd) {
+    struct poll_set *s = (struct poll_set *)hnd;
+    struct poll_item *i;
+
+    mutex_lock(&s->mutex);
+
+    while((i = LIST_FIRST(&s->items))) {
+        set_del(s, i);
+        free(i);
     }
 
-    /* We can't actually wait while we're in an interrupt, so if we got this far
-       it is an error. */
-    if(irq_inside_int()) {
-        mutex_unlock(&mutex);
-        errno = EPERM;
+    mutex_unlock(&s->mutex);
+    mutex_destroy(&s->mutex);
+    cond_destroy(&s->cv);
+    free(s);
+
+    return 0;
+}
+
+static short epoll_poll_hnd(void *hnd, short events) {
+    struct poll_set *s = (struct poll_set *)hnd;
+
+    /* This might be a false alarm, but if the ready list is empty, there's
+       definitely nothing to read. */
+    return TAILQ_EMPTY(&s->ready) ? 0 : (events & POLLIN);
+}
+
+static vfs_handler_t vh = {
+    /* Name handler */
+    {
+        "/epoll",       /* Name */
+        0,              /* tbfi */
+        0x00010000,     /* Version 1.0 */
+        0,              /* Flags */
+        NMMGR_TYPE_VFS,
+        NMMGR_LIST_INIT,
+    },
+
+    0, NULL,        /* No cache, privdata */
+
+    NULL,            /* open */
+    epoll_close_hnd, /* close */
+    NULL,            /* read */
+    NULL,            /* write */
+    NULL,            /* seek */
+    NULL,            /* tell */
+    NULL,            /* total */
+    NULL,            /* readdir */
+    NULL,            /* ioctl */
+    NULL,            /* rename */
+    NULL,            /* unlink */
+    NULL,            /* mmap */
+    NULL,            /* complete */
+    NULL,            /* stat */
+    NULL,            /* mkdir */
+    NULL,            /* rmdir */
+    NULL,            /* fcntl */
+    epoll_poll_hnd,  /* poll */
+    NULL,            /* link */
+    NULL,            /* symlink */
+    NULL,            /* seek64 */
+    NULL,            /* tell64 */
+    NULL,            /* total64 */
+    NULL,            /* readlink */
+    NULL,            /* rewinddir */
+    NULL             /* fstat */
+};
+
+static struct poll_set *epoll_get_set(int epfd) {
+    if(epfd < 0 || epfd >= FD_SETSIZE || !fs_get_handle(epfd)) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if(fs_get_handler(epfd) != &vh) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return (struct poll_set *)fs_get_handle(epfd);
+}
+
+int epoll_create(int size) {
+    if(size <= 0) {
+        errno = EINVAL;
         return -1;
     }
 
-    /* Map to the value used by cond_wait_timed() */
-    if(timeout == -1)
-        timeout = 0;
+    return epoll_create1(0);
+}
 
-    /* Add this instance to the list */
-    LIST_INSERT_HEAD(&poll_list, &p, entry);
+int epoll_create1(int flags) {
+    struct poll_set *s;
+    int fd;
 
-    tmp = errno;
-    if(cond_wait_timed(&p.cv, &mutex, timeout)) {
-        errno = tmp;
-        tmp = 0;
-        goto out;
+    if(flags & ~EPOLL_CLOEXEC) {
+        errno = EINVAL;
+        return -1;
     }
 
-    tmp = p.nmatched;
+    if(!(s = (struct poll_set *)malloc(sizeof(struct poll_set)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    set_init(s);
+
+    if((fd = fs_open_handle(&vh, s)) < 0) {
+        mutex_destroy(&s->mutex);
+        cond_destroy(&s->cv);
+        free(s);
+    }
 
-out:
-    /* Remove this instance from the list */
-    LIST_REMOVE(&p, entry);
+    return fd;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    struct poll_set *s;
+    struct poll_item *i;
+    int old, rv = 0;
+
+    if(!(s = epoll_get_set(epfd)))
+        return -1;
+
+    if(fd < 0 || fd >= FD_SETSIZE || !fs_get_handle(fd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(fs_get_handler(fd) == &vh) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(op != EPOLL_CTL_DEL && !event) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    mutex_lock(&s->mutex);
+
+    /* There's usually only one set watching any given fd, so this is quicker
+       than looking through everything in our set. */
+    old = irq_disable();
+
+    LIST_FOREACH(i, &watchers[fd], fd_entry) {
+        if(i->set == s)
+            break;
+    }
+
+    irq_restore(old);
+
+    switch(op) {
+        case EPOLL_CTL_ADD:
+            if(i) {
+                errno = EEXIST;
+                rv = -1;
+                break;
+            }
+
+            if(!(i = (struct poll_item *)malloc(sizeof(struct poll_item)))) {
+                errno = ENOMEM;
+                rv = -1;
+                break;
+            }
+
+            set_add(s, i, fd, event->events, event->data);
+
+            /* Have the next epoll_wait() check on it, in case it's already
+               ready. */
+            old = irq_disable();
+            item_ready(i);
+            irq_restore(old);
+            break;
+
+        case EPOLL_CTL_MOD:
+            if(!i) {
+                errno = ENOENT;
+                rv = -1;
+                break;
+            }
+
+            old = irq_disable();
+            i->events = event->events;
+            i->data = event->data;
+            i->flags &= ~ITEM_OFF;
+            item_ready(i);
+            irq_restore(old);
+            break;
+
+        case EPOLL_CTL_DEL:
+            if(!i) {
+                errno = ENOENT;
+                rv = -1;
+                break;
+            }
+
+            set_del(s, i);
+            free(i);
+            break;
+
+        default:
+            errno = EINVAL;
+            rv = -1;
+    }
+
+    mutex_unlock(&s->mutex);
+    return rv;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout) {
+    struct poll_set *s;
+    struct poll_item *i;
+    struct poll_item_queue q;
+    uint64 deadline = 0;
+    short ev;
+    int old, n = 0, err = errno;
+
+    if(!(s = epoll_get_set(epfd)))
+        return -1;
+
+    if(maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!events) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(timeout && irq_inside_int()) {
+        errno = EPERM;
+        return -1;
+    }
+
+    if(timeout > 0)
+        deadline = timer_ms_gettime64() + timeout;
+
+    mutex_lock(&s->mutex);
+
+    for(;;) {
+        set_drain(s, &q);
+
+        while(n < maxevents && (i = item_take(&q))) {
+            if(i->flags & ITEM_DEAD) {
+                LIST_REMOVE(i, set_entry);
+                free(i);
+                continue;
+            }
+
+            if(i->flags & ITEM_OFF)
+                continue;
+
+            ev = fd_query(i->fd, i->events);
+            ev &= i->events | POLLERR | POLLHUP;
+
+            if(!ev)
+                continue;
+
+            events[n].events = ev;
+            events[n].data = i->data;
+            ++n;
+
+            /* Level-triggered fds stay on the ready list, so the next call
+               checks on them again. */
+            old = irq_disable();
+
+            if(i->events & EPOLLONESHOT)
+                i->flags |= ITEM_OFF;
+            else if(!(i->events & EPOLLET))
+                item_ready(i);
+
+            irq_restore(old);
+        }
+
+        /* Put back anything we didn't get to, in front of everything else. */
+        if(!TAILQ_EMPTY(&q)) {
+            old = irq_disable();
+            TAILQ_CONCAT(&q, &s->ready, rdy_entry);
+            TAILQ_CONCAT(&s->ready, &q, rdy_entry);
+            irq_restore(old);
+        }
+
+        if(n || !timeout)
+            break;
+
+        if(set_wait(s, deadline) < 0) {
+            errno = err;
+            break;
+        }
+    }
 
-    mutex_unlock(&mutex);
-    return tmp;
+    mutex_unlock(&s->mutex);
+    return n;
 }
@@ -14,7 +14,11 @@
 /* Mutex Initialization Attributes, P1003.1c/Draft 10, p. 81 */
 
 int pthread_mutexattr_init(pthread_mutexattr_t *attr) {
-    (void)attr;
+    assert(attr);
+
+    /* KOS mutexes have always boosted their holders, so keep doing that by
+       default rather than defaulting to PTHREAD_PRIO_NONE. */
+    attr->protocol = PTHREAD_PRIO_INHERIT;
     return 0;
 }
 
@@ -38,10 +42,15 @@ int pthread_mutexattr_setpshared(pthread_mutexattr_t *attr, int pshared) {
 /* Initializing and Destroying a Mutex, P1003.1c/Draft 10, p. 87 */
 
 int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
-    (void)attr;
     assert(mutex);
 
-    return mutex_init(mutex, MUTEX_TYPE_NORMAL);
+    if(mutex_init(mutex, MUTEX_TYPE_NORMAL))
+        return errno;
+
+    if(attr && attr->protocol == PTHREAD_PRIO_NONE)
+        mutex_set_protocol(mutex, MUTEX_PRIO_NONE);
+
+    return 0;
 }
 
 int pthread_mutex_destroy(pthread_mutex_t *mutex) {
@@ -74,15 +83,23 @@ int pthread_mutex_unlock(pthread_mutex_t *mutex) {
 /* Mutex Initialization Scheduling Attributes, P1003.1c/Draft 10, p. 128 */
 
 int pthread_mutexattr_setprotocol(pthread_mutexattr_t *attr, int protocol) {
-    (void)attr;
-    (void)protocol;
+    assert(attr);
+
+    if(protocol != PTHREAD_PRIO_NONE && protocol != PTHREAD_PRIO_INHERIT)
+        return protocol == PTHREAD_PRIO_PROTECT ? ENOTSUP : EINVAL;
+
+    attr->protocol = protocol;
     return 0;
 }
 
 int pthread_mutexattr_getprotocol(const pthread_mutexattr_t *attr, int *protocol) {
-    (void)attr;
-    (void)protocol;
-    return EINVAL;
+    assert(attr);
+
+    if(!protocol)
+        return EINVAL;
+
+    *protocol = attr->protocol;
+    return 0;
 }
 
 int pthread_mutexattr_setprioceiling(pthread_mutexattr_t *attr, int prioceiling) {
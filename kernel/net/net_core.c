@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <kos/net.h>
 #include <kos/fs_socket.h>
+#include <arch/irq.h>
 
 #include "net_dhcp.h"
 #include "net_thd.h"
@@ -95,6 +96,83 @@ struct netif_list * net_get_if_list(void) {
     return &net_if_list;
 }
 
+/*****************************************************************************/
+/* Transmission */
+
+size_t net_iov_len(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    int i;
+
+    for(i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
+
+    return len;
+}
+
+void net_iov_copy(uint8 *dst, const struct iovec *iov, int iovcnt) {
+    int i;
+
+    for(i = 0; i < iovcnt; ++i) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+}
+
+int net_tx(netif_t *net, const struct iovec *iov, int iovcnt, int blocking) {
+    size_t len;
+    int rv;
+
+    /* If the device can take the packet in pieces, give it that way, and
+       don't bother telling it to send it off if we're in a batch. */
+    if(net->if_tx_sg) {
+        rv = net->if_tx_sg(net, iov, iovcnt, blocking);
+
+        if(rv == NETIF_TX_OK && !net->tx_batch && net->if_tx_commit)
+            net->if_tx_commit(net);
+
+        return rv;
+    }
+
+    if(iovcnt == 1)
+        return net->if_tx(net, (const uint8 *)iov[0].iov_base,
+                          (int)iov[0].iov_len, blocking);
+
+    /* Otherwise, we have to put it together ourselves. */
+    len = net_iov_len(iov, iovcnt);
+
+    {
+        uint8 buf[len];
+
+        net_iov_copy(buf, iov, iovcnt);
+        return net->if_tx(net, buf, (int)len, blocking);
+    }
+}
+
+void net_tx_batch_begin(netif_t *net) {
+    int old;
+
+    if(!net && !(net = net_default_dev))
+        return;
+
+    old = irq_disable();
+    ++net->tx_batch;
+    irq_restore(old);
+}
+
+void net_tx_batch_end(netif_t *net) {
+    int old, done;
+
+    if(!net && !(net = net_default_dev))
+        return;
+
+    old = irq_disable();
+    done = net->tx_batch > 0 && !--net->tx_batch;
+    irq_restore(old);
+
+    if(done && net->if_tx_sg && net->if_tx_commit)
+        net->if_tx_commit(net);
+}
+
 /*****************************************************************************/
 /* Init/shutdown */
 
@@ -34,7 +34,7 @@ uint16 net_ipv4_checksum(const uint8 *data, size_t bytes, uint16 start) {
         const uint8 *ptr = data;
 
         while(i > 1) {
-            sum += *ptr | ((*ptr + 1) << 8);
+            sum += *ptr | (*(ptr + 1) << 8);
             ptr += 2;
             i -= 2;
 
@@ -65,6 +65,72 @@ uint16 net_ipv4_checksum(const uint8 *data, size_t bytes, uint16 start) {
     return sum ^ 0xFFFF;
 }
 
+/* Copy a block of data, performing an IP-style checksum on it along the way,
+   so that it only has to be read once. The result is the same as calling
+   net_ipv4_checksum() on the copy afterwards. The Dreamcast has an optimized
+   version of this in assembly (arch/dreamcast/kernel/csum.s); this one is the
+   reference that one has to agree with, so it's built everywhere. */
+uint16 net_ipv4_checksum_copy_ref(uint8 *dst, const uint8 *src, size_t bytes,
+                                  uint16 start) {
+    uint32 sum = start;
+    size_t i;
+
+    for(i = 0; i + 1 < bytes; i += 2) {
+        dst[i] = src[i];
+        dst[i + 1] = src[i + 1];
+        sum += src[i] | (src[i + 1] << 8);
+
+        while(sum >> 16)
+            sum = (sum >> 16) + (sum & 0xFFFF);
+    }
+
+    /* Handle the last byte, if we have an odd byte count */
+    if(i < bytes) {
+        dst[i] = src[i];
+        sum += src[i];
+    }
+
+    while(sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum ^ 0xFFFF;
+}
+
+#ifndef _arch_dreamcast
+uint16 net_ipv4_checksum_copy(uint8 *dst, const uint8 *src, size_t bytes,
+                              uint16 start) {
+    return net_ipv4_checksum_copy_ref(dst, src, bytes, start);
+}
+#endif
+
+/* Perform an IP-style checksum on data that's in pieces, as if it were all in
+   one block. The pieces can be any length, so keep track of whether each one
+   starts on an odd byte, and swap its sum around if so. */
+uint16 net_ipv4_checksum_iov(const struct iovec *iov, int iovcnt, uint16 start) {
+    uint32 sum = start, part;
+    int i, odd = 0;
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(!iov[i].iov_len)
+            continue;
+
+        part = net_ipv4_checksum((const uint8 *)iov[i].iov_base,
+                                 iov[i].iov_len, 0) ^ 0xFFFF;
+
+        if(odd)
+            part = ((part & 0xFF) << 8) | (part >> 8);
+
+        sum += part;
+        sum = (sum >> 16) + (sum & 0xFFFF);
+        odd ^= iov[i].iov_len & 1;
+    }
+
+    while(sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum ^ 0xFFFF;
+}
+
 /* Determine if a given IP is in the current network */
 static int is_in_network(const uint8 src[4], const uint8 dest[4],
                          const uint8 netmask[4]) {
@@ -90,12 +156,14 @@ static int is_broadcast(const uint8 dest[4], const uint8 bc[4]) {
     return 1;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8 *data,
-                         size_t size) {
+/* Send a packet on the specified network adapter, given in pieces */
+int net_ipv4_send_packetv(netif_t *net, ip_hdr_t *hdr, const struct iovec *iov,
+                          int iovcnt) {
     uint8 dest_ip[4];
     uint8 dest_mac[6];
-    uint8 pkt[size + sizeof(ip_hdr_t) + sizeof(eth_hdr_t)];
+    int ihl = 4 * (hdr->version_ihl & 0x0f);
+    uint8 pkt[sizeof(eth_hdr_t) + 60];
+    struct iovec piov[iovcnt + 1];
     eth_hdr_t *ehdr;
     int err;
 
@@ -112,27 +180,30 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8 *data,
 
     /* Is this a loopback address (127/8)? */
     if(dest_ip[0] == 0x7F) {
+        size_t size = net_iov_len(iov, iovcnt);
+        uint8 lpkt[ihl + size];
+
         /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
+        memcpy(lpkt, hdr, ihl);
+        net_iov_copy(lpkt + ihl, iov, iovcnt);
 
         ++ipv4_stats.pkt_sent;
 
         /* Send it "away" */
-        net_ipv4_input(NULL, pkt, 4 * (hdr->version_ihl & 0x0f) + size, NULL);
+        net_ipv4_input(NULL, lpkt, ihl + size, NULL);
 
         return 0;
     }
     else if(net->flags & NETIF_NOETH) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
+        /* The IP header goes first, then the data */
+        piov[0].iov_base = hdr;
+        piov[0].iov_len = ihl;
+        memcpy(piov + 1, iov, iovcnt * sizeof(struct iovec));
 
         ++ipv4_stats.pkt_sent;
 
         /* Send it away */
-        return net->if_tx(net, pkt, 4 * (hdr->version_ihl & 0x0f) + size,
-                          NETIF_BLOCK);
+        return net_tx(net, piov, iovcnt + 1, NETIF_BLOCK);
     }
 
     /* Are we sending a broadcast packet? */
@@ -148,8 +219,15 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8 *data,
 
         /* Get our destination's MAC address. If we do not have the MAC address
            cached, return a distinguished error to the upper-level protocol so
-           that it can decide what to do. */
-        err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
+           that it can decide what to do. The ARP code can only hang onto a
+           packet that's in one piece, so one that isn't is dropped if the
+           lookup has to go out on the wire (the upper layer will resend it). */
+        if(iovcnt == 1)
+            err = net_arp_lookup(net, dest_ip, dest_mac, hdr,
+                                 (const uint8 *)iov[0].iov_base,
+                                 (int)iov[0].iov_len);
+        else
+            err = net_arp_lookup(net, dest_ip, dest_mac, hdr, NULL, 0);
 
         if(err == -1) {
             errno = ENETUNREACH;
@@ -170,23 +248,32 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8 *data,
     ehdr->type[0] = 0x08;
     ehdr->type[1] = 0x00;
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, 4 * (hdr->version_ihl & 0x0f));
-    memcpy(pkt + sizeof(eth_hdr_t) + 4 * (hdr->version_ihl & 0x0f), data,
-           size);
+    /* The headers go in front, and the data goes straight from wherever it is
+       now, if the device can take it that way. */
+    memcpy(pkt + sizeof(eth_hdr_t), hdr, ihl);
+    piov[0].iov_base = pkt;
+    piov[0].iov_len = sizeof(eth_hdr_t) + ihl;
+    memcpy(piov + 1, iov, iovcnt * sizeof(struct iovec));
 
     ++ipv4_stats.pkt_sent;
 
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ip_hdr_t) + size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    net_tx(net, piov, iovcnt + 1, NETIF_BLOCK);
 
     return 0;
 }
 
-int net_ipv4_send(netif_t *net, const uint8 *data, size_t size, int id, int ttl,
-                  int proto, uint32 src, uint32 dst) {
+int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8 *data,
+                         size_t size) {
+    struct iovec iov = { (void *)data, size };
+
+    return net_ipv4_send_packetv(net, hdr, &iov, 1);
+}
+
+int net_ipv4_sendv(netif_t *net, const struct iovec *iov, int iovcnt, int id,
+                   int ttl, int proto, uint32 src, uint32 dst) {
     ip_hdr_t hdr;
+    size_t size = net_iov_len(iov, iovcnt);
 
     /* If the ID is -1, generate a random ID value that can be used in case the
        packet gets fragmented. */
@@ -208,7 +295,29 @@ int net_ipv4_send(netif_t *net, const uint8 *data, size_t size, int id, int ttl,
 
     hdr.checksum = net_ipv4_checksum((uint8 *)&hdr, sizeof(ip_hdr_t), 0);
 
-    return net_ipv4_frag_send(net, &hdr, data, size);
+    if(net == NULL)
+        net = net_default_dev;
+
+    /* The fragmentation code wants the data in one piece. */
+    if(net && size + sizeof(ip_hdr_t) >= (size_t)net->mtu && iovcnt > 1) {
+        uint8 buf[size];
+
+        net_iov_copy(buf, iov, iovcnt);
+        return net_ipv4_frag_send(net, &hdr, buf, size);
+    }
+    else if(iovcnt == 1) {
+        return net_ipv4_frag_send(net, &hdr, (const uint8 *)iov[0].iov_base,
+                                  size);
+    }
+
+    return net_ipv4_send_packetv(net, &hdr, iov, iovcnt);
+}
+
+int net_ipv4_send(netif_t *net, const uint8 *data, size_t size, int id, int ttl,
+                  int proto, uint32 src, uint32 dst) {
+    struct iovec iov = { (void *)data, size };
+
+    return net_ipv4_sendv(net, &iov, 1, id, ttl, proto, src, dst);
 }
 
 int net_ipv4_input(netif_t *src, const uint8 *pkt, size_t pktsize,
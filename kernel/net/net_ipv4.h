@@ -28,10 +28,19 @@ typedef struct {
 #undef packed
 
 uint16 net_ipv4_checksum(const uint8 *data, size_t bytes, uint16 start);
+uint16 net_ipv4_checksum_copy(uint8 *dst, const uint8 *src, size_t bytes,
+                              uint16 start);
+uint16 net_ipv4_checksum_copy_ref(uint8 *dst, const uint8 *src, size_t bytes,
+                                  uint16 start);
 int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8 *data,
                          size_t size);
 int net_ipv4_send(netif_t *net, const uint8 *data, size_t size, int id, int ttl,
                   int proto, uint32 src, uint32 dst);
+int net_ipv4_send_packetv(netif_t *net, ip_hdr_t *hdr, const struct iovec *iov,
+                          int iovcnt);
+int net_ipv4_sendv(netif_t *net, const struct iovec *iov, int iovcnt, int id,
+                   int ttl, int proto, uint32 src, uint32 dst);
+uint16 net_ipv4_checksum_iov(const struct iovec *iov, int iovcnt, uint16 start);
 int net_ipv4_input(netif_t *src, const uint8 *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
 int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8 *data);
@@ -59,10 +59,11 @@ static int is_in_network(netif_t *net, const struct in6_addr *ip) {
     return 0;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8 *data,
-                         size_t data_size) {
-    uint8 pkt[data_size + sizeof(ipv6_hdr_t) + sizeof(eth_hdr_t)];
+/* Send a packet on the specified network adapter, given in pieces */
+int net_ipv6_send_packetv(netif_t *net, ipv6_hdr_t *hdr,
+                          const struct iovec *iov, int iovcnt) {
+    uint8 pkt[sizeof(ipv6_hdr_t) + sizeof(eth_hdr_t)];
+    struct iovec piov[iovcnt + 1];
     uint8 dst_mac[6];
     int err;
     struct in6_addr dst = hdr->dst_addr;
@@ -79,24 +80,27 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8 *data,
 
     /* Are we sending a packet to loopback? */
     if(IN6_IS_ADDR_LOOPBACK(&hdr->dst_addr)) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
+        size_t data_size = net_iov_len(iov, iovcnt);
+        uint8 lpkt[sizeof(ipv6_hdr_t) + data_size];
+
+        memcpy(lpkt, hdr, sizeof(ipv6_hdr_t));
+        net_iov_copy(lpkt + sizeof(ipv6_hdr_t), iov, iovcnt);
 
         ++ipv6_stats.pkt_sent;
 
         /* Send the packet "away" */
-        net_ipv6_input(NULL, pkt, sizeof(ipv6_hdr_t) + data_size, NULL);
+        net_ipv6_input(NULL, lpkt, sizeof(ipv6_hdr_t) + data_size, NULL);
         return 0;
     }
     else if(net->flags & NETIF_NOETH) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
+        piov[0].iov_base = hdr;
+        piov[0].iov_len = sizeof(ipv6_hdr_t);
+        memcpy(piov + 1, iov, iovcnt * sizeof(struct iovec));
 
         ++ipv6_stats.pkt_sent;
 
         /* Send the packet away */
-        return net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size,
-                          NETIF_BLOCK);
+        return net_tx(net, piov, iovcnt + 1, NETIF_BLOCK);
     }
     else if(IN6_IS_ADDR_MULTICAST(&hdr->dst_addr)) {
         dst_mac[0] = dst_mac[1] = 0x33;
@@ -110,7 +114,14 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8 *data,
             dst = net->ip6_gateway;
         }
 
-        err = net_ndp_lookup(net, &dst, dst_mac, hdr, data, data_size);
+        /* As with ARP, the NDP code can only hang onto a packet that's in one
+           piece while it waits for an answer. */
+        if(iovcnt == 1)
+            err = net_ndp_lookup(net, &dst, dst_mac, hdr,
+                                 (const uint8 *)iov[0].iov_base,
+                                 (int)iov[0].iov_len);
+        else
+            err = net_ndp_lookup(net, &dst, dst_mac, hdr, NULL, 0);
 
         if(err == -1) {
             errno = ENETUNREACH;
@@ -129,22 +140,30 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8 *data,
     ehdr->type[0] = 0x86;
     ehdr->type[1] = 0xDD;
 
-    /* Put the IP header / data into our ethernet packet */
+    /* Put the headers in front of the data */
     memcpy(pkt + sizeof(eth_hdr_t), hdr, sizeof(ipv6_hdr_t));
-    memcpy(pkt + sizeof(eth_hdr_t) + sizeof(ipv6_hdr_t), data, data_size);
+    piov[0].iov_base = pkt;
+    piov[0].iov_len = sizeof(pkt);
+    memcpy(piov + 1, iov, iovcnt * sizeof(struct iovec));
 
     ++ipv6_stats.pkt_sent;
 
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    net_tx(net, piov, iovcnt + 1, NETIF_BLOCK);
 
     return 0;
 }
 
-int net_ipv6_send(netif_t *net, const uint8 *data, size_t data_size,
-                  int hop_limit, int proto, const struct in6_addr *src,
-                  const struct in6_addr *dst) {
+int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8 *data,
+                         size_t data_size) {
+    struct iovec iov = { (void *)data, data_size };
+
+    return net_ipv6_send_packetv(net, hdr, &iov, 1);
+}
+
+int net_ipv6_sendv(netif_t *net, const struct iovec *iov, int iovcnt,
+                   int hop_limit, int proto, const struct in6_addr *src,
+                   const struct in6_addr *dst) {
     ipv6_hdr_t hdr;
 
     if(!net) {
@@ -170,9 +189,9 @@ int net_ipv6_send(netif_t *net, const uint8 *data, size_t data_size,
        send function to do the rest. Note that only V4-mapped addresses are
        supported here (::ffff:x.y.z.w) */
     if(IN6_IS_ADDR_V4MAPPED(src) && IN6_IS_ADDR_V4MAPPED(dst)) {
-        return net_ipv4_send(net, data, data_size, -1, hop_limit, proto,
-                             src->__s6_addr.__s6_addr32[3],
-                             dst->__s6_addr.__s6_addr32[3]);
+        return net_ipv4_sendv(net, iov, iovcnt, -1, hop_limit, proto,
+                              src->__s6_addr.__s6_addr32[3],
+                              dst->__s6_addr.__s6_addr32[3]);
     }
     else if(IN6_IS_ADDR_V4MAPPED(src) || IN6_IS_ADDR_V4MAPPED(dst) ||
             IN6_IS_ADDR_V4COMPAT(src) || IN6_IS_ADDR_V4COMPAT(dst)) {
@@ -182,14 +201,22 @@ int net_ipv6_send(netif_t *net, const uint8 *data, size_t data_size,
     hdr.version_lclass = 0x60;
     hdr.hclass_lflow = 0;
     hdr.lclass = 0;
-    hdr.length = ntohs(data_size);
+    hdr.length = ntohs(net_iov_len(iov, iovcnt));
     hdr.next_header = proto;
     hdr.hop_limit = hop_limit;
     hdr.src_addr = *src;
     hdr.dst_addr = *dst;
 
     /* XXXX: Handle fragmentation... */
-    return net_ipv6_send_packet(net, &hdr, data, data_size);
+    return net_ipv6_send_packetv(net, &hdr, iov, iovcnt);
+}
+
+int net_ipv6_send(netif_t *net, const uint8 *data, size_t data_size,
+                  int hop_limit, int proto, const struct in6_addr *src,
+                  const struct in6_addr *dst) {
+    struct iovec iov = { (void *)data, data_size };
+
+    return net_ipv6_sendv(net, &iov, 1, hop_limit, proto, src, dst);
 }
 
 int net_ipv6_input(netif_t *src, const uint8 *pkt, size_t pktsize,
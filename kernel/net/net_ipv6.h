@@ -48,6 +48,11 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8 *data,
 int net_ipv6_send(netif_t *net, const uint8 *data, size_t data_size,
                   int hop_limit, int proto, const struct in6_addr *src,
                   const struct in6_addr *dst);
+int net_ipv6_send_packetv(netif_t *net, ipv6_hdr_t *hdr,
+                          const struct iovec *iov, int iovcnt);
+int net_ipv6_sendv(netif_t *net, const struct iovec *iov, int iovcnt,
+                   int hop_limit, int proto, const struct in6_addr *src,
+                   const struct in6_addr *dst);
 int net_ipv6_input(netif_t *src, const uint8 *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
 uint16 net_ipv6_checksum_pseudo(const struct in6_addr *src,
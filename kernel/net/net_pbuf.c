@@ -0,0 +1,123 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.c
+   Copyright (C) 2026 The KOS Team and contributors
+
+*/
+
+#include <kos/net.h>
+#include <arch/irq.h>
+#include <arch/memory.h>
+
+/* Packet buffers are handed out from a fixed pool, so that getting one is
+   cheap and safe to do in an interrupt. The driver receives each frame
+   straight into one of these, and a socket that wants the data can hang onto
+   the buffer instead of copying out of it (see net_pbuf_keep()). The headers
+   live apart from the data they describe, so that the driver can invalidate
+   the cache over a whole buffer without clobbering anything. Everything in
+   here is protected by disabling interrupts. */
+
+/* Buffers a socket may not take, so that there's always room for the driver
+   to receive ACKs and the like, even if sockets are sitting on the rest. */
+#define NET_PBUF_RESERVE    (NET_PBUF_COUNT / 4)
+
+static uint8 pool[NET_PBUF_COUNT * NET_PBUF_SIZE] __attribute__((aligned(32)));
+static net_pbuf_t pbufs[NET_PBUF_COUNT];
+static net_pbuf_t *free_list;
+static int free_cnt = -1;
+
+static void pbuf_setup(void) {
+    int i;
+
+    free_list = NULL;
+
+    for(i = NET_PBUF_COUNT - 1; i >= 0; --i) {
+        pbufs[i].buf = pool + i * NET_PBUF_SIZE;
+        pbufs[i].refcnt = 0;
+        pbufs[i].next = free_list;
+        free_list = pbufs + i;
+    }
+
+    free_cnt = NET_PBUF_COUNT;
+}
+
+net_pbuf_t *net_pbuf_alloc(void) {
+    net_pbuf_t *pb;
+
+    irq_disable_scoped();
+
+    if(free_cnt < 0)
+        pbuf_setup();
+
+    if(!(pb = free_list))
+        return NULL;
+
+    free_list = pb->next;
+    --free_cnt;
+
+    pb->next = NULL;
+    pb->data = pb->buf;
+    pb->len = 0;
+    pb->tag = 0;
+    pb->refcnt = 1;
+
+    return pb;
+}
+
+void net_pbuf_ref(net_pbuf_t *pb) {
+    irq_disable_scoped();
+    ++pb->refcnt;
+}
+
+void net_pbuf_free(net_pbuf_t *pb) {
+    irq_disable_scoped();
+
+    if(--pb->refcnt)
+        return;
+
+    pb->next = free_list;
+    free_list = pb;
+    ++free_cnt;
+}
+
+/* Only let a buffer be kept if nobody else has already, and if there'll still
+   be enough left over for the driver to keep going. The driver may hand us
+   an uncached (P2) view of the buffer, so compare with the P2 bits off. */
+static net_pbuf_t *pbuf_keepable(const void *ptr) {
+    uint32 off = ((uint32)ptr & ~MEM_AREA_P2_BASE) -
+                 ((uint32)pool & ~MEM_AREA_P2_BASE);
+    net_pbuf_t *pb;
+
+    if(off >= sizeof(pool))
+        return NULL;
+
+    pb = pbufs + off / NET_PBUF_SIZE;
+
+    if(pb->refcnt != 1 || free_cnt < NET_PBUF_RESERVE)
+        return NULL;
+
+    return pb;
+}
+
+net_pbuf_t *net_pbuf_keep(const void *ptr) {
+    net_pbuf_t *pb;
+
+    irq_disable_scoped();
+
+    if((pb = pbuf_keepable(ptr)))
+        ++pb->refcnt;
+
+    return pb;
+}
+
+int net_pbuf_can_keep(const void *ptr) {
+    irq_disable_scoped();
+
+    return pbuf_keepable(ptr) != NULL;
+}
+
+int net_pbuf_avail(void) {
+    irq_disable_scoped();
+
+    return free_cnt < 0 ? NET_PBUF_COUNT : free_cnt;
+}
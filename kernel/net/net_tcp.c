@@ -72,22 +72,74 @@
    real socket created for them until they are accept()ed.
 
    On matching sockets:
-   All new sockets (including those created by accept()) are added to the head
-   of the list. Since we cannot bind a socket to an already used port for
-   listening, that means that any fully-created sockets should appear in the
-   list in front of those created for listening to a port (and thus that are
-   only partially-created). This simplifies the procedure for finding matching
-   sockets for incoming packets, since this makes sure that the fully-created
-   socket will be found first if it exists when simply iterating through the
-   list of sockets.
+   Every socket is on the list of sockets, but incoming packets don't look
+   through that. Once a socket has a local port, it is also put in one of three
+   hash tables, depending on how much of its address is known. Sockets with a
+   remote address (connected ones, and those created by accept()) go in a table
+   keyed on the remote address and both ports. Sockets without one that are
+   bound to a particular local address go in a table keyed on that address and
+   port, and those bound to the unspecified address go in one keyed on just the
+   port. An incoming packet is looked up in each of those in that order, so the
+   most specific match is always the one that gets found, and each lookup only
+   has to look at the handful of sockets that hashed to the same bucket. New
+   sockets go at the head of their bucket, so if two sockets could both match,
+   the newest one wins, just like it did when this was all one big list. The
+   tables are protected by the same lock as the list.
+
+   On timers:
+   Each socket has three timers on the network thread's timer queue, one for
+   retransmissions (which also covers resending SYNs and probing a closed
+   window), one for delayed ACKs and one for the TIME-WAIT state. Sockets that
+   have been closed, but couldn't be freed right away, are freed by the last of
+   those when they finally get to the closed state. Nothing runs for a socket
+   unless one of its timers is actually due, so an idle connection costs
+   nothing. The timer callbacks run in the network thread, and only ever try to
+   lock the socket (or the list of sockets), trying again a bit later if that
+   fails, so whoever is tearing a socket down can safely wait for them. The
+   retransmission timer is armed lazily: moving the deadline later (which
+   happens on just about every ACK) only updates data.timer, and the callback
+   puts itself back on the queue if it finds it ran early.
+
+   On receiving:
+   Data that arrives in order, in a segment of at least TCP_ZCOPY_MIN bytes, is
+   left where it is if it came in one of the packet buffers the network driver
+   receives into (see net_pbuf_keep()). The socket keeps the buffer on its
+   receive queue instead of copying the data into the receive buffer, so it
+   only gets copied once more, when it's read. Everything else (small segments,
+   anything out of order, or anything that came from a driver that doesn't use
+   packet buffers) is copied into the receive buffer like before. Each kept
+   buffer's tag holds how many bytes of the receive buffer come before it in
+   the stream, and rcvq_ring holds how many come after the last one, so reading
+   can put the two back together in order. Kept buffers count against the
+   receive window just the same as data in the receive buffer does. When a
+   segment is going to be copied in order into the receive buffer of an
+   established connection anyway, its checksum is worked out while copying it
+   (see net_ipv4_checksum_copy()), rather than reading it once to check it and
+   again to copy it. If the checksum turns out to be bad, the copy is just left
+   past the end of the data, where it'll be written over.
 
    On what's actually here:
-   I didn't bother implementing any TCP extensions beyond RFC 793. That means
-   that I just ignore things like the timestamp option and the selective
-   acknowledgement option. That also means that the window size maxes out at
-   65535. Some extensions may be implemented in the future, if I see fit to do
-   so. That all said, everything in here works just fine over IPv4 or IPv6, and
-   can be used just fine to communicate with "normal" TCP/IP implementations.
+   Beyond RFC 793, this implements window scaling and timestamps from RFC 7323
+   and selective acknowledgements from RFC 2018. All three are offered on every
+   SYN we send and are only used if the other side offers them too, so talking
+   to stacks that don't support them works just like it always did. Window
+   scaling is what allows SO_RCVBUF to go past 65535 usefully. With SACK, data
+   that arrives out of order is kept in the receive buffer (up to
+   TCP_OOO_BLOCKS separate ranges of it) and reported back, and a retransmission
+   timeout only resends the ranges the other side hasn't told us it has, rather
+   than everything from SND.UNA on.
+
+   The retransmission timeout follows the round trip time as RFC 6298 says to,
+   instead of being a fixed two seconds. Congestion control is NewReno (RFC 5681
+   and RFC 6582), with a fast retransmit on the third duplicate ACK, so a single
+   lost segment usually gets resent about one round trip later instead of after
+   a timeout. CUBIC (RFC 9438) can be picked instead with the TCP_CONGESTION
+   socket option. How much we have in flight is worked out from what the other
+   side has told us it has, so with SACK several holes in a window can all be
+   filled in one round trip.
+
+   Everything in here works just fine over IPv4 or IPv6, and can be used just
+   fine to communicate with "normal" TCP/IP implementations.
 */
 
 typedef struct tcp_hdr {
@@ -102,6 +154,35 @@ typedef struct tcp_hdr {
     uint8_t options[];
 } __attribute__((packed)) tcp_hdr_t;
 
+/* Number of ranges of out of order data we'll hold on to when receiving, and
+   the number of ranges the other side has selectively acknowledged that we'll
+   remember when sending. */
+#define TCP_OOO_BLOCKS      8
+#define TCP_SACK_BLOCKS     8
+
+/* Number of buckets in the hash table of connected sockets, and in each of the
+   ones for sockets that aren't connected. Both must be powers of two. */
+#define TCP_HASH_BUCKETS    256
+#define TCP_LHASH_BUCKETS   32
+
+/* A range of sequence numbers, from start up to (but not including) end. */
+struct seqblk {
+    uint32_t start;
+    uint32_t end;
+};
+
+/* Number of segments we remember the sum of the data in, so that resending one
+   of them only has to checksum the header again. */
+#define TCP_SEGSUM_CNT      8
+
+/* The sum of the data in a segment we've sent, as net_ipv4_checksum_iov()
+   would add it up (but not complemented). */
+struct segsum {
+    uint32_t seq;
+    uint32_t len;
+    uint16_t sum;
+};
+
 /* Listening socket. Each one of these is an incoming connection from a socket
    that is in the listen state */
 struct lsock {
@@ -110,7 +191,10 @@ struct lsock {
     struct sockaddr_in6 remote_addr;
     uint32_t isn;
     uint32_t wnd;
+    uint32_t ts_recent;
     uint16_t mss;
+    uint8_t wscale;
+    uint8_t opts;
 };
 
 /* Send/receive variables... */
@@ -123,6 +207,7 @@ struct sndrec {
     uint32_t wl2;
     uint32_t iss;
     uint16_t mss;
+    uint8_t wscale;
 };
 
 struct rcvrec {
@@ -130,10 +215,40 @@ struct rcvrec {
     uint32_t wnd;
     uint32_t up;
     uint32_t irs;
+    uint32_t ts_recent;
+    uint32_t adv_edge;
+    uint32_t unacked;       /* Bytes received since we last sent an ACK */
+    uint8_t wscale;
+};
+
+/* Round trip time estimation and congestion control state. Times are in
+   milliseconds and windows are in bytes. */
+struct tcp_cc {
+    uint32_t srtt;          /* Smoothed RTT, times 8 */
+    uint32_t rttvar;        /* RTT variation, times 4 */
+    uint32_t rto;           /* Current retransmission timeout */
+    uint32_t rtt_seq;       /* Sequence number being timed... */
+    uint32_t rtt_time;      /* ... and when it was sent */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;       /* SND.NXT when loss recovery started */
+    uint32_t rexmit_nxt;    /* Next sequence number to resend... */
+    uint32_t rexmit_end;    /* ... and where resending stops */
+    uint32_t w_max;         /* CUBIC: window before the last loss */
+    uint32_t w_last_max;    /* CUBIC: the same, one loss before that */
+    uint32_t w_est;         /* CUBIC: what Reno would have by now */
+    uint32_t origin;        /* CUBIC: window the curve is centered on */
+    uint32_t epoch;         /* CUBIC: when this epoch started, or 0 */
+    uint32_t k;             /* CUBIC: time to get back to origin */
+    uint16_t dupacks;
+    uint8_t recovery;       /* One of the TCP_RECOVERY_* values */
+    uint8_t timing;         /* Is rtt_seq being timed? */
 };
 
 struct tcp_sock {
     LIST_ENTRY(tcp_sock) sock_list;
+    LIST_ENTRY(tcp_sock) hash_list;
+    struct tcp_sock_list *bucket;   /* Hash bucket we're in, if any */
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -144,9 +259,14 @@ struct tcp_sock {
     int state;
     mutex_t mutex;
     int hop_limit;
+    int cc_algo;
     uint32_t rcvbuf_sz;
     uint32_t sndbuf_sz;
 
+    net_timer_t rxt_timer;      /* Retransmissions, window probes and SYNs */
+    net_timer_t delack_timer;   /* Delayed ACKs */
+    net_timer_t close_timer;    /* TIME-WAIT, and freeing closed sockets */
+
     union {
         struct {
             int backlog;
@@ -164,12 +284,23 @@ struct tcp_sock {
             uint32_t rcvbuf_cur_sz;
             uint32_t rcvbuf_head;
             uint32_t rcvbuf_tail;
+            net_pbuf_t *rcvq_head;
+            net_pbuf_t *rcvq_tail;
+            uint32_t rcvq_ring;
             uint8_t *sndbuf;
             uint32_t sndbuf_cur_sz;
             uint32_t sndbuf_head;
             uint32_t sndbuf_acked;
             uint32_t sndbuf_tail;
             uint64_t timer;
+            struct tcp_cc cc;
+            uint32_t opts;
+            struct seqblk ooo[TCP_OOO_BLOCKS];
+            int ooo_cnt;
+            struct seqblk sacked[TCP_SACK_BLOCKS];
+            int sacked_cnt;
+            struct segsum segsums[TCP_SEGSUM_CNT];
+            int segsum_next;
             condvar_t send_cv;
             condvar_t recv_cv;
         } data;
@@ -179,13 +310,26 @@ struct tcp_sock {
 LIST_HEAD(tcp_sock_list, tcp_sock);
 
 static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
+static struct tcp_sock_list tcp_conn_hash[TCP_HASH_BUCKETS];
+static struct tcp_sock_list tcp_listen_hash[TCP_LHASH_BUCKETS];
+static struct tcp_sock_list tcp_wild_hash[TCP_LHASH_BUCKETS];
 static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
-static int thd_cb_id = 0;
+static net_tcp_stats_t tcp_stats = { 0 };
 
 /* Default starting window size for connections. This should be big enough as a
    starting point, in general. If you need to adjust it, you can do so... */
 #define TCP_DEFAULT_WINDOW  8192
 
+/* The shift we ask the other side to apply to the windows we advertise, if
+   they agree to window scaling, and the biggest buffer that lets us make use
+   of. */
+#define TCP_RCV_WSCALE      4
+#define TCP_MAX_WINDOW      (65535 << TCP_RCV_WSCALE)
+
+/* Smallest amount of in order data we'll keep the packet buffer for, instead
+   of copying it into the receive buffer. */
+#define TCP_ZCOPY_MIN       512
+
 /* Default MSS */
 #define TCP_DEFAULT_MSS     1460
 
@@ -193,8 +337,34 @@ static int thd_cb_id = 0;
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
-#define TCP_DEFAULT_RTTO    2000
+/* Initial retransmission timeout (in milliseconds), used until we have a round
+   trip time measurement to go on. */
+#define TCP_DEFAULT_RTTO    1000
+
+/* Limits on the retransmission timeout (in milliseconds). RFC 6298 asks for at
+   least a second, but like most stacks we go well below that, since it's way
+   too long to wait on a LAN. */
+#define TCP_MIN_RTO         200
+#define TCP_MAX_RTO         60000
+
+/* How long (in milliseconds) we'll hold off on ACKing data we've received, in
+   the hope of having something to send back that it can ride along with. */
+#define TCP_DELACK_TIME     40
+
+/* Number of duplicate ACKs that trigger a fast retransmit */
+#define TCP_DUPACK_THRESH   3
+
+/* Congestion control algorithms */
+#define TCP_CC_NEWRENO      0
+#define TCP_CC_CUBIC        1
+
+/* Congestion control for new sockets */
+#define TCP_DEFAULT_CC      TCP_CC_NEWRENO
+
+/* Loss recovery states */
+#define TCP_RECOVERY_NONE   0
+#define TCP_RECOVERY_FAST   1
+#define TCP_RECOVERY_RTO    2
 
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
@@ -233,6 +403,30 @@ static int thd_cb_id = 0;
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
 #define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERM       4
+#define TCP_OPT_SACK            5
+#define TCP_OPT_TIMESTAMP       8
+
+/* The most option space a segment can have */
+#define TCP_MAX_OPTLEN          40
+
+/* Options seen on a segment/negotiated on a connection */
+#define TCP_OPTF_WSCALE         0x01
+#define TCP_OPTF_SACK           0x02
+#define TCP_OPTF_TIMESTAMP      0x04
+#define TCP_OPTF_MSS            0x08
+
+/* Options parsed out of an incoming segment */
+struct tcp_opts {
+    uint32_t flags;
+    uint16_t mss;
+    uint8_t wscale;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int sack_cnt;
+    struct seqblk sack[4];
+};
 
 /* A few macros for comparing sequence numbers */
 #define SEQ_LT(x, y)    (((int32_t)((x) - (y))) < 0)
@@ -241,6 +435,7 @@ static int thd_cb_id = 0;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -250,8 +445,115 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
                     uint32_t ack);
 static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
-static void tcp_send_data(struct tcp_sock *sock, int resend);
+static void tcp_send_data(struct tcp_sock *sock, int force);
 static void tcp_send_fin_ack(struct tcp_sock *sock);
+static void tcp_cc_init(struct tcp_sock *sock);
+static void tcp_rxt_arm(struct tcp_sock *sock);
+static void tcp_send_fin(struct tcp_sock *sock);
+static void tcp_rxt_cb(void *data);
+static void tcp_delack_cb(void *data);
+static void tcp_close_cb(void *data);
+static void tcp_ring_copy(uint8_t *dst, const uint8_t *ring, uint32_t sz,
+                          uint32_t head, uint32_t len);
+static void tcp_rcvq_free(struct tcp_sock *sock);
+
+/* Hash an address and a pair of ports for the socket tables. */
+static inline uint32_t tcp_hash(const struct in6_addr *addr, uint16_t p1,
+                                uint16_t p2) {
+    uint32_t h = addr->__s6_addr.__s6_addr32[0] ^
+                 addr->__s6_addr.__s6_addr32[1] ^
+                 addr->__s6_addr.__s6_addr32[2] ^
+                 addr->__s6_addr.__s6_addr32[3] ^
+                 (((uint32_t)p1 << 16) | p2);
+
+    h ^= h >> 16;
+    h *= 0x7FEB352D;
+    h ^= h >> 15;
+
+    return h;
+}
+
+static inline struct tcp_sock_list *tcp_conn_bucket(const struct in6_addr *ra,
+                                                    uint16_t rport,
+                                                    uint16_t lport) {
+    return &tcp_conn_hash[tcp_hash(ra, rport, lport) & (TCP_HASH_BUCKETS - 1)];
+}
+
+static inline struct tcp_sock_list *tcp_listen_bucket(const struct in6_addr *la,
+                                                      uint16_t lport) {
+    return &tcp_listen_hash[tcp_hash(la, lport, 0) & (TCP_LHASH_BUCKETS - 1)];
+}
+
+static inline struct tcp_sock_list *tcp_wild_bucket(uint16_t lport) {
+    return &tcp_wild_hash[tcp_hash(&in6addr_any, lport, 0) &
+                          (TCP_LHASH_BUCKETS - 1)];
+}
+
+/* Put the socket in the hash table that goes with its current addresses, taking
+   it out of whatever one it was in before. Call this with the write lock held
+   any time the local or remote address changes. */
+static void tcp_rehash(struct tcp_sock *sock) {
+    struct tcp_sock_list *b;
+
+    if(sock->bucket) {
+        LIST_REMOVE(sock, hash_list);
+        sock->bucket = NULL;
+    }
+
+    if(!sock->local_addr.sin6_port)
+        return;
+
+    if(!IN6_IS_ADDR_UNSPECIFIED(&sock->remote_addr.sin6_addr))
+        b = tcp_conn_bucket(&sock->remote_addr.sin6_addr,
+                            sock->remote_addr.sin6_port,
+                            sock->local_addr.sin6_port);
+    else if(!IN6_IS_ADDR_UNSPECIFIED(&sock->local_addr.sin6_addr))
+        b = tcp_listen_bucket(&sock->local_addr.sin6_addr,
+                              sock->local_addr.sin6_port);
+    else
+        b = tcp_wild_bucket(sock->local_addr.sin6_port);
+
+    LIST_INSERT_HEAD(b, sock, hash_list);
+    sock->bucket = b;
+}
+
+/* Take the socket off the list of sockets and out of the hash tables. Call this
+   with the write lock held. */
+static void tcp_unlink(struct tcp_sock *sock) {
+    LIST_REMOVE(sock, sock_list);
+
+    if(sock->bucket) {
+        LIST_REMOVE(sock, hash_list);
+        sock->bucket = NULL;
+    }
+}
+
+static int tcp_timers_init(struct tcp_sock *sock) {
+    if(net_timer_init(&sock->rxt_timer, &tcp_rxt_cb, sock))
+        return -1;
+
+    if(net_timer_init(&sock->delack_timer, &tcp_delack_cb, sock)) {
+        net_timer_destroy(&sock->rxt_timer);
+        return -1;
+    }
+
+    if(net_timer_init(&sock->close_timer, &tcp_close_cb, sock)) {
+        net_timer_destroy(&sock->delack_timer);
+        net_timer_destroy(&sock->rxt_timer);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Take the socket's timers off the queue for good. If one of them is running
+   right now, this waits for it to finish, so once this returns the socket can
+   be freed. */
+static void tcp_timers_destroy(struct tcp_sock *sock) {
+    net_timer_destroy(&sock->rxt_timer);
+    net_timer_destroy(&sock->delack_timer);
+    net_timer_destroy(&sock->close_timer);
+}
 
 /* Sockets interface... */
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
@@ -273,13 +575,21 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
         return -1;
     }
 
+    if(tcp_timers_init(sock)) {
+        mutex_destroy(&sock->mutex);
+        free(sock);
+        return -1;
+    }
+
     sock->domain = domain;
     sock->sock = hnd->fd;
     sock->hop_limit = TCP_DEFAULT_HOPS;
+    sock->cc_algo = TCP_DEFAULT_CC;
     sock->rcvbuf_sz = TCP_DEFAULT_WINDOW;
     sock->sndbuf_sz = TCP_DEFAULT_WINDOW;
 
     if(rwsem_write_lock_irqsafe(&tcp_sem)) {
+        tcp_timers_destroy(sock);
         free(sock);
         return -1;
     }
@@ -405,9 +715,8 @@ retry:
         case TCP_STATE_SYN_RECEIVED:
             /* Don't have to worry about queued packets, since we don't allow
                any queueing until after the connection is established. */
-            tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
             sock->state = TCP_STATE_FIN_WAIT_1;
+            tcp_send_fin(sock);
             goto ret_no_remove;
 
         case TCP_STATE_CLOSE_WAIT:
@@ -417,9 +726,8 @@ retry:
                 goto ret_no_remove;
             }
 
-            tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
             sock->state = TCP_STATE_CLOSING;
+            tcp_send_fin(sock);
             goto ret_no_remove;
 
         case TCP_STATE_CLOSED | TCP_STATE_RESET:
@@ -438,7 +746,8 @@ retry:
     }
 
 ret_remove:
-    LIST_REMOVE(sock, sock_list);
+    tcp_unlink(sock);
+    tcp_timers_destroy(sock);
     mutex_unlock(&sock->mutex);
     mutex_destroy(&sock->mutex);
     free(sock);
@@ -447,8 +756,13 @@ ret_remove:
     return;
 
 ret_no_remove:
-    if(sock->state != TCP_STATE_LISTEN)
+    /* A listening socket closed out from under accept() gets freed there.
+       Anything else won't be read from again, so there's no sense in holding
+       onto packet buffers for it until it's freed. */
+    if(!(sock->intflags & TCP_IFLAG_ACCEPTWAIT)) {
         sock->intflags = TCP_IFLAG_CANBEDEL;
+        tcp_rcvq_free(sock);
+    }
 
     if(sock->state == TCP_STATE_ESTABLISHED ||
             sock->state == TCP_STATE_CLOSE_WAIT)
@@ -456,8 +770,13 @@ ret_no_remove:
 
     sock->sock = -1;
 
-    /* Don't free anything here, it will be dealt with later on in the
-       net_thd callback. */
+    /* Don't free anything here, it will be dealt with later on by the close
+       timer, once the connection is all the way closed. If it already is, then
+       that's right away. */
+    if((sock->intflags & TCP_IFLAG_CANBEDEL) &&
+            (sock->state & 0x0F) == TCP_STATE_CLOSED)
+        net_timer_set(&sock->close_timer, 0);
+
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
     return;
@@ -513,7 +832,8 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             mutex_lock(&sock->mutex);
             free(sock->listen.queue);
             cond_destroy(&sock->listen.cv);
-            LIST_REMOVE(sock, sock_list);
+            tcp_unlink(sock);
+            tcp_timers_destroy(sock);
             mutex_unlock(&sock->mutex);
             mutex_destroy(&sock->mutex);
             free(sock);
@@ -549,9 +869,17 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         return -1;
     }
 
+    if(tcp_timers_init(sock2)) {
+        mutex_unlock(&sock->mutex);
+        mutex_destroy(&sock2->mutex);
+        free(sock2);
+        return -1;
+    }
+
     if(!(sock2->data.rcvbuf = (uint8_t *)malloc(sock->rcvbuf_sz))) {
         errno = ENOMEM;
         mutex_unlock(&sock->mutex);
+        tcp_timers_destroy(sock2);
         mutex_destroy(&sock2->mutex);
         free(sock2);
         return -1;
@@ -561,6 +889,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         errno = ENOMEM;
         mutex_unlock(&sock->mutex);
         free(sock2->data.rcvbuf);
+        tcp_timers_destroy(sock2);
         mutex_destroy(&sock2->mutex);
         free(sock2);
         return -1;
@@ -571,6 +900,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         mutex_unlock(&sock->mutex);
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
+        tcp_timers_destroy(sock2);
         mutex_destroy(&sock2->mutex);
         free(sock2);
         return -1;
@@ -582,6 +912,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         cond_destroy(&sock2->data.send_cv);
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
+        tcp_timers_destroy(sock2);
         mutex_destroy(&sock2->mutex);
         free(sock2);
         return -1;
@@ -594,6 +925,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         cond_destroy(&sock2->data.send_cv);
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
+        tcp_timers_destroy(sock2);
         mutex_destroy(&sock2->mutex);
         free(sock2);
         return -1;
@@ -606,6 +938,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->local_addr = lsock.local_addr;
     sock2->remote_addr = lsock.remote_addr;
     sock2->hop_limit = sock->hop_limit;
+    sock2->cc_algo = sock->cc_algo;
     sock2->rcvbuf_sz = sock->rcvbuf_sz;
     sock2->sndbuf_sz = sock->sndbuf_sz;
     sock2->data.rcv.wnd = sock->rcvbuf_sz;
@@ -658,6 +991,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             cond_destroy(&sock2->data.send_cv);
             free(sock2->data.sndbuf);
             free(sock2->data.rcvbuf);
+            tcp_timers_destroy(sock2);
             mutex_destroy(&sock2->mutex);
             free(sock2);
             errno = EWOULDBLOCK;
@@ -709,15 +1043,25 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->data.snd.mss = lsock.mss;
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
+    sock2->data.rcv.ts_recent = lsock.ts_recent;
+    sock2->data.opts = lsock.opts;
+
+    if(lsock.opts & TCP_OPTF_WSCALE) {
+        sock2->data.snd.wscale = lsock.wscale;
+        sock2->data.rcv.wscale = TCP_RCV_WSCALE;
+    }
 
     /* Since nothing else has a pointer to this socket, this will not fail. */
     mutex_trylock(&sock2->mutex);
 
     /* Send the <SYN,ACK> packet now, add it to the list, and clean up. */
+    tcp_cc_init(sock2);
     tcp_send_syn(sock2, 1);
     sock2->data.timer = timer_ms_gettime64();
+    tcp_rxt_arm(sock2);
     fd = sock2->sock;
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
+    tcp_rehash(sock2);
     mutex_unlock(&sock2->mutex);
 
     sock->state &= ~TCP_STATE_ACCEPTING;
@@ -869,6 +1213,8 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
         sock->local_addr.sin6_port = htons(port);
     }
 
+    tcp_rehash(sock);
+
     /* Release the locks, we're done */
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
@@ -1008,6 +1354,7 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     /* Set the remote address on the socket and go to the SYN-SENT state (this
        includes setting up all the data we need for that). */
     sock->remote_addr = realaddr6;
+    tcp_rehash(sock);
 
     if(!(sock->data.rcvbuf = (uint8_t *)malloc(sock->rcvbuf_sz))) {
         errno = ENOBUFS;
@@ -1050,6 +1397,7 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
     sock->state = TCP_STATE_SYN_SENT;
+    tcp_cc_init(sock);
 
     /* Send a <SYN> packet */
     if(tcp_send_syn(sock, 0) == -1) {
@@ -1058,6 +1406,9 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
         return -1;
     }
 
+    sock->data.timer = timer_ms_gettime64();
+    tcp_rxt_arm(sock);
+
     /* Release the write lock... */
     rwsem_write_unlock(&tcp_sem);
 
@@ -1150,14 +1501,115 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
     return 0;
 }
 
+/* Let the other side know that reading has opened the window back up, if it
+   has opened by enough to be worth it. That's a full segment or half of the
+   buffer, whichever is smaller, which keeps us from advertising lots of tiny
+   windows (RFC 1122, section 4.2.3.3). */
+static void tcp_wnd_update(struct tcp_sock *sock) {
+    uint32_t thresh = sock->rcvbuf_sz / 2;
+
+    if(sock->state != TCP_STATE_ESTABLISHED &&
+       sock->state != TCP_STATE_FIN_WAIT_1 &&
+       sock->state != TCP_STATE_FIN_WAIT_2)
+        return;
+
+    if(thresh > TCP_DEFAULT_MSS)
+        thresh = TCP_DEFAULT_MSS;
+
+    if(SEQ_GE(sock->data.rcv.nxt + sock->data.rcv.wnd,
+              sock->data.rcv.adv_edge + thresh))
+        tcp_send_ack(sock);
+}
+
+/* Copy len bytes from the front of the receive queue, taking the data from
+   the receive buffer and the kept packet buffers in the order it came in. */
+static void tcp_rcvq_copy(struct tcp_sock *sock, uint8_t *dst, uint32_t len) {
+    net_pbuf_t *pb = sock->data.rcvq_head;
+    uint32_t head = sock->data.rcvbuf_head, n;
+
+    while(len) {
+        /* Whatever is in the receive buffer in front of the next packet
+           buffer (or all of it, if there isn't one) */
+        n = (pb && pb->tag < len) ? pb->tag : len;
+        tcp_ring_copy(dst, sock->data.rcvbuf, sock->rcvbuf_sz, head, n);
+        head = (head + n) % sock->rcvbuf_sz;
+        dst += n;
+        len -= n;
+
+        if(!len)
+            break;
+
+        n = MIN(pb->len, len);
+        memcpy(dst, pb->data, n);
+        dst += n;
+        len -= n;
+        pb = pb->next;
+    }
+}
+
+/* Drop len bytes from the front of the receive queue, giving back any packet
+   buffers that have been used up. */
+static void tcp_rcvq_consume(struct tcp_sock *sock, uint32_t len) {
+    net_pbuf_t *pb;
+    uint32_t n;
+
+    while(len && (pb = sock->data.rcvq_head)) {
+        n = MIN(pb->tag, len);
+        pb->tag -= n;
+        sock->data.rcvbuf_head = (sock->data.rcvbuf_head + n) %
+                                 sock->rcvbuf_sz;
+        len -= n;
+
+        if(!len)
+            break;
+
+        n = MIN(pb->len, len);
+        pb->data += n;
+        pb->len -= n;
+        len -= n;
+
+        if(!pb->len) {
+            if(!(sock->data.rcvq_head = pb->next))
+                sock->data.rcvq_tail = NULL;
+
+            net_pbuf_free(pb);
+        }
+    }
+
+    sock->data.rcvq_ring -= len;
+    sock->data.rcvbuf_head = (sock->data.rcvbuf_head + len) % sock->rcvbuf_sz;
+}
+
+/* How much of the receive queue is in the receive buffer itself. */
+static uint32_t tcp_rcvq_ring_len(struct tcp_sock *sock) {
+    net_pbuf_t *pb;
+    uint32_t len = sock->data.rcvq_ring;
+
+    for(pb = sock->data.rcvq_head; pb; pb = pb->next)
+        len += pb->tag;
+
+    return len;
+}
+
+/* Give back all the packet buffers on the receive queue. */
+static void tcp_rcvq_free(struct tcp_sock *sock) {
+    net_pbuf_t *pb;
+
+    while((pb = sock->data.rcvq_head)) {
+        sock->data.rcvq_head = pb->next;
+        net_pbuf_free(pb);
+    }
+
+    sock->data.rcvq_tail = NULL;
+    sock->data.rcvq_ring = 0;
+}
+
 static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
                                 int flags, struct sockaddr *addr,
                                 socklen_t *addr_len) {
     struct tcp_sock *sock;
     ssize_t size = 0;
     uint8_t *buf = (uint8_t *)buffer;
-    uint8_t *rb;
-    int tmp;
 
     /* Check the parameters first */
     if(buffer == NULL || (addr != NULL && addr_len == NULL)) {
@@ -1248,35 +1700,19 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
     else
         size = length;
 
-    rb = sock->data.rcvbuf + sock->data.rcvbuf_head;
+    tcp_rcvq_copy(sock, buf, size);
 
     /* Advance the window if we're pulling data out of the queue. */
     if(!(flags & MSG_PEEK)) {
+        tcp_rcvq_consume(sock, size);
         sock->data.rcv.wnd += size;
         sock->data.rcvbuf_cur_sz -= size;
+        tcp_wnd_update(sock);
     }
 
-    if(sock->data.rcvbuf_head + size <= sock->rcvbuf_sz) {
-        memcpy(buf, rb, size);
-
-        if(!(flags & MSG_PEEK)) {
-            sock->data.rcvbuf_head += size;
-
-            if(sock->data.rcvbuf_head == sock->rcvbuf_sz)
-                sock->data.rcvbuf_head = 0;
-        }
-    }
-    else {
-        tmp = sock->rcvbuf_sz - sock->data.rcvbuf_head;
-        memcpy(buf, rb, tmp);
-        memcpy(buf + tmp, sock->data.rcvbuf, size - tmp);
-
-        if(!(flags & MSG_PEEK))
-            sock->data.rcvbuf_head = size - tmp;
-    }
-
-    /* If we've got nothing left, move the pointers back to the beginning */
-    if(!sock->data.rcvbuf_cur_sz) {
+    /* If we've got nothing left, move the pointers back to the beginning. We
+       can't do that if there's out of order data stored past the tail. */
+    if(!sock->data.rcvbuf_cur_sz && !sock->data.ooo_cnt) {
         sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
     }
 
@@ -1471,6 +1907,8 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                               void *option_value, socklen_t *option_len) {
     int tmp;
     struct tcp_sock *sock;
+    const char *name;
+    socklen_t len;
 
     if(!option_value || !option_len) {
         errno = EFAULT;
@@ -1540,6 +1978,17 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case TCP_NODELAY:
                     tmp = 1;
                     goto copy_int;
+
+                case TCP_CONGESTION:
+                    name = sock->cc_algo == TCP_CC_CUBIC ? "cubic" : "reno";
+                    len = strlen(name) + 1;
+
+                    if(*option_len < len)
+                        len = *option_len;
+
+                    memcpy(option_value, name, len);
+                    *option_len = len;
+                    goto simply_return;
             }
 
             break;
@@ -1572,10 +2021,33 @@ simply_return:
     return 0;
 }
 
+/* Whether the socket has its send and receive buffers yet. Sockets that have
+   never been connected, and listening ones, don't. */
+static int tcp_has_bufs(struct tcp_sock *sock) {
+    if((sock->state & 0x0F) == TCP_STATE_LISTEN)
+        return 0;
+
+    return sock->data.rcvbuf != NULL;
+}
+
+/* Copy len bytes out of a ring buffer of size sz, starting at head. */
+static void tcp_ring_copy(uint8_t *dst, const uint8_t *ring, uint32_t sz,
+                          uint32_t head, uint32_t len) {
+    if(head + len <= sz) {
+        memcpy(dst, ring + head, len);
+    }
+    else {
+        memcpy(dst, ring + head, sz - head);
+        memcpy(dst + sz - head, ring, len - (sz - head));
+    }
+}
+
 static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                               const void *option_value, socklen_t option_len) {
     struct tcp_sock *sock;
     int tmp;
+    uint32_t off;
+    size_t len;
     uint8_t *new_ptr;
 
     if(!option_value || !option_len) {
@@ -1599,18 +2071,47 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Receive buffer size must be in the range 256 - 65535 */
+                    /* Receive buffer size must be in the range 256 -
+                       TCP_MAX_WINDOW. Anything over 65535 only helps if the
+                       other side agrees to window scaling. */
                     if(tmp < 256)
                         tmp = 256;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_WINDOW)
+                        tmp = TCP_MAX_WINDOW;
+
+                    /* Listening and unconnected sockets don't have buffers
+                       yet, they just get made with this size later. */
+                    if(!tcp_has_bufs(sock)) {
+                        sock->rcvbuf_sz = tmp;
+                        goto ret_success;
+                    }
 
-                    new_ptr = realloc(sock->data.rcvbuf, tmp);
-                    if(!new_ptr)
+                    /* Don't drop anything that's waiting to be read */
+                    if((uint32_t)tmp < sock->data.rcvbuf_cur_sz)
+                        tmp = sock->data.rcvbuf_cur_sz;
+
+                    if(!(new_ptr = (uint8_t *)malloc(tmp)))
                         goto ret_nomem;
 
+                    /* Only what's in the buffer itself needs moving, any
+                       packet buffers that were kept stay where they are. */
+                    len = tcp_rcvq_ring_len(sock);
+                    tcp_ring_copy(new_ptr, sock->data.rcvbuf, sock->rcvbuf_sz,
+                                  sock->data.rcvbuf_head, len);
+                    free(sock->data.rcvbuf);
+
+                    /* Anything that arrived out of order gets dropped, it'll
+                       just be sent again. */
                     sock->data.rcvbuf = new_ptr;
+                    sock->data.rcvbuf_head = 0;
+                    sock->data.rcvbuf_tail = len;
+                    sock->data.ooo_cnt = 0;
                     sock->rcvbuf_sz = tmp;
+                    sock->data.rcv.wnd = tmp - sock->data.rcvbuf_cur_sz;
+
+                    if(sock->data.rcvbuf_tail == sock->rcvbuf_sz)
+                        sock->data.rcvbuf_tail = 0;
+
                     goto ret_success;
 
                 case SO_SNDBUF:
@@ -1618,19 +2119,54 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Send buffer size must be in the range 2048 - 65535 */
+                    /* Send buffer size must be in the range 2048 -
+                       TCP_MAX_WINDOW */
                     if(tmp < 2048)
                         tmp = 2048;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_WINDOW)
+                        tmp = TCP_MAX_WINDOW;
 
-                    new_ptr = realloc(sock->data.sndbuf, tmp);
-                    if(!new_ptr) {
-                        goto ret_nomem;
+                    if(!tcp_has_bufs(sock)) {
+                        sock->sndbuf_sz = tmp;
+                        goto ret_success;
                     }
 
+                    /* Don't drop anything that hasn't been acknowledged */
+                    if((uint32_t)tmp < sock->data.sndbuf_cur_sz)
+                        tmp = sock->data.sndbuf_cur_sz;
+
+                    if(!(new_ptr = (uint8_t *)malloc(tmp)))
+                        goto ret_nomem;
+
+                    tcp_ring_copy(new_ptr, sock->data.sndbuf, sock->sndbuf_sz,
+                                  sock->data.sndbuf_acked,
+                                  sock->data.sndbuf_cur_sz);
+                    free(sock->data.sndbuf);
+
+                    /* Figure out where the unsent data starts, relative to
+                       the oldest unacknowledged byte, which is now at the
+                       start. If the old buffer was full, the head and acked
+                       pointers match whether all of it was sent or none. */
+                    off = (sock->data.sndbuf_head + sock->sndbuf_sz -
+                           sock->data.sndbuf_acked) % sock->sndbuf_sz;
+
+                    if(!off && sock->data.sndbuf_cur_sz == sock->sndbuf_sz &&
+                       sock->data.snd.nxt - sock->data.snd.una >=
+                       sock->data.sndbuf_cur_sz)
+                        off = sock->data.sndbuf_cur_sz;
+
                     sock->data.sndbuf = new_ptr;
+                    sock->data.sndbuf_head = off;
+                    sock->data.sndbuf_acked = 0;
+                    sock->data.sndbuf_tail = sock->data.sndbuf_cur_sz;
                     sock->sndbuf_sz = tmp;
+
+                    if(sock->data.sndbuf_head == sock->sndbuf_sz)
+                        sock->data.sndbuf_head = 0;
+
+                    if(sock->data.sndbuf_tail == sock->sndbuf_sz)
+                        sock->data.sndbuf_tail = 0;
+
                     goto ret_success;
             }
 
@@ -1707,6 +2243,26 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     goto ret_success;
+
+                case TCP_CONGESTION:
+                    len = strnlen((const char *)option_value, option_len);
+
+                    if((len == 4 && !memcmp(option_value, "reno", 4)) ||
+                       (len == 7 && !memcmp(option_value, "newreno", 7)))
+                        tmp = TCP_CC_NEWRENO;
+                    else if(len == 5 && !memcmp(option_value, "cubic", 5))
+                        tmp = TCP_CC_CUBIC;
+                    else
+                        goto ret_inval;
+
+                    sock->cc_algo = tmp;
+
+                    /* Start a new CUBIC epoch if we're switching over to it in
+                       the middle of a connection. */
+                    if(tcp_has_bufs(sock))
+                        sock->data.cc.epoch = 0;
+
+                    goto ret_success;
             }
 
             break;
@@ -2013,6 +2569,7 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
     c = net_ipv6_checksum_pseudo(src, dst, sizeof(tcp_hdr_t), IPPROTO_TCP);
     pkt.checksum = net_ipv4_checksum((const uint8 *)&pkt, sizeof(tcp_hdr_t), c);
 
+    ++tcp_stats.pkt_sent;
     net_ipv6_send(net, (const uint8 *)&pkt, sizeof(tcp_hdr_t), 0, IPPROTO_TCP,
                   src, dst);
 }
@@ -2054,208 +2611,873 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
     pkt.checksum = net_ipv4_checksum((const uint8 *)&pkt, sizeof(tcp_hdr_t),
                                      cs);
 
+    ++tcp_stats.pkt_sent;
     net_ipv6_send(net, (const uint8 *)&pkt, sizeof(tcp_hdr_t), 0, IPPROTO_TCP,
                   dst, src);
 }
 
-static int tcp_send_syn(struct tcp_sock *sock, int ack) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+/* Timestamps are in milliseconds, which is well within what RFC 7323 asks. */
+static inline uint32_t tcp_now(void) {
+    return (uint32_t)timer_ms_gettime64();
+}
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.iss);
-    hdr->ack = htonl(sock->data.rcv.nxt);
+/* Options are not necessarily aligned, so these go a byte at a time. */
+static inline uint32_t tcp_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
 
-    if(ack) {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(6));
-    }
-    else {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(6));
+static inline void tcp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* Integer cube root, rounded down. */
+static uint32_t tcp_cbrt(uint64_t x) {
+    uint64_t r = 0, t;
+    int i;
+
+    for(i = 20; i >= 0; --i) {
+        t = r | (1ULL << i);
+
+        if(t * t * t <= x)
+            r = t;
     }
 
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->checksum = 0;
-    hdr->urg = 0;
+    return (uint32_t)r;
+}
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
-    hdr->options[0] = TCP_OPT_MSS;
-    hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
+/* Set up the RTT estimator and congestion control for a new connection. This
+   is called right before sending the <SYN> or <SYN,ACK>, which gets timed to
+   give us our first RTT measurement. */
+static void tcp_cc_init(struct tcp_sock *sock) {
+    struct tcp_cc *cc = &sock->data.cc;
+
+    memset(cc, 0, sizeof(struct tcp_cc));
+    cc->rto = TCP_DEFAULT_RTTO;
+    cc->ssthresh = UINT32_MAX;
+    cc->recover = sock->data.snd.iss;
+    cc->rexmit_nxt = cc->rexmit_end = sock->data.snd.iss;
+    cc->rtt_seq = sock->data.snd.iss;
+    cc->rtt_time = tcp_now();
+    cc->timing = 1;
+
+    /* Nothing's been sent yet, so forget any sums from the last connection. */
+    memset(sock->data.segsums, 0, sizeof(sock->data.segsums));
+    sock->data.segsum_next = 0;
+}
 
-    /* Calculate the real checksum */
-    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                  &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
+/* Called when the connection gets established, and we know the MSS. The
+   initial window is the one from RFC 6928. */
+static void tcp_cc_start(struct tcp_sock *sock) {
+    uint32_t mss = sock->data.snd.mss;
 
-    return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
-                         sock->hop_limit, IPPROTO_TCP,
-                         &sock->local_addr.sin6_addr,
-                         &sock->remote_addr.sin6_addr);
+    sock->data.cc.cwnd = mss * 10 < 14600 ? mss * 10 :
+                         (mss * 2 > 14600 ? mss * 2 : 14600);
 }
 
-static void tcp_send_fin_ack(struct tcp_sock *sock) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t)];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+/* Feed a round trip time measurement into the estimator, and work out the new
+   retransmission timeout from it, as RFC 6298 describes. */
+static void tcp_rtt_sample(struct tcp_cc *cc, uint32_t rtt) {
+    int32_t delta;
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.nxt);
-    hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->checksum = 0;
-    hdr->urg = 0;
+    /* The clock only has millisecond granularity, so anything faster than
+       that counts as 1ms. */
+    if(!rtt)
+        rtt = 1;
 
-    /* Calculate the real checksum */
-    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                  &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
+    if(!cc->srtt) {
+        cc->srtt = rtt << 3;
+        cc->rttvar = rtt << 1;
+    }
+    else {
+        delta = (int32_t)rtt - (int32_t)(cc->srtt >> 3);
+        cc->srtt += delta;
 
-    net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
-                  IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
-}
+        if(delta < 0)
+            delta = -delta;
 
-static void tcp_send_ack(struct tcp_sock *sock) {
-    tcp_hdr_t hdr;
-    uint16_t c;
+        cc->rttvar += delta - (int32_t)(cc->rttvar >> 2);
+    }
 
-    /* Fill in the base packet */
-    hdr.src_port = sock->local_addr.sin6_port;
-    hdr.dst_port = sock->remote_addr.sin6_port;
-    hdr.seq = htonl(sock->data.snd.nxt);
-    hdr.ack = htonl(sock->data.rcv.nxt);
-    hdr.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr.wnd = htons(sock->data.rcv.wnd);
-    hdr.checksum = 0;
-    hdr.urg = 0;
+    cc->rto = (cc->srtt >> 3) + MAX(cc->rttvar, 1);
 
-    /* Calculate the real checksum */
-    c = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                 &sock->remote_addr.sin6_addr,
-                                 sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr.checksum = net_ipv4_checksum((const uint8 *)&hdr, sizeof(tcp_hdr_t), c);
+    if(cc->rto < TCP_MIN_RTO)
+        cc->rto = TCP_MIN_RTO;
+    else if(cc->rto > TCP_MAX_RTO)
+        cc->rto = TCP_MAX_RTO;
+}
 
-    net_ipv6_send(sock->data.net, (const uint8 *)&hdr, sizeof(tcp_hdr_t),
-                  sock->hop_limit, IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+/* Back off the retransmission timeout after it has gone off. */
+static void tcp_rto_backoff(struct tcp_cc *cc) {
+    cc->rto = cc->rto * 2 > TCP_MAX_RTO ? TCP_MAX_RTO : cc->rto * 2;
 }
 
-static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz = sizeof(tcp_hdr_t);
-    uint8_t rawpkt[1500];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
-    uint8_t *sb, *buf;
-    uint32_t seq, unacked, head;
+/* Number of bytes between start and end that the other side has selectively
+   acknowledged. */
+static uint32_t tcp_sacked_bytes(struct tcp_sock *s, uint32_t start,
+                                 uint32_t end) {
+    uint32_t total = 0, lo, hi;
+    int i;
 
-    if(!resend) {
-        seq = sock->data.snd.nxt;
-        unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
-        head = sock->data.sndbuf_head;
-    }
-    else {
-        seq = sock->data.snd.una;
-        unacked = 0;
-        head = sock->data.sndbuf_acked;
+    for(i = 0; i < s->data.sacked_cnt; ++i) {
+        lo = SEQ_GT(s->data.sacked[i].start, start) ?
+             s->data.sacked[i].start : start;
+        hi = SEQ_LT(s->data.sacked[i].end, end) ? s->data.sacked[i].end : end;
+
+        if(SEQ_LT(lo, hi))
+            total += hi - lo;
     }
 
-    if(!wnd)
-        wnd = 1;
+    return total;
+}
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->urg = 0;
+/* How much of our data we think is still out in the network. That's everything
+   sent but not acknowledged, less anything the other side has selectively
+   acknowledged and anything we've decided was lost and haven't resent yet. This
+   is more or less the "pipe" from RFC 6675. */
+static uint32_t tcp_pipe(struct tcp_sock *s) {
+    struct tcp_cc *cc = &s->data.cc;
+    uint32_t pipe = s->data.snd.nxt - s->data.snd.una, gone;
 
-    /* Put on some data if we should do so */
-    while(sock->data.sndbuf_cur_sz - unacked && wnd) {
-        hdr->seq = htonl(seq);
-        hdr->checksum = 0;
-        buf = rawpkt + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
-        snd = wnd;
+    gone = tcp_sacked_bytes(s, s->data.snd.una, s->data.snd.nxt);
 
-        if(snd > sock->data.snd.mss - sizeof(tcp_hdr_t))
-            snd = sock->data.snd.mss - sizeof(tcp_hdr_t);
+    if(SEQ_LT(cc->rexmit_nxt, cc->rexmit_end))
+        gone += (cc->rexmit_end - cc->rexmit_nxt) -
+                tcp_sacked_bytes(s, cc->rexmit_nxt, cc->rexmit_end);
 
-        if(snd > sock->data.sndbuf_cur_sz - unacked)
-            snd = sock->data.sndbuf_cur_sz - unacked;
+    /* Without SACK, all we know is that each duplicate ACK means another
+       segment has left the network. */
+    if(!(s->data.opts & TCP_OPTF_SACK) && cc->recovery == TCP_RECOVERY_FAST)
+        gone += cc->dupacks * s->data.snd.mss;
+
+    return gone < pipe ? pipe - gone : 0;
+}
+
+/* Cut the slow start threshold after a loss. */
+static void tcp_cc_loss(struct tcp_sock *s) {
+    struct tcp_cc *cc = &s->data.cc;
+    uint32_t flight = s->data.snd.nxt - s->data.snd.una;
+
+    if(s->cc_algo == TCP_CC_CUBIC) {
+        /* With fast convergence, give up some of the old maximum if we didn't
+           make it back up to it, to leave room for newer connections. */
+        if(cc->cwnd < cc->w_max)
+            cc->w_max = cc->cwnd / 20 * 17;
+        else
+            cc->w_max = cc->cwnd;
+
+        cc->ssthresh = flight / 10 * 7;
+        cc->epoch = 0;
+    }
+    else {
+        cc->ssthresh = flight / 2;
+    }
+
+    if(cc->ssthresh < 2 * s->data.snd.mss)
+        cc->ssthresh = 2 * s->data.snd.mss;
 
-        /* Copy in the data */
-        if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
-            head += snd;
+    /* Karn's algorithm: nothing sent before now can be timed reliably. */
+    cc->timing = 0;
+}
 
-            if(head == sock->sndbuf_sz)
-                head = 0;
+/* Grow the congestion window in congestion avoidance, per CUBIC. */
+static void tcp_cubic_grow(struct tcp_sock *s, uint32_t acked) {
+    struct tcp_cc *cc = &s->data.cc;
+    uint32_t mss = s->data.snd.mss, now = tcp_now(), target;
+    int64_t t, w;
+
+    if(!cc->epoch) {
+        cc->epoch = now ? now : 1;
+        cc->w_est = cc->cwnd;
+
+        /* K is how long it takes the curve to get back up to where we were
+           when we lost something, with C = 0.4 segments/s^3. In ms, that's
+           cbrt((W_max - cwnd) / C * 10^9), with the window in segments. */
+        if(cc->cwnd < cc->w_max) {
+            cc->k = tcp_cbrt((uint64_t)(cc->w_max - cc->cwnd) * 2500000000ULL /
+                             mss);
+            cc->origin = cc->w_max;
         }
         else {
-            sz = sock->sndbuf_sz - head;
-            memcpy(buf, sb, sz);
-            memcpy(buf + sz, sock->data.sndbuf, snd - sz);
-            head = snd - sz;
+            cc->k = 0;
+            cc->origin = cc->cwnd;
         }
+    }
 
-        sz = snd + sizeof(tcp_hdr_t);
-        wnd -= snd;
-        seq += snd;
-        unacked += snd;
+    /* Where the curve will be one RTT from now: C * (t - K)^3 + origin. */
+    t = (int64_t)(now - cc->epoch) + (cc->srtt >> 3) - cc->k;
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
+    if(t > 60000)
+        t = 60000;
+    else if(t < -60000)
+        t = -60000;
 
-        net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit, IPPROTO_TCP,
-                      &sock->local_addr.sin6_addr,
-                      &sock->remote_addr.sin6_addr);
-    }
+    w = (int64_t)cc->origin + t * t * t * 4 * mss / 10000000000LL;
 
-    sock->data.timer = timer_ms_gettime64();
-    sock->data.sndbuf_head = head;
-    sock->data.snd.nxt = seq;
-}
+    if(w < cc->cwnd)
+        target = cc->cwnd;
+    else if(w > cc->cwnd + cc->cwnd / 2)
+        target = cc->cwnd + cc->cwnd / 2;
+    else
+        target = (uint32_t)w;
 
-#define ADDR_EQUAL(a1, a2) \
-    (((a1).__s6_addr.__s6_addr32[0] == (a2).__s6_addr.__s6_addr32[0]) && \
-     ((a1).__s6_addr.__s6_addr32[1] == (a2).__s6_addr.__s6_addr32[1]) && \
-     ((a1).__s6_addr.__s6_addr32[2] == (a2).__s6_addr.__s6_addr32[2]) && \
-     ((a1).__s6_addr.__s6_addr32[3] == (a2).__s6_addr.__s6_addr32[3]))
+    /* Don't do any worse than Reno would, which would grow its window by
+       3 * beta / (2 - beta) segments every RTT with beta = 0.7. */
+    cc->w_est += (uint32_t)((uint64_t)21 * mss * acked / (13 * cc->cwnd));
 
-/* Match a socket to an incoming packet. If an actual socket is returned, it is
-   the caller's responsibility  to release the socket's mutex when they're done
-   with it. */
-static struct tcp_sock *find_sock(const struct in6_addr *src,
-                                  const struct in6_addr *dst,
-                                  uint16_t sport, uint16_t dport, int domain) {
-    struct tcp_sock *i;
+    if(cc->w_est > target)
+        target = cc->w_est;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        /* Ignore any closed sockets */
-        if(i->state == TCP_STATE_CLOSED)
-            continue;
+    if(target > cc->cwnd)
+        cc->cwnd += (uint32_t)((uint64_t)(target - cc->cwnd) * acked /
+                               cc->cwnd);
+    else
+        cc->cwnd += mss * acked / cc->cwnd / 100;
+}
 
-        /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
-           packet, or any that are IPv4 only when we have an incoming IPv6
-           packet. */
-        if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
-                (domain == AF_INET6 && i->domain == AF_INET))
-            continue;
+/* Grow the congestion window after an ACK of new data. */
+static void tcp_cc_grow(struct tcp_sock *s, uint32_t acked) {
+    struct tcp_cc *cc = &s->data.cc;
+    uint32_t mss = s->data.snd.mss, inc;
+
+    /* Count the bytes acknowledged (RFC 3465), up to two segments' worth per
+       ACK, so that the window grows just as fast when the other side delays
+       its ACKs as it does when it acks every segment. */
+    acked = MIN(acked, 2 * mss);
+
+    if(cc->cwnd < cc->ssthresh) {
+        /* Slow start */
+        cc->cwnd += acked;
+    }
+    else if(s->cc_algo == TCP_CC_CUBIC) {
+        tcp_cubic_grow(s, acked);
+    }
+    else {
+        /* Congestion avoidance: about one segment per round trip */
+        inc = mss * acked / cc->cwnd;
+        cc->cwnd += inc ? inc : 1;
+    }
+
+    if(cc->cwnd > TCP_MAX_WINDOW)
+        cc->cwnd = TCP_MAX_WINDOW;
+}
+
+/* Mark everything we've sent as lost after the retransmission timer goes off,
+   and drop back to slow start. */
+static void tcp_cc_timeout(struct tcp_sock *s) {
+    struct tcp_cc *cc = &s->data.cc;
+
+    /* If we time out again while recovering from the last one, the threshold
+       has already been cut for this loss. */
+    if(cc->recovery != TCP_RECOVERY_RTO)
+        tcp_cc_loss(s);
+
+    cc->cwnd = s->data.snd.mss;
+    cc->recovery = TCP_RECOVERY_RTO;
+    cc->recover = s->data.snd.nxt;
+    cc->rexmit_nxt = s->data.snd.una;
+    cc->rexmit_end = s->data.snd.nxt;
+    cc->dupacks = 0;
+    cc->timing = 0;
+    tcp_rto_backoff(cc);
+
+    /* The other side is allowed to throw away data it has selectively
+       acknowledged, so don't trust what it told us past one timeout. If it
+       still has the data, it'll tell us again when it acks what we resend. */
+    s->data.sacked_cnt = 0;
+
+    ++tcp_stats.timeouts;
+}
+
+/* Make sure the retransmission timer goes off no later than one RTO after
+   data.timer, if there's anything for it to do then. A timer that's already
+   due sooner is left alone; it'll put itself back when it finds out it went
+   off early. */
+static void tcp_rxt_arm(struct tcp_sock *s) {
+    uint64_t when;
+
+    switch(s->state) {
+        case TCP_STATE_SYN_SENT:
+        case TCP_STATE_SYN_RECEIVED:
+            break;
+
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+
+            if(s->data.sndbuf_cur_sz)
+                break;
+
+            return;
+
+        case TCP_STATE_FIN_WAIT_1:
+        case TCP_STATE_CLOSING:
+        case TCP_STATE_LAST_ACK:
+
+            /* Our <FIN> is the only thing that can be outstanding here. */
+            if(s->data.snd.una != s->data.snd.nxt)
+                break;
+
+            return;
+
+        default:
+            return;
+    }
+
+    when = s->data.timer + s->data.cc.rto;
+
+    if(!net_timer_pending(&s->rxt_timer) || when < s->rxt_timer.when)
+        net_timer_set(&s->rxt_timer, when);
+}
+
+/* Go into TIME-WAIT, or restart the timer if we're already there. */
+static void tcp_time_wait(struct tcp_sock *s) {
+    s->state = TCP_STATE_TIME_WAIT;
+    s->data.timer = timer_ms_gettime64();
+
+    if(!net_timer_pending(&s->close_timer))
+        net_timer_set(&s->close_timer, s->data.timer + 2 * TCP_DEFAULT_MSL);
+}
+
+/* Send our <FIN>. It gets resent by the retransmission timer until it's
+   acknowledged, just like data would. */
+static void tcp_send_fin(struct tcp_sock *s) {
+    tcp_send_fin_ack(s);
+    ++s->data.snd.nxt;
+    s->data.timer = timer_ms_gettime64();
+    tcp_rxt_arm(s);
+}
+
+/* Send the <FIN> for a socket that was closed while it still had data waiting
+   to go out, once all of that data has been acknowledged. */
+static void tcp_queued_fin(struct tcp_sock *s) {
+    if(!(s->intflags & TCP_IFLAG_QUEUEDCLOSE) || s->data.sndbuf_cur_sz)
+        return;
+
+    if(s->state == TCP_STATE_ESTABLISHED)
+        s->state = TCP_STATE_FIN_WAIT_1;
+    else if(s->state == TCP_STATE_CLOSE_WAIT)
+        s->state = TCP_STATE_CLOSING;
+    else
+        return;
+
+    tcp_send_fin(s);
+}
+
+/* Deal with an incoming ACK as far as the retransmission timer and congestion
+   control go. acked is how much new data it acknowledged and dup is nonzero if
+   it's a duplicate ACK. Returns nonzero if it calls for a fast retransmit. */
+static int tcp_cc_ack(struct tcp_sock *s, uint32_t ack, uint32_t acked,
+                      int dup, const struct tcp_opts *o) {
+    struct tcp_cc *cc = &s->data.cc;
+    uint32_t mss = s->data.snd.mss, flight;
+    int rv = 0;
+
+    if(acked) {
+        /* Measure the round trip time, from the timestamp if we have one, or
+           from the segment we're timing if this covers it. */
+        if((s->data.opts & TCP_OPTF_TIMESTAMP) &&
+                (o->flags & TCP_OPTF_TIMESTAMP) && o->tsecr)
+            tcp_rtt_sample(cc, tcp_now() - o->tsecr);
+        else if(cc->timing && SEQ_GT(ack, cc->rtt_seq))
+            tcp_rtt_sample(cc, tcp_now() - cc->rtt_time);
+
+        if(SEQ_GT(ack, cc->rtt_seq))
+            cc->timing = 0;
+
+        /* Restart the retransmission timer, since things are moving. */
+        s->data.timer = timer_ms_gettime64();
+        tcp_rxt_arm(s);
+
+        if(SEQ_LT(cc->rexmit_nxt, ack))
+            cc->rexmit_nxt = ack;
+
+        if(SEQ_LT(cc->rexmit_end, cc->rexmit_nxt))
+            cc->rexmit_end = cc->rexmit_nxt;
+
+        if(cc->recovery != TCP_RECOVERY_NONE && SEQ_GE(ack, cc->recover)) {
+            /* Everything outstanding when we noticed the loss is now acked.
+               Coming out of fast recovery, go to the window we cut down to,
+               without letting that turn into a burst. */
+            if(cc->recovery == TCP_RECOVERY_FAST) {
+                flight = s->data.snd.nxt - s->data.snd.una;
+                cc->cwnd = MIN(cc->ssthresh, flight + mss);
+            }
+
+            cc->recovery = TCP_RECOVERY_NONE;
+        }
+        else if(cc->recovery == TCP_RECOVERY_FAST) {
+            /* A partial ACK: what it stops at is the next thing that was lost,
+               which NewReno resends right away. */
+            if(SEQ_LT(cc->rexmit_end, ack + mss))
+                cc->rexmit_end = SEQ_LT(ack + mss, s->data.snd.nxt) ?
+                                 ack + mss : s->data.snd.nxt;
+
+            rv = 1;
+        }
+
+        if(cc->recovery != TCP_RECOVERY_FAST)
+            tcp_cc_grow(s, acked);
+
+        cc->dupacks = 0;
+    }
+    else if(dup) {
+        ++cc->dupacks;
+
+        /* Only go into fast recovery once per window of data, hence the check
+           against recover (RFC 6582). */
+        if(cc->dupacks == TCP_DUPACK_THRESH &&
+                cc->recovery == TCP_RECOVERY_NONE &&
+                SEQ_GT(ack, cc->recover)) {
+            tcp_cc_loss(s);
+            cc->cwnd = cc->ssthresh;
+            cc->recovery = TCP_RECOVERY_FAST;
+            cc->recover = s->data.snd.nxt;
+            cc->rexmit_nxt = ack;
+            cc->rexmit_end = SEQ_LT(ack + mss, s->data.snd.nxt) ?
+                             ack + mss : s->data.snd.nxt;
+            ++tcp_stats.fast_retrans;
+            rv = 1;
+        }
+    }
+
+    /* With SACK, any hole below the highest block the other side has is taken
+       to be lost as well, so they can all be resent in this round trip. */
+    if(cc->recovery == TCP_RECOVERY_FAST && s->data.sacked_cnt &&
+            SEQ_LT(cc->rexmit_end,
+                   s->data.sacked[s->data.sacked_cnt - 1].start))
+        cc->rexmit_end = s->data.sacked[s->data.sacked_cnt - 1].start;
+
+    return rv;
+}
+
+/* The window to put in an outgoing segment. The window on a SYN is never
+   scaled. This also remembers the right edge of the window we advertised, so
+   we know when it's worth telling the other side that it has moved. */
+static uint16_t tcp_rcv_wnd(struct tcp_sock *sock, int syn) {
+    uint32_t wnd = sock->data.rcv.wnd;
+    int shift = syn ? 0 : sock->data.rcv.wscale;
+
+    wnd >>= shift;
+
+    if(wnd > 65535)
+        wnd = 65535;
+
+    sock->data.rcv.adv_edge = sock->data.rcv.nxt + (wnd << shift);
+    return wnd;
+}
+
+/* Fill in the options that go on every non-SYN segment of a connection: the
+   timestamp, if those are in use, and a SACK block for each range of out of
+   order data we're holding, if we're allowed to send those. Returns the length
+   of the options, which is always a multiple of 4. */
+static int tcp_data_opts(struct tcp_sock *sock, uint8_t *opt) {
+    int len = 0, i, cnt;
+
+    if(sock->data.opts & TCP_OPTF_TIMESTAMP) {
+        opt[0] = TCP_OPT_NOP;
+        opt[1] = TCP_OPT_NOP;
+        opt[2] = TCP_OPT_TIMESTAMP;
+        opt[3] = 10;
+        tcp_put32(opt + 4, tcp_now());
+        tcp_put32(opt + 8, sock->data.rcv.ts_recent);
+        len = 12;
+    }
+
+    if((sock->data.opts & TCP_OPTF_SACK) && sock->data.ooo_cnt) {
+        /* That's 3 blocks with a timestamp, or 4 without. */
+        cnt = (TCP_MAX_OPTLEN - len - 4) / 8;
+
+        if(cnt > sock->data.ooo_cnt)
+            cnt = sock->data.ooo_cnt;
+
+        opt[len] = TCP_OPT_NOP;
+        opt[len + 1] = TCP_OPT_NOP;
+        opt[len + 2] = TCP_OPT_SACK;
+        opt[len + 3] = 2 + 8 * cnt;
+        len += 4;
+
+        for(i = 0; i < cnt; ++i, len += 8) {
+            tcp_put32(opt + len, sock->data.ooo[i].start);
+            tcp_put32(opt + len + 4, sock->data.ooo[i].end);
+        }
+    }
+
+    return len;
+}
+
+static int tcp_send_syn(struct tcp_sock *sock, int ack) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + 20];
+    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    uint8_t *opt = hdr->options;
+    uint32_t opts;
+    int len;
+    uint16_t cs;
+
+    /* We offer everything we support on a <SYN>, but a <SYN,ACK> can only
+       carry the options the other side offered us. */
+    if(ack)
+        opts = sock->data.opts;
+    else
+        opts = TCP_OPTF_WSCALE | TCP_OPTF_SACK | TCP_OPTF_TIMESTAMP;
+
+    /* Fill in our SYN options, laid out the same way most other stacks do. */
+    opt[0] = TCP_OPT_MSS;
+    opt[1] = 4;
+    opt[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
+    opt[3] = TCP_DEFAULT_MSS & 0xFF;
+    len = 4;
+
+    if(opts & TCP_OPTF_SACK) {
+        if(!(opts & TCP_OPTF_TIMESTAMP)) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_NOP;
+        }
+
+        opt[len++] = TCP_OPT_SACK_PERM;
+        opt[len++] = 2;
+    }
+
+    if(opts & TCP_OPTF_TIMESTAMP) {
+        if(!(opts & TCP_OPTF_SACK)) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_NOP;
+        }
+
+        opt[len] = TCP_OPT_TIMESTAMP;
+        opt[len + 1] = 10;
+        tcp_put32(opt + len + 2, tcp_now());
+        tcp_put32(opt + len + 6, sock->data.rcv.ts_recent);
+        len += 10;
+    }
+
+    if(opts & TCP_OPTF_WSCALE) {
+        opt[len] = TCP_OPT_NOP;
+        opt[len + 1] = TCP_OPT_WSCALE;
+        opt[len + 2] = 3;
+        opt[len + 3] = TCP_RCV_WSCALE;
+        len += 4;
+    }
+
+    /* Fill in the base packet */
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(sock->data.snd.iss);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+
+    if(ack) {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK |
+                               TCP_OFFSET(5 + len / 4));
+    }
+    else {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(5 + len / 4));
+    }
+
+    hdr->wnd = htons(tcp_rcv_wnd(sock, 1));
+    hdr->checksum = 0;
+    hdr->urg = 0;
+
+    /* Calculate the real checksum */
+    len += sizeof(tcp_hdr_t);
+    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                  &sock->remote_addr.sin6_addr,
+                                  len, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, len, cs);
+
+    ++tcp_stats.pkt_sent;
+    return net_ipv6_send(sock->data.net, rawpkt, len, sock->hop_limit,
+                         IPPROTO_TCP, &sock->local_addr.sin6_addr,
+                         &sock->remote_addr.sin6_addr);
+}
+
+/* Every segment we send acknowledges everything we've received so far, so once
+   one goes out, there's no ACK owed any more. */
+static inline void tcp_ack_sent(struct tcp_sock *sock) {
+    sock->data.rcv.unacked = 0;
+
+    if(net_timer_pending(&sock->delack_timer))
+        net_timer_cancel(&sock->delack_timer);
+}
+
+/* Send a segment with no data in it. */
+static void tcp_send_empty(struct tcp_sock *sock, uint16_t flags) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTLEN];
+    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    uint16_t cs;
+    int len;
+
+    len = tcp_data_opts(sock, hdr->options);
+
+    /* Fill in the base packet */
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(sock->data.snd.nxt);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+    hdr->off_flags = htons(flags | TCP_OFFSET(5 + len / 4));
+    hdr->wnd = htons(tcp_rcv_wnd(sock, 0));
+    hdr->checksum = 0;
+    hdr->urg = 0;
+
+    /* Calculate the real checksum */
+    len += sizeof(tcp_hdr_t);
+    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                  &sock->remote_addr.sin6_addr,
+                                  len, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, len, cs);
+
+    ++tcp_stats.pkt_sent;
+    tcp_ack_sent(sock);
+    net_ipv6_send(sock->data.net, rawpkt, len, sock->hop_limit, IPPROTO_TCP,
+                  &sock->local_addr.sin6_addr, &sock->remote_addr.sin6_addr);
+}
+
+static void tcp_send_fin_ack(struct tcp_sock *sock) {
+    tcp_send_empty(sock, TCP_FLAG_FIN | TCP_FLAG_ACK);
+}
+
+static void tcp_send_ack(struct tcp_sock *sock) {
+    tcp_send_empty(sock, TCP_FLAG_ACK);
+}
+
+/* Add up the data going in a segment. The data for a sequence number doesn't
+   change until it's acked, so if we've sent this exact segment before, use the
+   sum from then, and only the header has to be checksummed again. */
+static uint16_t tcp_seg_sum(struct tcp_sock *sock, uint32_t seq, uint32_t len,
+                            const struct iovec *iov, int cnt) {
+    struct segsum *ss;
+    int i;
+
+    for(i = 0; i < TCP_SEGSUM_CNT; ++i) {
+        ss = &sock->data.segsums[i];
+
+        if(ss->seq == seq && ss->len == len)
+            return ss->sum;
+    }
+
+    ss = &sock->data.segsums[sock->data.segsum_next];
+    sock->data.segsum_next = (sock->data.segsum_next + 1) % TCP_SEGSUM_CNT;
+    ss->seq = seq;
+    ss->len = len;
+    ss->sum = net_ipv4_checksum_iov(iov, cnt, 0) ^ 0xFFFF;
+
+    return ss->sum;
+}
+
+/* Send len bytes of data starting at sequence number seq, which lives at head
+   in the send buffer, with the options given. The data goes down to the IP
+   layer straight out of the send buffer (in two pieces, if it wraps around the
+   end), rather than being copied in behind the header first. */
+static void tcp_send_seg(struct tcp_sock *sock, uint32_t seq, uint32_t head,
+                         uint32_t len, const uint8_t *opts, int optlen) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTLEN];
+    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    struct iovec iov[3];
+    uint32_t first, sum;
+    uint16_t cs;
+    int sz, cnt = 1;
+
+    /* Fill in the base packet */
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(seq);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5 + optlen / 4));
+    hdr->wnd = htons(tcp_rcv_wnd(sock, 0));
+    hdr->checksum = 0;
+    hdr->urg = 0;
+    memcpy(hdr->options, opts, optlen);
+
+    iov[0].iov_base = rawpkt;
+    iov[0].iov_len = sizeof(tcp_hdr_t) + optlen;
+
+    /* Point at the data */
+    first = MIN(len, sock->sndbuf_sz - head);
+
+    if(first) {
+        iov[cnt].iov_base = sock->data.sndbuf + head;
+        iov[cnt++].iov_len = first;
+    }
+
+    if(len > first) {
+        iov[cnt].iov_base = sock->data.sndbuf;
+        iov[cnt++].iov_len = len - first;
+    }
+
+    /* Calculate the checksum. The header is always an even length, so the sum
+       of the data can just be added on to it. */
+    sz = sizeof(tcp_hdr_t) + optlen + len;
+    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                  &sock->remote_addr.sin6_addr, sz,
+                                  IPPROTO_TCP);
+    sum = (net_ipv4_checksum(rawpkt, iov[0].iov_len, cs) ^ 0xFFFF) +
+          tcp_seg_sum(sock, seq, len, iov + 1, cnt - 1);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    hdr->checksum = (uint16_t)(sum ^ 0xFFFF);
+
+    ++tcp_stats.pkt_sent;
+    tcp_ack_sent(sock);
+    net_ipv6_sendv(sock->data.net, iov, cnt, sock->hop_limit, IPPROTO_TCP,
+                   &sock->local_addr.sin6_addr, &sock->remote_addr.sin6_addr);
+}
+
+/* Find the first sequence number at or after seq that the other side hasn't
+   selectively acknowledged, and where that hole ends. */
+static uint32_t tcp_next_hole(struct tcp_sock *sock, uint32_t seq,
+                              uint32_t *end) {
+    int i;
+
+    for(i = 0; i < sock->data.sacked_cnt; ++i) {
+        if(SEQ_LE(sock->data.sacked[i].end, seq))
+            continue;
+
+        if(SEQ_GT(sock->data.sacked[i].start, seq)) {
+            *end = sock->data.sacked[i].start;
+            return seq;
+        }
+
+        seq = sock->data.sacked[i].end;
+    }
+
+    *end = sock->data.snd.nxt;
+    return seq;
+}
+
+/* Send whatever we can. Anything we've decided was lost goes first, then new
+   data, as far as both the other side's window and the congestion window let
+   us. If force is set, one segment goes out regardless, which is how the first
+   segment of a fast retransmit and zero window probes get sent. */
+static void tcp_send_data(struct tcp_sock *sock, int force) {
+    struct tcp_cc *cc = &sock->data.cc;
+    uint32_t wnd, snd, max, seq, end, unacked, head, pipe;
+    uint8_t opts[TCP_MAX_OPTLEN];
+    int optlen, idle;
+
+    optlen = tcp_data_opts(sock, opts);
+    max = sock->data.snd.mss - sizeof(tcp_hdr_t) - optlen;
+    unacked = sock->data.snd.nxt - sock->data.snd.una;
+    idle = !unacked;
+    pipe = tcp_pipe(sock);
+
+    /* Let the device send everything we come up with here in one go. */
+    net_tx_batch_begin(sock->data.net);
+
+    /* Resend the holes first */
+    while(SEQ_LT(cc->rexmit_nxt, cc->rexmit_end) && (pipe < cc->cwnd || force)) {
+        seq = tcp_next_hole(sock, cc->rexmit_nxt, &end);
+
+        if(SEQ_GE(seq, cc->rexmit_end)) {
+            cc->rexmit_nxt = cc->rexmit_end;
+            break;
+        }
+
+        if(SEQ_GT(end, cc->rexmit_end))
+            end = cc->rexmit_end;
+
+        snd = end - seq;
+
+        if(snd > max)
+            snd = max;
+
+        head = (sock->data.sndbuf_acked + (seq - sock->data.snd.una)) %
+               sock->sndbuf_sz;
+        tcp_send_seg(sock, seq, head, snd, opts, optlen);
+        ++tcp_stats.pkt_retrans;
+
+        cc->rexmit_nxt = seq + snd;
+        pipe += snd;
+        force = 0;
+    }
+
+    /* Figure out how much new data the windows have room for. If the other side
+       has closed its window on us, poke it with a byte every so often, so we
+       find out when it opens back up. */
+    wnd = sock->data.snd.wnd > unacked ? sock->data.snd.wnd - unacked : 0;
+
+    if(pipe >= cc->cwnd)
+        wnd = 0;
+    else if(wnd > cc->cwnd - pipe)
+        wnd = cc->cwnd - pipe;
+
+    if(force && !wnd && !unacked)
+        wnd = 1;
+
+    seq = sock->data.snd.nxt;
+    head = sock->data.sndbuf_head;
+
+    /* Put on some data if we should do so */
+    while(unacked < sock->data.sndbuf_cur_sz && wnd) {
+        snd = wnd;
+
+        if(snd > max)
+            snd = max;
+
+        if(snd > sock->data.sndbuf_cur_sz - unacked)
+            snd = sock->data.sndbuf_cur_sz - unacked;
+
+        /* Don't send a runt when there's more waiting to go and something is
+           still in flight. The ACK for that will make room for a full-sized
+           segment (this is the sender side of RFC 1122's silly window syndrome
+           avoidance). */
+        if(snd < max && snd < sock->data.sndbuf_cur_sz - unacked && unacked)
+            break;
+
+        tcp_send_seg(sock, seq, head, snd, opts, optlen);
+
+        /* Time this segment, if we're not timing one already. */
+        if(!cc->timing) {
+            cc->rtt_seq = seq;
+            cc->rtt_time = tcp_now();
+            cc->timing = 1;
+        }
+
+        head += snd;
+
+        if(head >= sock->sndbuf_sz)
+            head -= sock->sndbuf_sz;
+
+        wnd -= snd;
+        seq += snd;
+        unacked += snd;
+    }
+
+    net_tx_batch_end(sock->data.net);
+
+    /* Start the retransmission timer, if it wasn't already running. */
+    if(idle && seq != sock->data.snd.nxt)
+        sock->data.timer = timer_ms_gettime64();
+
+    sock->data.sndbuf_head = head;
+    sock->data.snd.nxt = seq;
+    tcp_rxt_arm(sock);
+}
+
+#define ADDR_EQUAL(a1, a2) \
+    (((a1).__s6_addr.__s6_addr32[0] == (a2).__s6_addr.__s6_addr32[0]) && \
+     ((a1).__s6_addr.__s6_addr32[1] == (a2).__s6_addr.__s6_addr32[1]) && \
+     ((a1).__s6_addr.__s6_addr32[2] == (a2).__s6_addr.__s6_addr32[2]) && \
+     ((a1).__s6_addr.__s6_addr32[3] == (a2).__s6_addr.__s6_addr32[3]))
+
+/* Look through one hash bucket for a socket that matches an incoming packet. */
+static struct tcp_sock *find_sock_in(struct tcp_sock_list *b,
+                                     const struct in6_addr *src,
+                                     const struct in6_addr *dst,
+                                     uint16_t sport, uint16_t dport,
+                                     int domain) {
+    struct tcp_sock *i;
+
+    LIST_FOREACH(i, b, hash_list) {
+        /* Ignore any closed sockets */
+        if(i->state == TCP_STATE_CLOSED)
+            continue;
+
+        /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
+           packet, or any that are IPv4 only when we have an incoming IPv6
+           packet. */
+        if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
+                (domain == AF_INET6 && i->domain == AF_INET))
+            continue;
 
         /* See if the remote end matches what's in the socket */
         if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
@@ -2263,22 +3485,260 @@ static struct tcp_sock *find_sock(const struct in6_addr *src,
                  i->remote_addr.sin6_port != sport))
             continue;
 
-        /* See if it matches the local end */
-        if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
-                !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
-                i->local_addr.sin6_port != dport)
+        /* See if it matches the local end */
+        if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
+                !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
+                i->local_addr.sin6_port != dport)
+            continue;
+
+        if(mutex_lock_irqsafe(&i->mutex))
+            return (struct tcp_sock *) -1;
+
+        return i;
+    }
+
+    return NULL;
+}
+
+/* Match a socket to an incoming packet. If an actual socket is returned, it is
+   the caller's responsibility  to release the socket's mutex when they're done
+   with it. See the comment at the top of the file for how this works. */
+static struct tcp_sock *find_sock(const struct in6_addr *src,
+                                  const struct in6_addr *dst,
+                                  uint16_t sport, uint16_t dport, int domain) {
+    struct tcp_sock *rv;
+
+    if((rv = find_sock_in(tcp_conn_bucket(src, sport, dport), src, dst, sport,
+                          dport, domain)))
+        return rv;
+
+    if((rv = find_sock_in(tcp_listen_bucket(dst, dport), src, dst, sport,
+                          dport, domain)))
+        return rv;
+
+    return find_sock_in(tcp_wild_bucket(dport), src, dst, sport, dport,
+                        domain);
+}
+
+/* Parse the options on an incoming segment. Returns -1 if they're malformed. */
+static int tcp_parse_opts(const tcp_hdr_t *tcp, uint16_t flags,
+                          struct tcp_opts *o) {
+    const uint8_t *opt = tcp->options;
+    int end = TCP_GET_OFFSET(flags) - sizeof(tcp_hdr_t);
+    int j = 0, k, len;
+
+    o->flags = 0;
+    o->sack_cnt = 0;
+
+    while(j < end) {
+        if(opt[j] == TCP_OPT_EOL)
+            break;
+
+        if(opt[j] == TCP_OPT_NOP) {
+            ++j;
+            continue;
+        }
+
+        /* Everything else has a length */
+        if(j + 2 > end || (len = opt[j + 1]) < 2 || j + len > end)
+            return -1;
+
+        switch(opt[j]) {
+            case TCP_OPT_MSS:
+                if(len != 4)
+                    return -1;
+
+                o->flags |= TCP_OPTF_MSS;
+                o->mss = (opt[j + 2] << 8) | opt[j + 3];
+                break;
+
+            case TCP_OPT_WSCALE:
+                if(len != 3)
+                    return -1;
+
+                /* RFC 7323 says to treat anything past 14 as 14. */
+                o->flags |= TCP_OPTF_WSCALE;
+                o->wscale = opt[j + 2] > 14 ? 14 : opt[j + 2];
+                break;
+
+            case TCP_OPT_SACK_PERM:
+                if(len != 2)
+                    return -1;
+
+                o->flags |= TCP_OPTF_SACK;
+                break;
+
+            case TCP_OPT_TIMESTAMP:
+                if(len != 10)
+                    return -1;
+
+                o->flags |= TCP_OPTF_TIMESTAMP;
+                o->tsval = tcp_get32(opt + j + 2);
+                o->tsecr = tcp_get32(opt + j + 6);
+                break;
+
+            case TCP_OPT_SACK:
+                if((len - 2) % 8)
+                    return -1;
+
+                for(k = j + 2; k < j + len && o->sack_cnt < 4; k += 8) {
+                    o->sack[o->sack_cnt].start = tcp_get32(opt + k);
+                    o->sack[o->sack_cnt].end = tcp_get32(opt + k + 4);
+                    ++o->sack_cnt;
+                }
+
+                break;
+
+            /* Anything else just gets skipped. */
+        }
+
+        j += len;
+    }
+
+    return 0;
+}
+
+/* Add a block to a list of them sorted by sequence number, merging it with any
+   that it overlaps or touches. If the list is full, the highest block gets
+   dropped to make room. Returns the new number of blocks. */
+static int seqblk_add(struct seqblk *b, int cnt, int max, uint32_t start,
+                      uint32_t end) {
+    int i, j;
+
+    /* Find the first block that doesn't end before this one starts, then
+       swallow up everything that overlaps. */
+    for(i = 0; i < cnt && SEQ_LT(b[i].end, start); ++i);
+
+    for(j = i; j < cnt && SEQ_LE(b[j].start, end); ++j) {
+        if(SEQ_LT(b[j].start, start))
+            start = b[j].start;
+
+        if(SEQ_GT(b[j].end, end))
+            end = b[j].end;
+    }
+
+    if(j == i) {
+        if(cnt == max) {
+            if(i == max)
+                return cnt;
+
+            --cnt;
+        }
+
+        memmove(b + i + 1, b + i, (cnt - i) * sizeof(struct seqblk));
+        ++cnt;
+    }
+    else if(j > i + 1) {
+        memmove(b + i + 1, b + j, (cnt - j) * sizeof(struct seqblk));
+        cnt -= j - i - 1;
+    }
+
+    b[i].start = start;
+    b[i].end = end;
+    return cnt;
+}
+
+/* Update the list of blocks the other side has selectively acknowledged, both
+   by dropping anything that's now been acknowledged normally and by adding the
+   blocks on this segment. */
+static void tcp_sack_update(struct tcp_sock *s, const struct tcp_opts *o) {
+    struct seqblk *b = s->data.sacked;
+    uint32_t una = s->data.snd.una, start, end;
+    int i, j;
+
+    for(i = j = 0; i < s->data.sacked_cnt; ++i) {
+        if(SEQ_LE(b[i].end, una))
+            continue;
+
+        if(SEQ_LT(b[i].start, una))
+            b[i].start = una;
+
+        b[j++] = b[i];
+    }
+
+    s->data.sacked_cnt = j;
+
+    for(i = 0; i < o->sack_cnt; ++i) {
+        start = o->sack[i].start;
+        end = o->sack[i].end;
+
+        /* Ignore anything bogus or already acknowledged */
+        if(!SEQ_LT(start, end) || SEQ_LE(end, una) ||
+           SEQ_GT(end, s->data.snd.nxt))
             continue;
 
-        if(mutex_lock_irqsafe(&i->mutex))
-            return (struct tcp_sock *) -1;
+        if(SEQ_LT(start, una))
+            start = una;
 
-        /* Because we always add new sockets to the head of the list, this
-           should be sufficient to match the socket. See the comment at the top
-           of the file for more discussion of this, if you're interested. */
-        return i;
+        s->data.sacked_cnt = seqblk_add(b, s->data.sacked_cnt,
+                                        TCP_SACK_BLOCKS, start, end);
     }
+}
 
-    return NULL;
+/* Remember that we've stored a range of data that arrived out of order. The
+   block holding it goes to the front of the list, since RFC 2018 wants the
+   most recently changed one reported first. */
+static void tcp_ooo_add(struct tcp_sock *s, uint32_t start, uint32_t end) {
+    struct seqblk *b = s->data.ooo;
+    int i, j, k;
+
+    for(i = j = 0; i < s->data.ooo_cnt; ++i) {
+        if(SEQ_LE(b[i].start, end) && SEQ_GE(b[i].end, start)) {
+            if(SEQ_LT(b[i].start, start))
+                start = b[i].start;
+
+            if(SEQ_GT(b[i].end, end))
+                end = b[i].end;
+
+            continue;
+        }
+
+        b[j++] = b[i];
+    }
+
+    /* If we're out of room, forget whichever block is furthest from rcv.nxt,
+       since it'll be the last one we need. That data will just have to be sent
+       again. */
+    if(j == TCP_OOO_BLOCKS) {
+        for(i = 1, k = 0; i < j; ++i) {
+            if(SEQ_GT(b[i].start, b[k].start))
+                k = i;
+        }
+
+        if(SEQ_GT(start, b[k].start))
+            return;
+
+        memmove(b + k, b + k + 1, (j - k - 1) * sizeof(struct seqblk));
+        --j;
+    }
+
+    memmove(b + 1, b, j * sizeof(struct seqblk));
+    b[0].start = start;
+    b[0].end = end;
+    s->data.ooo_cnt = j + 1;
+}
+
+/* Pull in any out of order data that now lines up with rcv.nxt. Returns how
+   far rcv.nxt should move past where it is. */
+static uint32_t tcp_ooo_advance(struct tcp_sock *s) {
+    struct seqblk *b = s->data.ooo;
+    uint32_t nxt = s->data.rcv.nxt;
+    int i;
+
+restart:
+    for(i = 0; i < s->data.ooo_cnt; ++i) {
+        if(SEQ_LE(b[i].start, nxt)) {
+            if(SEQ_GT(b[i].end, nxt))
+                nxt = b[i].end;
+
+            memmove(b + i, b + i + 1,
+                    (s->data.ooo_cnt - i - 1) * sizeof(struct seqblk));
+            --s->data.ooo_cnt;
+            goto restart;
+        }
+    }
+
+    return nxt - s->data.rcv.nxt;
 }
 
 extern void __poll_event_trigger(int fd, short event);
@@ -2290,9 +3750,9 @@ extern void __poll_event_trigger(int fd, short event);
 static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                       const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                       struct tcp_sock *s, uint16_t flags, int size) {
-    int j = 0;
-    int end_of_opts;
+    int j;
     uint16_t mss = 576;
+    struct tcp_opts o;
 
     (void)size;
 
@@ -2304,36 +3764,13 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     if(flags & TCP_FLAG_ACK)
         return -1;
 
-    /* Parse options now, in case we need to update the max segment size. */
-    end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-    while(j < end_of_opts) {
-        switch(tcp->options[j]) {
-            case TCP_OPT_EOL:
-                j = end_of_opts;
-                break;
-
-            case TCP_OPT_NOP:
-                ++j;
-                break;
-
-            case TCP_OPT_MSS:
-                if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                    return -1;
-
-                mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                j += 4;
-                break;
-
-            default:
-
-                /* Skip unknown options */
-                if(j + 1 > end_of_opts || j + tcp->options[j + 1] > end_of_opts)
-                    return -1;
+    /* Parse options now, in case we need to update the max segment size and
+       to see which extensions the other side supports. */
+    if(tcp_parse_opts(tcp, flags, &o))
+        return -1;
 
-                j += tcp->options[j + 1];
-        }
-    }
+    if(o.flags & TCP_OPTF_MSS)
+        mss = o.mss;
 
     /* Silently cap the MSS... */
     if(mss > 1460)
@@ -2349,6 +3786,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                 s->listen.queue[j].remote_addr.sin6_port == tcp->src_port) {
             s->listen.queue[j].isn = ntohl(tcp->seq);
             s->listen.queue[j].mss = mss;
+            s->listen.queue[j].opts = o.flags & ~TCP_OPTF_MSS;
+            s->listen.queue[j].wscale = o.wscale;
+            s->listen.queue[j].ts_recent = o.tsval;
             return 0;
         }
     }
@@ -2367,6 +3807,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     s->listen.queue[s->listen.tail].isn = ntohl(tcp->seq);
     s->listen.queue[s->listen.tail].mss = mss;
     s->listen.queue[s->listen.tail].wnd = ntohs(tcp->wnd);
+    s->listen.queue[s->listen.tail].opts = o.flags & ~TCP_OPTF_MSS;
+    s->listen.queue[s->listen.tail].wscale = o.wscale;
+    s->listen.queue[s->listen.tail].ts_recent = o.tsval;
     ++s->listen.count;
     ++s->listen.tail;
 
@@ -2388,7 +3831,8 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, int size) {
     uint32_t ack, seq;
     int sz = size - TCP_GET_OFFSET(flags), gotack = 0;
-    int j = 0, end_of_opts, mss = 536;
+    int mss = 536;
+    struct tcp_opts o;
 
     (void)src;
 
@@ -2424,40 +3868,28 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
         s->data.rcv.nxt = seq + 1;
         s->data.rcv.irs = seq;
 
-        end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-        while(j < end_of_opts) {
-            switch(tcp->options[j]) {
-                case TCP_OPT_EOL:
-                    j = end_of_opts;
-                    break;
-
-                case TCP_OPT_NOP:
-                    ++j;
-                    break;
-
-                case TCP_OPT_MSS:
-
-                    if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                        return -1;
-
-                    mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                    j += 4;
-                    break;
+        if(tcp_parse_opts(tcp, flags, &o))
+            return -1;
 
-                default:
+        if(o.flags & TCP_OPTF_MSS)
+            mss = o.mss;
 
-                    /* Skip unknown options */
-                    if(j + 1 > end_of_opts ||
-                            j + tcp->options[j + 1] > end_of_opts)
-                        return -1;
+        /* We offered everything on our <SYN>, so whatever came back is what
+           the connection gets to use. */
+        s->data.opts = o.flags & ~TCP_OPTF_MSS;
 
-                    j += tcp->options[j + 1];
-            }
+        if(o.flags & TCP_OPTF_WSCALE) {
+            s->data.snd.wscale = o.wscale;
+            s->data.rcv.wscale = TCP_RCV_WSCALE;
         }
 
+        if(o.flags & TCP_OPTF_TIMESTAMP)
+            s->data.rcv.ts_recent = o.tsval;
+
         s->data.snd.mss = mss > 1460 ? 1460 : mss;
-        s->data.snd.wnd = htons(tcp->wnd);
+        s->data.snd.wnd = ntohs(tcp->wnd);
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
 
         if(gotack) {
             s->data.snd.una = ack;
@@ -2466,6 +3898,16 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                Update the state and ack it. */
             if(SEQ_GT(ack, s->data.snd.iss)) {
                 s->state = TCP_STATE_ESTABLISHED;
+                tcp_cc_start(s);
+
+                /* Unless we had to resend it, the <SYN> gives us our first
+                   round trip time measurement. */
+                if(s->data.cc.timing) {
+                    tcp_rtt_sample(&s->data.cc,
+                                   tcp_now() - s->data.cc.rtt_time);
+                    s->data.cc.timing = 0;
+                }
+
                 tcp_send_ack(s);
                 __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
                 cond_signal(&s->data.send_cv);
@@ -2486,40 +3928,59 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
    described in pages 69-76 of the RFC. */
 static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        const struct in6_addr *dsta, const tcp_hdr_t *tcp,
-                       struct tcp_sock *s, uint16_t flags, size_t size) {
-    uint32_t seq, ack, up;
+                       struct tcp_sock *s, uint16_t flags, size_t size,
+                       uint32_t pre) {
+    uint32_t seq, ack, up, fin_seq, off, adv, acked = 0;
     size_t sz;
-    int bad_pkt = 0, tmp, acksyn = 0;
+    int bad_pkt = 0, tmp, acksyn = 0, dup, fast, quickack = 0;
     const uint8_t *buf = (const uint8_t *)tcp;
     uint8_t *rb;
+    net_pbuf_t *pb;
+    struct tcp_opts o;
 
     (void)src;
 
+    /* Drop anything with garbage in its options */
+    if(tcp_parse_opts(tcp, flags, &o))
+        return 0;
+
     /* Grab the seq and ack values from the header. */
     seq = ntohl(tcp->seq);
     ack = ntohl(tcp->ack);
 
-    /* Check the validity of the incoming segment's sequence number */
+    /* Check the validity of the incoming segment's sequence number. A segment
+       with data is acceptable if any part of it falls in the window. An empty
+       one may also sit right at the edge of the window, which is where the
+       other side's ACKs will be once it's filled it (without this, both ends
+       end up acking each other's ACKs forever). */
     sz = size - TCP_GET_OFFSET(flags);
     buf += TCP_GET_OFFSET(flags);
+    fin_seq = seq + sz;
 
     if(s->data.rcv.wnd == 0) {
         if(sz || seq != s->data.rcv.nxt)
             bad_pkt = 1;
     }
     else {
-        if(!sz) {
-            if(!(SEQ_GE(seq, s->data.rcv.nxt) &&
-                    SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd)))
-                bad_pkt = 1;
-        }
-        else {
-            if(!(SEQ_GE(seq, s->data.rcv.nxt) &&
-                    SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd)))
-                bad_pkt = 1;
-        }
+        if(!(SEQ_GE(seq, s->data.rcv.nxt) &&
+                SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd)) &&
+                !(!sz && seq == s->data.rcv.nxt + s->data.rcv.wnd) &&
+                !(sz && SEQ_GT(seq + sz, s->data.rcv.nxt) &&
+                  SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd)))
+            bad_pkt = 1;
     }
 
+    /* Protect against wrapped sequence numbers, as described in RFC 7323: a
+       timestamp older than the last one we saw means this is an old duplicate
+       segment. Pure ACKs are left out of this, as they get reordered all the
+       time and throwing them away loses the SACK information they carry. */
+    if((s->data.opts & TCP_OPTF_TIMESTAMP) &&
+            (o.flags & TCP_OPTF_TIMESTAMP) &&
+            (sz || (flags & (TCP_FLAG_SYN | TCP_FLAG_FIN))) &&
+            !(flags & TCP_FLAG_RST) &&
+            SEQ_LT(o.tsval, s->data.rcv.ts_recent))
+        bad_pkt = 1;
+
     /* If the sequence number isn't valid, check the RST bit. If its not set,
        send the appropriate ACK. */
     if(bad_pkt) {
@@ -2532,6 +3993,15 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Remember the timestamp to echo back, if this segment starts at or before
+       what we last acknowledged. That's rcv.nxt, less whatever we're holding
+       off on acking, so a delayed ACK echoes the earliest segment it covers. */
+    if((s->data.opts & TCP_OPTF_TIMESTAMP) &&
+            (o.flags & TCP_OPTF_TIMESTAMP) &&
+            SEQ_LE(seq, s->data.rcv.nxt - s->data.rcv.unacked) &&
+            SEQ_GE(o.tsval, s->data.rcv.ts_recent))
+        s->data.rcv.ts_recent = o.tsval;
+
     /* See if we have a reset, and process it */
     if(flags & TCP_FLAG_RST) {
         if(s->state == TCP_STATE_SYN_SENT) {
@@ -2573,6 +4043,10 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     if(s->state == TCP_STATE_SYN_RECEIVED) {
         if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
             s->state = TCP_STATE_ESTABLISHED;
+            s->data.snd.wnd = ntohs(tcp->wnd) << s->data.snd.wscale;
+            s->data.snd.wl1 = seq;
+            s->data.snd.wl2 = ack;
+            tcp_cc_start(s);
             acksyn = 1;
         }
         else {
@@ -2581,8 +4055,16 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
+    /* Is this a duplicate ACK, as RFC 5681 defines it? That's one that doesn't
+       acknowledge anything new, carries no data, and doesn't change the window,
+       while we have something outstanding. */
+    dup = ack == s->data.snd.una && !sz && !(flags & TCP_FLAG_FIN) &&
+          s->data.snd.una != s->data.snd.nxt &&
+          (uint32_t)(ntohs(tcp->wnd) << s->data.snd.wscale) == s->data.snd.wnd;
+
     /* Check the ack number for validity */
     if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
+        acked = ack - s->data.snd.una;
         s->data.sndbuf_acked += (int32_t)(ack - s->data.snd.una - acksyn);
         s->data.sndbuf_cur_sz -= (int32_t)(ack - s->data.snd.una - acksyn);
         s->data.snd.una = ack;
@@ -2591,13 +4073,6 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
         if(s->data.sndbuf_acked >= s->sndbuf_sz)
             s->data.sndbuf_acked -= s->sndbuf_sz;
-
-        if(SEQ_LT(s->data.snd.wl1, seq) ||
-                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
-            s->data.snd.wl1 = seq;
-            s->data.snd.wl2 = ack;
-        }
     }
     else if(SEQ_GT(ack, s->data.snd.nxt)) {
         /* This ACKs something we haven't sent, so try to correct the other side
@@ -2606,6 +4081,35 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Update the send window. This also has to happen on duplicate ACKs, since
+       that's how a window that was full gets opened back up. */
+    if(ack == s->data.snd.una &&
+            (SEQ_LT(s->data.snd.wl1, seq) ||
+             (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack)))) {
+        s->data.snd.wnd = ntohs(tcp->wnd) << s->data.snd.wscale;
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
+    }
+
+    if(s->data.opts & TCP_OPTF_SACK)
+        tcp_sack_update(s, &o);
+
+    fast = tcp_cc_ack(s, ack, acked, dup, &o);
+
+    /* If this made room in the window for data that's waiting to go out, or
+       told us that something needs resending, send it now rather than waiting
+       for the next send() call or the timer. */
+    if((s->state == TCP_STATE_ESTABLISHED ||
+            s->state == TCP_STATE_CLOSE_WAIT) &&
+            (s->data.sndbuf_cur_sz > s->data.snd.nxt - s->data.snd.una ||
+             SEQ_LT(s->data.cc.rexmit_nxt, s->data.cc.rexmit_end)))
+        tcp_send_data(s, fast);
+
+    /* If the socket was closed with data still to send and that's all been
+       acknowledged now, the <FIN> can go out. */
+    if(acked)
+        tcp_queued_fin(s);
+
     /* We need to do a bit more processing in certain states... */
     switch(s->state) {
         case TCP_STATE_FIN_WAIT_1:
@@ -2621,8 +4125,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
             /* If the FIN has been acked, go to TIME-WAIT */
             if(ack == s->data.snd.nxt) {
-                s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_time_wait(s);
                 break;
             }
             else {
@@ -2641,7 +4144,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
         case TCP_STATE_TIME_WAIT:
             /* ACK the FIN again, and restart the timer */
-            s->data.timer = timer_ms_gettime64();
+            tcp_time_wait(s);
             tcp_send_ack(s);
             break;
     }
@@ -2658,48 +4161,108 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
     if(s->state == TCP_STATE_ESTABLISHED || s->state == TCP_STATE_FIN_WAIT_1 ||
             s->state == TCP_STATE_FIN_WAIT_2) {
-        /* Next, check the data size versus our window. If its more than the
-           window, truncate the data and copy out what we can. */
-        if(sz > s->data.rcv.wnd) {
-            sz = s->data.rcv.wnd;
-            bad_pkt = 1;
+        /* Skip over anything at the front that we already have. */
+        if(sz && SEQ_LT(seq, s->data.rcv.nxt)) {
+            off = s->data.rcv.nxt - seq;
+            buf += off;
+            sz -= off;
+            seq = s->data.rcv.nxt;
         }
 
-        /* Copy the data out */
+        /* Next, check the data size versus our window. If its more than the
+           window, truncate the data and copy out what we can. Data that is
+           ahead of rcv.nxt goes where it belongs in the buffer, and is kept
+           track of until the gap in front of it is filled in. */
+        off = seq - s->data.rcv.nxt;
+
+        if(sz > s->data.rcv.wnd - off)
+            sz = s->data.rcv.wnd - off;
+
+        /* Keep the packet buffer the data came in, if we can, or copy the
+           data out otherwise */
         if(sz) {
-            rb = s->data.rcvbuf + s->data.rcvbuf_tail;
-            s->data.rcv.nxt += sz;
-            s->data.rcv.wnd -= sz;
-            s->data.rcvbuf_cur_sz += sz;
-
-            if(s->data.rcvbuf_tail + sz <= s->rcvbuf_sz) {
-                memcpy(rb, buf, sz);
-                s->data.rcvbuf_tail += sz;
+            tcp_stats.bytes_recv += sz;
+
+            if(!off && !s->data.ooo_cnt && sz >= TCP_ZCOPY_MIN &&
+               s->sock != -1 && (pb = net_pbuf_keep(buf))) {
+                pb->data = (uint8_t *)buf;
+                pb->len = sz;
+                pb->tag = s->data.rcvq_ring;
+                pb->next = NULL;
+                s->data.rcvq_ring = 0;
+
+                if(s->data.rcvq_tail)
+                    s->data.rcvq_tail->next = pb;
+                else
+                    s->data.rcvq_head = pb;
+
+                s->data.rcvq_tail = pb;
+                adv = sz;
             }
             else {
-                tmp = s->rcvbuf_sz - s->data.rcvbuf_tail;
-                memcpy(rb, buf, tmp);
-                sz -= tmp;
-                buf += tmp;
-                memcpy(s->data.rcvbuf, buf, sz);
-                s->data.rcvbuf_tail = sz;
+                tcp_stats.bytes_recv_copied += sz;
+                tmp = (s->data.rcvbuf_tail + off) % s->rcvbuf_sz;
+                rb = s->data.rcvbuf + tmp;
+
+                /* It may have been copied in already, while the checksum was
+                   being checked (see tcp_check_data()). */
+                if(off || sz != pre) {
+                    if(tmp + sz <= s->rcvbuf_sz) {
+                        memcpy(rb, buf, sz);
+                    }
+                    else {
+                        tmp = s->rcvbuf_sz - tmp;
+                        memcpy(rb, buf, tmp);
+                        memcpy(s->data.rcvbuf, buf + tmp, sz - tmp);
+                    }
+                }
+
+                if(off) {
+                    tcp_ooo_add(s, seq, seq + sz);
+                    adv = 0;
+                }
+                else {
+                    s->data.rcv.nxt += sz;
+                    adv = sz + tcp_ooo_advance(s);
+                    s->data.rcvq_ring += adv;
+                    s->data.rcvbuf_tail = (s->data.rcvbuf_tail + adv) %
+                                          s->rcvbuf_sz;
+                }
             }
 
-            /* Signal any waiting thread and send an ack for what we read */
-            __poll_event_trigger(s->sock, POLLRDNORM);
-            cond_signal(&s->data.recv_cv);
-            tcp_send_ack(s);
+            if(off) {
+                quickack = 1;
+            }
+            else {
+                s->data.rcv.nxt = seq + adv;
+                s->data.rcv.wnd -= adv;
+                s->data.rcvbuf_cur_sz += adv;
+                s->data.rcv.unacked += adv;
+                quickack = adv != sz;
+
+                /* Signal any waiting thread */
+                __poll_event_trigger(s->sock, POLLRDNORM);
+                cond_signal(&s->data.recv_cv);
+            }
+
+            /* Data that came in out of order (or filled in a gap) gets acked
+               right away, so the other side finds out about the hole quickly.
+               Otherwise, we ack every second full segment, and hold off on
+               the rest for a bit, in case there's something going back the
+               other way soon that the ACK can ride along with (RFC 1122). */
+            if(quickack || s->data.ooo_cnt ||
+                    s->data.rcv.unacked >= 2 * (uint32_t)s->data.snd.mss)
+                tcp_send_ack(s);
+            else if(!net_timer_pending(&s->delack_timer))
+                net_timer_set(&s->delack_timer,
+                              timer_ms_gettime64() + TCP_DELACK_TIME);
         }
     }
-    else if(sz) {
-        /* If we get any segment text in here, there's a problem with the other
-           side... Ignore it. */
-        bad_pkt = 1;
-    }
 
-    /* Finally, check the FIN bit. We don't try to ack it if the packet had too
-       much data. */
-    if(!bad_pkt && (flags & TCP_FLAG_FIN)) {
+    /* Finally, check the FIN bit. We only ack it if everything before it has
+       arrived, which isn't the case if the packet had too much data or came in
+       out of order. */
+    if(fin_seq == s->data.rcv.nxt && (flags & TCP_FLAG_FIN)) {
         /* ACK the FIN */
         ++s->data.rcv.nxt;
         tcp_send_ack(s);
@@ -2722,12 +4285,8 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 break;
 
             case TCP_STATE_FIN_WAIT_2:
-                s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
-                break;
-
             case TCP_STATE_TIME_WAIT:
-                s->data.timer = timer_ms_gettime64();
+                tcp_time_wait(s);
                 break;
         }
     }
@@ -2736,6 +4295,49 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     return 0;
 }
 
+/* Finish checking the checksum on an incoming segment, given the checksum of
+   its header in cs. If it's the next segment in order on an established
+   connection, with nothing odd about it, and it would be copied into the
+   receive buffer, it gets copied in now, while we're going over it anyway, and
+   *pre is set to how much was. Returns nonzero if the checksum is bad. */
+static int tcp_check_data(struct tcp_sock *s, const tcp_hdr_t *tcp,
+                          uint16_t flags, size_t size, uint16_t cs,
+                          uint32_t *pre) {
+    const uint8_t *buf = (const uint8_t *)tcp + TCP_GET_OFFSET(flags);
+    uint32_t sz = size - TCP_GET_OFFSET(flags), first;
+
+    *pre = 0;
+
+    if(!s || s->state != TCP_STATE_ESTABLISHED ||
+       (flags & (TCP_FLAG_SYN | TCP_FLAG_FIN | TCP_FLAG_RST | TCP_FLAG_URG |
+                 TCP_FLAG_ACK)) != TCP_FLAG_ACK ||
+       ntohl(tcp->seq) != s->data.rcv.nxt || sz > s->data.rcv.wnd ||
+       s->data.ooo_cnt ||
+       (sz >= TCP_ZCOPY_MIN && s->sock != -1 && net_pbuf_can_keep(buf)))
+        return !!net_ipv4_checksum(buf, sz, cs ^ 0xFFFF);
+
+    first = MIN(sz, s->rcvbuf_sz - s->data.rcvbuf_tail);
+    cs = net_ipv4_checksum_copy(s->data.rcvbuf + s->data.rcvbuf_tail, buf,
+                                first, cs ^ 0xFFFF);
+
+    /* If it wraps around the end of the buffer, the rest goes at the start. If
+       the first piece was an odd length, everything after it is a byte off, so
+       swap the sum around for it, and back again after. */
+    if(sz > first) {
+        if(first & 1)
+            cs = (uint16_t)((cs << 8) | (cs >> 8));
+
+        cs = net_ipv4_checksum_copy(s->data.rcvbuf, buf + first, sz - first,
+                                    cs ^ 0xFFFF);
+
+        if(first & 1)
+            cs = (uint16_t)((cs << 8) | (cs >> 8));
+    }
+
+    *pre = sz;
+    return cs != 0;
+}
+
 static int net_tcp_input(netif_t *src, int domain, const void *hdr,
                          const uint8 *data, size_t size) {
     struct in6_addr srca, dsta;
@@ -2746,6 +4348,8 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     struct tcp_sock *s;
     int rv = -1;
     uint16_t c;
+    size_t hl = 0;
+    uint32_t pre = 0;
 
     switch(domain) {
         case AF_INET:
@@ -2773,11 +4377,21 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
 
     tcp = (const tcp_hdr_t *)data;
 
-    /* Check the TCP checksum */
+    /* Check the TCP checksum. If there's data in the segment, only the header
+       is checked here, and the rest is left until we know what socket the data
+       is going to (see tcp_check_data()). */
     c = net_ipv6_checksum_pseudo(&srca, &dsta, size, IPPROTO_TCP);
-    c = net_ipv4_checksum(data, size, c);
 
-    if(c) {
+    if(size > sizeof(tcp_hdr_t)) {
+        hl = TCP_GET_OFFSET(ntohs(tcp->off_flags));
+
+        if(hl < sizeof(tcp_hdr_t) || hl >= size)
+            hl = 0;
+    }
+
+    c = net_ipv4_checksum(data, hl ? hl : size, c);
+
+    if(!hl && c) {
         /* The checksum should be 0 on success, so discard the packet if it does
            not match that expectation. */
         return 0;
@@ -2789,13 +4403,25 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
         return -1;
 
     /* Find a matching socket */
-    if((s = find_sock(&srca, &dsta, tcp->src_port, tcp->dst_port, domain))) {
-        /* Make sure we take care of busy sockets... */
-        if(s == (struct tcp_sock *) - 1) {
-            rwsem_read_unlock(&tcp_sem);
-            return 0;
-        }
+    s = find_sock(&srca, &dsta, tcp->src_port, tcp->dst_port, domain);
+
+    /* Make sure we take care of busy sockets... */
+    if(s == (struct tcp_sock *) - 1) {
+        rwsem_read_unlock(&tcp_sem);
+        return 0;
+    }
+
+    if(hl && tcp_check_data(s, tcp, flags, size, c, &pre)) {
+        if(s)
+            mutex_unlock(&s->mutex);
+
+        rwsem_read_unlock(&tcp_sem);
+        return 0;
+    }
+
+    ++tcp_stats.pkt_recv;
 
+    if(s) {
         /* We have to do different things for different states, so figure out
            what this socket is doing. */
         switch(s->state) {
@@ -2820,10 +4446,17 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
             case TCP_STATE_CLOSING:
             case TCP_STATE_LAST_ACK:
             case TCP_STATE_TIME_WAIT:
-                rv = process_pkt(src, &srca, &dsta, tcp, s, flags, size);
+                rv = process_pkt(src, &srca, &dsta, tcp, s, flags, size,
+                                 pre);
                 break;
         }
 
+        /* If that finished off a connection that's already been closed, the
+           socket can be freed now. */
+        if((s->intflags & TCP_IFLAG_CANBEDEL) &&
+                (s->state & 0x0F) == TCP_STATE_CLOSED)
+            net_timer_set(&s->close_timer, 0);
+
         mutex_unlock(&s->mutex);
     }
 
@@ -2837,107 +4470,171 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     return 0;
 }
 
-static void tcp_thd_cb(void *arg) {
-    struct tcp_sock *i, *tmp;
-    uint64_t timer;
+/* Retransmission timer. This resends whatever hasn't been acknowledged (or
+   the <SYN> or <SYN,ACK>) once a retransmission timeout has gone by without
+   hearing anything, and probes the other side's window if it's closed. */
+static void tcp_rxt_cb(void *data) {
+    struct tcp_sock *i = (struct tcp_sock *)data;
+    uint64_t timer = timer_ms_gettime64();
+
+    /* Whoever has the socket locked won't have it for long, so just try again
+       in a moment, rather than holding up the whole network thread. */
+    if(mutex_trylock(&i->mutex)) {
+        net_timer_set(&i->rxt_timer, timer + 1);
+        return;
+    }
 
-    (void)arg;
+    switch(i->state) {
+        case TCP_STATE_SYN_SENT:
 
-    rwsem_read_lock(&tcp_sem);
+            /* If our last <SYN> was sent more than one  retransmission
+               timeout period ago and we are still in the SYN-SENT state,
+               send another one. */
+            if(i->data.timer + i->data.cc.rto <= timer) {
+                tcp_send_syn(i, 0);
+                tcp_rto_backoff(&i->data.cc);
+                i->data.cc.timing = 0;
+                i->data.timer = timer;
+            }
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        mutex_lock_scoped(&i->mutex);
-        timer = timer_ms_gettime64();
+            break;
 
-        switch(i->state) {
-            case TCP_STATE_LISTEN:
-                break;
+        case TCP_STATE_SYN_RECEIVED:
 
-            case TCP_STATE_SYN_SENT:
+            /* If our last <SYN,ACK> was sent more than one  retransmission
+               timeout period ago and we are still in the SYN-RECEIVED
+               state, send another one. */
+            if(i->data.timer + i->data.cc.rto <= timer) {
+                tcp_send_syn(i, 1);
+                tcp_rto_backoff(&i->data.cc);
+                i->data.cc.timing = 0;
+                i->data.timer = timer;
+            }
 
-                /* If our last <SYN> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-SENT state,
-                   send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 0);
-                    i->data.timer = timer;
-                }
+            break;
 
-                break;
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
 
-            case TCP_STATE_SYN_RECEIVED:
+            if(i->data.sndbuf_cur_sz &&
+                    i->data.timer + i->data.cc.rto <= timer) {
+                /* With nothing in flight, this is just a probe of a
+                   closed window, which isn't a sign of congestion. */
+                if(i->data.snd.nxt != i->data.snd.una)
+                    tcp_cc_timeout(i);
+                else
+                    tcp_rto_backoff(&i->data.cc);
+
+                tcp_send_data(i, 1);
+                i->data.timer = timer;
+            }
 
-                /* If our last <SYN,ACK> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-RECEIVED
-                   state, send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 1);
-                    i->data.timer = timer;
-                }
+            tcp_queued_fin(i);
+            break;
 
-                break;
+        case TCP_STATE_FIN_WAIT_1:
+        case TCP_STATE_CLOSING:
+        case TCP_STATE_LAST_ACK:
 
-            case TCP_STATE_TIME_WAIT:
+            /* Resend our <FIN>, if it hasn't been acknowledged. */
+            if(i->data.snd.una != i->data.snd.nxt &&
+                    i->data.timer + i->data.cc.rto <= timer) {
+                --i->data.snd.nxt;
+                tcp_send_fin_ack(i);
+                ++i->data.snd.nxt;
+                tcp_rto_backoff(&i->data.cc);
+                i->data.timer = timer;
+            }
 
-                /* If the TIME-WAIT timer has expired, then clean up the rest of
-                   the connection (the fd was already taken care of by a close()
-                   call earlier that ended up putting us in this state). */
-                if(i->data.timer + 2 * TCP_DEFAULT_MSL <= timer)
-                    i->state = TCP_STATE_CLOSED;
+            break;
+    }
 
-                break;
+    /* If there's still something outstanding, go again later. */
+    tcp_rxt_arm(i);
+    mutex_unlock(&i->mutex);
+}
 
-            case TCP_STATE_ESTABLISHED:
-            case TCP_STATE_CLOSE_WAIT:
+/* Delayed ACK timer. */
+static void tcp_delack_cb(void *data) {
+    struct tcp_sock *i = (struct tcp_sock *)data;
 
-                if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_data(i, 1);
-                }
-                else if(!i->data.sndbuf_cur_sz &&
-                        (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
-                    if(i->state == TCP_STATE_ESTABLISHED) {
-                        i->state = TCP_STATE_FIN_WAIT_1;
-                    }
-                    else {
-                        i->state = TCP_STATE_CLOSING;
-                    }
+    if(mutex_trylock(&i->mutex)) {
+        net_timer_set(&i->delack_timer, timer_ms_gettime64() + 1);
+        return;
+    }
 
-                    tcp_send_fin_ack(i);
-                    ++i->data.snd.nxt;
-                }
+    switch(i->state) {
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_FIN_WAIT_1:
+        case TCP_STATE_FIN_WAIT_2:
 
-                break;
-        }
-    }
+            if(i->data.rcv.unacked)
+                tcp_send_ack(i);
 
-    rwsem_read_unlock(&tcp_sem);
+            break;
+    }
 
-    /* Go through and clean up any sockets that need to be destroyed. */
-    rwsem_write_lock(&tcp_sem);
+    mutex_unlock(&i->mutex);
+}
 
-    i = LIST_FIRST(&tcp_socks);
+/* TIME-WAIT timer. This also frees sockets that have been closed once the
+   connection is all the way closed (the fd was already taken care of by the
+   close() call that left the socket to us). */
+static void tcp_close_cb(void *data) {
+    struct tcp_sock *i = (struct tcp_sock *)data;
+    uint64_t timer = timer_ms_gettime64();
+
+    /* Freeing the socket means taking it off the list, which needs the write
+       lock. Don't wait on that here, just come back in a bit. */
+    if(rwsem_write_trylock(&tcp_sem)) {
+        net_timer_set(&i->close_timer, timer + 10);
+        return;
+    }
 
-    while(i) {
-        tmp = LIST_NEXT(i, sock_list);
+    if(mutex_trylock(&i->mutex)) {
+        rwsem_write_unlock(&tcp_sem);
+        net_timer_set(&i->close_timer, timer + 10);
+        return;
+    }
 
-        if((i->intflags & TCP_IFLAG_CANBEDEL) &&
-                (i->state & 0x0F) == TCP_STATE_CLOSED) {
-            LIST_REMOVE(i, sock_list);
-            cond_destroy(&i->data.send_cv);
-            cond_destroy(&i->data.recv_cv);
-            mutex_destroy(&i->mutex);
-            free(i->data.sndbuf);
-            free(i->data.rcvbuf);
-            free(i);
+    /* If the TIME-WAIT timer has expired, then the connection is closed.
+       Otherwise, it got restarted since this was set, so wait some more. */
+    if(i->state == TCP_STATE_TIME_WAIT) {
+        if(i->data.timer + 2 * TCP_DEFAULT_MSL > timer) {
+            net_timer_set(&i->close_timer,
+                          i->data.timer + 2 * TCP_DEFAULT_MSL);
+            goto out;
         }
 
-        i = tmp;
+        i->state = TCP_STATE_CLOSED;
     }
 
+    if((i->intflags & TCP_IFLAG_CANBEDEL) &&
+            (i->state & 0x0F) == TCP_STATE_CLOSED) {
+        tcp_unlink(i);
+        tcp_timers_destroy(i);
+        cond_destroy(&i->data.send_cv);
+        cond_destroy(&i->data.recv_cv);
+        mutex_unlock(&i->mutex);
+        mutex_destroy(&i->mutex);
+        tcp_rcvq_free(i);
+        free(i->data.sndbuf);
+        free(i->data.rcvbuf);
+        free(i);
+
+        rwsem_write_unlock(&tcp_sem);
+        return;
+    }
+
+out:
+    mutex_unlock(&i->mutex);
     rwsem_write_unlock(&tcp_sem);
 }
 
+net_tcp_stats_t net_tcp_get_stats(void) {
+    return tcp_stats;
+}
+
 /* Protocol handler for fs_socket. */
 static fs_socket_proto_t proto = {
     FS_SOCKET_PROTO_ENTRY,
@@ -2959,22 +4656,27 @@ static fs_socket_proto_t proto = {
     net_tcp_getsockname,                /* getsockname */
     net_tcp_getpeername,                /* getpeername */
     net_tcp_fcntl,                      /* fcntl */
-    net_tcp_poll                        /* poll */
+    net_tcp_poll,                       /* poll */
+    NULL,                               /* recvmmsg */
+    NULL                                /* sendmmsg */
 };
 
 int net_tcp_init(void) {
-    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, 50)) < 0)
-        return -1;
-
     return fs_socket_proto_add(&proto);
 }
 
 void net_tcp_shutdown(void) {
     struct tcp_sock *i, *tmp;
 
-    /* Kill the thread and make sure we can grab the lock */
-    if(thd_cb_id >= 0)
-        net_thd_del_callback(thd_cb_id);
+    /* Take all the timers off the queue, waiting for any that are running to
+       finish up, so that nothing else touches the sockets from here on. */
+    rwsem_write_lock(&tcp_sem);
+
+    LIST_FOREACH(i, &tcp_socks, sock_list) {
+        tcp_timers_destroy(i);
+    }
+
+    rwsem_write_unlock(&tcp_sem);
 
     /* Disable IRQs so we can kill the sockets in peace... */
     irq_disable_scoped();
@@ -2989,10 +4691,11 @@ void net_tcp_shutdown(void) {
             close(i->sock);
         }
         else {
-            LIST_REMOVE(i, sock_list);
+            tcp_unlink(i);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
             mutex_destroy(&i->mutex);
+            tcp_rcvq_free(i);
             free(i->data.sndbuf);
             free(i->data.rcvbuf);
             free(i);
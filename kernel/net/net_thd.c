@@ -8,11 +8,21 @@
 #include <sys/queue.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <kos/thread.h>
+#include <kos/genwait.h>
 #include <arch/timer.h>
+#include <arch/irq.h>
 #include "net_thd.h"
 
+/* The network thread keeps every armed timer in a binary heap ordered by
+   deadline, and sleeps until the earliest one is due (or until something
+   arms a timer that's due sooner than that). The heap always has room for
+   every timer that has been initialized, so arming a timer never has to
+   allocate anything and is fine to do in an interrupt. Everything in here is
+   protected by disabling interrupts. */
+
 struct thd_cb {
     TAILQ_ENTRY(thd_cb) thds;
 
@@ -20,7 +30,7 @@ struct thd_cb {
     void (*cb)(void *);
     void *data;
     uint64 timeout;
-    uint64 nextrun;
+    net_timer_t timer;
 };
 
 TAILQ_HEAD(thd_cb_queue, thd_cb);
@@ -30,30 +40,212 @@ static kthread_t *thd;
 static int done = 0;
 static int cbid_top;
 
+static net_timer_t **heap;
+static int heap_cnt, heap_size, timer_cnt;
+static net_timer_t *running;
+static uint64 sleep_until;
+
+static inline void heap_put(int i, net_timer_t *t) {
+    heap[i] = t;
+    t->idx = i;
+}
+
+static void heap_up(int i) {
+    net_timer_t *t = heap[i];
+    int p;
+
+    while(i > 0) {
+        p = (i - 1) / 2;
+
+        if(heap[p]->when <= t->when)
+            break;
+
+        heap_put(i, heap[p]);
+        i = p;
+    }
+
+    heap_put(i, t);
+}
+
+static void heap_down(int i) {
+    net_timer_t *t = heap[i];
+    int c;
+
+    while((c = 2 * i + 1) < heap_cnt) {
+        if(c + 1 < heap_cnt && heap[c + 1]->when < heap[c]->when)
+            ++c;
+
+        if(t->when <= heap[c]->when)
+            break;
+
+        heap_put(i, heap[c]);
+        i = c;
+    }
+
+    heap_put(i, t);
+}
+
+static void heap_remove(net_timer_t *t) {
+    int i = t->idx;
+
+    t->idx = -1;
+
+    if(i == --heap_cnt)
+        return;
+
+    heap_put(i, heap[heap_cnt]);
+
+    if(i > 0 && heap[i]->when < heap[(i - 1) / 2]->when)
+        heap_up(i);
+    else
+        heap_down(i);
+}
+
+int net_timer_init(net_timer_t *t, void (*cb)(void *), void *data) {
+    net_timer_t **nh, **tmp;
+    int size, old;
+
+    t->when = 0;
+    t->cb = cb;
+    t->data = data;
+    t->idx = -1;
+
+    /* Make sure the heap has room for this one too. */
+    for(;;) {
+        old = irq_disable();
+
+        if(timer_cnt < heap_size) {
+            ++timer_cnt;
+            irq_restore(old);
+            return 0;
+        }
+
+        size = heap_size ? heap_size * 2 : 32;
+        irq_restore(old);
+
+        if(!(nh = (net_timer_t **)malloc(size * sizeof(net_timer_t *)))) {
+            errno = ENOMEM;
+            t->cb = NULL;
+            return -1;
+        }
+
+        old = irq_disable();
+
+        /* Someone else may have grown it while we weren't looking. */
+        if(size > heap_size) {
+            memcpy(nh, heap, heap_cnt * sizeof(net_timer_t *));
+            tmp = heap;
+            heap = nh;
+            nh = tmp;
+            heap_size = size;
+        }
+
+        irq_restore(old);
+        free(nh);
+    }
+}
+
+void net_timer_set(net_timer_t *t, uint64 when) {
+    irq_disable_scoped();
+
+    /* Destroyed timers stay that way. */
+    if(!t->cb)
+        return;
+
+    t->when = when;
+
+    if(t->idx < 0) {
+        heap_put(heap_cnt++, t);
+        heap_up(t->idx);
+    }
+    else if(t->idx > 0 && when < heap[(t->idx - 1) / 2]->when) {
+        heap_up(t->idx);
+    }
+    else {
+        heap_down(t->idx);
+    }
+
+    /* Wake the thread up if it's going to sleep past this. */
+    if(when < sleep_until)
+        genwait_wake_one(&heap);
+}
+
+void net_timer_cancel(net_timer_t *t) {
+    irq_disable_scoped();
+
+    if(t->idx >= 0)
+        heap_remove(t);
+}
+
+void net_timer_destroy(net_timer_t *t) {
+    int old = irq_disable();
+
+    if(!t->cb) {
+        irq_restore(old);
+        return;
+    }
+
+    if(t->idx >= 0)
+        heap_remove(t);
+
+    t->cb = NULL;
+    --timer_cnt;
+
+    /* If the callback is running right now, wait for it to finish, unless
+       it's the one destroying its own timer. This has to block rather than
+       yield, since the network thread may well be lower priority than us. */
+    while(running == t && !net_thd_is_current() && !irq_inside_int())
+        genwait_wait(&running, "net_timer_destroy", 0, NULL);
+
+    irq_restore(old);
+}
+
 static void *net_thd_thd(void *data) {
-    struct thd_cb *cb;
+    net_timer_t *t;
     uint64 now;
+    int old;
 
     (void)data;
 
+    old = irq_disable();
+
     while(!done) {
         now = timer_ms_gettime64();
 
-        /* Run any callbacks that need to be run now. */
-        TAILQ_FOREACH(cb, &cbs, thds) {
-            if(now >= cb->nextrun) {
-                cb->cb(cb->data);
-                cb->nextrun = now + cb->timeout;
-            }
+        /* Run the first timer, if it's due. */
+        if(heap_cnt && heap[0]->when <= now) {
+            t = heap[0];
+            heap_remove(t);
+            running = t;
+            irq_restore(old);
+
+            t->cb(t->data);
+
+            old = irq_disable();
+            running = NULL;
+            genwait_wake_all(&running);
+            continue;
         }
 
         /* Go to sleep til we need to be run again. */
-        thd_sleep(50);
+        sleep_until = heap_cnt ? heap[0]->when : (uint64)-1;
+        genwait_wait(&heap, "net_thd", heap_cnt ? (int)(sleep_until - now) : 0,
+                     NULL);
+        sleep_until = 0;
     }
 
+    irq_restore(old);
+
     return NULL;
 }
 
+static void net_thd_run_cb(void *data) {
+    struct thd_cb *cb = (struct thd_cb *)data;
+
+    cb->cb(cb->data);
+    net_timer_set(&cb->timer, timer_ms_gettime64() + cb->timeout);
+}
+
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64 timeout) {
     struct thd_cb *newcb;
 
@@ -65,36 +257,47 @@ int net_thd_add_callback(void (*cb)(void *), void *data, uint64 timeout) {
         return -1;
     }
 
+    if(net_timer_init(&newcb->timer, &net_thd_run_cb, newcb)) {
+        free(newcb);
+        return -1;
+    }
+
     newcb->cbid = cbid_top++;
     newcb->cb = cb;
     newcb->data = data;
     newcb->timeout = timeout;
-    newcb->nextrun = timer_ms_gettime64() + timeout;
 
     /* Disable interrupts, insert, and re-enable interrupts */
     irq_disable_scoped();
 
     TAILQ_INSERT_TAIL(&cbs, newcb, thds);
+    net_timer_set(&newcb->timer, timer_ms_gettime64() + timeout);
 
     return newcb->cbid;
 }
 
 int net_thd_del_callback(int cbid) {
     struct thd_cb *cb;
+    int old;
 
     /* Disable interrupts so we can search without fear of anything changing
        underneath us. */
-    irq_disable_scoped();
+    old = irq_disable();
 
     /* See if we can find the callback requested. */
     TAILQ_FOREACH(cb, &cbs, thds) {
         if(cb->cbid == cbid) {
             TAILQ_REMOVE(&cbs, cb, thds);
+            irq_restore(old);
+
+            net_timer_destroy(&cb->timer);
             free(cb);
             return 0;
         }
     }
 
+    irq_restore(old);
+
     /* We didn't find it, punt. */
     return -1;
 }
@@ -108,6 +311,7 @@ void net_thd_kill(void) {
     done = 1;
 
     if(!irq_inside_int()) {
+        genwait_wake_one(&heap);
         thd_join(thd, NULL);
     }
     else {
@@ -121,6 +325,7 @@ int net_thd_init(void) {
     TAILQ_INIT(&cbs);
     done = 0;
     cbid_top = 1;
+    sleep_until = 0;
 
     thd = thd_create(0, &net_thd_thd, NULL);
 
@@ -140,9 +345,17 @@ void net_thd_shutdown(void) {
 
     while(c) {
         n = TAILQ_NEXT(c, thds);
+        net_timer_destroy(&c->timer);
         free(c);
         c = n;
     }
 
     TAILQ_INIT(&cbs);
+
+    /* Everything else should have gotten rid of its timers by now. */
+    if(!timer_cnt) {
+        free(heap);
+        heap = NULL;
+        heap_size = heap_cnt = 0;
+    }
 }
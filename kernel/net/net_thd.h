@@ -14,6 +14,34 @@ __BEGIN_DECLS
 
 #include <arch/types.h>
 
+/* A one-shot timer, run by the network thread once its deadline (in
+   milliseconds, on the timer_ms_gettime64() clock) has passed. Initializing a
+   timer may allocate memory, but setting or cancelling one never does, so
+   those are safe to use anywhere, including in interrupts. */
+typedef struct net_timer {
+    uint64 when;
+    void (*cb)(void *);
+    void *data;
+    int idx;                    /* Where it is in the queue, or -1 */
+} net_timer_t;
+
+int net_timer_init(net_timer_t *t, void (*cb)(void *), void *data);
+
+/* Arm the timer for the given time, moving it if it was already armed. */
+void net_timer_set(net_timer_t *t, uint64 when);
+void net_timer_cancel(net_timer_t *t);
+
+static inline int net_timer_pending(const net_timer_t *t) {
+    return t->idx >= 0;
+}
+
+/* Cancel the timer for good. If its callback is running in the network thread
+   at the time, this waits for it to finish first (unless it's the callback
+   doing this), so the callback should never block on anything the caller might
+   be holding. Once this returns, the timer can be freed. */
+void net_timer_destroy(net_timer_t *t);
+
+/* Run cb every timeout milliseconds. */
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64 timeout);
 int net_thd_del_callback(int cbid);
 
@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <poll.h>
 #include <stdint.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <kos/net.h>
 #include <kos/mutex.h>
@@ -18,6 +19,7 @@
 #include <sys/queue.h>
 #include <kos/fs_socket.h>
 #include <arch/irq.h>
+#include <arch/timer.h>
 #include <sys/socket.h>
 #include <netinet/udp.h>
 #include <netinet/udplite.h>
@@ -33,6 +35,14 @@
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define UDP_DEFAULT_HOPS    64
 
+/* Number of buckets in the hash table sockets are looked up in by local port.
+   This must be a power of two. */
+#define UDP_HASH_BUCKETS    64
+
+/* Most pieces a datagram can be sent from. The list of them gets copied onto
+   the stack behind the header, so it can't be allowed to be just anything. */
+#define UDP_IOV_MAX         64
+
 #define packed __attribute__((packed))
 typedef struct {
     uint16 src_port    packed;
@@ -42,20 +52,49 @@ typedef struct {
 } udp_hdr_t;
 #undef packed
 
+/* Default size of the ring that received datagrams are kept in (SO_RCVBUF),
+   and the limits on what it can be set to. */
+#define UDP_DEFAULT_RCVBUF  16384
+#define UDP_MIN_RCVBUF      256
+#define UDP_MAX_RCVBUF      (1024 * 1024)
+
+/* Datagrams up to this size get copied into the receive ring. Anything bigger
+   that came in one of the network driver's packet buffers just hangs onto that
+   buffer, rather than being copied. */
+#define UDP_RING_COPY       512
+
+/* A received datagram. These are kept one after another in the socket's
+   receive ring, each followed by its data, unless the data is in a packet
+   buffer, or is too big to ever fit in the ring (in which case it has been
+   malloc'd separately). */
 struct udp_pkt {
-    TAILQ_ENTRY(udp_pkt) pkt_queue;
     struct sockaddr_in6 from;
     uint8 *data;
+    net_pbuf_t *pbuf;
+    uint32 size;                        /* Space taken up in the ring */
     uint16 datasize;
 };
 
-TAILQ_HEAD(udp_pkt_queue, udp_pkt);
+/* The receive ring. Datagrams go in at the tail and come out at the head. If
+   one won't fit between the tail and the end of the buffer, it goes at the
+   start instead, and end marks where the ones before it stop. */
+struct udp_ring {
+    uint8 *buf;
+    uint32 size;
+    uint32 head;
+    uint32 tail;
+    uint32 end;
+    uint32 cnt;
+};
+
+#define UDP_RING_ALIGN(x)   (((x) + 3) & ~3)
 
 #define UDPSOCK_NO_CHECKSUM 0x00000001
 #define UDPSOCK_LITE_RCVCOV 0x00000002
 
 struct udp_sock {
     LIST_ENTRY(udp_sock) sock_list;
+    LIST_ENTRY(udp_sock) hash_list;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -71,7 +110,7 @@ struct udp_sock {
         uint16_t recv_cscov;
     } udp_lite;
 
-    struct udp_pkt_queue packets;
+    struct udp_ring rcv;
 };
 
 LIST_HEAD(udp_sock_list, udp_sock);
@@ -80,10 +119,323 @@ static struct udp_sock_list net_udp_sockets = LIST_HEAD_INITIALIZER(0);
 static mutex_t udp_mutex = MUTEX_INITIALIZER;
 static net_udp_stats_t udp_stats = { 0 };
 
+/* Since no two sockets can share a local port, the port is all that's needed
+   to find the socket an incoming packet is meant for. Every socket that has a
+   port is in this table too, keyed on it. The table is protected by udp_mutex,
+   just like the list. */
+static struct udp_sock_list udp_port_hash[UDP_HASH_BUCKETS];
+
+static inline struct udp_sock_list *udp_port_bucket(uint16 port) {
+    return &udp_port_hash[(port ^ (port >> 8)) & (UDP_HASH_BUCKETS - 1)];
+}
+
+/* Find the socket bound to a port (in network byte order), if there is one. */
+static struct udp_sock *udp_port_lookup(uint16 port) {
+    struct udp_sock *iter;
+
+    LIST_FOREACH(iter, udp_port_bucket(port), hash_list) {
+        if(iter->local_addr.sin6_port == port)
+            return iter;
+    }
+
+    return NULL;
+}
+
+/* Pick the first unused port >= 1024, returned in network byte order. */
+static uint16 udp_port_alloc(void) {
+    uint16 port = 1024;
+
+    while(udp_port_lookup(htons(port)))
+        ++port;
+
+    return htons(port);
+}
+
+/* Set the local port of a socket, moving it to the right hash bucket. */
+static void udp_port_set(struct udp_sock *udpsock, uint16 port) {
+    if(udpsock->local_addr.sin6_port)
+        LIST_REMOVE(udpsock, hash_list);
+
+    udpsock->local_addr.sin6_port = port;
+    LIST_INSERT_HEAD(udp_port_bucket(port), udpsock, hash_list);
+}
+
+static int udp_ring_init(struct udp_ring *r, uint32 size) {
+    if(!(r->buf = (uint8 *)malloc(size)))
+        return -1;
+
+    r->size = r->end = size;
+    r->head = r->tail = r->cnt = 0;
+    return 0;
+}
+
+static inline struct udp_pkt *udp_ring_first(struct udp_ring *r) {
+    return (struct udp_pkt *)(r->buf + r->head);
+}
+
+/* Make room for a datagram taking up sz bytes at the tail of the ring. */
+static struct udp_pkt *udp_ring_alloc(struct udp_ring *r, uint32 sz) {
+    struct udp_pkt *pkt;
+    uint32 pos;
+
+    if(!r->cnt) {
+        r->head = r->tail = 0;
+        r->end = r->size;
+    }
+
+    /* The tail can never quite catch up to the head, so that the two are only
+       ever equal when the ring is empty. */
+    if(r->tail >= r->head && r->size - r->tail >= sz) {
+        pos = r->tail;
+    }
+    else if(r->tail >= r->head && sz < r->head) {
+        r->end = r->tail;
+        pos = 0;
+    }
+    else if(r->tail < r->head && r->head - r->tail > sz) {
+        pos = r->tail;
+    }
+    else {
+        return NULL;
+    }
+
+    r->tail = pos + sz;
+    ++r->cnt;
+
+    pkt = (struct udp_pkt *)(r->buf + pos);
+    pkt->size = sz;
+    return pkt;
+}
+
+static inline int udp_pkt_inline(const struct udp_pkt *pkt) {
+    return pkt->data == (const uint8 *)(pkt + 1);
+}
+
+/* Take the datagram at the head off the ring, and free its data. */
+static void udp_ring_pop(struct udp_ring *r) {
+    struct udp_pkt *pkt = udp_ring_first(r);
+
+    if(pkt->pbuf)
+        net_pbuf_free(pkt->pbuf);
+    else if(!udp_pkt_inline(pkt))
+        free(pkt->data);
+
+    r->head += pkt->size;
+
+    if(!--r->cnt) {
+        r->head = r->tail = 0;
+        r->end = r->size;
+    }
+    else if(r->head == r->end) {
+        r->head = 0;
+        r->end = r->size;
+    }
+}
+
+/* Give a socket a new receive ring, moving over whatever is queued up in the
+   old one. The new ring is made big enough to hold all of it. */
+static int udp_ring_resize(struct udp_sock *sock, uint32 size) {
+    struct udp_ring r;
+    struct udp_pkt *pkt, *old;
+    uint32 pos = sock->rcv.head, used = 0, i;
+
+    for(i = 0; i < sock->rcv.cnt; ++i) {
+        old = (struct udp_pkt *)(sock->rcv.buf + pos);
+        used += old->size;
+
+        if((pos += old->size) == sock->rcv.end)
+            pos = 0;
+    }
+
+    size = UDP_RING_ALIGN(size);
+
+    if(size < used)
+        size = used;
+
+    if(udp_ring_init(&r, size))
+        return -1;
+
+    while(sock->rcv.cnt) {
+        old = udp_ring_first(&sock->rcv);
+        pkt = udp_ring_alloc(&r, old->size);
+        memcpy(pkt, old, old->size);
+
+        /* The data moves with it if it was in the ring, otherwise it stays
+           where it is, and the old one mustn't free it. */
+        if(udp_pkt_inline(old))
+            pkt->data = (uint8 *)(pkt + 1);
+
+        old->pbuf = NULL;
+        old->data = (uint8 *)(old + 1);
+        udp_ring_pop(&sock->rcv);
+    }
+
+    free(sock->rcv.buf);
+    sock->rcv = r;
+    return 0;
+}
+
+/* Queue up a received datagram on a socket. If cs is not NULL, the rest of the
+   checksum still needs checking (cs is what net_ipv4_checksum() gave for
+   everything before the data), which is done while copying, if we have to
+   copy, so the data only gets read once. The caller fills in the address. */
+static struct udp_pkt *udp_pkt_queue(struct udp_sock *sock, const uint8 *data,
+                                     size_t size, const uint16 *cs) {
+    struct udp_ring saved = sock->rcv;
+    struct udp_pkt *pkt;
+    net_pbuf_t *pb = NULL;
+    uint32 sz = UDP_RING_ALIGN(sizeof(struct udp_pkt) + size);
+    int ext = 0;
+
+    if(size > UDP_RING_COPY || sz > sock->rcv.size)
+        pb = net_pbuf_keep(data);
+
+    if(pb || sz > sock->rcv.size) {
+        sz = sizeof(struct udp_pkt);
+        ext = !pb;
+    }
+
+    if(!(pkt = udp_ring_alloc(&sock->rcv, sz))) {
+        if(pb)
+            net_pbuf_free(pb);
+
+        ++udp_stats.pkt_recv_no_space;
+        return NULL;
+    }
+
+    pkt->datasize = size;
+    pkt->pbuf = pb;
+
+    if(pb) {
+        pkt->data = (uint8 *)data;
+
+        if(cs && net_ipv4_checksum(data, size, *cs ^ 0xFFFF))
+            goto bad;
+    }
+    else {
+        if(!ext)
+            pkt->data = (uint8 *)(pkt + 1);
+        else if(!(pkt->data = (uint8 *)malloc(size))) {
+            sock->rcv = saved;
+            return NULL;
+        }
+
+        if(!cs) {
+            memcpy(pkt->data, data, size);
+        }
+        else if(net_ipv4_checksum_copy(pkt->data, data, size, *cs ^ 0xFFFF)) {
+            if(ext)
+                free(pkt->data);
+
+            goto bad;
+        }
+
+        udp_stats.bytes_recv_copied += size;
+    }
+
+    udp_stats.bytes_recv += size;
+    return pkt;
+
+bad:
+    if(pb)
+        net_pbuf_free(pb);
+
+    sock->rcv = saved;
+    ++udp_stats.pkt_recv_bad_chksum;
+    return NULL;
+}
+
+/* Wait for a datagram to come in. This is called with udp_mutex held, and it
+   is let go of while we wait. Interrupts are kept off from then until we're
+   asleep, so one that comes in right in between can't be missed. */
+static int udp_wait(struct udp_sock *sock, const char *mesg, int timeout) {
+    int old, rv;
+
+    old = irq_disable();
+    mutex_unlock(&udp_mutex);
+    rv = genwait_wait(sock, mesg, timeout, NULL);
+    irq_restore(old);
+    mutex_lock(&udp_mutex);
+
+    return rv;
+}
+
+/* Give back the address a datagram came from, in the form the socket uses. */
+static void udp_name(const struct udp_sock *udpsock,
+                     const struct sockaddr_in6 *from, struct sockaddr *addr,
+                     socklen_t *addr_len) {
+    if(udpsock->domain == AF_INET) {
+        struct sockaddr_in realaddr;
+
+        memset(&realaddr, 0, sizeof(struct sockaddr_in));
+        realaddr.sin_family = AF_INET;
+        realaddr.sin_addr.s_addr = from->sin6_addr.__s6_addr.__s6_addr32[3];
+        realaddr.sin_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in)) {
+            memcpy(addr, &realaddr, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
+            *addr_len = sizeof(struct sockaddr_in);
+        }
+    }
+    else if(udpsock->domain == AF_INET6) {
+        struct sockaddr_in6 realaddr6;
+
+        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
+        realaddr6.sin6_family = AF_INET6;
+        realaddr6.sin6_addr = from->sin6_addr;
+        realaddr6.sin6_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in6)) {
+            memcpy(addr, &realaddr6, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
+            *addr_len = sizeof(struct sockaddr_in6);
+        }
+    }
+}
+
+/* Copy the first queued datagram out into iov, and take it off the queue
+   unless we're only peeking. Returns how much was copied, and sets MSG_TRUNC
+   in *mflags (if given) if that wasn't all of it. */
+static size_t udp_recv_one(struct udp_sock *udpsock, const struct iovec *iov,
+                           int iovcnt, int flags, struct sockaddr *addr,
+                           socklen_t *addr_len, int *mflags) {
+    struct udp_pkt *pkt = udp_ring_first(&udpsock->rcv);
+    size_t off = 0, n;
+    int i;
+
+    for(i = 0; i < iovcnt && off < pkt->datasize; ++i) {
+        n = pkt->datasize - off;
+
+        if(n > iov[i].iov_len)
+            n = iov[i].iov_len;
+
+        memcpy(iov[i].iov_base, pkt->data + off, n);
+        off += n;
+    }
+
+    if(mflags && off < pkt->datasize)
+        *mflags |= MSG_TRUNC;
+
+    if(addr != NULL)
+        udp_name(udpsock, &pkt->from, addr, addr_len);
+
+    /* Remove the packet if we're pulling data out of the queue. */
+    if(!(flags & MSG_PEEK))
+        udp_ring_pop(&udpsock->rcv);
+
+    return off;
+}
+
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8 *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov);
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *data, int datacnt,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov);
 
 static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
                           socklen_t *addr_len) {
@@ -169,38 +521,22 @@ static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-            if(iter == udpsock)
-                continue;
+        iter = udp_port_lookup(realaddr6.sin6_port);
 
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&udp_mutex);
-                errno = EADDRINUSE;
-                return -1;
-            }
+        if(iter && iter != udpsock) {
+            mutex_unlock(&udp_mutex);
+            errno = EADDRINUSE;
+            return -1;
         }
-
-        udpsock->local_addr = realaddr6;
     }
     else {
-        uint16 port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr = realaddr6;
-        udpsock->local_addr.sin6_port = htons(port);
+        /* Grab the first unused port >= 1024. */
+        realaddr6.sin6_port = udp_port_alloc();
     }
 
+    udp_port_set(udpsock, realaddr6.sin6_port);
+    udpsock->local_addr = realaddr6;
+
     udpsock->sock = hnd->fd;
 
     mutex_unlock(&udp_mutex);
@@ -311,7 +647,7 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
                                 int flags, struct sockaddr *addr,
                                 socklen_t *addr_len) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
+    struct iovec iov;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return -1;
@@ -335,7 +671,7 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return -1;
     }
 
-    if(TAILQ_EMPTY(&udpsock->packets) &&
+    if(!udpsock->rcv.cnt &&
        ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
         irq_inside_int())) {
         mutex_unlock(&udp_mutex);
@@ -343,73 +679,97 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return -1;
     }
 
-    while(TAILQ_EMPTY(&udpsock->packets)) {
-        mutex_unlock(&udp_mutex);
-        genwait_wait(udpsock, "net_udp_recvfrom", 0, NULL);
-        mutex_lock(&udp_mutex);
-    }
+    while(!udpsock->rcv.cnt)
+        udp_wait(udpsock, "net_udp_recvfrom", 0);
 
-    pkt = TAILQ_FIRST(&udpsock->packets);
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+    length = udp_recv_one(udpsock, &iov, 1, flags, addr, addr_len, NULL);
 
-    if(pkt->datasize > length) {
-        memcpy(buffer, pkt->data, length);
+    mutex_unlock(&udp_mutex);
+
+    return length;
+}
+
+static int net_udp_recvmmsg(net_socket_t *hnd, struct mmsghdr *msgs,
+                            unsigned int vlen, int flags,
+                            struct timespec *timeout) {
+    struct udp_sock *udpsock;
+    struct msghdr *m;
+    uint64 deadline = 0, now;
+    unsigned int i;
+    int block, tmout;
+
+    if(timeout)
+        deadline = timer_ms_gettime64() + timeout->tv_sec * 1000 +
+                   timeout->tv_nsec / 1000000;
+
+    if(mutex_lock_irqsafe(&udp_mutex))
+        return -1;
+
+    udpsock = (struct udp_sock *)hnd->data;
+
+    if(udpsock == NULL) {
+        mutex_unlock(&udp_mutex);
+        errno = EBADF;
+        return -1;
     }
-    else {
-        memcpy(buffer, pkt->data, pkt->datasize);
-        length = pkt->datasize;
+
+    if(udpsock->flags & (SHUT_RD << 24)) {
+        mutex_unlock(&udp_mutex);
+        return 0;
     }
 
-    if(addr != NULL) {
-        if(udpsock->domain == AF_INET) {
-            struct sockaddr_in realaddr;
+    block = !((udpsock->flags & FS_SOCKET_NONBLOCK) ||
+              (flags & MSG_DONTWAIT) || irq_inside_int());
 
-            memset(&realaddr, 0, sizeof(struct sockaddr_in));
-            realaddr.sin_family = AF_INET;
-            realaddr.sin_addr.s_addr =
-                pkt->from.sin6_addr.__s6_addr.__s6_addr32[3];
-            realaddr.sin_port = pkt->from.sin6_port;
+    /* Everything that's already here comes out under the one lock. */
+    for(i = 0; i < vlen; ++i) {
+        while(!udpsock->rcv.cnt) {
+            if(!block || (i && (flags & MSG_WAITFORONE)))
+                goto out;
 
-            if(*addr_len < sizeof(struct sockaddr_in)) {
-                memcpy(addr, &realaddr, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
-                *addr_len = sizeof(struct sockaddr_in);
-            }
-        }
-        else if(udpsock->domain == AF_INET6) {
-            struct sockaddr_in6 realaddr6;
+            tmout = 0;
 
-            memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-            realaddr6.sin6_family = AF_INET6;
-            realaddr6.sin6_addr = pkt->from.sin6_addr;
-            realaddr6.sin6_port = pkt->from.sin6_port;
+            if(deadline) {
+                if((now = timer_ms_gettime64()) >= deadline)
+                    goto out;
 
-            if(*addr_len < sizeof(struct sockaddr_in6)) {
-                memcpy(addr, &realaddr6, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
-                *addr_len = sizeof(struct sockaddr_in6);
+                tmout = (int)(deadline - now);
             }
+
+            udp_wait(udpsock, "net_udp_recvmmsg", tmout);
         }
-    }
 
-    /* Remove the packet if we're pulling data out of the queue. */
-    if(!(flags & MSG_PEEK)) {
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt->data);
-        free(pkt);
+        m = &msgs[i].msg_hdr;
+        m->msg_flags = 0;
+        m->msg_controllen = 0;
+        msgs[i].msg_len = udp_recv_one(udpsock, m->msg_iov, m->msg_iovlen,
+                                       flags, (struct sockaddr *)m->msg_name,
+                                       &m->msg_namelen, &m->msg_flags);
+
+        /* Peeking would just give back the same one again. */
+        if(flags & MSG_PEEK) {
+            ++i;
+            break;
+        }
     }
 
+out:
     mutex_unlock(&udp_mutex);
 
-    return length;
+    if(!i && vlen) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    return i;
 }
 
-static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
-                              size_t length, int flags,
-                              const struct sockaddr *addr, socklen_t addr_len) {
+/* Send a datagram made up of the pieces in iov. */
+static ssize_t udp_sendv(net_socket_t *hnd, const struct iovec *iov,
+                         int iovcnt, const struct sockaddr *addr,
+                         socklen_t addr_len) {
     struct udp_sock *udpsock;
     struct sockaddr_in *realaddr;
     struct sockaddr_in6 realaddr6;
@@ -418,8 +778,6 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     uint16_t cscov;
     struct sockaddr_in6 local_addr;
 
-    (void)flags;
-
     if(mutex_lock_irqsafe(&udp_mutex))
         return -1;
 
@@ -480,28 +838,14 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
         goto err;
     }
 
-    if(message == NULL) {
+    if(iov == NULL && iovcnt) {
         errno = EFAULT;
         goto err;
     }
 
     if(udpsock->local_addr.sin6_port == 0) {
-        uint16 port = 1024, tmp = 0;
-        struct udp_sock *iter;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr.sin6_port = htons(port);
+        /* Grab the first unused port >= 1024. */
+        udp_port_set(udpsock, udp_port_alloc());
     }
 
     local_addr = udpsock->local_addr;
@@ -512,14 +856,66 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     cscov = udpsock->udp_lite.send_cscov;
     mutex_unlock(&udp_mutex);
 
-    return net_udp_send_raw(NULL, &local_addr, &realaddr6,
-                            (const uint8 *)message, length, sflags, hops,
-                            iflags, proto, cscov);
+    return net_udp_send_raw(NULL, &local_addr, &realaddr6, iov, iovcnt,
+                            sflags, hops, iflags, proto, cscov);
 err:
     mutex_unlock(&udp_mutex);
     return -1;
 }
 
+static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
+                              size_t length, int flags,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+    struct iovec iov;
+
+    (void)flags;
+
+    if(message == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    iov.iov_base = (void *)message;
+    iov.iov_len = length;
+
+    return udp_sendv(hnd, &iov, 1, addr, addr_len);
+}
+
+static int net_udp_sendmmsg(net_socket_t *hnd, struct mmsghdr *msgs,
+                            unsigned int vlen, int flags) {
+    struct msghdr *m;
+    unsigned int i;
+    ssize_t rv;
+
+    (void)flags;
+
+    /* Let the device send them all off together. */
+    net_tx_batch_begin(NULL);
+
+    for(i = 0; i < vlen; ++i) {
+        m = &msgs[i].msg_hdr;
+
+        if(m->msg_iovlen < 0 || m->msg_iovlen > UDP_IOV_MAX) {
+            errno = EMSGSIZE;
+            break;
+        }
+
+        if((rv = udp_sendv(hnd, m->msg_iov, m->msg_iovlen,
+                           (const struct sockaddr *)m->msg_name,
+                           m->msg_namelen)) < 0)
+            break;
+
+        msgs[i].msg_len = rv;
+    }
+
+    net_tx_batch_end(NULL);
+
+    if(!i && vlen)
+        return -1;
+
+    return i;
+}
+
 static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
     struct udp_sock *udpsock;
 
@@ -570,12 +966,19 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     }
 
     memset(udpsock, 0, sizeof(struct udp_sock));
-    TAILQ_INIT(&udpsock->packets);
+
+    if(udp_ring_init(&udpsock->rcv, UDP_DEFAULT_RCVBUF)) {
+        free(udpsock);
+        errno = ENOMEM;
+        return -1;
+    }
+
     udpsock->domain = domain;
     udpsock->proto = proto;
     udpsock->hop_limit = UDP_DEFAULT_HOPS;
 
     if(mutex_lock_irqsafe(&udp_mutex)) {
+        free(udpsock->rcv.buf);
         free(udpsock);
         return -1;
     }
@@ -589,8 +992,6 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 
 static void net_udp_close(net_socket_t *hnd) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
-    struct udp_pkt *it;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return;
@@ -603,18 +1004,16 @@ static void net_udp_close(net_socket_t *hnd) {
         return;
     }
 
-    it = udpsock->packets.tqh_first;
-    while(it) {
-        pkt = it;
-        it = it->pkt_queue.tqe_next;
+    while(udpsock->rcv.cnt)
+        udp_ring_pop(&udpsock->rcv);
 
-        free(pkt->data);
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt);
-    }
+    free(udpsock->rcv.buf);
 
     LIST_REMOVE(udpsock, sock_list);
 
+    if(udpsock->local_addr.sin6_port)
+        LIST_REMOVE(udpsock, hash_list);
+
     free(udpsock);
     mutex_unlock(&udp_mutex);
 }
@@ -643,6 +1042,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_TYPE:
                     tmp = SOCK_DGRAM;
                     goto copy_int;
+
+                case SO_RCVBUF:
+                    tmp = sock->rcv.size;
+                    goto copy_int;
             }
 
             break;
@@ -754,6 +1157,27 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_ERROR:
                 case SO_TYPE:
                     goto ret_inval;
+
+                case SO_RCVBUF:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    /* Anything already queued up is kept, even if the new
+                       size is too small for it. */
+                    if(tmp < UDP_MIN_RCVBUF)
+                        tmp = UDP_MIN_RCVBUF;
+                    else if(tmp > UDP_MAX_RCVBUF)
+                        tmp = UDP_MAX_RCVBUF;
+
+                    if(udp_ring_resize(sock, tmp)) {
+                        mutex_unlock(&udp_mutex);
+                        errno = ENOMEM;
+                        return -1;
+                    }
+
+                    goto ret_success;
             }
 
             break;
@@ -1093,7 +1517,7 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
         return POLLNVAL;
     }
 
-    if(!TAILQ_EMPTY(&sock->packets))
+    if(sock->rcv.cnt)
         rv |= POLLRDNORM;
 
     mutex_unlock(&udp_mutex);
@@ -1106,8 +1530,8 @@ extern void __poll_event_trigger(int fd, short event);
 static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8 *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16 cs, cscov = 0;
-    int partial = 1;
+    uint16 cs = 0, cscov = 0;
+    int partial = 1, check = 0;
     struct udp_sock *sock;
     struct udp_pkt *pkt;
 
@@ -1127,13 +1551,10 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8 *data,
         if(hdr->checksum != 0) {
             cs = net_ipv4_checksum_pseudo(ip->src, ip->dest, IPPROTO_UDP, size);
 
-            /* If the checksum is right, we'll get zero back from the checksum
-               function */
-            if(net_ipv4_checksum(data, size, cs)) {
-                /* The checksum was wrong, bail out */
-                ++udp_stats.pkt_recv_bad_chksum;
-                return -1;
-            }
+            /* Only check the header for now. The rest gets checked once we
+               know where the data is going (see udp_pkt_queue()). */
+            cs = net_ipv4_checksum(data, sizeof(udp_hdr_t), cs);
+            check = 1;
         }
     }
     else {
@@ -1155,8 +1576,12 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8 *data,
         cs = net_ipv4_checksum_pseudo(ip->src, ip->dest, IPPROTO_UDPLITE, size);
 
         /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, cscov, cs)) {
+           function. If it covers everything, do it like plain UDP does. */
+        if(!partial) {
+            cs = net_ipv4_checksum(data, sizeof(udp_hdr_t), cs);
+            check = 1;
+        }
+        else if(net_ipv4_checksum(data, cscov, cs)) {
             ++udp_stats.pkt_recv_bad_chksum;
             return -1;
         }
@@ -1166,7 +1591,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8 *data,
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_port_bucket(hdr->dst_port), hash_list) {
         /* Don't even bother looking at IPv6-only sockets */
         if(sock->domain == AF_INET6 && (sock->flags & FS_SOCKET_V6ONLY))
             continue;
@@ -1204,30 +1629,19 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8 *data,
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8 *)malloc(pkt->datasize))) {
-            free(pkt);
+        if(!(pkt = udp_pkt_queue(sock, data + sizeof(udp_hdr_t),
+                                 size - sizeof(udp_hdr_t),
+                                 check ? &cs : NULL))) {
             mutex_unlock(&udp_mutex);
             return -1;
         }
 
+        memset(&pkt->from, 0, sizeof(struct sockaddr_in6));
         pkt->from.sin6_family = AF_INET6;
         pkt->from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
         pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
         pkt->from.sin6_port = hdr->src_port;
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
         ++udp_stats.pkt_recv;
         __poll_event_trigger(sock->sock, POLLRDNORM);
         genwait_wake_one(sock);
@@ -1236,17 +1650,24 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8 *data,
         return 0;
     }
 
-    ++udp_stats.pkt_recv_no_sock;
     mutex_unlock(&udp_mutex);
 
+    /* Make sure it really was meant for us before saying nobody wanted it. */
+    if(check && net_ipv4_checksum(data + sizeof(udp_hdr_t),
+                                  size - sizeof(udp_hdr_t), cs ^ 0xFFFF)) {
+        ++udp_stats.pkt_recv_bad_chksum;
+        return -1;
+    }
+
+    ++udp_stats.pkt_recv_no_sock;
     return -1;
 }
 
 static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8 *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16 cs, cscov = 0;
-    int partial = 1;
+    uint16 cs = 0, cscov = 0;
+    int partial = 1, check = 0;
     struct udp_sock *sock;
     struct udp_pkt *pkt;
 
@@ -1264,13 +1685,10 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8 *data,
         cs = net_ipv6_checksum_pseudo(&ip->src_addr, &ip->dst_addr, size,
                                       IPPROTO_UDP);
 
-        /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, size, cs)) {
-            /* The checksum was wrong, bail out */
-            ++udp_stats.pkt_recv_bad_chksum;
-            return -1;
-        }
+        /* Only check the header for now. The rest gets checked once we know
+           where the data is going (see udp_pkt_queue()). */
+        cs = net_ipv4_checksum(data, sizeof(udp_hdr_t), cs);
+        check = 1;
     }
     else {
         cscov = ntohs(hdr->length);
@@ -1292,8 +1710,12 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8 *data,
                                       IPPROTO_UDPLITE);
 
         /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, cscov, cs)) {
+           function. If it covers everything, do it like plain UDP does. */
+        if(!partial) {
+            cs = net_ipv4_checksum(data, sizeof(udp_hdr_t), cs);
+            check = 1;
+        }
+        else if(net_ipv4_checksum(data, cscov, cs)) {
             ++udp_stats.pkt_recv_bad_chksum;
             return -1;
         }
@@ -1303,7 +1725,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8 *data,
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_port_bucket(hdr->dst_port), hash_list) {
         /* Don't even bother looking at IPv4 sockets */
         if(sock->domain == AF_INET)
             continue;
@@ -1341,29 +1763,18 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8 *data,
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8 *)malloc(pkt->datasize))) {
-            free(pkt);
+        if(!(pkt = udp_pkt_queue(sock, data + sizeof(udp_hdr_t),
+                                 size - sizeof(udp_hdr_t),
+                                 check ? &cs : NULL))) {
             mutex_unlock(&udp_mutex);
             return -1;
         }
 
+        memset(&pkt->from, 0, sizeof(struct sockaddr_in6));
         pkt->from.sin6_family = AF_INET6;
         pkt->from.sin6_addr = ip->src_addr;
         pkt->from.sin6_port = hdr->src_port;
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
         ++udp_stats.pkt_recv;
         __poll_event_trigger(sock->sock, POLLRDNORM);
         genwait_wake_one(sock);
@@ -1372,9 +1783,16 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8 *data,
         return 0;
     }
 
-    ++udp_stats.pkt_recv_no_sock;
     mutex_unlock(&udp_mutex);
 
+    /* Make sure it really was meant for us before saying nobody wanted it. */
+    if(check && net_ipv4_checksum(data + sizeof(udp_hdr_t),
+                                  size - sizeof(udp_hdr_t), cs ^ 0xFFFF)) {
+        ++udp_stats.pkt_recv_bad_chksum;
+        return -1;
+    }
+
+    ++udp_stats.pkt_recv_no_sock;
     return -1;
 }
 
@@ -1393,17 +1811,25 @@ static int net_udp_input(netif_t *src, int domain, const void *hdr,
 
 /* XXX */
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8 *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov) {
-    uint8 buf[size + sizeof(udp_hdr_t)];
-    udp_hdr_t *hdr = (udp_hdr_t *)buf;
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *data, int datacnt,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov) {
+    udp_hdr_t hdr[1];
+    struct iovec iov[UDP_IOV_MAX + 1];
+    size_t size;
     uint16 cs;
     int err;
     struct in6_addr srcaddr = src->sin6_addr;
 
     (void)flags;
 
+    if(datacnt < 0 || datacnt > UDP_IOV_MAX) {
+        errno = EMSGSIZE;
+        ++udp_stats.pkt_send_failed;
+        return -1;
+    }
+
     if(!net) {
         net = net_default_dev;
 
@@ -1440,8 +1866,18 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
-    size += sizeof(udp_hdr_t);
+    /* The header goes out in front of the data, which is passed along as it
+       is, rather than copied in behind the header. */
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(udp_hdr_t);
+    memcpy(iov + 1, data, sizeof(struct iovec) * datacnt);
+    size = net_iov_len(data, datacnt) + sizeof(udp_hdr_t);
+
+    if(size > 0xFFFF) {
+        errno = EMSGSIZE;
+        ++udp_stats.pkt_send_failed;
+        return -1;
+    }
 
     hdr->src_port = src->sin6_port;
     hdr->dst_port = dst->sin6_port;
@@ -1454,7 +1890,7 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         if(!(iflags & UDPSOCK_NO_CHECKSUM)) {
             cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
                                           proto);
-            hdr->checksum = net_ipv4_checksum(buf, size, cs);
+            hdr->checksum = net_ipv4_checksum_iov(iov, datacnt + 1, cs);
         }
     }
     else {
@@ -1467,12 +1903,12 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
 
         cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size, proto);
-        hdr->checksum = net_ipv4_checksum(buf, size, cs);
+        hdr->checksum = net_ipv4_checksum_iov(iov, datacnt + 1, cs);
     }
 
     /* Pass everything off to the network layer to do the rest. */
-    err = net_ipv6_send(net, buf, size, hops, proto, &srcaddr,
-                        &dst->sin6_addr);
+    err = net_ipv6_sendv(net, iov, datacnt + 1, hops, proto, &srcaddr,
+                         &dst->sin6_addr);
 
     if(err < 0) {
         ++udp_stats.pkt_send_failed;
@@ -1509,7 +1945,9 @@ static fs_socket_proto_t proto = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 static fs_socket_proto_t proto_lite = {
@@ -1532,7 +1970,9 @@ static fs_socket_proto_t proto_lite = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 int net_udp_init(void) {
@@ -21,6 +21,7 @@
 #include <errno.h>
 
 #include <arch/timer.h>
+#include <dc/perfctr.h>
 #include <kos/genwait.h>
 #include <kos/sem.h>
 
@@ -35,36 +36,112 @@ static TAILQ_HEAD(slpquehead, kthread) slpque[TABLESIZE];
    ready to run at a later time will be placed here. Note that this doesn't
    deal with pre-emptive timeslice context switching, only things that are
    specifically blocked for a timed event (thd_sleep, genwait_wait, etc).
-   This queue is sorted by remaining time (smallest at the front). */
-static struct ktqueue timer_queue;
 
-/* Internal function to insert a thread on the timer queue. Maintains
-   sorting order by wait time. */
-static void tq_insert(kthread_t * thd) {
-    kthread_t * t;
+   This is a pairing heap keyed on the wake-up time, threaded through the
+   timerq handles in each thread, so it never needs to allocate. The root is
+   always the thread with the earliest timeout. Insertion is constant time;
+   removing the root or cancelling an arbitrary thread's timeout is amortized
+   logarithmic in the number of sleepers. */
+static kthread_t *timer_queue;
+
+/* Meld two heaps together, returning the new root. The roots passed in must
+   not have any siblings. */
+static kthread_t *tq_meld(kthread_t *a, kthread_t *b) {
+    kthread_t *t;
+
+    if(!a)
+        return b;
+    if(!b)
+        return a;
+
+    /* Keep the earlier timeout on top. Ties go to a, which keeps threads
+       with equal timeouts roughly in the order they went to sleep. */
+    if(b->wait_timeout < a->wait_timeout) {
+        t = a;
+        a = b;
+        b = t;
+    }
 
-    /* Search for its place; note that new threads will be placed at
-       the end of a group with the same timeout. */
-    TAILQ_FOREACH(t, &timer_queue, timerq) {
-        if(thd->wait_timeout < t->wait_timeout) {
-            TAILQ_INSERT_BEFORE(t, thd, timerq);
-            return;
+    /* Make b the first child of a. */
+    b->timerq.prev = a;
+    b->timerq.sibling = a->timerq.child;
+
+    if(a->timerq.child)
+        a->timerq.child->timerq.prev = b;
+
+    a->timerq.child = b;
+
+    return a;
+}
+
+/* Standard two-pass pairing of a list of siblings: meld them pairwise from
+   left to right, then meld the results together from right to left. */
+static kthread_t *tq_merge_pairs(kthread_t *first) {
+    kthread_t *a, *b, *next, *stack = NULL, *rv = NULL;
+
+    while(first) {
+        a = first;
+        b = a->timerq.sibling;
+        next = b ? b->timerq.sibling : NULL;
+
+        a->timerq.prev = a->timerq.sibling = NULL;
+
+        if(b) {
+            b->timerq.prev = b->timerq.sibling = NULL;
+            a = tq_meld(a, b);
         }
+
+        /* Push the pair onto a stack for the second pass. */
+        a->timerq.sibling = stack;
+        stack = a;
+        first = next;
     }
 
-    /* Couldn't find anything scheduled later, put this at the end. */
-    TAILQ_INSERT_TAIL(&timer_queue, thd, timerq);
+    while(stack) {
+        next = stack->timerq.sibling;
+        stack->timerq.sibling = NULL;
+        rv = tq_meld(rv, stack);
+        stack = next;
+    }
+
+    return rv;
+}
+
+/* Internal function to insert a thread on the timer queue. */
+static void tq_insert(kthread_t *thd) {
+    thd->timerq.child = thd->timerq.sibling = thd->timerq.prev = NULL;
+    timer_queue = tq_meld(timer_queue, thd);
 }
 
 /* Internal function to remove a thread from the timer queue. */
-static void tq_remove(kthread_t * thd) {
-    TAILQ_REMOVE(&timer_queue, thd, timerq);
+static void tq_remove(kthread_t *thd) {
+    kthread_t *sub;
+
+    if(thd == timer_queue) {
+        timer_queue = tq_merge_pairs(thd->timerq.child);
+    }
+    else {
+        /* Unlink it from its parent (or previous sibling)... */
+        if(thd->timerq.prev->timerq.child == thd)
+            thd->timerq.prev->timerq.child = thd->timerq.sibling;
+        else
+            thd->timerq.prev->timerq.sibling = thd->timerq.sibling;
+
+        if(thd->timerq.sibling)
+            thd->timerq.sibling->timerq.prev = thd->timerq.prev;
+
+        /* ... and hang its children back on the main heap. */
+        sub = tq_merge_pairs(thd->timerq.child);
+        timer_queue = tq_meld(timer_queue, sub);
+    }
+
+    thd->timerq.child = thd->timerq.sibling = thd->timerq.prev = NULL;
 }
 
 /* Returns the top thread on the timer queue (next event). If nothing is
    queued, we'll return NULL. */
-static kthread_t * tq_next(void) {
-    return TAILQ_FIRST(&timer_queue);
+static inline kthread_t *tq_next(void) {
+    return timer_queue;
 }
 
 int genwait_wait(void * obj, const char * mesg, int timeout, void (*callback)(void *)) {
@@ -82,6 +159,7 @@ int genwait_wait(void * obj, const char * mesg, int timeout, void (*callback)(vo
     me = thd_current;
     me->state = STATE_WAIT;
     me->wait_obj = obj;
+    me->stats.wait_since = perf_cntr_timer_ns();
     me->wait_msg = mesg;
 
     if(timeout > 0) {
@@ -101,9 +179,43 @@ int genwait_wait(void * obj, const char * mesg, int timeout, void (*callback)(vo
     return thd_block_now(&me->context);
 }
 
+/* Charge the time a thread just spent blocked to the object it waited on. If
+   the object isn't in the thread's table yet, it takes over the empty or the
+   least interesting slot. */
+static void genwait_account(kthread_t *thd) {
+    kthread_wait_stat_t *ws = NULL, *victim = &thd->stats.waits[0];
+    uint64_t ns = perf_cntr_timer_ns() - thd->stats.wait_since;
+    int i;
+
+    thd->stats.wait_time += ns;
+
+    for(i = 0; i < KTHREAD_WAIT_STATS; i++) {
+        if(thd->stats.waits[i].obj == thd->wait_obj) {
+            ws = &thd->stats.waits[i];
+            break;
+        }
+
+        if(thd->stats.waits[i].time < victim->time)
+            victim = &thd->stats.waits[i];
+    }
+
+    if(!ws) {
+        ws = victim;
+        ws->obj = thd->wait_obj;
+        ws->count = 0;
+        ws->time = 0;
+    }
+
+    ws->msg = thd->wait_msg;
+    ws->count++;
+    ws->time += ns;
+}
+
 /* Removes a thread from its wait queue; assumes ints are disabled. */
 static void genwait_unqueue(kthread_t * thd) {
     if(thd->wait_obj) {
+        genwait_account(thd);
+
         /* Remove it from the queue */
         TAILQ_REMOVE(&slpque[LOOKUP(thd->wait_obj)], thd, thdq);
 
@@ -219,6 +331,19 @@ int genwait_wake_thd(void *obj, kthread_t *thd, int err) {
     return 0;
 }
 
+kthread_t *genwait_top_waiter(void *obj) {
+    kthread_t *t, *rv = NULL;
+
+    irq_disable_scoped();
+
+    TAILQ_FOREACH(t, &slpque[LOOKUP(obj)], thdq) {
+        if(t->wait_obj == obj && (!rv || t->prio < rv->prio))
+            rv = t;
+    }
+
+    return rv;
+}
+
 void genwait_check_timeouts(uint64 tm) {
     kthread_t   *t;
 
@@ -263,7 +388,7 @@ int genwait_init(void) {
     for(i = 0; i < TABLESIZE; i++)
         TAILQ_INIT(&slpque[i]);
 
-    TAILQ_INIT(&timer_queue);
+    timer_queue = NULL;
     return 0;
 }
 
@@ -31,6 +31,8 @@ mutex_t *mutex_create(void) {
     rv->dynamic = 1;
     rv->holder = NULL;
     rv->count = 0;
+    rv->protocol = MUTEX_PRIO_INHERIT;
+    rv->pi.owner = NULL;
 
     return rv;
 }
@@ -47,10 +49,40 @@ int mutex_init(mutex_t *m, int mtype) {
     m->dynamic = 0;
     m->holder = NULL;
     m->count = 0;
+    m->protocol = MUTEX_PRIO_INHERIT;
+    m->pi.owner = NULL;
 
     return 0;
 }
 
+int mutex_set_protocol(mutex_t *m, int protocol) {
+    if(protocol != MUTEX_PRIO_INHERIT && protocol != MUTEX_PRIO_NONE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    irq_disable_scoped();
+
+    if(m->count) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    m->protocol = protocol;
+
+    return 0;
+}
+
+/* Take ownership of an unlocked mutex; assumes ints are disabled. */
+static void mutex_take(mutex_t *m, kthread_t *thd) {
+    m->holder = thd;
+    m->count = 1;
+
+    /* Interrupts can't be boosted, so don't track them as owners. */
+    if(m->protocol == MUTEX_PRIO_INHERIT && thd != (kthread_t *)0xFFFFFFFF)
+        thd_pi_acquired(&m->pi, m, NULL);
+}
+
 int mutex_destroy(mutex_t *m) {
     irq_disable_scoped();
 
@@ -112,8 +144,7 @@ int mutex_lock_timed(mutex_t *m, int timeout) {
         rv = -1;
     }
     else if(!m->count) {
-        m->count = 1;
-        m->holder = thd_current;
+        mutex_take(m, thd_current);
     }
     else if(m->type == MUTEX_TYPE_RECURSIVE && m->holder == thd_current) {
         if(m->count == INT_MAX) {
@@ -133,25 +164,24 @@ int mutex_lock_timed(mutex_t *m, int timeout) {
             deadline = timer_ms_gettime64() + timeout;
 
         for(;;) {
-            if (m->holder->prio >= thd_current->prio) {
-                m->holder->prio = thd_current->prio;
-
-                /* Thread list is sorted by priority, update the position
-                 * of the thread holding the lock */
-                thd_remove_from_runnable(m->holder);
-                thd_add_to_runnable(m->holder, true);
-            }
+            /* Boost the thread holding the lock (and whatever it is blocked
+               on in turn) up to our priority while we wait. */
+            if(m->protocol == MUTEX_PRIO_INHERIT)
+                thd_pi_wait_begin(&m->pi);
 
             rv = genwait_wait(m, timeout ? "mutex_lock_timed" : "mutex_lock",
                               timeout, NULL);
+
+            if(m->protocol == MUTEX_PRIO_INHERIT)
+                thd_pi_wait_end(&m->pi, rv < 0);
+
             if(rv < 0) {
                 errno = ETIMEDOUT;
                 break;
             }
 
             if(!m->holder) {
-                m->holder = thd_current;
-                m->count = 1;
+                mutex_take(m, thd_current);
                 break;
             }
 
@@ -194,19 +224,17 @@ int mutex_trylock(mutex_t *m) {
         return -1;
     }
 
-    m->holder = thd;
+    if(!m->count) {
+        mutex_take(m, thd);
+        return 0;
+    }
 
     switch(m->type) {
         case MUTEX_TYPE_NORMAL:
         case MUTEX_TYPE_OLDNORMAL:
         case MUTEX_TYPE_ERRORCHECK:
-            if(m->count) {
-                errno = EDEADLK;
-                return -1;
-            }
-
-            m->count = 1;
-            break;
+            errno = EDEADLK;
+            return -1;
 
         case MUTEX_TYPE_RECURSIVE:
             if(m->count == INT_MAX) {
@@ -262,12 +290,21 @@ static int mutex_unlock_common(mutex_t *m, kthread_t *thd) {
             return -1;
     }
 
-    if (thd != (kthread_t *)0xffffffff)
-        thd->prio = thd->real_prio;
+    if(!wakeup)
+        return 0;
 
-    /* If we need to wake up a thread, do so. */
-    if(wakeup)
+    /* Drop any boost the holder got from this mutex's waiters. */
+    thd_pi_released(&m->pi);
+
+    /* Wake up a waiting thread, giving the highest priority one the first
+       shot at the mutex when using priority inheritance. */
+    if(m->protocol == MUTEX_PRIO_INHERIT) {
+        if((thd = genwait_top_waiter(m)))
+            genwait_wake_thd(m, thd, 0);
+    }
+    else {
         genwait_wake_one(m);
+    }
 
     return 0;
 }
@@ -13,6 +13,12 @@
 #include <kos/rwsem.h>
 #include <kos/genwait.h>
 
+/* Give the current thread the write lock; assumes ints are disabled. */
+static void rwsem_take_write(rw_semaphore_t *s) {
+    s->write_lock = thd_current;
+    thd_pi_acquired(&s->pi, s, &s->write_lock);
+}
+
 /* Allocate a new reader/writer semaphore */
 rw_semaphore_t *rwsem_create(void) {
     rw_semaphore_t *s;
@@ -29,6 +35,7 @@ rw_semaphore_t *rwsem_create(void) {
     s->read_count = 0;
     s->write_lock = NULL;
     s->reader_waiting = NULL;
+    s->pi.owner = NULL;
 
     return s;
 }
@@ -38,6 +45,7 @@ int rwsem_init(rw_semaphore_t *s) {
     s->read_count = 0;
     s->write_lock = NULL;
     s->reader_waiting = NULL;
+    s->pi.owner = NULL;
 
     return 0;
 }
@@ -84,9 +92,12 @@ int rwsem_read_lock_timed(rw_semaphore_t *s, int timeout) {
         ++s->read_count;
     }
     else {
-        /* Block until the write lock is not held any more */
+        /* Block until the write lock is not held any more, boosting the
+           writer in the meantime */
+        thd_pi_wait_begin(&s->pi);
         rv = genwait_wait(s, timeout ? "rwsem_read_lock_timed" :
                           "rwsem_read_lock", timeout, NULL);
+        thd_pi_wait_end(&s->pi, rv < 0);
 
         if(rv < 0) {
             rv = -1;
@@ -133,13 +144,15 @@ int rwsem_write_lock_timed(rw_semaphore_t *s, int timeout) {
     /* If the write lock is not held and there are no readers in their critical
        sections, let the thread proceed. */
     if(!s->write_lock && !s->read_count) {
-        s->write_lock = thd_current;
+        rwsem_take_write(s);
     }
     else {
         /* Block until the write lock is not held and there are no readers
            inside their critical sections */
+        thd_pi_wait_begin(&s->pi);
         rv = genwait_wait(&s->write_lock, timeout ? "rwsem_write_lock_timed" :
                           "rwsem_write_lock", timeout, NULL);
+        thd_pi_wait_end(&s->pi, rv < 0);
 
         if(rv < 0) {
             rv = -1;
@@ -147,7 +160,7 @@ int rwsem_write_lock_timed(rw_semaphore_t *s, int timeout) {
                 errno = ETIMEDOUT;
         }
         else {
-            s->write_lock = thd_current;
+            rwsem_take_write(s);
         }
     }
 
@@ -202,6 +215,7 @@ int rwsem_write_unlock(rw_semaphore_t *s) {
     }
 
     s->write_lock = NULL;
+    thd_pi_released(&s->pi);
 
     /* Give writers priority, attempt to wake any writers first. */
     woken = genwait_wake_cnt(&s->write_lock, 1, 0);
@@ -255,7 +269,7 @@ int rwsem_write_trylock(rw_semaphore_t *s) {
         return -1;
     }
 
-    s->write_lock = thd_current;
+    rwsem_take_write(s);
     return 0;
 }
 
@@ -304,11 +318,11 @@ int rwsem_read_upgrade_timed(rw_semaphore_t *s, int timeout) {
             return -1;
         }
 
-        s->write_lock = thd_current;
+        rwsem_take_write(s);
     }
     else {
         s->read_count = 0;
-        s->write_lock = thd_current;
+        rwsem_take_write(s);
     }
 
     return 0;
@@ -333,7 +347,7 @@ int rwsem_read_tryupgrade(rw_semaphore_t *s) {
     }
 
     s->read_count = 0;
-    s->write_lock = thd_current;
+    rwsem_take_write(s);
 
     return 0;
 }
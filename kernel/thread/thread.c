@@ -66,13 +66,27 @@ static unsigned int thd_sched_ms = 1000 / THD_SCHED_HZ;
 static struct ktlist thd_list;
 
 /* Run queue. This is more like on a standard time sharing system than the
-   previous versions. The top element of this priority queue should be the
-   thread that is ready to run next. When a thread is scheduled, it will be
-   removed from this queue. When it's de-scheduled, it will be re-inserted
-   by its priority value at the end of its priority group. Note that right
-   now this condition is being broken because sleeping threads are on the
-   same queue. We deal with those in thd_switch below. */
-static struct ktqueue run_queue;
+   previous versions. Priorities are split into levels of 16 values each, with
+   one queue per level, plus a two-level bitmap recording which of those
+   queues are non-empty. Each queue is kept in priority order, so the head of
+   the lowest-numbered non-empty queue is the thread that is ready to run
+   next. When a thread is scheduled, it will be removed from its queue. When
+   it's de-scheduled, it will be re-inserted at the end of its priority group.
+   Pick-next and dequeue are constant time, and enqueue only has to step over
+   threads in the same level with a different priority. One queue per
+   priority value would take 4097 queue heads (about 32KB), which isn't worth
+   it when hardly any program uses more than a handful of priorities. Only
+   STATE_READY threads live on here; sleeping threads sit on the genwait
+   queues instead. */
+#define RUNQ_SHIFT      4
+#define RUNQ_LEVEL(p)   ((p) >> RUNQ_SHIFT)
+#define RUNQ_LEVELS     (RUNQ_LEVEL(PRIO_MAX) + 1)
+#define RUNQ_WORDS      ((RUNQ_LEVELS + 31) / 32)
+#define RUNQ_SUMMARY    ((RUNQ_WORDS + 31) / 32)
+
+static struct ktqueue run_queue[RUNQ_LEVELS];
+static uint32_t run_queue_map[RUNQ_WORDS];
+static uint32_t run_queue_summary[RUNQ_SUMMARY];
 
 /* The currently executing thread. This thread should not be on any queues. */
 kthread_t *thd_current = NULL;
@@ -89,6 +103,15 @@ static size_t thd_count = 0;
 /* The idle task */
 static kthread_t *thd_idle_thd = NULL;
 
+/* Tickless mode state. thd_wakeup_at is the absolute time (in milliseconds)
+   that the primary timer is currently programmed to fire at, or 0 if it is
+   not armed. The rest is bookkeeping for thd_get_timer_irqs_saved(). */
+static uint64_t thd_wakeup_at;
+static uint64_t thd_timer_irqs;
+static uint64_t thd_tickless_irqs;
+static uint64_t thd_tickless_ms;
+static uint64_t thd_tickless_start;
+
 /*****************************************************************************/
 /* Debug */
 
@@ -161,22 +184,29 @@ int thd_pslist(int (*pf)(const char *fmt, ...)) {
 
 int thd_pslist_queue(int (*pf)(const char *fmt, ...)) {
     kthread_t *cur;
+    int level;
 
     pf("Queued threads:\n");
     pf("addr\t\ttid\tprio\tflags\twait_timeout\tstate     name\n");
-    TAILQ_FOREACH(cur, &run_queue, thdq) {
-        pf("%08lx\t", CONTEXT_PC(cur->context));
-        pf("%d\t", cur->tid);
 
-        if(cur->prio == PRIO_MAX)
-            pf("MAX\t");
-        else
-            pf("%d\t", cur->prio);
+    for(level = 0; level < RUNQ_LEVELS; level++) {
+        if(!(run_queue_map[level >> 5] & (1u << (level & 31))))
+            continue;
 
-        pf("%08lx\t", cur->flags);
-        pf("%ld\t\t", (uint32_t)cur->wait_timeout);
-        pf("%10s", thd_state_to_str(cur));
-        pf("%s\n", cur->label);
+        TAILQ_FOREACH(cur, &run_queue[level], thdq) {
+            pf("%08lx\t", CONTEXT_PC(cur->context));
+            pf("%d\t", cur->tid);
+
+            if(cur->prio == PRIO_MAX)
+                pf("MAX\t");
+            else
+                pf("%d\t", cur->prio);
+
+            pf("%08lx\t", cur->flags);
+            pf("%ld\t\t", (uint32_t)cur->wait_timeout);
+            pf("%10s", thd_state_to_str(cur));
+            pf("%s\n", cur->label);
+        }
     }
 
     return 0;
@@ -305,49 +335,126 @@ void thd_exit(void *rv) {
 /*****************************************************************************/
 /* Thread creation and deletion */
 
+/* Program the primary timer for the given absolute time in tickless mode. */
+static void thd_tickless_program(uint64_t when, uint64_t now) {
+    if(!when) {
+        if(thd_wakeup_at)
+            timer_primary_cancel();
+
+        thd_wakeup_at = 0;
+        return;
+    }
+
+    thd_wakeup_at = when;
+    timer_primary_wakeup(when > now ? (uint32_t)(when - now) : 1);
+}
+
+/* Make sure the primary timer will fire by the end of a timeslice from now,
+   leaving it alone if it is already set to fire before that. */
+static void thd_tickless_arm_slice(void) {
+    uint64_t now = timer_ms_gettime64();
+
+    if(!thd_wakeup_at || thd_wakeup_at > now + thd_sched_ms)
+        thd_tickless_program(now + thd_sched_ms, now);
+}
+
+/* Mark a run queue level as having runnable threads. */
+static inline void runq_mark(unsigned int level) {
+    unsigned int word = level >> 5;
+
+    run_queue_map[word] |= 1u << (level & 31);
+    run_queue_summary[word >> 5] |= 1u << (word & 31);
+}
+
+/* Clear a run queue level's bit once its queue has drained. */
+static inline void runq_unmark(unsigned int level) {
+    unsigned int word = level >> 5;
+
+    run_queue_map[word] &= ~(1u << (level & 31));
+
+    if(!run_queue_map[word])
+        run_queue_summary[word >> 5] &= ~(1u << (word & 31));
+}
+
+/* Returns the first thread of the highest priority (lowest value) non-empty
+   run queue, or NULL if nothing at all is runnable. */
+static kthread_t *runq_first(void) {
+    unsigned int i, word;
+
+    for(i = 0; i < RUNQ_SUMMARY; i++) {
+        if(run_queue_summary[i]) {
+            word = (i << 5) + __builtin_ctz(run_queue_summary[i]);
+
+            return TAILQ_FIRST(&run_queue[(word << 5) +
+                               __builtin_ctz(run_queue_map[word])]);
+        }
+    }
+
+    return NULL;
+}
+
+/* Work out when the scheduler next needs to run in tickless mode: the next
+   genwait timeout, or the end of the current timeslice if another thread at
+   the same (or a better) priority is waiting to run, whichever is first. */
+static void thd_tickless_rearm(uint64_t now) {
+    kthread_t *next = runq_first();
+    uint64_t when = genwait_next_timeout();
+
+    if(next && next != thd_idle_thd && next->prio <= thd_current->prio) {
+        if(!when || when > now + thd_sched_ms)
+            when = now + thd_sched_ms;
+    }
+
+    thd_tickless_program(when, now);
+}
+
 /* Enqueue a process in the runnable queue; adds it right after the
    process group of the same priority (front_of_line==0) or
    right before the process group of the same priority (front_of_line!=0).
    See thd_schedule for why this is helpful. */
 void thd_add_to_runnable(kthread_t *t, bool front_of_line) {
-    kthread_t *i;
-    int done;
+    struct ktqueue *q;
+    kthread_t *cur;
 
     if(t->flags & THD_QUEUED)
         return;
 
-    done = 0;
+    q = &run_queue[RUNQ_LEVEL(t->prio)];
 
+    /* Most of the time everything in the level has the same priority, so
+       these stop at the first thread they look at. */
     if(!front_of_line) {
-        /* Look for a thread of lower priority and insert
-           before it. If there is nothing on the run queue, we'll
-           fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio > t->prio) {
-                TAILQ_INSERT_BEFORE(i, t, thdq);
-                done = 1;
+        TAILQ_FOREACH_REVERSE(cur, q, ktqueue, thdq) {
+            if(cur->prio <= t->prio)
                 break;
-            }
         }
+
+        if(cur)
+            TAILQ_INSERT_AFTER(q, cur, t, thdq);
+        else
+            TAILQ_INSERT_HEAD(q, t, thdq);
     }
     else {
-        /* Look for a thread of the same or lower priority and
-           insert before it. If there is nothing on the run queue,
-           we'll fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio >= t->prio) {
-                TAILQ_INSERT_BEFORE(i, t, thdq);
-                done = 1;
+        TAILQ_FOREACH(cur, q, thdq) {
+            if(cur->prio >= t->prio)
                 break;
-            }
         }
-    }
 
-    /* Didn't find one, put it at the end */
-    if(!done)
-        TAILQ_INSERT_TAIL(&run_queue, t, thdq);
+        if(cur)
+            TAILQ_INSERT_BEFORE(cur, t, thdq);
+        else
+            TAILQ_INSERT_TAIL(q, t, thdq);
+    }
 
+    runq_mark(RUNQ_LEVEL(t->prio));
     t->flags |= THD_QUEUED;
+    t->stats.ready_since = perf_cntr_timer_ns();
+
+    /* Without a periodic tick, nothing would ever preempt the current thread
+       in favor of this one. Make sure a timeslice ends soon enough. */
+    if(thd_mode == THD_MODE_TICKLESS && thd_current && t != thd_current &&
+       t->prio <= thd_current->prio)
+        thd_tickless_arm_slice();
 }
 
 /* Removes a thread from the runnable queue, if it's there. */
@@ -355,7 +462,11 @@ int thd_remove_from_runnable(kthread_t *thd) {
     if(!(thd->flags & THD_QUEUED)) return 0;
 
     thd->flags &= ~THD_QUEUED;
-    TAILQ_REMOVE(&run_queue, thd, thdq);
+    TAILQ_REMOVE(&run_queue[RUNQ_LEVEL(thd->prio)], thd, thdq);
+
+    if(TAILQ_EMPTY(&run_queue[RUNQ_LEVEL(thd->prio)]))
+        runq_unmark(RUNQ_LEVEL(thd->prio));
+
     return 0;
 }
 
@@ -565,6 +676,7 @@ kthread_t *thd_create(bool detach, void *(*routine)(void *), void *param) {
    the execution chain. */
 int thd_destroy(kthread_t *thd) {
     kthread_tls_kv_t *i, *i2;
+    kthread_pi_lock_t *pi;
 
     /* Make sure there are no ints */
     irq_disable_scoped();
@@ -581,6 +693,13 @@ int thd_destroy(kthread_t *thd) {
     /* De-schedule the thread if it's scheduled. */
     thd_remove_from_runnable(thd);
 
+    /* Forget about any priority inheritance locks it still owns. */
+    while(!LIST_EMPTY(&thd->pi_locks)) {
+        pi = LIST_FIRST(&thd->pi_locks);
+        LIST_REMOVE(pi, list);
+        pi->owner = NULL;
+    }
+
     /* Remove it from the thread list. */
     LIST_REMOVE(thd, t_list);
 
@@ -615,6 +734,102 @@ int thd_destroy(kthread_t *thd) {
     return 0;
 }
 
+/*****************************************************************************/
+/* Priority inheritance */
+
+/* Limit on how far a boost is propagated along a chain of blocked owners. This
+   also keeps us from looping forever on a deadlock cycle. */
+#define PI_MAX_DEPTH    16
+
+/* Work out a thread's dynamic priority from its static priority and the
+   sleepers on every priority inheritance lock it holds. */
+static void thd_pi_recompute(kthread_t *thd) {
+    kthread_pi_lock_t *pi;
+    kthread_t *w;
+    prio_t prio = thd->real_prio;
+    int i;
+
+    LIST_FOREACH(pi, &thd->pi_locks, list) {
+        for(i = 0; i < 2; i++) {
+            if(!pi->wait_obj[i])
+                continue;
+
+            w = genwait_top_waiter(pi->wait_obj[i]);
+
+            if(w && w->prio < prio)
+                prio = w->prio;
+        }
+    }
+
+    if(prio != thd->prio)
+        thd_set_prio_dyn(thd, prio);
+}
+
+void thd_pi_acquired(kthread_pi_lock_t *pi, void *obj0, void *obj1) {
+    kthread_t *w;
+    prio_t prio = thd_current->prio;
+    int i;
+
+    pi->owner = thd_current;
+    pi->wait_obj[0] = obj0;
+    pi->wait_obj[1] = obj1;
+    LIST_INSERT_HEAD(&thd_current->pi_locks, pi, list);
+
+    /* Anyone still waiting on the lock now boosts us instead. Taking a lock
+       can only raise our priority, so there's no need to look at the other
+       locks we hold. */
+    for(i = 0; i < 2; i++) {
+        if(!pi->wait_obj[i])
+            continue;
+
+        w = genwait_top_waiter(pi->wait_obj[i]);
+
+        if(w && w->prio < prio)
+            prio = w->prio;
+    }
+
+    if(prio != thd_current->prio)
+        thd_set_prio_dyn(thd_current, prio);
+}
+
+void thd_pi_released(kthread_pi_lock_t *pi) {
+    kthread_t *owner = pi->owner;
+
+    if(!owner)
+        return;
+
+    LIST_REMOVE(pi, list);
+    pi->owner = NULL;
+    thd_pi_recompute(owner);
+}
+
+void thd_pi_wait_begin(kthread_pi_lock_t *pi) {
+    prio_t prio = thd_current->prio;
+    kthread_t *owner;
+    int depth;
+
+    thd_current->pi_blocked = pi;
+
+    for(depth = 0; pi && depth < PI_MAX_DEPTH; depth++) {
+        owner = pi->owner;
+
+        if(!owner || owner == thd_current || owner->prio <= prio)
+            break;
+
+        thd_set_prio_dyn(owner, prio);
+        pi = owner->pi_blocked;
+    }
+}
+
+void thd_pi_wait_end(kthread_pi_lock_t *pi, bool timed_out) {
+    thd_current->pi_blocked = NULL;
+
+    /* We're not waiting any more, so we might not need to boost the owner
+       as far as we did. */
+    if(timed_out && pi->owner)
+        thd_pi_recompute(pi->owner);
+}
+
 /*****************************************************************************/
 /* Thread attribute functions */
 
@@ -626,22 +841,81 @@ int thd_set_prio(kthread_t *thd, prio_t prio) {
     if((prio < 0) || (prio > PRIO_MAX))
         return -2;
 
-    /* Set the new priority */
-    thd->prio = prio;
+    irq_disable_scoped();
+
+    /* Set the new priority, moving the thread to its new run queue if it is
+       currently runnable. Any priority inheritance boost still applies. */
     thd->real_prio = prio;
+    thd_pi_recompute(thd);
     return 0;
 }
 
+/* Change only the dynamic priority of a thread; assumes ints are disabled.
+   A thread being boosted goes to the front of its new priority group, so
+   that whoever boosted it gets its resource back as soon as possible. */
+void thd_set_prio_dyn(kthread_t *thd, prio_t prio) {
+    bool boost = prio < thd->prio;
+
+    if(thd->flags & THD_QUEUED) {
+        thd_remove_from_runnable(thd);
+        thd->prio = prio;
+        thd_add_to_runnable(thd, boost);
+    }
+    else {
+        thd->prio = prio;
+    }
+}
+
 /*****************************************************************************/
 /* Scheduling routines */
 
-static void thd_update_cpu_time(kthread_t *thd) {
+static uint64_t thd_update_cpu_time(kthread_t *thd) {
     const uint64_t ns = perf_cntr_timer_ns();
 
     thd_current->cpu_time.total +=
             ns - thd_current->cpu_time.scheduled;
 
     thd->cpu_time.scheduled = ns;
+
+    return ns;
+}
+
+/* Set when the current thread gave up the CPU of its own accord, so that
+   thd_schedule() can tell a yield from a preemption. */
+static bool thd_yielding;
+
+/* Sample how deep the outgoing thread's stack is. Its context has already
+   been saved by the time we get here. */
+static inline void thd_stats_stack(kthread_t *thd) {
+    uintptr_t top, sp = CONTEXT_SP(thd->context);
+
+    if(!thd->stack || !thd->stack_size)
+        return;
+
+    top = (uintptr_t)thd->stack + thd->stack_size;
+
+    if(sp < top && top - sp > thd->stats.stack_max)
+        thd->stats.stack_max = top - sp;
+}
+
+/* Account for a switch from the current thread to thd, which is about to
+   leave the run queue at time ns. */
+static void thd_stats_switch(kthread_t *thd, bool preempted, uint64_t ns) {
+    uint64_t waited;
+
+    if(thd == thd_current)
+        return;
+
+    if(preempted)
+        thd_current->stats.invol_switches++;
+    else
+        thd_current->stats.vol_switches++;
+
+    waited = ns - thd->stats.ready_since;
+    thd->stats.runq_time += waited;
+
+    if(waited > thd->stats.runq_max)
+        thd->stats.runq_max = waited;
 }
 
 /* Thread scheduler; this function will find a new thread to run when a
@@ -662,6 +936,7 @@ static void thd_update_cpu_time(kthread_t *thd) {
 */
 void thd_schedule(bool front_of_line, uint64_t now) {
     kthread_t *thd;
+    bool preempted;
 
     if(now == 0)
         now = timer_ms_gettime64();
@@ -673,6 +948,11 @@ void thd_schedule(bool front_of_line, uint64_t now) {
         arch_exit();
     }
 
+    /* Anything still running at this point that didn't ask to give up the
+       CPU is being preempted. */
+    preempted = thd_current->state == STATE_RUNNING && !thd_yielding;
+    thd_stats_stack(thd_current);
+
     /* If the current thread is supposed to be in the front of the line, and it
        did not die, re-enqueue it to the front of the line now. */
     if(front_of_line && thd_current->state == STATE_RUNNING) {
@@ -683,14 +963,10 @@ void thd_schedule(bool front_of_line, uint64_t now) {
     /* Look for timed out waits */
     genwait_check_timeouts(now);
 
-    /* Search downwards through the run queue for a runnable thread; if
-       we don't find a normal runnable thread, the idle process will
-       always be there at the bottom. */
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        /* Is it runnable? If not, keep going */
-        if(thd->state == STATE_READY)
-            break;
-    }
+    /* Grab the head of the highest priority run queue; if we don't find a
+       normal runnable thread, the idle process will always be there at the
+       bottom. */
+    thd = runq_first();
 
     /* If we didn't already re-enqueue the thread and we are supposed to do so,
        do it now. */
@@ -714,7 +990,7 @@ void thd_schedule(bool front_of_line, uint64_t now) {
        run queue and switch to it. */
     thd_remove_from_runnable(thd);
 
-    thd_update_cpu_time(thd);
+    thd_stats_switch(thd, preempted, thd_update_cpu_time(thd));
 
     thd_current = thd;
     _impure_ptr = &thd->thd_reent;
@@ -729,6 +1005,9 @@ void thd_schedule(bool front_of_line, uint64_t now) {
         }
     }
 
+    if(thd_mode == THD_MODE_TICKLESS)
+        thd_tickless_rearm(now);
+
     irq_set_context(&thd_current->context);
 }
 
@@ -737,6 +1016,8 @@ void thd_schedule(bool front_of_line, uint64_t now) {
    interrupt return to jump back to the new thread instead of the one that
    was executing (unless it was already executing). */
 void thd_schedule_next(kthread_t *thd) {
+    bool preempted;
+
     /* Make sure we're actually inside an interrupt */
     if(!irq_inside_int())
         return;
@@ -749,6 +1030,9 @@ void thd_schedule_next(kthread_t *thd) {
     if(thd->state != STATE_READY)
         return;
 
+    preempted = thd_current->state == STATE_RUNNING;
+    thd_stats_stack(thd_current);
+
     /* Unfortunately we have to take care of this here */
     if(thd_current->state == STATE_ZOMBIE) {
         sem_signal(&thd_reap_sem);
@@ -760,11 +1044,15 @@ void thd_schedule_next(kthread_t *thd) {
 
     thd_remove_from_runnable(thd);
 
-    thd_update_cpu_time(thd);
+    thd_stats_switch(thd, preempted, thd_update_cpu_time(thd));
 
     thd_current = thd;
     _impure_ptr = &thd->thd_reent;
     thd_current->state = STATE_RUNNING;
+
+    if(thd_mode == THD_MODE_TICKLESS)
+        thd_tickless_rearm(timer_ms_gettime64());
+
     irq_set_context(&thd_current->context);
 }
 
@@ -774,8 +1062,11 @@ irq_context_t *thd_choose_new(void) {
 
     //printf("thd_choose_new() woken at %d\n", (uint32_t)now);
 
-    /* Do any re-scheduling */
+    /* Do any re-scheduling. We only get here through thd_block_now(), so
+       whatever the current thread is doing, it chose to stop running. */
+    thd_yielding = true;
     thd_schedule(0, now);
+    thd_yielding = false;
 
     /* Return the new IRQ context back to the caller */
     return &thd_current->context;
@@ -795,6 +1086,17 @@ static void thd_timer_hnd(irq_context_t *context) {
 
     //printf("timer woke at %d\n", (uint32_t)now);
 
+    ++thd_timer_irqs;
+
+    if(thd_mode == THD_MODE_TICKLESS) {
+        /* The timer is one-shot here; thd_schedule() will re-arm it if and
+           when it is needed again. */
+        ++thd_tickless_irqs;
+        thd_wakeup_at = 0;
+        thd_schedule(0, now);
+        return;
+    }
+
     thd_schedule(0, now);
     timer_primary_wakeup(thd_sched_ms);
 }
@@ -973,20 +1275,98 @@ uint64_t thd_get_cpu_time(kthread_t *thd) {
     return thd->cpu_time.total;
 }
 
+int thd_get_stats(kthread_t *thd, kthread_stats_t *stats) {
+    if(!thd || !stats)
+        return -1;
+
+    irq_disable_scoped();
+    *stats = thd->stats;
+
+    return 0;
+}
+
+static void thd_reset_one(kthread_t *thd) {
+    uint64_t ready_since = thd->stats.ready_since;
+    uint64_t wait_since = thd->stats.wait_since;
+
+    memset(&thd->stats, 0, sizeof(thd->stats));
+    thd->stats.ready_since = ready_since;
+    thd->stats.wait_since = wait_since;
+}
+
+void thd_reset_stats(kthread_t *thd) {
+    kthread_t *cur;
+
+    irq_disable_scoped();
+
+    if(thd) {
+        thd_reset_one(thd);
+        return;
+    }
+
+    LIST_FOREACH(cur, &thd_list, t_list)
+        thd_reset_one(cur);
+}
+
 /*****************************************************************************/
 
 /* Change threading modes */
 int thd_set_mode(kthread_mode_t mode) {
-    dbglog(DBG_WARNING, "thd_set_mode() has no effect. Cooperative threading "
-           "mode is deprecated. Threading is always in preemptive mode.\n");
+    kthread_mode_t old = thd_mode;
+    uint64_t now;
+
+    if(mode != THD_MODE_PREEMPT && mode != THD_MODE_TICKLESS) {
+        dbglog(DBG_WARNING, "thd_set_mode(): Cooperative threading mode is "
+               "deprecated. Threading is always in preemptive mode.\n");
+        return -1;
+    }
 
-    return mode;
+    if(old == THD_MODE_NONE)
+        return -1;
+
+    if(mode == old)
+        return old;
+
+    irq_disable_scoped();
+    now = timer_ms_gettime64();
+    thd_mode = mode;
+
+    if(mode == THD_MODE_TICKLESS) {
+        thd_tickless_start = now;
+        thd_wakeup_at = 0;
+        thd_tickless_rearm(now);
+    }
+    else {
+        thd_tickless_ms += now - thd_tickless_start;
+        thd_wakeup_at = 0;
+        timer_primary_wakeup(thd_sched_ms);
+    }
+
+    return old;
 }
 
 kthread_mode_t thd_get_mode(void) {
     return thd_mode;
 }
 
+uint64_t thd_get_timer_irqs(void) {
+    return thd_timer_irqs;
+}
+
+uint64_t thd_get_timer_irqs_saved(void) {
+    uint64_t ms, ticks;
+
+    irq_disable_scoped();
+    ms = thd_tickless_ms;
+
+    if(thd_mode == THD_MODE_TICKLESS)
+        ms += timer_ms_gettime64() - thd_tickless_start;
+
+    ticks = ms / thd_sched_ms;
+
+    return ticks > thd_tickless_irqs ? ticks - thd_tickless_irqs : 0;
+}
+
 unsigned thd_get_hz(void) {
     return 1000 / thd_sched_ms;
 }
@@ -1065,6 +1445,7 @@ int thd_init(void) {
     };
 
     kthread_t *kern;
+    int i;
 
     /* Make sure we're not already running */
     if(thd_mode != THD_MODE_NONE)
@@ -1076,11 +1457,21 @@ int thd_init(void) {
     /* Initialize handle counters */
     tid_highest = 1;
 
+    /* Reset the scheduler interrupt counters */
+    thd_wakeup_at = 0;
+    thd_timer_irqs = 0;
+    thd_tickless_irqs = 0;
+    thd_tickless_ms = 0;
+
     /* Initialize the thread list */
     LIST_INIT(&thd_list);
 
-    /* Initialize the run queue */
-    TAILQ_INIT(&run_queue);
+    /* Initialize the run queues */
+    for(i = 0; i < RUNQ_LEVELS; i++)
+        TAILQ_INIT(&run_queue[i]);
+
+    memset(run_queue_map, 0, sizeof(run_queue_map));
+    memset(run_queue_summary, 0, sizeof(run_queue_summary));
 
     /* Start off with no "current" thread */
     thd_current = NULL;
@@ -1136,6 +1527,7 @@ void thd_shutdown(void) {
 
     /* Remove our pre-emption handler */
     timer_primary_set_callback(NULL);
+    timer_primary_cancel();
 
     /* Kill remaining live threads */
     LIST_FOREACH_SAFE(cur, &thd_list, t_list, tmp) {
@@ -138,6 +138,8 @@ struct filenode {
     unsigned int offset;
     unsigned int size;
     unsigned int pad;
+    unsigned char *zdata;
+    unsigned int zsize;
 };
 
 struct aligns {
@@ -151,6 +153,51 @@ struct excludes {
     char pattern[0];
 };
 
+/*
+ * Optional path index (-i), appended after the last file and counted in
+ * the image size.  Everything is big-endian, like the rest of romfs:
+ *
+ *   header   "-romidx-", slot count (a power of two), entry count
+ *   slots    { FNV-1a hash of the lower-cased path, header offset,
+ *              path offset in the string table } each, open addressed
+ *              with linear probing; an offset of 0 marks an empty slot
+ *   strings  full paths relative to the root, without a leading slash,
+ *              NUL-terminated, padded to 16 bytes
+ *   footer   "-romidx-", offset of the header, size of header + slots +
+ *              strings
+ *
+ * The footer is the last 16 bytes of the image, so a reader can find the
+ * index from the image size alone.  Only plain files and directories are
+ * indexed; hard links (including . and ..) are not.
+ */
+#define ROMIDX_MAGIC "-romidx-"
+
+#define ALIGNUP16(x) (((x)+15)&~15)
+
+struct idxent {
+    unsigned int hash;
+    unsigned int offset;
+    char *path;
+};
+
+/*
+ * Optional compression (-z / -Z).  A compressed regular file has a spec
+ * field of ROMFH_ZMAGIC | log2(block size), keeps its real size in the
+ * size field, and its data is a table of (blocks + 1) big-endian offsets,
+ * relative to the start of the data, to each block.  Blocks are LZ4 block
+ * format, each on its own, or stored as is if that isn't smaller.  Files
+ * that don't get smaller overall are left alone.
+ */
+#define ROMFH_ZMAGIC 0x4c5a3400
+
+static int zshift = 0;
+
+static struct idxent *idxents = NULL;
+static int idxcount = 0;
+static int idxalloc = 0;
+static char *idxbuf = NULL;
+static int idxsize = 0;
+
 void initlist(struct filehdr *fh, struct filenode *owner) {
     fh->head = (struct filenode *)&fh->tail;
     fh->tail = NULL;
@@ -182,6 +229,9 @@ void shownode(int level, struct filenode *node, FILE *f) {
     if(node->orig_link)
         fprintf(f, " [link to 0x%-6x]", node->orig_link->offset);
 
+    if(node->zdata)
+        fprintf(f, " [compressed to %u]", node->zsize);
+
     fprintf(f, "\n");
 
     p = node->dirlist.head;
@@ -377,6 +427,12 @@ int dumpnode(struct filenode *node, FILE *f) {
         dumpdataa(bigbuf, node->size, f);
     }
 #endif
+    else if(S_ISREG(node->modes) && node->zdata) {
+        ri.nextfh |= htonl(ROMFH_REG);
+        ri.spec = htonl(ROMFH_ZMAGIC | zshift);
+        dumpri(&ri, node, f);
+        dumpdataa(node->zdata, node->zsize, f);
+    }
     else if(S_ISREG(node->modes)) {
         int offset, len, fd, max, avail;
         ri.nextfh |= htonl(ROMFH_REG);
@@ -447,6 +503,280 @@ int dumpnode(struct filenode *node, FILE *f) {
     return 0;
 }
 
+void idxput(char *buf, unsigned int val) {
+    val = htonl(val);
+    memcpy(buf, &val, 4);
+}
+
+/* Compression */
+
+#define LZ_HASHBITS 12
+#define LZ_MINMATCH 4
+
+static unsigned int lzread32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned char *lzputlen(unsigned char *op, unsigned int len) {
+    while(len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = len;
+    return op;
+}
+
+static unsigned char *lzsequence(unsigned char *op, const unsigned char *lit,
+                                 unsigned int litlen, unsigned int off,
+                                 unsigned int mlen) {
+    unsigned char *token = op++;
+
+    *token = (litlen >= 15 ? 15 : litlen) << 4;
+
+    if(litlen >= 15)
+        op = lzputlen(op, litlen - 15);
+
+    memcpy(op, lit, litlen);
+    op += litlen;
+
+    if(mlen) {
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        mlen -= LZ_MINMATCH;
+        *token |= mlen >= 15 ? 15 : mlen;
+
+        if(mlen >= 15)
+            op = lzputlen(op, mlen - 15);
+    }
+
+    return op;
+}
+
+/* Compress one block in LZ4 block format.  dst must have room for
+ * len + len / 255 + 16 bytes.  Returns the compressed size. */
+int lzcompress(const unsigned char *src, int len, unsigned char *dst) {
+    int htab[1 << LZ_HASHBITS];
+    int i = 0, anchor = 0, ref, mlen, h;
+    int mflimit = len - 12, matchlimit = len - 5;
+    unsigned char *op = dst;
+
+    memset(htab, 0xff, sizeof(htab));
+
+    while(i < mflimit) {
+        h = (lzread32(src + i) * 2654435761u) >> (32 - LZ_HASHBITS);
+        ref = htab[h];
+        htab[h] = i;
+
+        if(ref < 0 || i - ref > 65535 ||
+           lzread32(src + ref) != lzread32(src + i)) {
+            i++;
+            continue;
+        }
+
+        /* Grow the match backwards over pending literals, then forwards */
+        while(i > anchor && ref > 0 && src[i - 1] == src[ref - 1]) {
+            i--;
+            ref--;
+        }
+
+        for(mlen = LZ_MINMATCH; i + mlen < matchlimit &&
+            src[i + mlen] == src[ref + mlen]; mlen++)
+            ;
+
+        op = lzsequence(op, src + anchor, i - anchor, i - ref, mlen);
+        i += mlen;
+        anchor = i;
+    }
+
+    op = lzsequence(op, src + anchor, len - anchor, 0, 0);
+
+    return op - dst;
+}
+
+/* Compress a regular file, if that makes it smaller. */
+void compressnode(struct filenode *node) {
+    int bsize = 1 << zshift, nblocks, i, n, fd, got, r;
+    unsigned char *raw, *out, *op;
+
+    if(!node->size)
+        return;
+
+    raw = malloc(node->size);
+    nblocks = (node->size + bsize - 1) / bsize;
+    out = malloc((nblocks + 1) * 4 + node->size + node->size / 255 +
+                 nblocks * 16);
+
+    if(!raw || !out) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    fd = open(node->realname, O_RDONLY
+#ifdef O_BINARY
+              | O_BINARY
+#endif
+             );
+
+    for(got = 0; fd >= 0 && got < node->size; got += r)
+        if((r = read(fd, raw + got, node->size - got)) <= 0)
+            break;
+
+    if(fd >= 0)
+        close(fd);
+
+    if(got != node->size) {
+        fprintf(stderr, "not compressing '%s' (read failed)\n",
+                node->realname);
+        free(raw);
+        free(out);
+        return;
+    }
+
+    op = out + (nblocks + 1) * 4;
+
+    for(i = 0; i < nblocks; i++) {
+        idxput((char *)out + i * 4, op - out);
+        n = node->size - i * bsize < bsize ? node->size - i * bsize : bsize;
+
+        r = lzcompress(raw + i * bsize, n, op);
+
+        if(r >= n) {
+            memcpy(op, raw + i * bsize, n);
+            r = n;
+        }
+
+        op += r;
+    }
+
+    idxput((char *)out + nblocks * 4, op - out);
+
+    if(op - out < node->size) {
+        node->zdata = out;
+        node->zsize = op - out;
+    }
+    else {
+        free(out);
+    }
+
+    free(raw);
+}
+
+/* Path index building */
+
+unsigned int idxhash(const char *path) {
+    unsigned int hash = 2166136261u;
+
+    while(*path) {
+        unsigned char c = *path++;
+
+        if(c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+
+        hash = (hash ^ c) * 16777619u;
+    }
+
+    return hash;
+}
+
+void idxcollect(struct filenode *dir, const char *prefix) {
+    struct filenode *p;
+    char *path;
+
+    for(p = dir->dirlist.head; p->next; p = p->next) {
+        if(p->orig_link || !strcmp(p->name, ".") || !strcmp(p->name, ".."))
+            continue;
+
+        if(!S_ISDIR(p->modes) && !S_ISREG(p->modes))
+            continue;
+
+        path = malloc(strlen(prefix) + strlen(p->name) + 2);
+
+        if(!path) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        if(*prefix)
+            sprintf(path, "%s/%s", prefix, p->name);
+        else
+            strcpy(path, p->name);
+
+        if(idxcount == idxalloc) {
+            idxalloc = idxalloc ? idxalloc * 2 : 64;
+            idxents = realloc(idxents, idxalloc * sizeof(*idxents));
+
+            if(!idxents) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+
+        idxents[idxcount].hash = idxhash(path);
+        idxents[idxcount].offset = p->offset;
+        idxents[idxcount].path = path;
+        idxcount++;
+
+        if(S_ISDIR(p->modes))
+            idxcollect(p, path);
+    }
+}
+
+/* Build the index for the tree, to be placed at lastoff.  Returns the new
+ * size of the image. */
+int buildindex(struct filenode *root, int lastoff) {
+    int slots, strsize, tblsize, i, j, pos;
+    char *slot;
+
+    idxcollect(root, "");
+
+    for(slots = 16; slots < idxcount * 2; slots <<= 1)
+        ;
+
+    strsize = 0;
+
+    for(i = 0; i < idxcount; i++)
+        strsize += strlen(idxents[i].path) + 1;
+
+    tblsize = ALIGNUP16(16 + slots * 12);
+    idxsize = tblsize + ALIGNUP16(strsize) + 16;
+    idxbuf = calloc(1, idxsize);
+
+    if(!idxbuf) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    memcpy(idxbuf, ROMIDX_MAGIC, 8);
+    idxput(idxbuf + 8, slots);
+    idxput(idxbuf + 12, idxcount);
+
+    pos = tblsize;
+
+    for(i = 0; i < idxcount; i++) {
+        /* No object lives at offset 0, so that marks a free slot */
+        j = idxents[i].hash & (slots - 1);
+        slot = idxbuf + 16 + j * 12;
+
+        while(memcmp(slot + 4, "\0\0\0\0", 4)) {
+            j = (j + 1) & (slots - 1);
+            slot = idxbuf + 16 + j * 12;
+        }
+
+        idxput(slot, idxents[i].hash);
+        idxput(slot + 4, idxents[i].offset);
+        idxput(slot + 8, pos - tblsize);
+        strcpy(idxbuf + pos, idxents[i].path);
+        pos += strlen(idxents[i].path) + 1;
+    }
+
+    memcpy(idxbuf + idxsize - 16, ROMIDX_MAGIC, 8);
+    idxput(idxbuf + idxsize - 8, lastoff);
+    idxput(idxbuf + idxsize - 4, idxsize - 16);
+
+    return lastoff + idxsize;
+}
+
 int dumpall(struct filenode *node, int lastoff, FILE *f) {
     struct romfh ri;
     struct filenode *p;
@@ -465,6 +795,9 @@ int dumpall(struct filenode *node, int lastoff, FILE *f) {
         p = p->next;
     }
 
+    if(idxbuf)
+        dumpdata(idxbuf, idxsize, f);
+
     /* Align the whole bunch to ROMBSIZE boundary */
     if(lastoff & 1023)
         dumpzero(1024 - (lastoff & 1023), f);
@@ -542,6 +875,8 @@ struct filenode *newnode(const char *base, const char *name, int curroffset) {
     node->orig_link = NULL;
     node->offset = curroffset;
     node->pad = 0;
+    node->zdata = NULL;
+    node->zsize = 0;
 
     return node;
 }
@@ -571,10 +906,9 @@ struct filenode *findnode(struct filenode *node, dev_t dev, ino_t ino) {
     return NULL;
 }
 
-#define ALIGNUP16(x) (((x)+15)&~15)
-
 int spaceneeded(struct filenode *node) {
-    return 16 + ALIGNUP16(strlen(node->name) + 1) + ALIGNUP16(node->size);
+    return 16 + ALIGNUP16(strlen(node->name) + 1) +
+           ALIGNUP16(node->zdata ? node->zsize : node->size);
 }
 
 int alignnode(struct filenode *node, int curroffset, int extraspace) {
@@ -744,6 +1078,9 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
         if(S_ISREG(sb->st_mode)) {
             curroffset = alignnode(n, curroffset, spaceneeded(n));
             n->size = sb->st_size;
+
+            if(zshift)
+                compressnode(n);
         }
         else
             curroffset = alignnode(n, curroffset, 0);
@@ -791,6 +1128,9 @@ void showhelp(const char *argv0) {
     printf("  -a ALIGN               Align regular file data to ALIGN bytes\n");
     printf("  -A ALIGN,PATTERN       Align all objects matching pattern to at least ALIGN bytes\n");
     printf("  -x PATTERN             Exclude all objects matching pattern\n");
+    printf("  -i                     Add a path index for faster lookups\n");
+    printf("  -z                     Compress regular files in 8K blocks\n");
+    printf("  -Z BLOCKSIZE           Compress regular files in BLOCKSIZE blocks\n");
     printf("  -h                     Show this help\n");
     printf("\n");
     printf("Report bugs to chexum@shadow.banki.hu\n");
@@ -802,6 +1142,7 @@ int main(int argc, char *argv[]) {
     char *outf = NULL;
     char *volname = NULL;
     int verbose = 0;
+    int makeindex = 0;
     char buf[256];
     struct filenode *root;
     struct stat sb;
@@ -812,7 +1153,7 @@ int main(int argc, char *argv[]) {
     struct excludes *pe, *pe2;
     FILE *f;
 
-    while((c = getopt(argc, argv, "V:vd:f:ha:A:x:")) != EOF) {
+    while((c = getopt(argc, argv, "V:vd:f:ha:A:x:izZ:")) != EOF) {
         switch(c) {
             case 'd':
                 dir = optarg;
@@ -825,6 +1166,24 @@ int main(int argc, char *argv[]) {
                 break;
             case 'v':
                 verbose = 1;
+                break;
+            case 'i':
+                makeindex = 1;
+                break;
+            case 'z':
+                zshift = 13;
+                break;
+            case 'Z':
+                i = strtoul(optarg, NULL, 0);
+
+                if(i < 1024 || i > 65536 || (i & (i - 1))) {
+                    fprintf(stderr, "Block size has to be a power of two from 1024 to 65536\n");
+                    exit(1);
+                }
+
+                for(zshift = 0; (1 << zshift) < i; zshift++)
+                    ;
+
                 break;
             case 'h':
                 showhelp(argv[0]);
@@ -918,9 +1277,17 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    if(verbose)
+    if(makeindex)
+        lastoff = buildindex(root, lastoff);
+
+    if(verbose) {
         shownode(0, root, stderr);
 
+        if(makeindex)
+            fprintf(stderr, "index: %d entries, %d bytes\n", idxcount,
+                    idxsize);
+    }
+
     if(dumpall(root, lastoff, f)) {
         fprintf(stderr, "Error while dumping!\n");
         return 1;
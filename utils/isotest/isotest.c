@@ -4,7 +4,9 @@
    (c)2000 Megan Potter
 
    Test ISO filesystem reader. This is a functional duplicate of fs_iso9660, but
-   designed to run on a PC for testing.
+   designed to run on a PC for testing. It reads from a disc image (or a real
+   drive) and counts the commands that would be sent to the drive, which is
+   what the block cache and read-ahead are there to cut down on.
 
 */
 
@@ -20,7 +22,10 @@ In Linux, accessing the /dev device on a single-session CD puts the
 /****************************** LINUX SPECIFIC CODE ***********************************/
 
 #include <stdio.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <sys/queue.h>
+#include <sys/types.h>
 
 typedef unsigned char uint8;
 typedef unsigned short uint16;
@@ -29,6 +34,12 @@ typedef signed char int8;
 typedef signed short int16;
 typedef signed long int32;
 
+/* Disc image or device to read from */
+static const char *cdrom_image = "/dev/scd0";
+
+/* Drive usage counters */
+static uint32 cdrom_cmds, cdrom_sectors;
+
 /* Low-level sector read (for Linux to emulate hardware/cd.c) */
 static int cdrom_read_sectors(void *buffer, uint32 sector, uint32 cnt) {
     FILE *f;
@@ -36,14 +47,17 @@ static int cdrom_read_sectors(void *buffer, uint32 sector, uint32 cnt) {
     /* Subtract out DC's LBA offset */
     sector -= 150;
 
-    f = fopen("/dev/scd0", "r");
+    f = fopen(cdrom_image, "r");
 
     if(!f) return -1;
 
+    cdrom_cmds++;
+    cdrom_sectors += cnt;
+
     fseek(f, sector * 2048, SEEK_SET);
     if(fread(buffer, cnt * 2048, 1, f) != 1) {
         fclose(f);
-        return 1;
+        return -1;
     }
 
     fclose(f);
@@ -153,99 +167,152 @@ static uint32 iso_733(uint8 *from) {
 
 
 /********************************************************************************/
-/* Low-level block caching routines. This implements a simple queue-based
-   LRU/MRU caching system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
-
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
-    int32   sector;         /* CD sector */
-    uint8   data[2048];     /* Sector data */
+/* Low-level block caching routines. The cache is a fixed pool of blocks,
+   indexed by a hash of the sector number and kept on an LRU list. Whenever
+   a block is requested, it will be moved to the MRU end of the list. As more
+   blocks are loaded than can fit in the cache, blocks are recycled from the
+   LRU end. */
+
+/* Holds the data for one cache block. */
+typedef struct cache_block {
+    int32   sector;                     /* CD sector */
+    struct cache_block *hnext;          /* Next block in the hash chain */
+    TAILQ_ENTRY(cache_block) lru;       /* LRU list handle */
+    uint8   data[2048];                 /* Sector data */
 } cache_block_t;
 
-/* List of cache blocks (ordered least recently used to most recently) */
-#define NUM_CACHE_BLOCKS 8
-static cache_block_t *cache[NUM_CACHE_BLOCKS];
+#define NUM_CACHE_BLOCKS 16
+static cache_block_t *cache;
+static cache_block_t **cache_hash;
+static int cache_count = NUM_CACHE_BLOCKS;
+static uint32 cache_hmask;
+static TAILQ_HEAD(, cache_block) cache_lru;
+static uint32 cache_hits, cache_misses;
+
+/* Read-ahead window, in sectors, and its staging buffer */
+static int readahead = 8;
+static uint8 *ra_buf;
 
 /* Cache modification mutex */
 static thd_mutex_t cache_mutex;
 
+static void bunhash(cache_block_t *blk) {
+    cache_block_t **p;
+
+    if(blk->sector == -1)
+        return;
+
+    for(p = &cache_hash[blk->sector & cache_hmask]; *p; p = &(*p)->hnext) {
+        if(*p == blk) {
+            *p = blk->hnext;
+            break;
+        }
+    }
+
+    blk->sector = -1;
+}
+
 /* Clears all cache blocks */
 static void bclear() {
     int i;
 
     thd_mutex_lock(&cache_mutex);
 
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = -1;
+    for(i = 0; i <= (int)cache_hmask; i++)
+        cache_hash[i] = NULL;
+
+    for(i = 0; i < cache_count; i++)
+        cache[i].sector = -1;
+
+    cache_hits = cache_misses = 0;
 
     thd_mutex_unlock(&cache_mutex);
 }
 
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad(int block) {
-    int     i;
-    cache_block_t   *tmp;
+/* Look up a sector; on a hit, the block graduates to the MRU end. */
+static cache_block_t *bfind(int32 sector) {
+    cache_block_t *blk;
+
+    for(blk = cache_hash[sector & cache_hmask]; blk; blk = blk->hnext) {
+        if(blk->sector == sector) {
+            TAILQ_REMOVE(&cache_lru, blk, lru);
+            TAILQ_INSERT_TAIL(&cache_lru, blk, lru);
+            return blk;
+        }
+    }
+
+    return NULL;
+}
 
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
+/* Kick the LRU block out of the cache, and give it to the given sector. */
+static cache_block_t *bnew(int32 sector) {
+    cache_block_t *blk = TAILQ_FIRST(&cache_lru);
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+    bunhash(blk);
 
-    for(i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
+    blk->sector = sector;
+    blk->hnext = cache_hash[sector & cache_hmask];
+    cache_hash[sector & cache_hmask] = blk;
 
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
+    TAILQ_REMOVE(&cache_lru, blk, lru);
+    TAILQ_INSERT_TAIL(&cache_lru, blk, lru);
+
+    return blk;
 }
 
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
-static int bread(int32 sector) {
-    int i, rv = -1;
+/* Pulls the requested sector into a cache block and returns the block. Note
+   that the sector in question may already be in the cache, in which case it
+   just returns the containing block. If ra is more than one, that many
+   sectors are read in one go. */
+static cache_block_t *bread_ra(int32 sector, int ra) {
+    cache_block_t *blk = NULL;
+    int i;
 
     thd_mutex_lock(&cache_mutex);
 
     /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad(i);
-            rv = NUM_CACHE_BLOCKS - 1;
-            goto bread_exit;
-        }
+    if((blk = bfind(sector))) {
+        cache_hits++;
+        goto bread_exit;
     }
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == -1) break;
-    }
+    cache_misses++;
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
-    }
+    if(ra > readahead)
+        ra = readahead;
+
+    /* Single sector, straight into the cache */
+    if(ra <= 1) {
+        blk = bnew(sector);
+
+        if(cdrom_read_sectors(blk->data, sector + 150, 1) < 0) {
+            bunhash(blk);
+            blk = NULL;
+        }
 
-    /* Load the requested block */
-    if(cdrom_read_sectors(cache[i]->data, sector + 150, 1) < 0) {
-        rv = -1;
         goto bread_exit;
     }
 
-    cache[i]->sector = sector;
+    /* Read the whole window at once, then spread it around. */
+    if(cdrom_read_sectors(ra_buf, sector + 150, ra) < 0)
+        goto bread_exit;
+
+    /* Go backwards, so the one we want ends up most recently used. */
+    for(i = ra; i-- > 0;) {
+        if(!(blk = bfind(sector + i)))
+            blk = bnew(sector + i);
 
-    /* Move it to the most-recently-used position */
-    bgrad(i);
-    rv = NUM_CACHE_BLOCKS - 1;
+        memcpy(blk->data, ra_buf + i * 2048, 2048);
+    }
 
-    /* Return the new cache block index */
+    /* Return the new cache block */
 bread_exit:
     thd_mutex_unlock(&cache_mutex);
-    return rv;
+    return blk;
+}
+
+static cache_block_t *bread(int32 sector) {
+    return bread_ra(sector, 1);
 }
 
 
@@ -266,6 +333,7 @@ static iso_dirent_t root_dirent;
    a new CD has been inserted. */
 static int init_percd() {
     int     i;
+    cache_block_t *blk;
     CDROM_TOC   toc;
 
     /* Start off with no cached blocks */
@@ -282,17 +350,17 @@ static int init_percd() {
         return -1;
 
     /* Grab and check the volume descriptor */
-    i = bread(session_base + 16 - 150);
+    blk = bread(session_base + 16 - 150);
 
-    if(i < 0) return i;
+    if(!blk) return -1;
 
-    if(memcmp((char*)cache[i]->data, "\01CD001", 6)) {
+    if(memcmp((char*)blk->data, "\01CD001", 6)) {
         printf("fs_iso9660: disc is not iso9660\r\n");
         return -1;
     }
 
     /* Locate the root directory */
-    memcpy(&root_dirent, cache[i]->data + 156, sizeof(iso_dirent_t));
+    memcpy(&root_dirent, blk->data + 156, sizeof(iso_dirent_t));
     root_extent = iso_733(root_dirent.extent);
     root_size = iso_733(root_dirent.size);
 
@@ -331,13 +399,13 @@ static iso_dirent_t *find_object(const char *fn, int dir,
     iso_dirent_t * de;
 
     while(dir_size > 0) {
-        int c = bread(dir_extent);
+        cache_block_t *c = bread(dir_extent);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
         for(i = 0; i < 2048 && i < dir_size;) {
             /* Locate the current dirent */
-            de = (iso_dirent_t *)(cache[c]->data + i);
+            de = (iso_dirent_t *)(c->data + i);
 
             if(!de->length) break;
 
@@ -410,6 +478,7 @@ static struct {
     int32      ptr;        /* Current read position in bytes */
     int32      size;       /* Length of file in bytes */
     dirent_t    dirent;     /* A static dirent to pass back to clients */
+    int32      next_sector;    /* Sector a sequential reader wants next */
 } fh[MAX_ISO_FILES];
 
 /* Mutex for file handles */
@@ -453,6 +522,7 @@ static int32 iso_open(const char *fn, int mode) {
     fh[fd].dir = (mode & O_DIR) ? 1 : 0;
     fh[fd].ptr = 0;
     fh[fd].size = iso_733(de->size);
+    fh[fd].next_sector = fh[fd].first_extent;
 
     return fd;
 }
@@ -468,8 +538,10 @@ static void iso_close(uint32 fd) {
 
 /* Read from a file */
 static ssize_t iso_read(uint32 fd, char *buf, size_t bytes) {
-    int rv = 0, c;
+    int rv = 0, ra;
+    int32 sector;
     size_t toread, thissect;
+    cache_block_t *c;
 
     /* Check that the fd is valid */
     if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0)
@@ -485,14 +557,40 @@ static ssize_t iso_read(uint32 fd, char *buf, size_t bytes) {
 
         /* How much more can we read in the current sector? */
         thissect = 2048 - (fh[fd].ptr % 2048);
-        toread = (toread > thissect) ? thissect : toread;
+        sector = fh[fd].first_extent + fh[fd].ptr / 2048;
 
-        /* Do the read */
-        c = bread(fh[fd].first_extent + fh[fd].ptr / 2048);
+        /* Whole sectors into an aligned buffer skip the cache, as long as
+           there's at least a read-ahead window's worth of them */
+        if(thissect == 2048 && toread >= 2048 * (readahead > 1 ? readahead : 2)
+           && !((uintptr_t)buf & 31)) {
+            thissect = toread / 2048;
+            toread = thissect * 2048;
+
+            if(cdrom_read_sectors(buf, sector + 150, thissect) < 0)
+                return -1;
+
+            fh[fd].next_sector = sector + thissect;
+        }
+        else {
+            toread = (toread > thissect) ? thissect : toread;
+
+            /* Sequential readers get a whole read-ahead window */
+            ra = 1;
+
+            if(sector == fh[fd].next_sector)
+                ra = (fh[fd].size + 2047) / 2048 -
+                     (sector - fh[fd].first_extent);
 
-        if(c < 0) return -1;
+            /* Do the read */
+            c = bread_ra(sector, ra);
 
-        memcpy(buf, cache[c]->data + (fh[fd].ptr % 2048), toread);
+            if(!c) return -1;
+
+            memcpy(buf, c->data + (fh[fd].ptr % 2048), toread);
+
+            if(sector == fh[fd].next_sector || sector + 1 == fh[fd].next_sector)
+                fh[fd].next_sector = sector + (toread == thissect);
+        }
 
         /* Adjust pointers */
         buf += toread;
@@ -557,7 +655,7 @@ static void fn_postprocess(char *fn) {
 
 /* Read a directory entry */
 static dirent_t *iso_readdir(uint32 fd) {
-    int     c;
+    cache_block_t *c = NULL;
     iso_dirent_t    *de;
 
     if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0 || !fh[fd].dir)
@@ -569,9 +667,9 @@ static dirent_t *iso_readdir(uint32 fd) {
         /* Get the current dirent block */
         c = bread(fh[fd].first_extent + fh[fd].ptr / 2048);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
 
         if(de->length) break;
 
@@ -584,9 +682,9 @@ static dirent_t *iso_readdir(uint32 fd) {
     /* If we're at the first, skip the two blank entries */
     if(!de->name[0]) {
         fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
         fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(cache[c]->data + (fh[fd].ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fh[fd].ptr % 2048));
 
         if(!de->length) return NULL;
     }
@@ -635,10 +733,28 @@ static int fs_iso9660_init() {
     thd_mutex_reset(&cache_mutex);
     thd_mutex_reset(&fh_mutex);
 
-    /* Allocate cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        cache[i] = malloc(sizeof(cache_block_t));
-        cache[i]->sector = -1;
+    /* Allocate cache block space; keep the hash chains short */
+    cache_hmask = 1;
+
+    while((int)cache_hmask < cache_count)
+        cache_hmask <<= 1;
+
+    cache = malloc(cache_count * sizeof(cache_block_t));
+    cache_hash = calloc(cache_hmask, sizeof(cache_block_t *));
+    cache_hmask--;
+
+    /* Don't let one read-ahead flush the whole cache */
+    if(readahead > cache_count / 2)
+        readahead = cache_count / 2;
+
+    ra_buf = malloc((readahead > 0 ? readahead : 1) * 2048);
+
+    TAILQ_INIT(&cache_lru);
+
+    for(i = 0; i < cache_count; i++) {
+        cache[i].sector = -1;
+        cache[i].hnext = NULL;
+        TAILQ_INSERT_TAIL(&cache_lru, &cache[i], lru);
     }
 
     /* Register with VFS */
@@ -647,11 +763,10 @@ static int fs_iso9660_init() {
 
 /* De-init the file system */
 static int fs_iso9660_shutdown() {
-    int i;
-
     /* Dealloc cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        free(cache[i]);
+    free(cache);
+    free(cache_hash);
+    free(ra_buf);
 
     return fs_handler_remove(&vh);
 }
@@ -669,12 +784,12 @@ static void read_dir(uint32 extent, uint32 size) {
     char        fn[32];
 
     while(size > 0) {
-        int c = bread(extent);
+        cache_block_t *c = bread(extent);
 
-        if(c < 0) return;
+        if(!c) return;
 
         for(i = 0; i < 2048 && i < size;) {
-            de = (iso_dirent_t*)(cache[c]->data + i);
+            de = (iso_dirent_t*)(c->data + i);
 
             if(!de->length) break;
 
@@ -696,64 +811,107 @@ static void read_dir(uint32 extent, uint32 size) {
 #endif
 
 
-int main() {
-    fs_iso9660_init();
+/* Read a whole file in chunks of the given size, from a buffer at the given
+   offset from 32-byte alignment, and report what it cost. */
+static int read_test(const char *fn, size_t chunk, int misalign) {
+    static uint8 buf[65536 + 64] __attribute__((aligned(32)));
+    uint32 fd, total = 0, hash = 2166136261u;
+    ssize_t r, i;
 
-    /*
-    {
-    uint32  fd, size, t;
-    char    buf[667];
+    cdrom_cmds = cdrom_sectors = 0;
 
-    printf("Opening file /escape.txt\n");
-    fd = iso_open("/escape.txt", O_RDONLY);
-    if (fd == 0) {
-        printf("Couldn't open file\n");
-        return 1;
+    fd = iso_open(fn, O_RDONLY);
+
+    if(fd == 0) {
+        printf("Couldn't open %s\n", fn);
+        return -1;
     }
-    size = iso_total(fd);
-    printf("fd is %d, size is %08lx\n", fd, size);
-
-    while (size > 0) {
-        int r;
-        r = iso_read(fd, buf, 666);
-        if (r < 0) {
-            printf("Read error\n");
-            return 1;
-        }
-        buf[r] = 0;
-        printf("%s", buf);
-        if (strstr(buf, "Let the party")) {
-            t = 0;
-        }
-        size -= r;
+
+    /* Don't count the directory lookups */
+    cdrom_cmds = cdrom_sectors = 0;
+    cache_hits = cache_misses = 0;
+
+    while((r = iso_read(fd, (char *)buf + misalign, chunk)) > 0) {
+        total += r;
+
+        /* FNV-1a, so the different ways of reading can be compared */
+        for(i = 0; i < r; i++)
+            hash = (hash ^ buf[misalign + i]) * 16777619u;
     }
-    printf("\nFile read is done\n");
-    iso_close(fd); */
 
-    {
-        uint32      fd;
-        dirent_t    *de;
+    iso_close(fd);
 
-        printf("Opening /demos");
-        fd = iso_open("/music/mc2/entries/rookie", O_RDONLY | O_DIR);
+    if(r < 0) {
+        printf("Read error\n");
+        return -1;
+    }
 
-        if(fd == 0) {
-            printf("Couldn't open file\n");
-            return 1;
-        }
+    printf("%6u %s  %8lu bytes  %08lx  %6lu cmds  %6lu sectors  "
+           "%6lu hits  %6lu misses\n", (unsigned)chunk,
+           misalign ? "unaligned" : "aligned  ", (unsigned long)total,
+           (unsigned long)(hash & 0xffffffff),
+           (unsigned long)cdrom_cmds, (unsigned long)cdrom_sectors,
+           (unsigned long)cache_hits, (unsigned long)cache_misses);
 
-        printf("Scanning dir:\n");
+    return 0;
+}
 
-        while((de = iso_readdir(fd))) {
-            printf("%s\t%d\n", de->name, de->size);
+static void usage(void) {
+    printf("usage: isotest [-b blocks] [-r readahead] image [path]\n");
+}
 
-            if(!strcmp(de->name, "R_WAR.ZIP")) {
-                /* what's this test for? */
-            }
-        }
+int main(int argc, char *argv[]) {
+    const char *path = "/";
+    static const size_t chunks[] = { 512, 2048, 32768 };
+    uint32 fd;
+    dirent_t *de;
+    int i;
+
+    while(argc > 2 && argv[1][0] == '-') {
+        if(!strcmp(argv[1], "-b"))
+            cache_count = atoi(argv[2]);
+        else if(!strcmp(argv[1], "-r"))
+            readahead = atoi(argv[2]);
+        else
+            break;
+
+        argc -= 2;
+        argv += 2;
+    }
+
+    if(argc < 2 || argv[1][0] == '-' || cache_count < 2) {
+        usage();
+        return 1;
+    }
+
+    cdrom_image = argv[1];
+
+    if(argc > 2)
+        path = argv[2];
+
+    fs_iso9660_init();
+
+    printf("cache: %d blocks, read-ahead: %d sectors\n", cache_count,
+           readahead);
+
+    /* Directories get listed, files get read a few different ways */
+    fd = iso_open(path, O_RDONLY | O_DIR);
+
+    if(fd != 0) {
+        printf("Scanning %s:\n", path);
+
+        while((de = iso_readdir(fd)))
+            printf("%s\t%d\n", de->name, de->size);
 
         iso_close(fd);
     }
+    else {
+        for(i = 0; i < (int)(sizeof(chunks) / sizeof(chunks[0])); i++) {
+            if(read_test(path, chunks[i], 4) < 0 ||
+               read_test(path, chunks[i], 0) < 0)
+                return 1;
+        }
+    }
 
     fs_iso9660_shutdown();
 
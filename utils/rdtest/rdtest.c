@@ -6,57 +6,53 @@
    Test romdisk filesystem reader. This is a functional duplicate of fs_romdisk, but
    designed to run on a PC for testing.
 
+   Given an image and the directory it was made from, every file in the
+   directory is read back through the romdisk code in uneven pieces, with
+   seeks and with mmap, and checked against the original. This covers images
+   made with genromfs -z, whose files are read through the block cache.
+
 */
 
 /****************************** LINUX SPECIFIC CODE ***********************************/
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 
-typedef unsigned char uint8;
-typedef unsigned short uint16;
-typedef unsigned long uint32;
-typedef signed char int8;
-typedef signed short int16;
-typedef signed long int32;
+typedef uint8_t uint8;
+typedef uint32_t uint32;
+typedef int file_t;
 
 /* KOS VFS prims */
 #define O_RDONLY 0
 #define O_MODE_MASK 0xfff
 #define O_DIR 0x1000
-#define MAX_FN_LEN 256
-typedef struct {
-    int     size;
-    char    name[MAX_FN_LEN];
-    uint32  time;
-    uint32  attr;
-} dirent_t;
-
-typedef void *vfs_handler[];
-static int fs_handler_add(char *fn, void *p) {
-    return 0;
-}
-static int fs_handler_remove(void *p) {
-    return 0;
-}
 
 /* Thread prims */
-typedef int thd_mutex_t;
-static void thd_mutex_reset(int *p) { }
-static void thd_mutex_lock(int *p) { }
-static void thd_mutex_unlock(int *p) { }
+typedef int mutex_t;
+#define mutex_lock_scoped(m) ((void)(m))
+
+#define dbglog(lvl, ...) fprintf(stderr, __VA_ARGS__)
+#define DBG_ERROR 0
 
 /* romdisk defines */
-#define MAX_RD_FILES 8
+#define FS_ROMDISK_MAX_FILES 8
+#define FS_ROMDISK_ZCACHE_BLOCKS 4
+
+/* Cache statistics, only kept here */
+static unsigned long zhits, zmisses;
 
 /****************************** END LINUX SPECIFIC CODE ***********************************/
 
 /* Cut here to insert into KallistiOS fs_romdisk.c */
 
-
-/* #include <kallisti/stdtypes.h> */
-#include <stdlib.h>
-#include <string.h>
-
 /* Header definitions from Linux ROMFS documentation; all integer quantities are
    expressed in big-endian notation. Unfortunately the ROMFS guys were being
    clever and made this header a variable length depending on the size of
@@ -82,156 +78,254 @@ typedef struct {
 /* Util function to reverse the byte order of a uint32 */
 static uint32 ntohl_32(const void *data) {
     const uint8 *d = (const uint8*)data;
-    return (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3] << 0);
+    return ((uint32)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3] << 0);
 }
 
-/* Pointer to the ROMFS image created by the host PC */
-static uint8 *romdisk_image = NULL;
-
-/* Some convenience pointers */
-static romdisk_hdr_t *romdisk_hdr = NULL;
-static uint32 romdisk_files = 0;
+/* A single mounted romdisk image */
+typedef struct rd_image {
+    const uint8     * image;    /* The actual image */
+    const romdisk_hdr_t * hdr;      /* Pointer to the header */
+    uint32          files;      /* Offset in the image to the files area */
+} rd_image_t;
 
 /********************************************************************************/
 /* File primitives */
 
-/* File handles.. I could probably do this with a linked list, but I'm just
-   too lazy right now. =) */
 static struct {
     uint32      index;      /* romfs image index */
     int     dir;        /* >0 if a directory */
     uint32      ptr;        /* Current read position in bytes */
     uint32      size;       /* Length of file in bytes */
-    /* dirent_t dirent; */  /* A static dirent to pass back to clients */
-} fh[MAX_RD_FILES];
+    rd_image_t  * mnt;      /* Which mount instance are we using? */
+    uint32      zshift;     /* log2 of the block size if compressed, or 0 */
+    uint8       * map;      /* Decompressed copy for mmap, if any */
+} fh[FS_ROMDISK_MAX_FILES];
 
-/* Mutex for file handles */
-static thd_mutex_t fh_mutex;
-
-/* Given a filename and a starting romdisk directory listing (byte offset),
-   search for the entry in the directory and return the byte offset to its
-   entry. */
-static uint32 romdisk_find_object(const char *fn, int fnlen, int dir, uint32 offset) {
-    uint32      i, ni, type;
-    romdisk_file_t  *fhdr;
+/* File type */
+#define ROMFH_DIR   1
+#define ROMFH_REG   2
 
-    i = offset;
+#define ROMFH_MASK  3
 
-    do {
-        /* Locate the entry, next pointer, and type info */
-        fhdr = (romdisk_file_t *)(romdisk_image + i);
-        ni = ntohl_32(&fhdr->next_header);
-        type = ni & 0x0f;
-        ni = ni & 0xfffffff0;
+/* Compressed files, see fs_romdisk.c */
+#define ROMFH_ZMAGIC    0x4c5a3400
+#define ROMFH_ZSHIFT    0x1f
 
-        /* Check the type */
-        if(!dir) {
-            if((type & 3) != 2) {
-                i = ni;
-
-                if(!i)
-                    break;
-                else
-                    continue;
-            }
+/* Cache of recently decompressed blocks, shared by all files */
+typedef struct {
+    const uint8 * src;      /* Compressed block held, or NULL if unused */
+    uint8       * data;     /* Decompressed data */
+    uint32      size;       /* Bytes of data */
+    uint32      alloc;      /* Size of the data buffer */
+    uint32      used;       /* Last use, for LRU replacement */
+} rd_zblock_t;
+
+static rd_zblock_t zcache[FS_ROMDISK_ZCACHE_BLOCKS];
+static uint32 zstamp;
+static mutex_t zcache_mutex;
+
+/* Decode one LZ4 block into dst, which must have room for exactly dlen
+   bytes. Returns 0 on success, or -1 if the data is corrupt. */
+static int romdisk_lz4_decode(const uint8 *src, uint32 slen, uint8 *dst,
+                              uint32 dlen) {
+    const uint8 *send = src + slen, *match;
+    uint8 *d = dst, *dend = dst + dlen;
+    uint32 len, off, b;
+    uint8 token;
+
+    while(src < send) {
+        token = *src++;
+
+        /* Literals */
+        if((len = token >> 4) == 15) {
+            do {
+                if(src >= send)
+                    return -1;
+
+                b = *src++;
+                len += b;
+            } while(b == 255);
         }
-        else {
-            if((type & 3) != 1) {
-                i = ni;
 
-                if(!i)
-                    break;
-                else
-                    continue;
-            }
-        }
+        if(len > (uint32)(send - src) || len > (uint32)(dend - d))
+            return -1;
 
-        /* Check filename */
-        if(!strncmp(fhdr->filename, fn, fnlen)) {
-            /* Match: return this index */
-            return i;
+        memcpy(d, src, len);
+        d += len;
+        src += len;
+
+        /* The last sequence is only literals */
+        if(src == send)
+            break;
+
+        /* Match */
+        if(send - src < 2)
+            return -1;
+
+        off = src[0] | (src[1] << 8);
+        src += 2;
+
+        if(!off || off > (uint32)(d - dst))
+            return -1;
+
+        if((len = (token & 15) + 4) == 19) {
+            do {
+                if(src >= send)
+                    return -1;
+
+                b = *src++;
+                len += b;
+            } while(b == 255);
         }
 
-        i = ni;
+        if(len > (uint32)(dend - d))
+            return -1;
+
+        /* Matches may overlap what they write, so copy bytewise */
+        for(match = d - off; len; len--)
+            *d++ = *match++;
     }
-    while(i != 0);
 
-    /* Didn't find it */
-    return 0;
+    return d == dend ? 0 : -1;
 }
 
-/* Locate an object anywhere in the image, starting at the root, and
-   expecting a fully qualified path name. This is analogous to the
-   find_object_path in iso9660.
-
-   fn:      object filename (absolute path)
-   dir:     0 if looking for a file, 1 if looking for a dir
+/* Decompress block blk of a compressed file into dst. */
+static int romdisk_zdecode(file_t fd, uint32 blk, uint8 *dst, uint32 size) {
+    const uint8 *base = fh[fd].mnt->image + fh[fd].index;
+    uint32 start = ntohl_32(base + blk * 4);
+    uint32 end = ntohl_32(base + blk * 4 + 4);
 
-   It will return an offset in the romdisk image for the object. */
-static uint32 romdisk_find(const char *fn, int dir) {
-    const char  *cur;
-    uint32      i;
-    romdisk_file_t  *fhdr;
+    if(end - start == size) {
+        memcpy(dst, base + start, size);
+        return 0;
+    }
 
-    /* If the object is in a sub-tree, traverse the trees looking
-       for the right directory. */
-    i = romdisk_files;
+    return romdisk_lz4_decode(base + start, end - start, dst, size);
+}
 
-    while((cur = strchr(fn, '/'))) {
-        if(cur != fn) {
-            i = romdisk_find_object(fn, cur - fn, 1, i);
+/* Size of block blk of a compressed file. */
+static uint32 romdisk_zsize(file_t fd, uint32 blk) {
+    uint32 pos = blk << fh[fd].zshift;
 
-            if(i == 0) return 0;
+    return (fh[fd].size - pos) < (1UL << fh[fd].zshift) ?
+           fh[fd].size - pos : (1UL << fh[fd].zshift);
+}
 
-            fhdr = (romdisk_file_t *)(romdisk_image + i);
-            i = ntohl_32(&fhdr->spec_info);
+/* Find block blk of a compressed file in the cache, decompressing it into
+   the least recently used slot if it isn't there. */
+static rd_zblock_t *romdisk_zblock(file_t fd, uint32 blk) {
+    const uint8 *src = fh[fd].mnt->image + fh[fd].index + blk * 4;
+    rd_zblock_t *z, *victim = zcache;
+    uint32 size = romdisk_zsize(fd, blk);
+    uint8 *data;
+    int i;
+
+    for(i = 0; i < FS_ROMDISK_ZCACHE_BLOCKS; i++) {
+        z = &zcache[i];
+
+        if(z->src == src) {
+            z->used = ++zstamp;
+            zhits++;
+            return z;
         }
 
-        fn = cur + 1;
+        if(z->used < victim->used)
+            victim = z;
     }
 
-    /* Locate the file in the resulting directory */
-    if(*fn) {
-        i = romdisk_find_object(fn, strlen(fn), dir, i);
-        return i;
+    zmisses++;
+
+    if(victim->alloc < size) {
+        if(!(data = realloc(victim->data, size)))
+            return NULL;
+
+        victim->data = data;
+        victim->alloc = size;
     }
-    else {
-        if(!dir)
-            return 0;
-        else
-            return i;
+
+    victim->src = NULL;
+    victim->used = 0;
+
+    if(romdisk_zdecode(fd, blk, victim->data, size) < 0) {
+        dbglog(DBG_ERROR, "fs_romdisk: corrupt compressed block %lu\n",
+               (unsigned long)blk);
+        return NULL;
     }
+
+    victim->src = src;
+    victim->size = size;
+    victim->used = ++zstamp;
+
+    return victim;
 }
 
+/* Read from a compressed file. Whole blocks go straight to the caller's
+   buffer; partial ones come through the cache. */
+static ssize_t romdisk_zread(file_t fd, uint8 *buf, size_t bytes) {
+    uint32 bmask = (1UL << fh[fd].zshift) - 1, blk, off, n;
+    rd_zblock_t *z;
+    size_t done = 0;
+
+    mutex_lock_scoped(&zcache_mutex);
+
+    while(done < bytes) {
+        blk = fh[fd].ptr >> fh[fd].zshift;
+        off = fh[fd].ptr & bmask;
+        n = romdisk_zsize(fd, blk);
+
+        if(!off && bytes - done >= n) {
+            if(romdisk_zdecode(fd, blk, buf + done, n) < 0) {
+                errno = EIO;
+                return done ? (ssize_t)done : -1;
+            }
+        }
+        else {
+            if(!(z = romdisk_zblock(fd, blk))) {
+                errno = EIO;
+                return done ? (ssize_t)done : -1;
+            }
+
+            n = z->size - off;
+
+            if(n > bytes - done)
+                n = bytes - done;
+
+            memcpy(buf + done, z->data + off, n);
+        }
+
+        done += n;
+        fh[fd].ptr += n;
+    }
 
-#if 0
-/* Find a filename in the root of the romdisk image */
-static uint32 romdisk_find(const char *fn) {
-    uint32      i, ni, type;
-    romdisk_file_t  *fhdr;
+    return done;
+}
+
+/* Given a filename and a starting romdisk directory listing (byte offset),
+   search for the entry in the directory and return the byte offset to its
+   entry. */
+static uint32 romdisk_find_object(rd_image_t * mnt, const char *fn, size_t fnlen, int dir, uint32 offset) {
+    uint32          i, ni, type;
+    const romdisk_file_t    *fhdr;
 
-    i = romdisk_files;
+    i = offset;
 
     do {
-        /* Locate the file, next pointer, and type info */
-        fhdr = (romdisk_file_t*)(romdisk_image + i);
+        /* Locate the entry, next pointer, and type info */
+        fhdr = (const romdisk_file_t *)(mnt->image + i);
         ni = ntohl_32(&fhdr->next_header);
         type = ni & 0x0f;
         ni = ni & 0xfffffff0;
 
-        /* Ignore non-files */
-        if(type != 2) {
+        /* Check the type */
+        if((type & ROMFH_MASK) != (dir ? ROMFH_DIR : ROMFH_REG)) {
             i = ni;
             continue;
         }
 
         /* Check filename */
-        if(!strcmp(fhdr->filename, fn)) {
-            /* Match: return this index */
+        if(!strncasecmp(fhdr->filename, fn, fnlen) && !fhdr->filename[fnlen])
             return i;
-        }
 
-        /* Nope, continue on */
         i = ni;
     }
     while(i != 0);
@@ -239,228 +333,149 @@ static uint32 romdisk_find(const char *fn) {
     /* Didn't find it */
     return 0;
 }
-#endif
 
-/* Open a file or directory */
-static uint32 romdisk_open(const char *fn, int mode) {
-    uint32      fd;
-    uint32      filehdr;
-    romdisk_file_t  *fhdr;
+/* Locate an object anywhere in the image, starting at the root, and
+   expecting a fully qualified path name. */
+static uint32 romdisk_find(rd_image_t * mnt, const char *fn, int dir) {
+    const char      *cur;
+    uint32          i;
+    const romdisk_file_t    *fhdr;
 
-    /* Make sure they don't want to open things as writeable */
-    if((mode & O_MODE_MASK) != O_RDONLY)
-        return 0;
+    i = mnt->files;
 
-    /* Make sure we're not trying to open a directory (not supported yet) */
-    if(mode & O_DIR)
-        return 0;
+    while((cur = strchr(fn, '/'))) {
+        if(cur != fn) {
+            i = romdisk_find_object(mnt, fn, cur - fn, 1, i);
+
+            if(i == 0) return 0;
 
-    /* Look for the file */
-    filehdr = romdisk_find(fn + 1, 0);
+            fhdr = (const romdisk_file_t *)(mnt->image + i);
+            i = ntohl_32(&fhdr->spec_info);
+        }
 
-    if(filehdr == 0)
-        return 0;
+        fn = cur + 1;
+    }
 
-    /* Find a free file handle */
-    thd_mutex_lock(&fh_mutex);
+    if(*fn)
+        return romdisk_find_object(mnt, fn, strlen(fn), dir, i);
 
-    for(fd = 0; fd < MAX_RD_FILES; fd++)
-        if(fh[fd].index == 0) {
-            fh[fd].index = -1;
-            break;
-        }
+    return dir ? i : 0;
+}
 
-    thd_mutex_unlock(&fh_mutex);
+/* Open a file */
+static file_t romdisk_open(rd_image_t *mnt, const char *fn, int mode) {
+    file_t          fd;
+    uint32          filehdr;
+    const romdisk_file_t    *fhdr;
 
-    if(fd >= MAX_RD_FILES)
-        return 0;
+    if((mode & O_MODE_MASK) != O_RDONLY || (mode & O_DIR))
+        return -1;
+
+    if(!(filehdr = romdisk_find(mnt, fn + 1, 0)))
+        return -1;
+
+    for(fd = 0; fd < FS_ROMDISK_MAX_FILES; fd++)
+        if(fh[fd].index == 0)
+            break;
 
-    /* Fill the fd structure */
-    fhdr = (romdisk_file_t *)(romdisk_image + filehdr);
+    if(fd >= FS_ROMDISK_MAX_FILES)
+        return -1;
+
+    fhdr = (const romdisk_file_t *)(mnt->image + filehdr);
     fh[fd].index = filehdr + sizeof(romdisk_file_t) + (strlen(fhdr->filename) / 16) * 16;
     fh[fd].dir = 0;
     fh[fd].ptr = 0;
     fh[fd].size = ntohl_32(&fhdr->size);
+    fh[fd].mnt = mnt;
+    fh[fd].map = NULL;
+    fh[fd].zshift = 0;
+
+    if((ntohl_32(&fhdr->spec_info) & ~ROMFH_ZSHIFT) == ROMFH_ZMAGIC)
+        fh[fd].zshift = ntohl_32(&fhdr->spec_info) & ROMFH_ZSHIFT;
 
     return fd;
 }
 
-/* Close a file or directory */
-static void romdisk_close(uint32 fd) {
-    /* Check that the fd is valid */
-    if(fd < MAX_RD_FILES) {
-        /* No need to lock the mutex: this is an atomic op */
-        fh[fd].index = 0;
-    }
+/* Close a file */
+static void romdisk_close(file_t fd) {
+    free(fh[fd].map);
+    fh[fd].map = NULL;
+    fh[fd].index = 0;
 }
 
 /* Read from a file */
-static ssize_t romdisk_read(uint32 fd, void *buf, size_t bytes) {
-    /* Check that the fd is valid */
-    if(fd >= MAX_RD_FILES || fh[fd].index == 0)
-        return -1;
-
-    /* Is there enough left? */
+static ssize_t romdisk_read(file_t fd, void *buf, size_t bytes) {
     if((fh[fd].ptr + bytes) > fh[fd].size)
         bytes = fh[fd].size - fh[fd].ptr;
 
-    /* Copy out the requested amount */
-    memcpy(buf, romdisk_image + fh[fd].index + fh[fd].ptr, bytes);
+    if(fh[fd].zshift)
+        return romdisk_zread(fd, (uint8 *)buf, bytes);
+
+    memcpy(buf, fh[fd].mnt->image + fh[fd].index + fh[fd].ptr, bytes);
     fh[fd].ptr += bytes;
 
     return bytes;
 }
 
-/* Seek elsewhere in a file */
-static off_t romdisk_seek(uint32 fd, off_t offset, int whence) {
-    /* Check that the fd is valid */
-    if(fd >= MAX_RD_FILES || fh[fd].index == 0)
-        return -1;
-
-    /* Update current position according to arguments */
-    switch(whence) {
-        case SEEK_SET:
-            fh[fd].ptr = offset;
-        case SEEK_CUR:
-            fh[fd].ptr += offset;
-        case SEEK_END:
-            fh[fd].ptr = fh[fd].size + offset;
-        default:
-            return -1;
-    }
-
-    /* Check bounds */
-    if(fh[fd].ptr > fh[fd].size) fh[fd].ptr = fh[fd].size;
-
-    return fh[fd].ptr;
+/* Seek to an absolute position */
+static void romdisk_seek(file_t fd, uint32 pos) {
+    fh[fd].ptr = pos > fh[fd].size ? fh[fd].size : pos;
 }
 
-/* Tell where in the file we are */
-static off_t romdisk_tell(uint32 fd) {
-    if(fd >= MAX_RD_FILES || fh[fd].index == 0)
-        return -1;
-
-    return fh[fd].ptr;
-}
+/* Map a file, unpacking compressed ones in full */
+static void *romdisk_mmap(file_t fd) {
+    uint32 blk, pos;
 
-/* Tell how big the file is */
-static size_t romdisk_total(uint32 fd) {
-    if(fd >= MAX_RD_FILES || fh[fd].index == 0)
-        return -1;
+    if(!fh[fd].zshift)
+        return (void *)(fh[fd].mnt->image + fh[fd].index);
 
-    return fh[fd].size;
-}
+    if(fh[fd].map)
+        return fh[fd].map;
 
-/* Read a directory entry */
-dirent_t *romdisk_readdir(uint32 fd) {
-    /*  int     i, c;
+    if(!(fh[fd].map = malloc(fh[fd].size ? fh[fd].size : 1)))
+        return NULL;
 
-        if (fd>=MAX_RD_FILES || fh[fd].index==0 || !fh[fd].dir)
+    for(blk = 0, pos = 0; pos < fh[fd].size; blk++) {
+        if(romdisk_zdecode(fd, blk, fh[fd].map + pos,
+                           romdisk_zsize(fd, blk)) < 0) {
+            free(fh[fd].map);
+            fh[fd].map = NULL;
             return NULL;
+        }
 
-        return &fh[fd].dirent; */
-    return NULL;
-}
-
-/* Put everything together */
-static vfs_handler vh = {
-    0, 0,       /* In-kernel, no caching */
-    romdisk_open,
-    romdisk_close,
-    romdisk_read,
-    NULL,
-    romdisk_seek,
-    romdisk_tell,
-    romdisk_total,
-    romdisk_readdir,
-    NULL,
-    NULL
-};
-
-/* Initialize the file system */
-static int fs_romdisk_init(uint8 *img) {
-    int i, ni;
-    romdisk_file_t *fhdr;
-
-    /* Set the ROMFS image */
-    romdisk_image = img;
-
-    /* Check and print some info about it */
-    romdisk_hdr = (romdisk_hdr_t *)romdisk_image;
-
-    if(strncmp((char*)romdisk_image, "-rom1fs-", 8)) {
-        printf("Rom disk image at 0x%p is not a ROMFS image\r\n", img);
-        return -1;
+        pos += romdisk_zsize(fd, blk);
     }
 
-    printf("ROMFS image recognized. Full size is 0x%lx bytes\r\n",
-           ntohl_32(&romdisk_hdr->full_size));
-    printf("  Checksum is 0x%lx\r\n",
-           ntohl_32(&romdisk_hdr->checksum));
-    printf("  Volume ID is ``%s''\r\n",
-           romdisk_hdr->volume_name);
-
-    romdisk_files = sizeof(romdisk_hdr_t)
-                    + (strlen(romdisk_hdr->volume_name) / 16) * 16;
-    printf("  File entries begin at offset 0x%lx\r\n",
-           romdisk_files);
-
-    printf("Files:\r\n");
-    i = romdisk_files;
-
-    do {
-        printf("0x%x: ", i);
-
-        fhdr = (romdisk_file_t*)(romdisk_image + i);
-        ni = ntohl_32(&fhdr->next_header);
-        printf("next=%x, ", ni & 0xfffffff0);
-        printf("type=%x, ", ni & 0x0f);
-        ni &= 0xfffffff0;
-        printf("spec_info=%lx, ", ntohl_32(&fhdr->spec_info));
-        printf("size=%lx, ", ntohl_32(&fhdr->size));
-        printf("checksum=%lx ", ntohl_32(&fhdr->checksum));
-        printf("filename='%s'\r\n", fhdr->filename);
-        printf("  File data starts at %lx\r\n",
-               i + sizeof(romdisk_file_t)
-               + (strlen(fhdr->filename) / 16) * 16);
+    return fh[fd].map;
+}
 
-        i = ni;
-    }
-    while(i != 0);
+/* Cut here to insert into KallistiOS fs_romdisk.c */
 
-    /* Reset fd's */
-    memset(fh, 0, sizeof(fh));
+/********************************************************************************/
 
-    /* Mark the first as active so we can have an error FD of zero */
-    fh[0].index = -1;
+static rd_image_t mnt;
 
-    /* Init thread mutexes */
-    thd_mutex_reset(&fh_mutex);
+/* Totals for the summary */
+static unsigned long files, zfiles, bytes, errors;
+static double read_secs;
 
-    /* Register with VFS */
-    return fs_handler_add("/rd", &vh);
-}
+static double now(void) {
+    struct timespec ts;
 
-/* De-init the file system */
-static int fs_romdisk_shutdown() {
-    return fs_handler_remove(&vh);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-
-
-/* Cut here to insert into KallistiOS fs_iso9660.c */
-
-/********************************************************************************/
-
 /**
- * Helper function to load the raw texture data into an array.
- * @param filename The filename of the texture.
- * @param data A pointer to an array where the data should be stored.
- * @param size A pointer to a variable where to size should be stored.
+ * Helper function to load a whole file into memory.
+ * @param filename The filename.
+ * @param data A pointer to where to store the buffer.
+ * @param size A pointer to where to store the size.
  * @return 0 on success, non-zero on error.
  */
-static int read_file_contents(char const * const filename, char **data, size_t *size) {
+static int read_file_contents(char const * const filename, uint8 **data, size_t *size) {
     FILE *f = 0;
+    long len;
 
     f = fopen(filename, "rb");
 
@@ -469,16 +484,16 @@ static int read_file_contents(char const * const filename, char **data, size_t *
     }
 
     fseek(f, 0, SEEK_END);
-    long imageSize = ftell(f);
+    len = ftell(f);
     rewind(f);
 
-    *data = malloc(imageSize);
+    *data = malloc(len ? len : 1);
     if(!*data) {
         fclose(f);
         return 2;
     }
 
-    if(fread(*data, imageSize, 1, f) != 1) {
+    if(len && fread(*data, len, 1, f) != 1) {
         free(*data);
         fclose(f);
         return 3;
@@ -486,88 +501,154 @@ static int read_file_contents(char const * const filename, char **data, size_t *
 
     fclose(f);
 
-    *size = imageSize;
+    *size = len;
 
     return 0;
 }
 
-static int init() {
-    uint8 *img;
-    size_t  size;
+/* Read one file back from the image every way we can and compare it */
+static void check_file(const char *path, const char *rdpath) {
+    static const size_t chunks[] = { 1, 333, 4096, 8192, 20000, 65536 };
+    uint8 *orig, *buf, *map;
+    size_t size, pos, n;
+    double start;
+    ssize_t r;
+    file_t fd;
+    int i;
+
+    if(read_file_contents(path, &orig, &size)) {
+        printf("%s: can't read the original\n", path);
+        errors++;
+        return;
+    }
 
-    if(read_file_contents("romdisk2.img", (char**)&img, &size)) {
-        fprintf(stderr, "Cannot read romdisk2.img.\n");
-        return 1;
+    buf = malloc(size + 65536);
+
+    if((fd = romdisk_open(&mnt, rdpath, O_RDONLY)) < 0) {
+        printf("%s: not found in the image\n", rdpath);
+        errors++;
+        free(orig);
+        free(buf);
+        return;
     }
 
-    fs_romdisk_init(img);
-    fs_romdisk_shutdown();
+    files++;
+    bytes += size;
 
-    free(img);
+    if(fh[fd].zshift)
+        zfiles++;
 
-    return 0;
-}
+    /* Sequential reads in uneven pieces */
+    start = now();
 
-int main() {
-    if(init()) {
-        fprintf(stderr, "Cannot init.\n");
-        return 1;
+    for(pos = 0, i = 0; pos < size; pos += r, i++) {
+        r = romdisk_read(fd, buf + pos, chunks[i % 6]);
+
+        if(r <= 0)
+            break;
     }
 
-    {
-        uint32  fd, size;
-        char    buf[667];
+    read_secs += now() - start;
 
-        printf("Opening file /testdir/rdtest.c\n");
-        fd = romdisk_open("/testdir/rdtest.c", O_RDONLY);
+    if(pos != size || memcmp(buf, orig, size)) {
+        printf("%s: sequential read mismatch\n", rdpath);
+        errors++;
+    }
 
-        if(fd == 0) {
-            printf("Couldn't open file\n");
-            return 1;
+    /* Random seeks and reads */
+    for(i = 0; i < 64 && size; i++) {
+        pos = rand() % size;
+        n = chunks[rand() % 6];
+        romdisk_seek(fd, pos);
+        r = romdisk_read(fd, buf, n);
+
+        if(r != (ssize_t)(n < size - pos ? n : size - pos) ||
+           memcmp(buf, orig + pos, r)) {
+            printf("%s: read of %d at %d mismatch\n", rdpath, (int)n, (int)pos);
+            errors++;
+            break;
         }
+    }
 
-        size = romdisk_total(fd);
-        printf("fd is %ld, size is %08lx\n", fd, size);
+    /* And the whole thing mapped */
+    if(!(map = romdisk_mmap(fd)) || memcmp(map, orig, size)) {
+        printf("%s: mmap mismatch\n", rdpath);
+        errors++;
+    }
 
-        while(size > 0) {
-            int r;
-            r = romdisk_read(fd, buf, 666);
+    romdisk_close(fd);
+    free(orig);
+    free(buf);
+}
 
-            if(r < 0) {
-                printf("Read error\n");
-                return 1;
-            }
+/* Check every regular file under dir */
+static void check_dir(const char *dir, const char *rddir) {
+    char path[1024], rdpath[1024];
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
 
-            buf[r] = 0;
-            printf("%s", buf);
-            size -= r;
-        }
+    if(!(d = opendir(dir)))
+        return;
 
-        printf("\nFile read is done\n");
-        romdisk_close(fd);
+    while((de = readdir(d))) {
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+           !strcmp(de->d_name, ".keepme") || !strcmp(de->d_name, ".svn"))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        snprintf(rdpath, sizeof(rdpath), "%s/%s", rddir, de->d_name);
+
+        if(lstat(path, &st))
+            continue;
+
+        if(S_ISDIR(st.st_mode))
+            check_dir(path, rdpath);
+        else if(S_ISREG(st.st_mode))
+            check_file(path, rdpath);
     }
 
-    /* {
-        uint32      fd, t;
-        dirent_t    *de;
+    closedir(d);
+}
 
-        printf("Opening /demos");
-        fd = iso_open("/music/mc2/entries/rookie", O_RDONLY | O_DIR);
-        if (fd == 0) {
-            printf("Couldn't open file\n");
-            return;
-        }
+int main(int argc, char **argv) {
+    uint8 *img;
+    size_t size;
 
-        printf("Scanning dir:\n");
-        while ( (de = iso_readdir(fd)) ) {
-            printf("%s\t%d\n", de->name, de->size);
-            if (!strcmp(de->name, "R_WAR.ZIP")) {
-                t = 0;
-            }
-        }
+    if(argc != 3) {
+        fprintf(stderr, "Usage: %s IMAGE DIRECTORY\n", argv[0]);
+        return 1;
+    }
 
-        iso_close(fd);
-    } */
+    if(read_file_contents(argv[1], &img, &size)) {
+        fprintf(stderr, "Cannot read %s.\n", argv[1]);
+        return 1;
+    }
 
-    return 0;
+    if(size < sizeof(romdisk_hdr_t) || strncmp((char *)img, "-rom1fs-", 8)) {
+        fprintf(stderr, "%s is not a ROMFS image\n", argv[1]);
+        return 1;
+    }
+
+    mnt.image = img;
+    mnt.hdr = (const romdisk_hdr_t *)img;
+    mnt.files = sizeof(romdisk_hdr_t)
+                + (strlen(mnt.hdr->volume_name) / 16) * 16;
+
+    check_dir(argv[2], "");
+
+    printf("%lu files (%lu compressed), %lu bytes in a %lu byte image (%.1f%%)\n",
+           files, zfiles, bytes, (unsigned long)size,
+           bytes ? 100.0 * size / bytes : 0.0);
+    printf("sequential reads: %.1f MB/s, block cache %lu hits, %lu misses\n",
+           read_secs > 0 ? bytes / read_secs / 1e6 : 0.0, zhits, zmisses);
+
+    if(errors)
+        printf("FAILED: %lu errors\n", errors);
+    else
+        printf("SUCCESS\n");
+
+    free(img);
+
+    return errors ? 1 : 0;
 }